@@ -0,0 +1,224 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+/*
+ * cdxa.hh
+ *
+ * Provides access to the files inside CD-XA BIN disc images, such as those of
+ * the PlayStation games. A BIN image is a sequence of raw 2352-byte sectors.
+ * Each data sector starts with a sync pattern and a header, and those in Mode 2
+ * Form 1 are followed by a subheader, 2048 bytes of user data, and the EDC/ECC
+ * error correction data. The user data of the sectors holds an ISO9660 file
+ * system.
+ */
+
+#include <string>
+#include "util.hh"
+
+namespace drnsf {
+namespace cdxa {
+
+/*
+ * cdxa::raw_sector_size
+ * cdxa::sector_data_size
+ *
+ * The size in bytes of a raw sector in a BIN image, and of the user data in a
+ * Mode 1 or Mode 2 Form 1 sector.
+ */
+constexpr size_t raw_sector_size = 2352;
+constexpr size_t sector_data_size = 2048;
+
+/*
+ * cdxa::compute_edc
+ *
+ * Continues the EDC (error detection code, a 32-bit CRC) `edc' over the given
+ * data and returns the result. The EDC of a sector starts from zero.
+ */
+uint32_t compute_edc(uint32_t edc, const unsigned char *data, size_t size);
+
+/*
+ * cdxa::encode_sector
+ *
+ * Recomputes the EDC and the ECC (error correction code, the Reed-Solomon P and
+ * Q parity) of the given raw Mode 2 Form 1 sector from its subheader and user
+ * data, and writes them into the end of the sector. The sync pattern, header
+ * and subheader must already be in place.
+ */
+void encode_sector(unsigned char *sector);
+
+/*
+ * cdxa::file_entry
+ *
+ * A file or directory in the file system of an image. `lba' is the first sector
+ * of its data, and `size' is its size in bytes. The data of a file occupies
+ * consecutive sectors.
+ *
+ * `record_lba' and `record_offset' give the position of the entry's directory
+ * record within the user data of the image, so that the record can be updated
+ * in place. For the root directory, this is its record in the primary volume
+ * descriptor.
+ */
+struct file_entry {
+    std::string name;
+    uint32_t lba;
+    uint32_t size;
+    bool is_dir;
+    uint32_t record_lba;
+    uint32_t record_offset;
+};
+
+/*
+ * cdxa::image
+ *
+ * A BIN disc image. The image data is mapped or shared rather than read up
+ * front (see `util::mapped_file'), and the user data of each sector is read in
+ * place, skipping the sector headers and error correction data, so files can be
+ * read from the image without extracting them first.
+ *
+ * Both Mode 1 and Mode 2 Form 1 data sectors are accepted. Reading from any
+ * other kind of sector throws an exception.
+ *
+ * When initially constructed, the object is in a closed state. To use the
+ * object, call `open' with a filename or the image data.
+ */
+class image : private util::nocopy {
+private:
+    // (var) m_data
+    // The data of the open image, or empty if no image is open.
+    util::shared_blob m_data;
+
+    // (var) m_open
+    // True if an image is currently open, false otherwise.
+    bool m_open = false;
+
+public:
+    // (func) open
+    // Opens the given image, either by mapping the named file or by using the
+    // given data. If an error occurs, an exception is thrown and the object is
+    // not modified.
+    //
+    // If an image is already open, an exception is thrown.
+    void open(const std::string &path);
+    void open(util::shared_blob data);
+
+    // (func) get_sector_count
+    // Returns the number of whole sectors in the image.
+    size_t get_sector_count() const;
+
+    // (func) get_raw_sector
+    // Returns a pointer to the given raw sector, including its headers and
+    // error correction data. An exception is thrown if the sector is past the
+    // end of the image.
+    const unsigned char *get_raw_sector(uint32_t lba) const;
+
+    // (func) get_sector_data
+    // Returns a pointer to the 2048 bytes of user data in the given sector.
+    // An exception is thrown if the sector is past the end of the image or is
+    // not a Mode 1 or Mode 2 Form 1 sector.
+    const unsigned char *get_sector_data(uint32_t lba) const;
+
+    // (func) get_root
+    // Returns the root directory of the image's file system, as given by its
+    // primary volume descriptor.
+    file_entry get_root() const;
+
+    // (func) list
+    // Returns the entries of the given directory, not including the "." and
+    // ".." entries. Names have any ";1" version suffix removed.
+    std::vector<file_entry> list(const file_entry &dir) const;
+
+    // (func) find
+    // Returns the file or directory at the given path, such as "/S2/S0.NSF".
+    // Names are matched without regard to case or version suffixes, and the
+    // leading "/" is optional. An exception is thrown if it is not found.
+    file_entry find(const std::string &path) const;
+
+    // (func) read
+    // Reads `len' bytes of the given file starting at byte `offset' into
+    // `dest', a sector at a time. An exception is thrown if the range is past
+    // the end of the file.
+    void read(
+        const file_entry &file,
+        size_t offset,
+        void *dest,
+        size_t len) const;
+
+    // (func) read_file
+    // Returns the entire contents of the given file.
+    util::blob read_file(const file_entry &file) const;
+};
+
+/*
+ * cdxa::split_path
+ *
+ * Splits a path to a file inside an image, such as "game.bin:/S2/S0.NSF", into
+ * the path of the image and the path inside it. Returns false if the path is
+ * not of this form, which is the case if it names an existing file on its own
+ * or if no prefix of it ending before a ':' names an existing file.
+ */
+bool split_path(
+    const std::string &path,
+    std::string &image_path,
+    std::string &inner_path);
+
+/*
+ * cdxa::write_file
+ *
+ * Writes `data' over the contents of the file at `inner_path' in the BIN image
+ * at `image_path', in place, and returns the number of sectors written. The
+ * file must already exist in the image, and the new data must fit within the
+ * sectors the file already occupies. If the size of the file changes, its
+ * directory record and the end-of-file flags in the subheaders are updated.
+ *
+ * Only sectors whose contents change are written, and the EDC and ECC are
+ * recomputed for those sectors only (see `encode_sector'). Sectors past the new
+ * end of a file which has shrunk are left as they are.
+ */
+size_t write_file(
+    const std::string &image_path,
+    const std::string &inner_path,
+    const util::shared_blob &data);
+
+/*
+ * cdxa::load_file
+ *
+ * Returns the contents of the given file. If the path is a path into a BIN
+ * image (see `split_path'), the file is read out of the image. Otherwise the
+ * file is mapped into memory (see `util::mapped_file') rather than read.
+ */
+util::shared_blob load_file(const std::string &path);
+
+#if FEATURE_INTERNAL_TEST
+/*
+ * cdxa::make_test_image
+ *
+ * For internal tests. Returns a Mode 2 image whose root directory holds "S2",
+ * which holds "S0.NSF;1" with the given contents. The file starts at LBA 20 and
+ * its last sector has the end-of-file submode bits set. It is followed by
+ * `spare_sectors' sectors filled with 0xEE. The EDC/ECC data of every sector
+ * is left as zeros.
+ */
+util::blob make_test_image(const util::blob &file, size_t spare_sectors = 0);
+#endif
+
+}
+}
@@ -0,0 +1,419 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include "cdxa.hh"
+#include "fs.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace cdxa {
+
+// (s-var) sync_pattern
+// The 12 bytes at the start of every data sector.
+static const unsigned char sync_pattern[12] = {
+    0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+
+// (s-var) pvd_lba
+// The sector holding the primary volume descriptor of the file system.
+static constexpr uint32_t pvd_lba = 16;
+
+// (s-func) read_u32
+// Reads a little-endian 32-bit value. ISO9660 stores most values in both byte
+// orders, and the little-endian half comes first.
+static uint32_t read_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+// (s-func) parse_record
+// Parses the directory record at `p' into `out'. Returns false if the record is
+// the "." or ".." entry of its directory.
+static bool parse_record(const unsigned char *p, file_entry &out)
+{
+    auto name_len = p[32];
+    auto name = reinterpret_cast<const char *>(p + 33);
+    if (name_len == 1 && (name[0] == 0 || name[0] == 1))
+        return false;
+
+    out.name.assign(name, name_len);
+    auto version = out.name.find(';');
+    if (version != std::string::npos) {
+        out.name.erase(version);
+    }
+    out.lba = read_u32(p + 2);
+    out.size = read_u32(p + 10);
+    out.is_dir = (p[25] & 2) != 0;
+    return true;
+}
+
+// (s-func) same_name
+// Returns true if the given names are equal without regard to ASCII case.
+static bool same_name(const std::string &a, const std::string &b)
+{
+    const auto upper = [](char c) {
+        return std::toupper(static_cast<unsigned char>(c));
+    };
+    return std::equal(
+        a.begin(), a.end(),
+        b.begin(), b.end(),
+        [&](char x, char y) { return upper(x) == upper(y); }
+    );
+}
+
+// declared in cdxa.hh
+void image::open(const std::string &path)
+{
+    if (m_open)
+        throw std::logic_error("cdxa::image::open: image already open");
+
+    auto map = std::make_shared<util::mapped_file>();
+    map->open(path);
+    open(util::shared_blob(map, map->data(), map->size()));
+}
+
+// declared in cdxa.hh
+void image::open(util::shared_blob data)
+{
+    if (m_open)
+        throw std::logic_error("cdxa::image::open: image already open");
+
+    if (data.size() % raw_sector_size != 0)
+        throw std::runtime_error("cdxa::image::open: not a BIN image");
+
+    m_data = std::move(data);
+    m_open = true;
+}
+
+// declared in cdxa.hh
+size_t image::get_sector_count() const
+{
+    return m_data.size() / raw_sector_size;
+}
+
+// declared in cdxa.hh
+const unsigned char *image::get_raw_sector(uint32_t lba) const
+{
+    if (!m_open)
+        throw std::logic_error("cdxa::image::get_raw_sector: no image open");
+
+    if (lba >= get_sector_count())
+        throw std::runtime_error("cdxa::image: sector past end of image");
+
+    return m_data.data() + size_t(lba) * raw_sector_size;
+}
+
+// declared in cdxa.hh
+const unsigned char *image::get_sector_data(uint32_t lba) const
+{
+    auto sector = get_raw_sector(lba);
+    if (std::memcmp(sector, sync_pattern, sizeof(sync_pattern)) != 0)
+        throw std::runtime_error("cdxa::image: not a data sector");
+
+    // Byte 15 is the sector mode. In Mode 2, the submode byte of the subheader
+    // tells Form 1 and Form 2 sectors apart.
+    switch (sector[15]) {
+    case 1:
+        return sector + 16;
+    case 2:
+        if (sector[18] & 0x20)
+            throw std::runtime_error("cdxa::image: Mode 2 Form 2 sector");
+        return sector + 24;
+    default:
+        throw std::runtime_error("cdxa::image: bad sector mode");
+    }
+}
+
+// declared in cdxa.hh
+file_entry image::get_root() const
+{
+    auto pvd = get_sector_data(pvd_lba);
+    if (pvd[0] != 1 || std::memcmp(pvd + 1, "CD001", 5) != 0)
+        throw std::runtime_error("cdxa::image: no ISO9660 volume descriptor");
+
+    file_entry root;
+    root.name = "";
+    root.lba = read_u32(pvd + 156 + 2);
+    root.size = read_u32(pvd + 156 + 10);
+    root.is_dir = true;
+    root.record_lba = pvd_lba;
+    root.record_offset = 156;
+    return root;
+}
+
+// declared in cdxa.hh
+std::vector<file_entry> image::list(const file_entry &dir) const
+{
+    if (!dir.is_dir)
+        throw std::logic_error("cdxa::image::list: not a directory");
+
+    // Directory records do not cross sector boundaries. A record length of
+    // zero marks the unused end of a sector.
+    std::vector<file_entry> entries;
+    auto sector_count = (dir.size + sector_data_size - 1) / sector_data_size;
+    for (uint32_t i = 0; i < sector_count; i++) {
+        auto data = get_sector_data(dir.lba + i);
+        size_t offset = 0;
+        while (offset < sector_data_size) {
+            auto record_len = data[offset];
+            if (record_len == 0)
+                break;
+            if (record_len < 33 ||
+                offset + record_len > sector_data_size ||
+                33 + data[offset + 32] > record_len) {
+                throw std::runtime_error("cdxa::image: bad directory record");
+            }
+
+            file_entry entry;
+            entry.record_lba = dir.lba + i;
+            entry.record_offset = offset;
+            if (parse_record(data + offset, entry)) {
+                entries.push_back(std::move(entry));
+            }
+            offset += record_len;
+        }
+    }
+    return entries;
+}
+
+// declared in cdxa.hh
+file_entry image::find(const std::string &path) const
+{
+    auto entry = get_root();
+
+    size_t start = 0;
+    while (start < path.size()) {
+        auto end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+
+        auto name = path.substr(start, end - start);
+        start = end + 1;
+        if (name.empty())
+            continue;
+
+        if (!entry.is_dir)
+            throw std::runtime_error("cdxa::image: not a directory: " + path);
+
+        auto entries = list(entry);
+        auto it = std::find_if(entries.begin(), entries.end(), [&](auto &&e) {
+            return same_name(e.name, name);
+        });
+        if (it == entries.end())
+            throw std::runtime_error("cdxa::image: file not found: " + path);
+        entry = std::move(*it);
+    }
+
+    return entry;
+}
+
+// declared in cdxa.hh
+void image::read(
+    const file_entry &file,
+    size_t offset,
+    void *dest,
+    size_t len) const
+{
+    if (offset > file.size || len > file.size - offset)
+        throw std::runtime_error("cdxa::image::read: past end of file");
+
+    auto out = static_cast<unsigned char *>(dest);
+    while (len > 0) {
+        auto lba = file.lba + offset / sector_data_size;
+        auto sector_offset = offset % sector_data_size;
+        auto chunk = std::min(len, sector_data_size - sector_offset);
+        std::memcpy(out, get_sector_data(lba) + sector_offset, chunk);
+        out += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+// declared in cdxa.hh
+util::blob image::read_file(const file_entry &file) const
+{
+    util::blob data(file.size);
+    read(file, 0, data.data(), data.size());
+    return data;
+}
+
+// declared in cdxa.hh
+bool split_path(
+    const std::string &path,
+    std::string &image_path,
+    std::string &inner_path)
+{
+    if (fs::is_regular_file(path))
+        return false;
+
+    // Try each ':' in turn, so that image paths which contain a ':' of their
+    // own (such as Windows drive letters) still work.
+    for (auto pos = path.find(':'); pos != std::string::npos;
+        pos = path.find(':', pos + 1)) {
+        auto prefix = path.substr(0, pos);
+        if (!prefix.empty() && fs::is_regular_file(prefix)) {
+            image_path = std::move(prefix);
+            inner_path = path.substr(pos + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// declared in cdxa.hh
+util::shared_blob load_file(const std::string &path)
+{
+    std::string image_path;
+    std::string inner_path;
+    if (split_path(path, image_path, inner_path)) {
+        image img;
+        img.open(image_path);
+        return img.read_file(img.find(inner_path));
+    }
+
+    auto map = std::make_shared<util::mapped_file>();
+    map->open(path);
+    return util::shared_blob(map, map->data(), map->size());
+}
+
+#if FEATURE_INTERNAL_TEST
+// (s-func) write_sector
+// Writes a Mode 2 Form 1 sector with the given user data and subheader submode
+// into `img'. The EDC/ECC data is left as zeros.
+static void write_sector(
+    util::blob &img,
+    uint32_t lba,
+    const unsigned char *data,
+    size_t size,
+    unsigned char submode = 0x08)
+{
+    if (img.size() < (lba + 1) * raw_sector_size) {
+        img.resize((lba + 1) * raw_sector_size);
+    }
+    auto sector = img.data() + lba * raw_sector_size;
+    std::memcpy(sector, sync_pattern, sizeof(sync_pattern));
+    sector[15] = 2;
+    sector[18] = sector[22] = submode;
+    std::memcpy(sector + 24, data, size);
+}
+
+// (s-func) add_record
+// Appends a directory record to `dir'.
+static void add_record(
+    util::blob &dir,
+    const std::string &name,
+    uint32_t lba,
+    uint32_t size,
+    bool is_dir)
+{
+    util::blob record(33 + name.size() + (name.size() % 2 == 0));
+    record[0] = record.size();
+    for (int i = 0; i < 4; i++) {
+        record[2 + i] = lba >> (i * 8);
+        record[10 + i] = size >> (i * 8);
+    }
+    record[25] = is_dir ? 2 : 0;
+    record[32] = name.size();
+    std::copy(name.begin(), name.end(), record.begin() + 33);
+    dir.insert(dir.end(), record.begin(), record.end());
+}
+
+// declared in cdxa.hh
+util::blob make_test_image(const util::blob &file, size_t spare_sectors)
+{
+    util::blob img;
+
+    // Lay out a root directory holding "S2", which holds "S0.NSF;1".
+    util::blob root;
+    add_record(root, std::string(1, '\0'), 18, 2048, true);
+    add_record(root, std::string(1, '\1'), 18, 2048, true);
+    add_record(root, "S2", 19, 2048, true);
+    write_sector(img, 18, root.data(), root.size());
+
+    util::blob s2;
+    add_record(s2, std::string(1, '\0'), 19, 2048, true);
+    add_record(s2, std::string(1, '\1'), 18, 2048, true);
+    add_record(s2, "S0.NSF;1", 20, file.size(), false);
+    write_sector(img, 19, s2.data(), s2.size());
+
+    uint32_t lba = 20;
+    for (size_t offset = 0; offset < file.size(); offset += sector_data_size) {
+        auto len = std::min(sector_data_size, file.size() - offset);
+        bool is_last = offset + len == file.size();
+        write_sector(img, lba++, &file[offset], len, is_last ? 0x89 : 0x08);
+    }
+
+    unsigned char spare[sector_data_size];
+    std::memset(spare, 0xEE, sizeof(spare));
+    for (size_t i = 0; i < spare_sectors; i++) {
+        write_sector(img, lba++, spare, sizeof(spare));
+    }
+
+    unsigned char pvd[sector_data_size] = {};
+    pvd[0] = 1;
+    std::memcpy(pvd + 1, "CD001", 5);
+    std::memcpy(pvd + 156, root.data(), 34);
+    write_sector(img, pvd_lba, pvd, sizeof(pvd));
+
+    return img;
+}
+
+namespace {
+
+// (test) ReadsFileAcrossSectors
+// Ensures a file in a subdirectory can be found by path and read back without
+// the sector headers, including from a range which spans two sectors.
+TEST(cdxa_image, ReadsFileAcrossSectors)
+{
+    util::blob file(3000);
+    for (auto &&i : util::range_of(file)) {
+        file[i] = i * 7;
+    }
+
+    image disc;
+    disc.open(make_test_image(file));
+
+    auto entry = disc.find("/s2/s0.nsf");
+    EXPECT_EQ(entry.name, "S0.NSF");
+    EXPECT_EQ(entry.lba, 20u);
+    EXPECT_FALSE(entry.is_dir);
+    EXPECT_TRUE(disc.read_file(entry) == file);
+
+    unsigned char middle[100];
+    disc.read(entry, 2000, middle, sizeof(middle));
+    EXPECT_TRUE(std::equal(middle, middle + 100, file.begin() + 2000));
+
+    EXPECT_THROW(disc.find("/S2/MISSING.NSF"), std::runtime_error);
+    EXPECT_THROW(disc.read(entry, 2990, middle, 20), std::runtime_error);
+}
+
+}
+#endif
+
+}
+}
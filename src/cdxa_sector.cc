@@ -0,0 +1,221 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include "cdxa.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace cdxa {
+
+// (s-struct) code_tables
+// The lookup tables for the EDC and ECC:
+//
+//   edc: The CRC of each byte value, for the reversed polynomial 0xD8018001.
+//   ecc_f: Each byte value multiplied by two (alpha) in GF(2^8), using the
+//     field polynomial 0x11D.
+//   ecc_b: The inverse of `x ^ ecc_f[x]' for each byte value `x', which is
+//     division by three (alpha + 1) in the same field.
+struct code_tables {
+    uint32_t edc[256];
+    uint8_t ecc_f[256];
+    uint8_t ecc_b[256];
+
+    code_tables()
+    {
+        for (int i = 0; i < 256; i++) {
+            uint32_t edc_value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                edc_value = (edc_value >> 1) ^ (edc_value & 1 ? 0xD8018001 : 0);
+            }
+            edc[i] = edc_value;
+
+            int f = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
+            ecc_f[i] = f;
+            ecc_b[i ^ f] = i;
+        }
+    }
+};
+
+// (s-var) tables
+// The shared lookup tables, built when the program starts.
+static const code_tables tables;
+
+// (s-func) compute_ecc_block
+// Computes one set of Reed-Solomon parity over the 2064 bytes of `src' (the
+// sector header, subheader, user data and EDC) and writes it to `dest'. There
+// are `major_count' codewords of `minor_count' bytes each. The bytes of each
+// codeword are `minor_inc' bytes apart, wrapping around the end of the data,
+// and the codewords start `major_mult' bytes apart in pairs.
+static void compute_ecc_block(
+    const unsigned char *src,
+    size_t major_count,
+    size_t minor_count,
+    size_t major_mult,
+    size_t minor_inc,
+    unsigned char *dest)
+{
+    size_t size = major_count * minor_count;
+    for (size_t major = 0; major < major_count; major++) {
+        size_t index = (major >> 1) * major_mult + (major & 1);
+        uint8_t ecc_a = 0;
+        uint8_t ecc_b = 0;
+        for (size_t minor = 0; minor < minor_count; minor++) {
+            uint8_t value = src[index];
+            index += minor_inc;
+            if (index >= size) {
+                index -= size;
+            }
+            ecc_a ^= value;
+            ecc_b ^= value;
+            ecc_a = tables.ecc_f[ecc_a];
+        }
+        ecc_a = tables.ecc_b[tables.ecc_f[ecc_a] ^ ecc_b];
+        dest[major] = ecc_a;
+        dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+}
+
+// declared in cdxa.hh
+uint32_t compute_edc(uint32_t edc, const unsigned char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        edc = (edc >> 8) ^ tables.edc[(edc ^ data[i]) & 0xFF];
+    }
+    return edc;
+}
+
+// declared in cdxa.hh
+void encode_sector(unsigned char *sector)
+{
+    // The EDC covers the subheader and user data, and is stored little-endian
+    // after them.
+    uint32_t edc = compute_edc(0, sector + 16, 8 + sector_data_size);
+    sector[2072] = edc;
+    sector[2073] = edc >> 8;
+    sector[2074] = edc >> 16;
+    sector[2075] = edc >> 24;
+
+    // In Mode 2, the ECC is computed as if the header were all zeros, so that
+    // the sector can be moved to another address without recomputing it.
+    unsigned char header[4];
+    std::copy(sector + 12, sector + 16, header);
+    std::fill(sector + 12, sector + 16, 0);
+    compute_ecc_block(sector + 12, 86, 24, 2, 86, sector + 2076);
+    compute_ecc_block(sector + 12, 52, 43, 86, 88, sector + 2248);
+    std::copy(header, header + 4, sector + 12);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) gf_mul
+// Multiplies two values in GF(2^8) with the field polynomial 0x11D, bit by bit
+// rather than through the tables.
+uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t result = 0;
+    while (b) {
+        if (b & 1) {
+            result ^= a;
+        }
+        a = (a << 1) ^ (a & 0x80 ? 0x1D : 0);
+        b >>= 1;
+    }
+    return result;
+}
+
+// (s-func) check_codewords
+// Checks that each codeword laid out as in `compute_ecc_block', followed by its
+// two parity bytes, has zero syndromes for the roots 1 and alpha.
+void check_codewords(
+    const unsigned char *src,
+    size_t major_count,
+    size_t minor_count,
+    size_t major_mult,
+    size_t minor_inc,
+    const unsigned char *parity)
+{
+    size_t size = major_count * minor_count;
+    for (size_t major = 0; major < major_count; major++) {
+        std::vector<uint8_t> codeword;
+        size_t index = (major >> 1) * major_mult + (major & 1);
+        for (size_t minor = 0; minor < minor_count; minor++) {
+            codeword.push_back(src[index]);
+            index = (index + minor_inc) % size;
+        }
+        codeword.push_back(parity[major]);
+        codeword.push_back(parity[major + major_count]);
+
+        uint8_t s0 = 0;
+        uint8_t s1 = 0;
+        for (auto &&value : codeword) {
+            s0 ^= value;
+            s1 = gf_mul(s1, 2) ^ value;
+        }
+        EXPECT_EQ(s0, 0);
+        EXPECT_EQ(s1, 0);
+    }
+}
+
+// (test) EncodesValidCodes
+// Ensures the EDC matches a bitwise CRC and that the P and Q parity written by
+// `encode_sector' form valid Reed-Solomon codewords.
+TEST(cdxa_sector, EncodesValidCodes)
+{
+    unsigned char sector[raw_sector_size] = {};
+    sector[12] = 0x00;
+    sector[13] = 0x02;
+    sector[14] = 0x16;
+    sector[15] = 2;
+    sector[18] = sector[22] = 0x08;
+    for (size_t i = 24; i < 24 + sector_data_size; i++) {
+        sector[i] = (i * 31) ^ (i >> 3);
+    }
+    encode_sector(sector);
+
+    uint32_t crc = 0;
+    for (size_t i = 16; i < 2072; i++) {
+        crc ^= sector[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xD8018001 : 0);
+        }
+    }
+    EXPECT_EQ(sector[2072], uint8_t(crc));
+    EXPECT_EQ(sector[2075], uint8_t(crc >> 24));
+
+    // The header is left as it was, but treated as zeros by the parity.
+    EXPECT_EQ(sector[14], 0x16);
+    unsigned char src[2340];
+    std::copy(sector + 12, sector + raw_sector_size, src);
+    std::fill(src, src + 4, 0);
+    check_codewords(src, 86, 24, 2, 86, src + 2064);
+    check_codewords(src, 52, 43, 86, 88, src + 2236);
+}
+
+}
+#endif
+
+}
+}
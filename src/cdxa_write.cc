@@ -0,0 +1,320 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include "cdxa.hh"
+#include "fs.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace cdxa {
+
+// (s-var) submode_eof
+// The end-of-record and end-of-file bits of the subheader submode byte, which
+// are set on the last sector of a file.
+static constexpr unsigned char submode_eof = 0x81;
+
+// (s-func) prepare_sectors
+// Returns the raw sectors which must be written to the image to replace the
+// given file with `data', by LBA, without their EDC and ECC. Each starts as a
+// copy of the sector in the image, so its header and subheader are kept.
+static std::map<uint32_t, util::blob> prepare_sectors(
+    const std::string &image_path,
+    const std::string &inner_path,
+    const util::shared_blob &data)
+{
+    image img;
+    img.open(image_path);
+    auto file = img.find(inner_path);
+    if (file.is_dir)
+        throw std::runtime_error("cdxa::write_file: not a file");
+
+    auto sector_count = [](size_t size) {
+        return (size + sector_data_size - 1) / sector_data_size;
+    };
+    auto old_sectors = sector_count(file.size);
+    auto new_sectors = sector_count(data.size());
+    if (new_sectors > old_sectors)
+        throw std::runtime_error("cdxa::write_file: new data does not fit");
+
+    std::map<uint32_t, util::blob> changed;
+    const auto get_raw = [&](uint32_t lba) -> unsigned char * {
+        auto &&raw = changed[lba];
+        if (raw.empty()) {
+            auto sector = img.get_raw_sector(lba);
+            if (sector[15] != 2) {
+                throw std::runtime_error(
+                    "cdxa::write_file: not a Mode 2 image"
+                );
+            }
+            raw.assign(sector, sector + raw_sector_size);
+        }
+        return raw.data();
+    };
+
+    // Compare each sector of the new data against the image, padding the last
+    // sector with zeros.
+    unsigned char buffer[sector_data_size];
+    for (size_t i = 0; i < new_sectors; i++) {
+        auto offset = i * sector_data_size;
+        auto len = std::min(sector_data_size, data.size() - offset);
+        std::memcpy(buffer, data.data() + offset, len);
+        std::memset(buffer + len, 0, sector_data_size - len);
+
+        uint32_t lba = file.lba + i;
+        if (std::memcmp(buffer, img.get_sector_data(lba), sector_data_size)) {
+            std::memcpy(get_raw(lba) + 24, buffer, sector_data_size);
+        }
+    }
+
+    if (data.size() != file.size) {
+        // Move the end-of-file flags onto the new last sector.
+        if (new_sectors != old_sectors && new_sectors > 0) {
+            auto old_last = get_raw(file.lba + old_sectors - 1);
+            auto new_last = get_raw(file.lba + new_sectors - 1);
+            for (int i : { 18, 22 }) {
+                new_last[i] |= old_last[i] & submode_eof;
+                old_last[i] &= ~submode_eof;
+            }
+        }
+
+        // Update the size in the directory record, in both byte orders.
+        auto record = get_raw(file.record_lba) + 24 + file.record_offset;
+        uint32_t size = data.size();
+        for (int i = 0; i < 4; i++) {
+            record[10 + i] = size >> (i * 8);
+            record[17 - i] = size >> (i * 8);
+        }
+    }
+
+    return changed;
+}
+
+// declared in cdxa.hh
+size_t write_file(
+    const std::string &image_path,
+    const std::string &inner_path,
+    const util::shared_blob &data)
+{
+    // The image is mapped while the changes are found, and is no longer mapped
+    // by the time they are written.
+    auto changed = prepare_sectors(image_path, inner_path, data);
+
+    // Recompute the EDC and ECC of the changed sectors and write them out,
+    // writing each run of consecutive sectors at once.
+    for (auto &&[lba, raw] : changed) {
+        encode_sector(raw.data());
+    }
+
+    util::file out;
+    out.open(image_path, "rb+");
+    auto it = changed.begin();
+    while (it != changed.end()) {
+        auto run_start = it->first;
+        util::blob run;
+        do {
+            run.insert(run.end(), it->second.begin(), it->second.end());
+            ++it;
+        } while (it != changed.end() &&
+            it->first == run_start + run.size() / raw_sector_size);
+
+        out.seek(long(run_start) * raw_sector_size, SEEK_SET);
+        out.write(run.data(), run.size());
+    }
+    out.close();
+
+    return changed.size();
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-struct) temp_image
+// An image written to a file in the temporary directory, which is removed again
+// when the object is destroyed.
+struct temp_image : private util::nocopy {
+    std::string path;
+
+    temp_image(const std::string &name, const util::blob &img) :
+        path((fs::temp_directory_path() / name).string())
+    {
+        util::file f;
+        f.open(path, "wb");
+        f.write(img.data(), img.size());
+        f.close();
+    }
+
+    ~temp_image()
+    {
+        std::error_code ec;
+        fs::remove(path, ec);
+    }
+};
+
+// (s-func) make_file_data
+// Returns `size' bytes of file data which depend on `seed'.
+util::blob make_file_data(size_t size, int seed)
+{
+    util::blob data(size);
+    for (auto &&i : util::range_of(data)) {
+        data[i] = i * 13 + seed;
+    }
+    return data;
+}
+
+// (s-func) expect_encoded
+// Ensures the EDC and ECC of the given raw sector are as `encode_sector' would
+// write them.
+void expect_encoded(const unsigned char *sector)
+{
+    unsigned char expected[raw_sector_size];
+    std::memcpy(expected, sector, raw_sector_size);
+    encode_sector(expected);
+    EXPECT_EQ(std::memcmp(expected, sector, raw_sector_size), 0);
+}
+
+// (s-func) same_sector
+// Returns true if the given raw sector is the same in both images.
+bool same_sector(const util::blob &a, const image &b, uint32_t lba)
+{
+    return std::equal(
+        a.begin() + lba * raw_sector_size,
+        a.begin() + (lba + 1) * raw_sector_size,
+        b.get_raw_sector(lba)
+    );
+}
+
+// (test) ShrinkUpdatesRecordAndEndOfFile
+// Ensures shrinking a file by a sector updates the size in its directory record
+// in both byte orders, moves the end-of-file bits onto the new last sector, and
+// only rewrites the sectors which changed.
+TEST(cdxa_write, ShrinkUpdatesRecordAndEndOfFile)
+{
+    auto file = make_file_data(5000, 1);
+    auto original = make_test_image(file, 1);
+    temp_image tmp("drnsf-test-cdxa-shrink.bin", original);
+
+    // The first sector of the new data matches the old file.
+    util::blob data(file.begin(), file.begin() + 3000);
+    EXPECT_EQ(write_file(tmp.path, "/S2/S0.NSF", data), 3u);
+
+    image img;
+    img.open(tmp.path);
+    auto entry = img.find("/S2/S0.NSF");
+    EXPECT_EQ(entry.size, 3000u);
+    EXPECT_TRUE(img.read_file(entry) == data);
+
+    auto record = img.get_sector_data(entry.record_lba) + entry.record_offset;
+    const unsigned char size_le[4] = { 0xB8, 0x0B, 0x00, 0x00 };
+    const unsigned char size_be[4] = { 0x00, 0x00, 0x0B, 0xB8 };
+    EXPECT_EQ(std::memcmp(record + 10, size_le, 4), 0);
+    EXPECT_EQ(std::memcmp(record + 14, size_be, 4), 0);
+
+    EXPECT_EQ(img.get_raw_sector(21)[18], 0x89);
+    EXPECT_EQ(img.get_raw_sector(21)[22], 0x89);
+    EXPECT_EQ(img.get_raw_sector(22)[18], 0x08);
+    EXPECT_EQ(img.get_raw_sector(22)[22], 0x08);
+    EXPECT_TRUE(std::equal(
+        file.begin() + 4096,
+        file.end(),
+        img.get_sector_data(22)
+    ));
+
+    for (uint32_t lba : { 19, 21, 22 }) {
+        expect_encoded(img.get_raw_sector(lba));
+    }
+    for (uint32_t lba : { 18, 20, 23 }) {
+        EXPECT_TRUE(same_sector(original, img, lba));
+    }
+}
+
+// (test) WritesSeparateRuns
+// Ensures changed sectors are written whether or not they are next to each
+// other, and that the unchanged sector between two runs is left alone.
+TEST(cdxa_write, WritesSeparateRuns)
+{
+    auto file = make_file_data(4 * sector_data_size, 2);
+    auto original = make_test_image(file, 1);
+    temp_image tmp("drnsf-test-cdxa-runs.bin", original);
+
+    // Change the first two sectors and the last, but not the third.
+    auto data = file;
+    data[100] ^= 1;
+    data[sector_data_size + 100] ^= 1;
+    data[3 * sector_data_size + 100] ^= 1;
+    EXPECT_EQ(write_file(tmp.path, "/S2/S0.NSF", data), 3u);
+
+    image img;
+    img.open(tmp.path);
+    EXPECT_TRUE(img.read_file(img.find("/S2/S0.NSF")) == data);
+    for (uint32_t lba : { 20, 21, 23 }) {
+        expect_encoded(img.get_raw_sector(lba));
+    }
+    for (uint32_t lba : { 19, 22, 24 }) {
+        EXPECT_TRUE(same_sector(original, img, lba));
+    }
+    EXPECT_EQ(img.get_sector_count(), 25u);
+}
+
+// (test) RejectsDataWhichDoesNotFit
+// Ensures data which needs more sectors than the file occupies is rejected
+// without changing the image, and that data which fills those sectors exactly
+// is accepted.
+TEST(cdxa_write, RejectsDataWhichDoesNotFit)
+{
+    auto file = make_file_data(3000, 3);
+    auto original = make_test_image(file, 1);
+    temp_image tmp("drnsf-test-cdxa-fit.bin", original);
+
+    auto too_big = make_file_data(2 * sector_data_size + 1, 4);
+    EXPECT_THROW(
+        write_file(tmp.path, "/S2/S0.NSF", too_big),
+        std::runtime_error
+    );
+    {
+        auto unchanged = load_file(tmp.path);
+        EXPECT_TRUE(std::equal(
+            original.begin(),
+            original.end(),
+            unchanged.begin(),
+            unchanged.end()
+        ));
+    }
+
+    auto exact = make_file_data(2 * sector_data_size, 4);
+    write_file(tmp.path, "/S2/S0.NSF", exact);
+
+    image img;
+    img.open(tmp.path);
+    EXPECT_TRUE(img.read_file(img.find("/S2/S0.NSF")) == exact);
+    EXPECT_EQ(img.get_raw_sector(21)[18], 0x89);
+}
+
+}
+#endif
+
+}
+}
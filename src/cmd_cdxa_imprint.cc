@@ -21,6 +21,7 @@
 #include "common.hh"
 #include "core.hh"
 #include <iostream>
+#include <sstream>
 #include <cstring>
 
 DRNSF_DECLARE_EMBED(imprints::infousa_dat);
@@ -30,15 +31,82 @@ DRNSF_DECLARE_EMBED(imprints::infojap_dat);
 namespace drnsf {
 namespace core {
 
+// (s-struct) imprint_task
+// The imprinting of a single image. `sysinfo' is the index of the system
+// information data to write. Images may be imprinted on separate threads, so
+// each task collects its messages in `out' and they are printed later in the
+// order the images were given.
+struct imprint_task {
+    std::string filename;
+    size_t sysinfo;
+    std::ostringstream out;
+    bool ok = true;
+    bool written = false;
+};
+
+// (s-func) do_imprint
+// Imprints the given image with the given system information data, unless the
+// image already holds exactly that data. The data is read back after writing
+// to check that the write took effect.
+static void do_imprint(imprint_task &task, const util::blob &sysinfo)
+{
+    try {
+        util::file file;
+        file.open(task.filename, "rb+");
+
+        // Images too small to hold the data are written without comparing.
+        file.seek(0, SEEK_END);
+        bool big_enough = (file.tell() >= long(sysinfo.size()));
+
+        util::blob current(sysinfo.size());
+        if (big_enough &&
+            file.read_at(0, current.data(), current.size()) &&
+            current == sysinfo) {
+            task.out << task.filename << ": already imprinted" << std::endl;
+            return;
+        }
+
+        // Close the file once written, and read the data back through a new
+        // handle, so the check sees what reached the file.
+        file.write_at(0, sysinfo.data(), sysinfo.size());
+        file.close();
+        file.open(task.filename, "rb");
+        if (!file.read_at(0, current.data(), current.size()) ||
+            current != sysinfo) {
+            throw std::runtime_error("data read back does not match");
+        }
+
+        task.written = true;
+        task.out << task.filename << ": imprinted" << std::endl;
+    } catch (std::exception &ex) {
+        task.out
+            << task.filename
+            << ": "
+            << ex.what()
+            << std::endl;
+        task.ok = false;
+    }
+}
+
 // FIXME explain
 int cmd_cdxa_imprint(cmdenv e)
 {
     uint8_t sysinfo[37632];
     bool sysinfo_set = false;
+    bool sysinfo_changed = false;
+    int jobs = 1;
 
     argparser o;
     o.add_opt("help", [&]{ e.help_requested = true; });
     o.alias_opt('h', "help");
+    o.add_opt("jobs", [&](std::string value) {
+        try {
+            jobs = std::stoi(value);
+        } catch (std::exception &) {
+            throw arg_error("--jobs: not a number");
+        }
+    });
+    o.alias_opt('j', "jobs");
     o.add_opt("info-file", [&](std::string filename) {
         util::file sysinfo_file;
         sysinfo_file.open(filename, "rb");
@@ -52,18 +120,22 @@ int cmd_cdxa_imprint(cmdenv e)
         }
         sysinfo_file.read(sysinfo, sizeof(sysinfo));
         sysinfo_set = true;
+        sysinfo_changed = true;
     }, true);
     o.add_opt("psx-scea", [&]{
         std::memcpy(sysinfo, embed::imprints::infousa_dat::data, 37632);
         sysinfo_set = true;
+        sysinfo_changed = true;
     }, true);
     o.add_opt("psx-scee", [&]{
         std::memcpy(sysinfo, embed::imprints::infoeur_dat::data, 37632);
         sysinfo_set = true;
+        sysinfo_changed = true;
     }, true);
     o.add_opt("psx-scei", [&]{
         std::memcpy(sysinfo, embed::imprints::infojap_dat::data, 37632);
         sysinfo_set = true;
+        sysinfo_changed = true;
     }, true);
     o.begin(e.argv);
 
@@ -105,6 +177,17 @@ options are available:
         refuse to boot a game disc unless it contains a proper system
         information section as provided by these options.
 
+    -j, --jobs <count>
+        Imprint up to <count> images at once on separate threads. The
+        messages for each image are still printed in the order the
+        images were given. A count of zero uses one thread per hardware
+        thread. The default is one.
+
+Images which already begin with the given system information data are
+left untouched. Otherwise, the data is written and then read back to
+check that it was written correctly. A status line is printed for each
+image, followed by a summary.
+
 The system information data (--info-file, --psx-..., etc) to use must
 be specified before any BIN image arguments are given. You may specify
 multiple such options to apply to different images; see the examples
@@ -118,6 +201,9 @@ Example usage:
     # Apply an NTSC-U image to several BIN files.
     drnsf :cdxa-imprint --scea disc_1.bin disc_2.bin disc_3.bin
 
+    # Apply an NTSC-U image to a whole set of BIN files using 8 threads.
+    drnsf :cdxa-imprint --jobs 8 --psx-scea tests/*.bin
+
     # Apply several sysinfo images to different BIN files.
     drnsf :cdxa-imprint --scea mymod_us.bin --scee mymod_eu.bin \
         --scei mymod_jp.bin --info-file=/dev/urandom mymod_garbage.bin
@@ -130,34 +216,54 @@ Example usage:
         throw arg_error("No files specified.");
     }
 
-    bool ok = true;
-
+    // Gather the images to imprint, along with the system information data
+    // given before each one.
+    std::vector<util::blob> sysinfos;
+    std::vector<std::unique_ptr<imprint_task>> tasks;
     while (!o.pump_eof()) {
-        std::string arg;
-        o >> arg;
+        auto task = std::make_unique<imprint_task>();
+        o >> task->filename;
 
         if (!sysinfo_set) {
             throw arg_error("No system information data specified.");
         }
-
-        std::cout << arg << ": imprinting..." << std::endl;
-
-        try {
-            util::file file;
-            file.open(arg, "rb+");
-            file.write(sysinfo, sizeof(sysinfo));
-        } catch (std::exception &ex) {
-            std::cerr
-                << arg
-                << ": "
-                << ex.what()
-                << std::endl;
-            ok = false;
+        if (sysinfo_changed) {
+            sysinfos.emplace_back(sysinfo, sysinfo + sizeof(sysinfo));
+            sysinfo_changed = false;
         }
+        task->sysinfo = sysinfos.size() - 1;
+        tasks.push_back(std::move(task));
     }
 
     o.end();
 
+    // Imprint the images, printing the messages for each image once it and
+    // every image before it have finished.
+    util::parallel_for_ordered(tasks.size(), [&](size_t i) {
+        do_imprint(*tasks[i], sysinfos[tasks[i]->sysinfo]);
+    }, [&](size_t i) {
+        auto &&task = *tasks[i];
+        (task.ok ? std::cout : std::cerr) << task.out.str() << std::flush;
+    }, jobs);
+
+    size_t written = 0;
+    size_t failed = 0;
+    for (auto &&task : tasks) {
+        written += task->written;
+        failed += !task->ok;
+    }
+    std::cout
+        << tasks.size()
+        << " images: "
+        << written
+        << " imprinted, "
+        << (tasks.size() - written - failed)
+        << " already imprinted, "
+        << failed
+        << " failed"
+        << std::endl;
+
+    bool ok = (failed == 0);
     return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -0,0 +1,117 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "core.hh"
+#include <iostream>
+#include "cdxa.hh"
+
+namespace drnsf {
+namespace core {
+
+// FIXME explain
+int cmd_cdxa_write(cmdenv e)
+{
+    argparser o;
+    o.add_opt("help", [&]{ e.help_requested = true; });
+    o.alias_opt('h', "help");
+    o.begin(e.argv);
+
+    if (e.help_requested) {
+        std::cout << R"(Usage:
+
+    drnsf :cdxa-write <file> <image>:<path>
+
+Writes the given file over the file at <path> inside the CD-XA BIN disc
+image <image>, in place, without rebuilding the image. The file in the
+image must already exist, and the new file must fit within the sectors
+it already occupies. If the size of the file changes, its directory
+record is updated to match.
+
+Only the sectors whose contents change are written, and the error
+detection and correction data (EDC/ECC) is recomputed for each of them.
+
+Example usage:
+
+    # Write a re-exported Snow Go back into the disc image
+    drnsf :cdxa-write S000000E.NSF crash2.bin:/S2/S000000E.NSF
+)"
+            << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::string input_filename;
+    std::string output_path;
+    if (o.pump_eof()) {
+        std::cerr
+            << "drnsf cdxa-write: No input file specified.\n\n"
+            << "Try: drnsf :help cdxa-write"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    o >> input_filename;
+    if (o.pump_eof()) {
+        std::cerr
+            << "drnsf cdxa-write: No destination specified.\n\n"
+            << "Try: drnsf :help cdxa-write"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    o >> output_path;
+    o.end();
+
+    std::string image_path;
+    std::string inner_path;
+    if (!cdxa::split_path(output_path, image_path, inner_path)) {
+        std::cerr
+            << "drnsf cdxa-write: The destination must be a path into an "
+            << "existing BIN image, such as crash2.bin:/S2/S000000E.NSF."
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto data = cdxa::load_file(input_filename);
+
+        util::stopwatch timer;
+        auto count = cdxa::write_file(image_path, inner_path, data);
+
+        std::cout
+            << output_path
+            << ": "
+            << count
+            << " sectors written in "
+            << timer.lap()
+            << " ms"
+            << std::endl;
+    } catch (std::exception &ex) {
+        std::cerr
+            << output_path
+            << ": "
+            << ex.what()
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+}
+}
@@ -0,0 +1,331 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "core.hh"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include "fs.hh"
+#include "nsf.hh"
+#include "cdxa.hh"
+
+namespace drnsf {
+namespace core {
+
+// (s-struct) file_diff
+// The comparison of one pair of files. Pairs may be compared on separate
+// threads, so each comparison collects its output in `out' rather than writing
+// it directly, and they are printed later in order.
+struct file_diff {
+    std::string old_filename;
+    std::string new_filename;
+    std::ostringstream out;
+    bool same = true;
+    bool ok = true;
+};
+
+// (s-func) load_digest
+// Imports the given NSF file without processing its entries and returns the
+// digest of the resulting archive.
+static nsf::archive_digest load_digest(const std::string &filename)
+{
+    auto nsf_data = cdxa::load_file(filename);
+
+    res::project proj;
+    nsf::archive::ref arc = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+        arc->import_and_process(
+            TS,
+            nsf_data,
+            nsf::game_ver::none,
+            nsf::archive::processing::lazy,
+            1
+        );
+    });
+
+    return nsf::archive_digest::build(*arc);
+}
+
+// (s-func) page_str
+// Returns the given page index as a string, or "-" if there is no page.
+static std::string page_str(size_t page)
+{
+    if (page == nsf::entry_change::no_page)
+        return "-";
+    return std::to_string(page);
+}
+
+// (s-func) do_diff
+// Compares the pair of files in `fd' and writes the differences to `fd.out'.
+static void do_diff(file_diff &fd, bool quiet)
+{
+    using kind = nsf::entry_change::kind;
+
+    try {
+        auto old_digest = load_digest(fd.old_filename);
+        auto new_digest = load_digest(fd.new_filename);
+        auto changes = nsf::diff_archives(old_digest, new_digest);
+
+        // Find the pages which differ from the page at the same index in the
+        // other file.
+        auto &&old_pages = old_digest.pages;
+        auto &&new_pages = new_digest.pages;
+        auto page_count = std::max(old_pages.size(), new_pages.size());
+        std::vector<size_t> changed_pages;
+        for (size_t i = 0; i < page_count; i++) {
+            if (i >= old_pages.size() ||
+                i >= new_pages.size() ||
+                old_pages[i].hash != new_pages[i].hash) {
+                changed_pages.push_back(i);
+            }
+        }
+
+        if (changes.empty() && changed_pages.empty())
+            return;
+        fd.same = false;
+
+        fd.out
+            << "--- " << fd.old_filename << "\n"
+            << "+++ " << fd.new_filename << "\n"
+            << "pages: " << old_pages.size() << " -> " << new_pages.size()
+            << ", " << changed_pages.size() << " changed"
+            << "\n";
+
+        size_t counts[4] = {};
+        for (auto &&c : changes) {
+            counts[static_cast<int>(c.what)]++;
+        }
+
+        if (!quiet) {
+            if (!changed_pages.empty()) {
+                fd.out << "changed pages:";
+                for (auto &&page : changed_pages) {
+                    fd.out << " " << page;
+                }
+                fd.out << "\n";
+            }
+
+            for (auto &&c : changes) {
+                const char *label = "";
+                switch (c.what) {
+                case kind::added:
+                    label = "added";
+                    break;
+                case kind::removed:
+                    label = "removed";
+                    break;
+                case kind::moved:
+                    label = "moved";
+                    break;
+                case kind::modified:
+                    label = "modified";
+                    break;
+                }
+
+                fd.out
+                    << "  "
+                    << std::left << std::setw(10) << label
+                    << std::setw(7) << c.id.str() << std::right
+                    << "  page "
+                    << page_str(c.old_page) << " -> " << page_str(c.new_page);
+                if (!c.items.empty()) {
+                    fd.out << "  items";
+                    for (auto &&item : c.items) {
+                        fd.out << " " << item;
+                    }
+                }
+                fd.out << "\n";
+            }
+        }
+
+        fd.out
+            << counts[static_cast<int>(kind::added)] << " added, "
+            << counts[static_cast<int>(kind::removed)] << " removed, "
+            << counts[static_cast<int>(kind::moved)] << " moved, "
+            << counts[static_cast<int>(kind::modified)] << " modified"
+            << "\n\n";
+    } catch (std::exception &ex) {
+        fd.out
+            << fd.old_filename
+            << " / "
+            << fd.new_filename
+            << ": "
+            << ex.what()
+            << "\n";
+        fd.same = false;
+        fd.ok = false;
+    }
+}
+
+// FIXME explain
+int cmd_diff(cmdenv e)
+{
+    bool quiet = false;
+    int jobs = 1;
+
+    argparser o;
+    o.add_opt("help", [&]{ e.help_requested = true; });
+    o.add_opt("quiet", [&]{ quiet = true; });
+    o.add_opt("jobs", [&](std::string value) {
+        try {
+            jobs = std::stoi(value);
+        } catch (std::exception &) {
+            throw arg_error("--jobs: not a number");
+        }
+    });
+    o.alias_opt('h', "help");
+    o.alias_opt('q', "quiet");
+    o.alias_opt('j', "jobs");
+    o.begin(e.argv);
+
+    if (e.help_requested) {
+        std::cout << R"(Usage:
+
+    drnsf :diff [options] <old> <new>
+
+Compares two NSF files and lists the entries and texture pages which
+were added, removed, moved to another page or modified, by EID. For a
+modified entry, the indices of the items which differ are also listed,
+along with the page indices in the old and new files. The pages which
+differ from the page at the same index in the other file are listed as
+well.
+
+An NSF file inside a CD-XA BIN disc image can be given as the path of
+the image followed by the path inside it, such as:
+
+    crash2.bin:/S2/S000000E.NSF
+
+Entries are not processed, and the files are compared by hashes of
+their pages, entries and items rather than byte by byte, so the game
+version is not needed.
+
+If <old> and <new> are both directories, each file in <old> is compared
+with the file of the same name in <new>, and files which are only in one
+of the directories are listed. Subdirectories are not searched.
+
+Nothing is printed for files which are the same. The exit code is zero
+if every pair of files is the same, and non-zero otherwise.
+
+Options:
+
+    -q, --quiet
+        Only print the number of changes for each pair of files, not
+        the changes themselves.
+
+    -j, --jobs <count>
+        Compare up to <count> pairs of files at once on separate
+        threads. The output is still printed in order. A count of zero
+        uses one thread per hardware thread. The default is one.
+
+Example usage:
+
+    # Compare two builds of Snow Go
+    drnsf :diff old/S000000E.NSF new/S000000E.NSF
+
+    # Compare every level of two builds using 8 threads
+    drnsf :diff --jobs 8 old/S2 new/S2
+)"
+            << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::string old_path;
+    std::string new_path;
+    if (o.pump_eof()) {
+        std::cerr
+            << "drnsf diff: No files specified.\n\n"
+            << "Try: drnsf :help diff"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    o >> old_path;
+    if (o.pump_eof()) {
+        std::cerr
+            << "drnsf diff: Only one file specified.\n\n"
+            << "Try: drnsf :help diff"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    o >> new_path;
+    o.end();
+
+    // Pair up the files to compare.
+    std::vector<std::unique_ptr<file_diff>> diffs;
+    bool only_in_one = false;
+    if (fs::is_directory(old_path) && fs::is_directory(new_path)) {
+        const auto list_files = [](const std::string &dir) {
+            std::set<std::string> names;
+            for (auto &&de : fs::directory_iterator(dir)) {
+                if (fs::is_regular_file(de.status())) {
+                    names.insert(de.path().filename().string());
+                }
+            }
+            return names;
+        };
+        auto old_names = list_files(old_path);
+        auto new_names = list_files(new_path);
+
+        for (auto &&name : old_names) {
+            if (!new_names.count(name)) {
+                std::cout << "Only in " << old_path << ": " << name << "\n";
+                only_in_one = true;
+                continue;
+            }
+            auto fd = std::make_unique<file_diff>();
+            fd->old_filename = (fs::path(old_path) / name).string();
+            fd->new_filename = (fs::path(new_path) / name).string();
+            diffs.push_back(std::move(fd));
+        }
+        for (auto &&name : new_names) {
+            if (!old_names.count(name)) {
+                std::cout << "Only in " << new_path << ": " << name << "\n";
+                only_in_one = true;
+            }
+        }
+    } else {
+        auto fd = std::make_unique<file_diff>();
+        fd->old_filename = old_path;
+        fd->new_filename = new_path;
+        diffs.push_back(std::move(fd));
+    }
+
+    // Compare the files, printing the output for each pair once it and every
+    // pair before it have finished.
+    util::parallel_for_ordered(diffs.size(), [&](size_t i) {
+        do_diff(*diffs[i], quiet);
+    }, [&](size_t i) {
+        auto &&fd = *diffs[i];
+        (fd.ok ? std::cout : std::cerr) << fd.out.str() << std::flush;
+    }, jobs);
+
+    bool same = !only_in_one && std::all_of(
+        diffs.begin(),
+        diffs.end(),
+        [](auto &&fd) { return fd->same; }
+    );
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
+}
@@ -135,9 +135,18 @@ The following subcommands are available:
     resave-test
         Run resave consistency tests against NSF files.
 
+    pack-pages
+        Repack the entries of an NSF file and report the page fetches.
+
+    diff
+        List the entries which differ between two NSF files.
+
     cdxa-imprint
         Overwrite the system info section of CD-XA BIN disc images.
 
+    cdxa-write
+        Write a file over an existing file inside a CD-XA BIN disc image.
+
     dump-gl
         Dump information about your OpenGL implementation, if possible.
 
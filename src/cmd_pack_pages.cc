@@ -0,0 +1,243 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "core.hh"
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include "nsf.hh"
+#include "cdxa.hh"
+
+namespace drnsf {
+namespace core {
+
+// (s-func) print_fetch_summary
+// Prints the mean and maximum page fetches and page runs of the given chunks.
+static void print_fetch_summary(
+    const char *label,
+    const std::vector<nsf::chunk_fetches> &chunks)
+{
+    size_t total_pages = 0;
+    size_t total_runs = 0;
+    size_t max_pages = 0;
+    size_t max_runs = 0;
+    for (auto &&c : chunks) {
+        total_pages += c.pages;
+        total_runs += c.runs;
+        max_pages = std::max(max_pages, c.pages);
+        max_runs = std::max(max_runs, c.runs);
+    }
+
+    double n = chunks.empty() ? 1 : chunks.size();
+    std::cout
+        << std::left << std::setw(8) << label << std::right
+        << std::fixed << std::setprecision(2)
+        << "pages: mean " << std::setw(6) << (total_pages / n)
+        << ", max " << std::setw(3) << max_pages
+        << "   runs: mean " << std::setw(6) << (total_runs / n)
+        << ", max " << std::setw(3) << max_runs
+        << std::endl;
+}
+
+// FIXME explain
+int cmd_pack_pages(cmdenv e)
+{
+    nsf::archive::packing mode = nsf::archive::packing::compact;
+    int effort = 4;
+    bool quiet = false;
+    bool renumber = false;
+    nsf::game_ver game_ver = nsf::game_ver::none;
+
+    argparser o;
+    o.add_opt("help", [&]{ e.help_requested = true; });
+    o.add_opt("c1", [&]{ game_ver = nsf::game_ver::crash1; });
+    o.add_opt("c2", [&]{ game_ver = nsf::game_ver::crash2; });
+    o.add_opt("c3", [&]{ game_ver = nsf::game_ver::crash3; });
+    o.add_opt("locality", [&]{ mode = nsf::archive::packing::locality; });
+    o.add_opt("quiet", [&]{ quiet = true; });
+    o.add_opt("renumber", [&]{ renumber = true; });
+    o.add_opt("effort", [&](std::string value) {
+        try {
+            effort = std::stoi(value);
+        } catch (std::exception &) {
+            throw arg_error("--effort: not a number");
+        }
+    });
+    o.alias_opt('h', "help");
+    o.alias_opt('q', "quiet");
+    o.begin(e.argv);
+
+    if (e.help_requested) {
+        std::cout << R"(Usage:
+
+    drnsf :pack-pages [options] {--c1 | --c2 | --c3} <input> [<output>]
+
+Repacks the entries in the standard pages of the given NSF file, then
+writes the result to <output> if it is given. <output> must not be the
+same file as <input>.
+
+Before and after packing, the expected page fetches for each scenery
+chunk are printed: the number of distinct pages which must be read to
+load the chunk, and the number of runs of consecutive pages among them
+(the number of seeks needed). Chunks which use exactly the same texture
+pages are assumed to be loaded together.
+
+An NSF file inside a CD-XA BIN disc image can be given as the path of
+the image followed by the path inside it, such as:
+
+    crash2.bin:/S2/S000000E.NSF
+
+Entries are not processed, so the game version is only used to find the
+references between entries. Texture pages are not moved. The page
+numbers stored in the level's NSD file are not updated, so the output
+is only loadable by the game once the NSD file has been rebuilt.
+
+Options:
+
+    --locality
+        Keep entries which refer to the same texture pages in the same
+        or neighbouring pages, instead of packing the entries into as
+        few pages as possible.
+
+    --effort <level>
+        How hard to search for a smaller packing, from 0. The default
+        is 4. This has no effect with --locality.
+
+    -q, --quiet
+        Only print the summary of the page fetches, not the fetches for
+        each chunk.
+
+    --renumber
+        Renumber the chunk IDs of the standard pages to match their new
+        places in the file. By default, the pages keep their chunk IDs
+        and new pages are numbered after the largest one.
+
+Example usage:
+
+    # Compare the page fetches of Snow Go with and without --locality
+    drnsf :pack-pages --c2 S000000E.NSF
+    drnsf :pack-pages --c2 --locality S000000E.NSF
+
+    # Write the packed file
+    drnsf :pack-pages --c2 --locality S000000E.NSF S000000E.packed.NSF
+)"
+            << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::string input_filename;
+    std::string output_filename;
+    if (o.pump_eof()) {
+        std::cerr
+            << "drnsf pack-pages: No input file specified.\n\n"
+            << "Try: drnsf :help pack-pages"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    o >> input_filename;
+    if (!o.pump_eof()) {
+        o >> output_filename;
+    }
+    o.end();
+
+    if (game_ver == nsf::game_ver::none) {
+        std::cerr
+            << "drnsf pack-pages: No game version specified.\n\n"
+            << "Try: drnsf :help pack-pages"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (output_filename == input_filename) {
+        std::cerr
+            << "drnsf pack-pages: The output file must not be the input file."
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto nsf_data = cdxa::load_file(input_filename);
+
+    res::project proj;
+    nsf::archive::ref arc = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+        arc->import_and_process(
+            TS,
+            nsf_data,
+            game_ver,
+            nsf::archive::processing::lazy
+        );
+    });
+
+    auto pages_before = arc->get_pages().size();
+    auto before = nsf::measure_fetches(nsf::entry_graph::build(*arc));
+
+    proj.get_transact().run([&](TRANSACT) {
+        TS.describe("Pack pages");
+        arc->pack_pages(TS, mode, effort);
+        if (renumber) {
+            arc->renumber_pages(TS);
+        }
+    });
+
+    auto pages_after = arc->get_pages().size();
+    auto after = nsf::measure_fetches(nsf::entry_graph::build(*arc));
+
+    // The chunks are listed in page order, which packing changes, so match
+    // them up by EID.
+    if (!quiet) {
+        std::map<uint32_t, nsf::chunk_fetches> after_by_eid;
+        for (auto &&c : after) {
+            after_by_eid.emplace(c.chunk, c);
+        }
+
+        std::cout << "chunk     pages   runs" << std::endl;
+        for (auto &&c : before) {
+            auto &&a = after_by_eid.at(c.chunk);
+            std::cout
+                << std::left << std::setw(8) << c.chunk.str() << std::right
+                << std::setw(4) << c.pages << " -> " << std::setw(2) << a.pages
+                << std::setw(4) << c.runs << " -> " << std::setw(2) << a.runs
+                << std::endl;
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout
+        << before.size() << " scenery chunks, "
+        << pages_before << " pages before and "
+        << pages_after << " pages after packing."
+        << std::endl;
+    print_fetch_summary("before", before);
+    print_fetch_summary("after", after);
+
+    if (!output_filename.empty()) {
+        util::file output;
+        output.open(output_filename, "wb");
+        util::file_sink sink(output);
+        arc->export_file(sink);
+        output.close();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+}
+}
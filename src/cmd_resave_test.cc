@@ -21,17 +21,99 @@
 #include "common.hh"
 #include "core.hh"
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
 #include "nsf.hh"
 #include "misc.hh"
+#include "cdxa.hh"
 
 namespace drnsf {
 namespace core {
 
-// (s-var) s_game_ver
-// The game version being loaded and unloaded.
-// FIXME - this maybe should not be global, in case subcommands can be run
-// simultaneously from scripts (or otherwise) in the future?
-static nsf::game_ver s_game_ver;
+// (s-typedef) test_clock
+// The clock used to time each stage of the test.
+using test_clock = std::chrono::steady_clock;
+
+// (s-struct) stage_times
+// The total time spent in each stage of the test. The time for each stage
+// includes the stages nested within it; for example, the page time includes
+// the time spent testing that page's pagelets.
+struct stage_times {
+    test_clock::duration read{};
+    test_clock::duration verify{};
+    test_clock::duration archive{};
+    test_clock::duration page{};
+    test_clock::duration pagelet{};
+    test_clock::duration entry{};
+};
+
+// (s-struct) file_test
+// The state of the test of a single file. Files may be tested on separate
+// threads, so each test collects its messages in `out' rather than writing
+// them directly, and they are printed later in the order the files were given.
+//
+// `jobs' is the number of threads to use within the test of the file, as given
+// to `util::parallel_for'. If only one file is tested, this is the `--jobs'
+// option. Otherwise it is one, so that the threads for each file don't
+// multiply with the threads testing the files.
+struct file_test {
+    std::string filename;
+    nsf::game_ver ver;
+    int jobs = 0;
+    std::ostringstream out;
+    bool ok = true;
+    size_t size = 0;
+    stage_times times;
+};
+
+// (s-class) stage_timer
+// Adds the time between construction and destruction of the timer onto the
+// given duration.
+class stage_timer : private util::nocopy {
+private:
+    test_clock::duration &m_total;
+    test_clock::time_point m_start;
+
+public:
+    explicit stage_timer(test_clock::duration &total) :
+        m_total(total),
+        m_start(test_clock::now()) {}
+
+    ~stage_timer()
+    {
+        m_total += test_clock::now() - m_start;
+    }
+};
+
+// (s-func) do_verify
+// Checks the checksum of every page in the given NSF file data. A message is
+// printed for each page with a bad checksum, and the function returns false if
+// there were any.
+static bool do_verify(file_test &ft, const util::shared_blob &data)
+{
+    stage_timer timer(ft.times.verify);
+
+    auto mismatches = nsf::archive::verify_file(data, ft.jobs);
+
+    for (auto &&mismatch : mismatches) {
+        ft.out
+            << ft.filename
+            << ": \033[42;30m  verify \033[0m "
+            << "bad checksum on page "
+            << (mismatch.page + 1)
+            << std::hex
+            << " (stored 0x"
+            << mismatch.stored
+            << ", calculated 0x"
+            << mismatch.actual
+            << ")."
+            << std::dec
+            << std::endl;
+    }
+
+    return mismatches.empty();
+}
 
 // (s-func) equal_without_padding
 // Returns true if the two blobs given are equivalent after trimming all
@@ -76,23 +158,25 @@ bool equal_without_padding(const util::blob &lhs, const util::blob &rhs)
 // the exported data with the input data to ensure a lossless import->export
 // operation. In the case of any mismatch, the function prints an error message
 // and returns false. Otherwise, the function returne true.
-static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
+static bool do_entry(TRANSACT, file_test &ft, nsf::raw_entry::ref src)
 {
+    stage_timer timer(ft.times.entry);
+
     bool ok = true;
 
     uint32_t in_type = src->get_type();
     auto in_items = src->get_items();
 
     nsf::entry::ref entry = src;
-    src->process_by_type(TS, s_game_ver);
+    src->process_by_type(TS, ft.ver);
 
     uint32_t out_type;
     auto out_items = entry->export_entry(out_type);
 
     if (in_type != out_type) {
         ok = false;
-        std::cerr
-            << filename
+        ft.out
+            << ft.filename
             << ": \033[46;30m  entry  \033[0m "
             << "resave \033[31mtype\033[0m mismatch on `"
             << entry.full_path()
@@ -102,8 +186,8 @@ static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
 
     if (in_items != out_items) {
         ok = false;
-        std::cerr
-            << filename
+        ft.out
+            << ft.filename
             << ": \033[46;30m  entry  \033[0m "
             << "resave item mismatch on `"
             << entry.full_path()
@@ -116,8 +200,10 @@ static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
 
 // (s-func) do_pagelet
 // FIXME explain
-static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_pagelet(TRANSACT, file_test &ft, misc::raw_data::ref src)
 {
+    stage_timer timer(ft.times.pagelet);
+
     bool ok = true;
 
     util::blob in_data = src->get_data();
@@ -133,8 +219,8 @@ static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
 
     if (!equal_without_padding(in_data, out_data)) {
         ok = false;
-        std::cerr
-            << filename
+        ft.out
+            << ft.filename
             << ": \033[45;30m pagelet \033[0m "
             << "resave data mismatch on `"
             << raw_entry.full_path()
@@ -142,22 +228,52 @@ static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
             << std::endl;
     }
 
-    ok &= do_entry(TS, filename, raw_entry);
+    ok &= do_entry(TS, ft, raw_entry);
 
     return ok;
 }
 
 // (s-func) do_page
 // FIXME explain
-static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_page(
+    TRANSACT,
+    file_test &ft,
+    misc::raw_data::ref src,
+    nsf::tpage::texture_map &textures)
 {
+    stage_timer timer(ft.times.page);
+
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::shared_blob in_data = src->get_data();
 
     if (src->get_data()[2] == 1) {
         // This is a texture page if the type is 1.
-        // TODO
+        nsf::tpage::ref tpage = src;
+        src->rename(TS, src / "_PROCESSING");
+        src /= "_PROCESSING";
+        tpage.create(TS, src->get_proj());
+        tpage->import_staged(
+            TS,
+            nsf::tpage::parse_file(src->get_data()),
+            &textures
+        );
+        src->destroy(TS);
+
+        util::shared_blob out_data = tpage->export_file();
+
+        if (!std::equal(
+            in_data.begin(), in_data.end(),
+            out_data.begin(), out_data.end())) {
+            ok = false;
+            ft.out
+                << ft.filename
+                << ": \033[44;30m  tpage  \033[0m "
+                << "resave data mismatch on `"
+                << tpage.full_path()
+                << "'."
+                << std::endl;
+        }
     } else {
         // For all other types, this is a standard page.
         nsf::spage::ref spage = src;
@@ -169,10 +285,12 @@ static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
 
         util::blob out_data = spage->export_file();
 
-        if (in_data != out_data) {
+        if (!std::equal(
+            in_data.begin(), in_data.end(),
+            out_data.begin(), out_data.end())) {
             ok = false;
-            std::cerr
-                << filename
+            ft.out
+                << ft.filename
                 << ": \033[43;30m  spage  \033[0m "
                 << "resave data mismatch on `"
                 << spage.full_path()
@@ -181,7 +299,7 @@ static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
         }
 
         for (misc::raw_data::ref pagelet : spage->get_pagelets()) {
-            ok &= do_pagelet(TS, filename, pagelet);
+            ok &= do_pagelet(TS, ft, pagelet);
         }
     }
 
@@ -190,11 +308,13 @@ static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
 
 // (s-func) do_nsf
 // FIXME explain
-static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_nsf(TRANSACT, file_test &ft, misc::raw_data::ref src)
 {
+    stage_timer timer(ft.times.archive);
+
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::shared_blob in_data = src->get_data();
 
     nsf::archive::ref archive = src;
     src->rename(TS, src / "_PROCESSING");
@@ -203,12 +323,47 @@ static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
     archive->import_file(TS, src->get_data());
     src->destroy(TS);
 
-    util::blob out_data = archive->export_file();
+    util::blob out_data = archive->export_file(
+        nsf::archive::compression::keep,
+        nsf::archive::default_compress_effort,
+        ft.jobs
+    );
 
-    if (in_data != out_data) {
+    // Compressed pages are recompressed on export, which is unlikely to give
+    // the exact same bytes as the original file. For those archives, check
+    // that the exported file imports back to the same pages instead.
+    bool match;
+    if (archive->get_compressed_pages().empty()) {
+        match = std::equal(
+            in_data.begin(), in_data.end(),
+            out_data.begin(), out_data.end()
+        );
+    } else {
+        nsf::archive::ref reimport = archive / "_REIMPORT";
+        reimport.create(TS, archive->get_proj());
+        reimport->import_file(TS, std::move(out_data));
+
+        auto &&in_pages = archive->get_pages();
+        auto &&out_pages = reimport->get_pages();
+        match = in_pages.size() == out_pages.size() &&
+            archive->get_compressed_pages().size() ==
+            reimport->get_compressed_pages().size();
+        for (size_t i = 0; match && i < in_pages.size(); i++) {
+            misc::raw_data::ref in_page = in_pages[i];
+            misc::raw_data::ref out_page = out_pages[i];
+            match = in_page->get_data() == out_page->get_data();
+        }
+
+        for (misc::raw_data::ref page : out_pages) {
+            page->destroy(TS);
+        }
+        reimport->destroy(TS);
+    }
+
+    if (!match) {
         ok = false;
-        std::cerr
-            << filename
+        ft.out
+            << ft.filename
             << ": \033[41;30m archive \033[0m "
             << "resave data mismatch on `"
             << archive.full_path()
@@ -216,28 +371,144 @@ static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
             << std::endl;
     }
 
+    nsf::tpage::texture_map textures;
     for (misc::raw_data::ref page : archive->get_pages()) {
-        ok &= do_page(TS, filename, page);
+        ok &= do_page(TS, ft, page, textures);
     }
 
     return ok;
 }
 
+// (s-func) do_file
+// Runs the test on the given file, recording the results in `ft'.
+static void do_file(file_test &ft, bool verify)
+{
+    try {
+        util::shared_blob nsf_data;
+        {
+            stage_timer timer(ft.times.read);
+
+            nsf_data = cdxa::load_file(ft.filename);
+            ft.size = nsf_data.size();
+        }
+
+        if (verify) {
+            ft.ok &= do_verify(ft, nsf_data);
+        }
+
+        res::project proj;
+        proj.get_transact().run([&](TRANSACT) {
+            misc::raw_data::ref nsfile = proj.get_asset_root() / "nsfile";
+            nsfile.create(TS, proj);
+            nsfile->set_data(TS, nsf_data);
+            ft.ok &= do_nsf(TS, ft, nsfile);
+        });
+    } catch (std::exception &ex) {
+        ft.out
+            << ft.filename
+            << ": "
+            << ex.what()
+            << std::endl;
+        ft.ok = false;
+    }
+}
+
+// (s-func) print_summary
+// Prints the total time spent in each stage across all of the given tests, and
+// the overall throughput given the wall-clock time the tests took to run.
+static void print_summary(
+    const std::vector<std::unique_ptr<file_test>> &tests,
+    test_clock::duration elapsed,
+    bool verify)
+{
+    stage_times total;
+    size_t total_size = 0;
+    size_t failed = 0;
+    for (auto &&ft : tests) {
+        total.read += ft->times.read;
+        total.verify += ft->times.verify;
+        total.archive += ft->times.archive;
+        total.page += ft->times.page;
+        total.pagelet += ft->times.pagelet;
+        total.entry += ft->times.entry;
+        total_size += ft->size;
+        if (!ft->ok) {
+            failed++;
+        }
+    }
+
+    const auto ms = [](test_clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+
+    const auto print_stage = [&](const char *name, test_clock::duration d) {
+        std::cout
+            << "  "
+            << std::left << std::setw(10) << name
+            << std::right << std::setw(12) << ms(d)
+            << " ms"
+            << std::endl;
+    };
+
+    // The stage times nest, so each stage is shown without the time of the
+    // stages within it.
+    std::cout
+        << std::fixed << std::setprecision(1)
+        << "Stage times (total across all threads):"
+        << std::endl;
+    print_stage("read", total.read);
+    if (verify) {
+        print_stage("verify", total.verify);
+    }
+    print_stage("archive", total.archive - total.page);
+    print_stage("page", total.page - total.pagelet);
+    print_stage("pagelet", total.pagelet - total.entry);
+    print_stage("entry", total.entry);
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double megabytes = double(total_size) / 1048576;
+    std::cout
+        << tests.size()
+        << " files ("
+        << failed
+        << " failed), "
+        << megabytes
+        << " MB in "
+        << seconds
+        << " s ("
+        << (seconds > 0 ? megabytes / seconds : 0)
+        << " MB/s)"
+        << std::endl;
+}
+
 // FIXME explain
 int cmd_resave_test(cmdenv e)
 {
+    bool verify = false;
+    int jobs = 1;
+    nsf::game_ver game_ver = nsf::game_ver::none;
+
     argparser o;
     o.add_opt("help", [&]{ e.help_requested = true; });
-    o.add_opt("c1", [&]{ s_game_ver = nsf::game_ver::crash1; });
-    o.add_opt("c2", [&]{ s_game_ver = nsf::game_ver::crash2; });
-    o.add_opt("c3", [&]{ s_game_ver = nsf::game_ver::crash3; });
+    o.add_opt("c1", [&]{ game_ver = nsf::game_ver::crash1; }, true);
+    o.add_opt("c2", [&]{ game_ver = nsf::game_ver::crash2; }, true);
+    o.add_opt("c3", [&]{ game_ver = nsf::game_ver::crash3; }, true);
+    o.add_opt("verify", [&]{ verify = true; });
+    o.add_opt("jobs", [&](std::string value) {
+        try {
+            jobs = std::stoi(value);
+        } catch (std::exception &) {
+            throw arg_error("--jobs: not a number");
+        }
+    });
     o.alias_opt('h', "help");
+    o.alias_opt('j', "jobs");
     o.begin(e.argv);
 
     if (e.help_requested) {
         std::cout << R"(Usage:
 
-    drnsf :resave-test {--c1 | --c2 | --c3} <file>...
+    drnsf :resave-test [options] {--c1 | --c2 | --c3} <file>...
 
 Runs resave tests against the given NSF files. For each given NSF file,
 DRNSF will import the NSF file and process it, then re-export the
@@ -245,12 +516,34 @@ processed data. If there is any mismatch between the input and output
 data, messages will be printed for each such mismatch, and the program
 will exit with a failure code.
 
+An NSF file inside a CD-XA BIN disc image can be given as the path of
+the image followed by the path inside it, such as:
+
+    crash2.bin:/S2/S000000E.NSF
+
 No files are overwritten by this command. All exporting is in-memory.
 
 This command is not intended to check an NSF file for consistency, but
 is instead intended to test the internal import/export code in DRNSF
 against a large set of pre-existing NSF files.
 
+When all of the files have been tested, the time spent in each stage of
+the test and the overall throughput are printed.
+
+Options:
+
+    --verify
+        Before importing each file, check the checksum of every page in
+        the file and print a message for each page with a bad checksum.
+        Files with bad checksums are counted as failures.
+
+    -j, --jobs <count>
+        Test up to <count> files at once on separate threads. The
+        messages for each file are still printed in the order the files
+        were given. If only one file is given, its pages are processed
+        on up to <count> threads instead. A count of zero uses one
+        thread per hardware thread. The default is one.
+
 Example usage:
 
     # Run resave checks against Snow Go and Piston It Away
@@ -261,6 +554,9 @@ Example usage:
 
     # Run resave checks against various game versions
     drnsf :resave-test --c2 crash2/*/*.NSF --c3 crash3/*/*.NSF
+
+    # Run resave checks against a whole game using 8 threads
+    drnsf :resave-test --jobs 8 --c2 crash2/*/*.NSF
 )"
             << std::endl;
         return EXIT_SUCCESS;
@@ -274,41 +570,34 @@ Example usage:
         return EXIT_FAILURE;
     }
 
-    bool ok = true;
-
+    // Gather the files to test, along with the game version given before
+    // each one.
+    std::vector<std::unique_ptr<file_test>> tests;
     while (!o.pump_eof()) {
-        std::string arg;
-        o >> arg;
-
-        try {
-            util::file nsf_file;
-            nsf_file.open(arg, "rb");
-
-            nsf_file.seek(0, SEEK_END);
-            auto nsf_size = nsf_file.tell();
-            nsf_file.seek(0, SEEK_SET);
-
-            util::blob nsf_data(nsf_size);
-            nsf_file.read(nsf_data.data(), nsf_size);
-            nsf_file.close();
-
-            res::project proj;
-            proj.get_transact().run([&](TRANSACT) {
-                misc::raw_data::ref nsfile = proj.get_asset_root() / "nsfile";
-                nsfile.create(TS, proj);
-                nsfile->set_data(TS, nsf_data);
-                ok &= do_nsf(TS, arg, nsfile);
-            });
-        } catch (std::exception &ex) {
-            std::cerr
-                << arg
-                << ": "
-                << ex.what()
-                << std::endl;
-            ok = false;
-        }
+        auto ft = std::make_unique<file_test>();
+        o >> ft->filename;
+        ft->ver = game_ver;
+        tests.push_back(std::move(ft));
+    }
+    for (auto &&ft : tests) {
+        ft->jobs = (tests.size() == 1) ? jobs : 1;
     }
 
+    // Test the files, printing the messages for each file once it and every
+    // file before it have finished.
+    auto start_time = test_clock::now();
+    util::parallel_for_ordered(tests.size(), [&](size_t i) {
+        do_file(*tests[i], verify);
+    }, [&](size_t i) {
+        std::cerr << tests[i]->out.str() << std::flush;
+    }, jobs);
+    auto elapsed = test_clock::now() - start_time;
+
+    print_summary(tests, elapsed, verify);
+
+    bool ok = std::all_of(tests.begin(), tests.end(), [](auto &&ft) {
+        return ft->ok;
+    });
     return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
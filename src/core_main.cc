@@ -31,7 +31,10 @@ extern int cmd_version(cmdenv e);
 extern int cmd_gui(cmdenv e);
 extern int cmd_internal_test(cmdenv e);
 extern int cmd_resave_test(cmdenv e);
+extern int cmd_pack_pages(cmdenv e);
+extern int cmd_diff(cmdenv e);
 extern int cmd_cdxa_imprint(cmdenv e);
+extern int cmd_cdxa_write(cmdenv e);
 extern int cmd_dump_gl(cmdenv e);
 
 // (s-func) cmd_default
@@ -50,7 +53,10 @@ extern const std::map<std::string, int (*)(cmdenv)> g_cmds = {
     { "gui", cmd_gui },
     { "internal-test", cmd_internal_test },
     { "resave-test", cmd_resave_test },
+    { "pack-pages", cmd_pack_pages },
+    { "diff", cmd_diff },
     { "cdxa-imprint", cmd_cdxa_imprint },
+    { "cdxa-write", cmd_cdxa_write },
     { "dump-gl", cmd_dump_gl }
 };
 
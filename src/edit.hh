@@ -484,6 +484,24 @@ public:
     explicit mni_redo(gui::menu &menu, context &ctx);
 };
 
+/*
+ * edit::menus::mni_fit_pages
+ *
+ * Edit -> Fit Pages
+ * Moves entries out of any pages which have grown past 64K, so that the project
+ * can be saved. See `nsf::archive::fit_pages'.
+ */
+class mni_fit_pages : private gui::menu::item {
+private:
+    context &m_ctx;
+    void on_activate() final override;
+
+    decltype(context::on_project_change)::watch h_project_change;
+
+public:
+    explicit mni_fit_pages(gui::menu &menu, context &ctx);
+};
+
 /*
  * edit::menus::mnu_edit
  *
@@ -495,6 +513,7 @@ private:
     mode_widget &m_mode_widget;
     mni_undo m_undo{*this, m_ctx};
     mni_redo m_redo{*this, m_ctx};
+    mni_fit_pages m_fit_pages{*this, m_ctx};
     mode_menuset m_modes{*this, m_mode_widget};
 
 public:
@@ -1112,20 +1131,20 @@ public:
 };
 
 /*
- * edit::field
- *   for raw data (util::blob)
+ * edit::blob_field
  *
- * This provides a specialized version of `edit::field' for `util::blob'. This
- * field is presented as a basic hex editor.
+ * This provides the implementation of `edit::field' for raw data types, which
+ * are `util::blob' and `util::shared_blob'. This field is presented as a basic
+ * hex editor.
  *
  * For more details, see the non-specialized version of `edit::field'.
  */
-template <>
-class field<util::blob> : private util::nocopy {
+template <typename T>
+class blob_field : private util::nocopy {
 private:
     // (var) m_object
     // See the non-specialized `edit::field' for details.
-    const util::blob *m_object;
+    const T *m_object;
 
     // (var) m_selected_byte
     // The offset of the currently selected byte in the editor. This may be
@@ -1145,7 +1164,7 @@ private:
 public:
     // (func) bind
     // See the non-specialized `edit::field' for details.
-    void bind(const util::blob *object)
+    void bind(const T *object)
     {
         m_object = object;
     }
@@ -1156,9 +1175,20 @@ public:
 
     // (event) on_change
     // See the non-specialized `edit::field' for details.
-    util::event<util::blob> on_change;
+    util::event<T> on_change;
 };
 
+/*
+ * edit::field
+ *   for raw data (util::blob, util::shared_blob)
+ *
+ * These specializations of `edit::field' use `edit::blob_field' above.
+ */
+template <>
+class field<util::blob> : public blob_field<util::blob> {};
+template <>
+class field<util::shared_blob> : public blob_field<util::shared_blob> {};
+
 /*
  * edit::field
  *   for gfx::vertex
@@ -1901,7 +1931,9 @@ public:
     }
 
     // (func) set_name
-    // Sets the asset name used by all of the contained widgets.
+    // Sets the asset name used by all of the contained widgets. Entries which
+    // have not been processed yet should be processed by the caller first (see
+    // `nsf::process_pending'), otherwise the widgets show the raw entry.
     void set_name(res::atom name)
     {
         m_metactl.set_name(name);
@@ -25,9 +25,10 @@ namespace drnsf {
 namespace edit {
 
 // declared in edit.hh
-void field<util::blob>::frame()
+template <typename T>
+void blob_field<T>::frame()
 {
-    const util::blob empty = {};
+    const T empty = {};
     auto &obj = m_object ? *m_object : empty;
     // If there is no blob bound to the field, display the UI as if there
     // was a zero-length blob bound to it.
@@ -229,7 +230,7 @@ void field<util::blob>::frame()
 
             if (m_input_len == 2) {
                 if (m_selected_byte < obj.size()) {
-                    util::blob new_value = obj;
+                    util::blob new_value(obj.begin(), obj.end());
                     new_value[m_selected_byte] = m_input_value;
                     on_change(std::move(new_value));
                 }
@@ -339,5 +340,8 @@ void field<util::blob>::frame()
     ImGui::PopStyleVar(2);
 }
 
+template class blob_field<util::blob>;
+template class blob_field<util::shared_blob>;
+
 }
 }
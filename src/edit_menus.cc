@@ -20,6 +20,8 @@
 
 #include "common.hh"
 #include "edit.hh"
+#include "fs.hh"
+#include "cdxa.hh"
 
 namespace drnsf {
 namespace edit {
@@ -44,72 +46,22 @@ void mni_open<GameVersion>::on_activate()
     proj.get_transact().run([&](TRANSACT) {
         TS.describe("Import NSF");
 
-        // Open the NSF file and read the data into memory.
-        util::file nsf_file;
-        nsf_file.open(path, "rb");
+        // Map the NSF file into memory. The imported pages and pagelets will
+        // refer to this mapping directly, so the file is not copied. A path
+        // into a BIN image (e.g. "game.bin:/S2/S000000E.NSF") is read out of
+        // the image instead (see `cdxa::load_file').
+        auto nsf_data = cdxa::load_file(path);
 
-        nsf_file.seek(0, SEEK_END);
-        auto nsf_size = nsf_file.tell();
-        nsf_file.seek(0, SEEK_SET);
-
-        util::blob nsf_data(nsf_size);
-        nsf_file.read(nsf_data.data(), nsf_size);
-        nsf_file.close();
-
-        // Import the data into an NSF asset.
+        // Import the data into an NSF asset and process all of its pages.
+        // Entries are processed later, when they are first opened.
         nsf::archive::ref nsf_asset = proj.get_asset_root() / "nsfile";
         nsf_asset.create(TS, proj);
-        nsf_asset->import_file(TS, std::move(nsf_data));
-
-        // Process all of the pages in the new NSF asset.
-        for (misc::raw_data::ref page : nsf_asset->get_pages()) {
-
-            // Pages with type 1 should be processed as texture pages.
-            if (page->get_data()[2] == 1) {
-                nsf::tpage::ref tpage = page;
-                page->rename(TS, page / "_PROCESSING");
-                page /= "_PROCESSING";
-                tpage.create(TS, proj);
-                tpage->import_file(TS, page->get_data());
-                page->destroy(TS);
-                
-                continue;
-            }
-
-            nsf::spage::ref spage = page;
-            page->rename(TS, page / "_PROCESSING");
-            page /= "_PROCESSING";
-            spage.create(TS, proj);
-            spage->import_file(TS, page->get_data());
-            page->destroy(TS);
-
-            // Process all of the entries inside each standard page.
-            auto pagelets = spage->get_pagelets();
-            for (auto &p : pagelets) {
-                misc::raw_data::ref pagelet = p;
-
-                nsf::raw_entry::ref entry = pagelet;
-                pagelet->rename(TS, pagelet / "_PROCESSING");
-                pagelet /= "_PROCESSING";
-                entry.create(TS, proj);
-                entry->import_file(TS, pagelet->get_data());
-                pagelet->destroy(TS);
-
-                // Rename the entry asset to "entries/<eid_here>". This brings
-                // all of the entries together as siblings for easy access.
-                auto new_path =
-                    proj.get_asset_root() /
-                    "entries" /
-                    entry->get_eid().str();
-                if (!new_path.get())
-                    entry->rename(TS, new_path);
-                entry = new_path;
-                p = new_path;
-
-                entry->process_by_type(TS, GameVersion);
-            }
-            spage->set_pagelets(TS, pagelets);
-        }
+        nsf_asset->import_and_process(
+            TS,
+            nsf_data,
+            GameVersion,
+            nsf::archive::processing::lazy
+        );
     });
 
     // Point the context to the newly opened project.
@@ -154,20 +106,29 @@ void mni_save_as::on_activate()
 
     // TODO - make the remaining code asynchronous to not block the UI
 
-    // Deserialize all of the assets referenced (directly or indirectly) into
-    // one large blob of NSF file data.
-    util::blob nsf_data;
+    // Serialize all of the assets referenced (directly or indirectly) as NSF
+    // file data, writing each page into the file specified by the user as
+    // soon as it is ready. The data is written to a temporary file which then
+    // replaces the target. This avoids truncating the target in place, which
+    // matters if it is the file the project was opened from, as that file is
+    // still memory-mapped by any unmodified pages.
+    //
+    // If the export or the rename fails, the temporary file is removed and the
+    // target is left as it was.
     /*try*/ {
-        nsf_data = nsf_asset->export_file();
-    } /*catch (?) {
-        TODO - handle errors
-    }*/
-
-    // Write the NSF data into the file specified by the user.
-    /*try*/ {
-        util::file nsf_file;
-        nsf_file.open(path, "wb");
-        nsf_file.write(nsf_data.data(), nsf_data.size());
+        std::string tmp_path = path + ".tmp";
+        try {
+            util::file nsf_file;
+            nsf_file.open(tmp_path, "wb");
+            util::file_sink nsf_sink(nsf_file);
+            nsf_asset->export_file(nsf_sink);
+            nsf_file.close();
+            fs::rename(fs::u8path(tmp_path), fs::u8path(path));
+        } catch (...) {
+            std::error_code ec;
+            fs::remove(fs::u8path(tmp_path), ec);
+            throw;
+        }
     } /*catch (?) {
         TODO - handle errors
     }*/
@@ -329,6 +290,41 @@ mni_redo::mni_redo(gui::menu &menu, context &ctx) :
     h_project_change(ctx.get_proj());
 }
 
+// declared in edit.hh
+mni_fit_pages::mni_fit_pages(gui::menu &menu, context &ctx) :
+    item(menu, "Fit Pages"),
+    m_ctx(ctx)
+{
+    h_project_change <<= [this](const std::shared_ptr<res::project> &proj) {
+        set_enabled(m_ctx.get_proj() != nullptr);
+    };
+    h_project_change.bind(ctx.on_project_change);
+    h_project_change(ctx.get_proj());
+}
+
+// declared in edit.hh
+void mni_fit_pages::on_activate()
+{
+    auto proj = m_ctx.get_proj();
+    if (!proj) return;
+
+    auto &tsn = proj->get_transact();
+    if (tsn.get_status() != transact::status::ready) return;
+
+    nsf::archive::ref nsf_asset = proj->get_asset_root() / "nsfile";
+    if (!nsf_asset.ok()) {
+        // TODO - error message box
+        return;
+    }
+
+    // The chunk IDs of the existing pages are left as they are, as the NSD
+    // file is not rebuilt to match (see `nsf::archive::renumber_pages').
+    tsn.run([&](TRANSACT) {
+        TS.describe("Fit pages");
+        nsf_asset->fit_pages(TS);
+    });
+}
+
 // declared in edit.hh
 void mni_new_window::on_activate()
 {
@@ -35,6 +35,9 @@ mainctl::mainctl(
     m_ctx(ctx)
 {
     m_tree.on_select <<= [this](res::atom atom) {
+        if (atom) {
+            nsf::process_pending(*atom.get_proj(), {atom});
+        }
         m_body.set_name(atom);
     };
 
@@ -39,6 +39,9 @@ mainctl::mainctl(
     // widget; this would cause a problem during destruction if a node was
     // selected in the tree at that time.
     h_tree_select <<= [this](res::atom atom) {
+        if (atom) {
+            nsf::process_pending(*atom.get_proj(), {atom});
+        }
         m_body.set_name(atom);
     };
     h_tree_select.bind(m_tree.on_select);
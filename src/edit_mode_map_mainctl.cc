@@ -26,6 +26,19 @@ namespace drnsf {
 namespace edit {
 namespace mode_map {
 
+// (s-func) process_entries
+// Processes any entries in the project which have not been processed yet, as
+// the map shows the worlds from every entry at once. See
+// `nsf::process_pending'.
+static void process_entries(res::project &proj)
+{
+    auto pending = nsf::find_pending(proj);
+    if (pending.empty())
+        return;
+
+    nsf::process_pending(proj, pending);
+}
+
 // declared in edit.hh
 mainctl::mainctl(
     gui::container &parent,
@@ -49,6 +62,7 @@ mainctl::mainctl(
 
     h_project_change <<= [this](const std::shared_ptr<res::project> &proj) {
         if (proj) {
+            process_entries(*proj);
             m_world_tracker.set_base(proj->get_asset_root());
         } else {
             m_world_tracker.set_base(nullptr);
@@ -57,6 +71,7 @@ mainctl::mainctl(
     h_project_change.bind(m_ctx.on_project_change);
 
     if (m_ctx.get_proj()) {
+        process_entries(*m_ctx.get_proj());
         m_world_tracker.set_base(m_ctx.get_proj()->get_asset_root());
     }
 
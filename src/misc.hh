@@ -65,8 +65,11 @@ public:
     using ref = res::ref<raw_data>;
 
     // (prop) data
-    // FIXME explain
-    DEFINE_APROP(data, util::blob);
+    // The bytes held by this asset. This is a shared (reference-counted) blob
+    // so that data imported from a larger file, such as pages within an NSF
+    // file, can refer to that file's memory without a copy being made. See
+    // `util::shared_blob' for details.
+    DEFINE_APROP(data, util::shared_blob);
 };
 
 }
@@ -83,7 +86,7 @@ struct asset_type_info<misc::raw_data> {
 };
 template <>
 struct asset_prop_info<misc::raw_data, 0> {
-    using type = util::blob;
+    using type = util::shared_blob;
 
     static constexpr const char *name = "data";
     static constexpr auto ptr = &misc::raw_data::p_data;
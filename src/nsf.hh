@@ -27,6 +27,8 @@
  */
 
 #include <vector>
+#include <memory>
+#include <unordered_map>
 #include "res.hh"
 #include "gfx.hh"
 
@@ -122,6 +124,110 @@ public:
  */
 constexpr size_t page_size = 65536;
 
+/*
+ * nsf::page_checksum
+ *
+ * Calculates the checksum of the given page data, as stored in bytes 12-15 of
+ * the page header. Those four bytes are not included in the checksum, so the
+ * result does not depend on the checksum already present in the data.
+ *
+ * The checksum is calculated over the uncompressed page. For a compressed page
+ * it must be calculated on the data given by `archive::decompress_spage'.
+ */
+uint32_t page_checksum(const unsigned char *data, size_t size = page_size);
+
+/*
+ * nsf::pagelet_info
+ *
+ * The parts of a pagelet which decide where it may be placed in a standard
+ * page. If the pagelet is an entry, the first item of the entry must be aligned
+ * to the page's alignment (see `get_page_alignment'), so the entry may need
+ * padding placed before it. Other pagelets are placed without any padding.
+ */
+struct pagelet_info {
+    size_t size;
+    bool is_entry;
+    uint32_t first_item_offset;
+};
+
+/*
+ * nsf::get_pagelet_info
+ *
+ * Returns the `pagelet_info' for the given pagelet data. The data is treated as
+ * an entry if it starts with a viable entry header.
+ */
+pagelet_info get_pagelet_info(const util::shared_blob &pagelet);
+
+/*
+ * nsf::get_page_alignment
+ *
+ * Returns the alignment of the first item of each entry in a standard page of
+ * the given type. All known non-zero type pages (except type 1 TPAG texture
+ * pages) contain audio data and need to have 16-byte aligned entries. Normal
+ * type zero pages only require 4-byte alignment.
+ */
+int get_page_alignment(uint16_t type);
+
+/*
+ * nsf::layout_page
+ *
+ * Lays out the given pagelets, in order, in a standard page with the given
+ * alignment, the same way `spage::export_file' does. Returns the size of the
+ * page up to the end of the last pagelet, which may be larger than `page_size'
+ * if the pagelets do not fit. If `padding' is given, it is set to the number of
+ * bytes of padding placed before each pagelet.
+ */
+size_t layout_page(
+    const std::vector<pagelet_info> &pagelets,
+    int alignment,
+    std::vector<uint32_t> *padding = nullptr);
+
+/*
+ * nsf::pack_pagelets
+ *
+ * Assigns the given pagelets to as few standard pages as possible and returns
+ * the indices of the pagelets in each page. The pagelets in each page are in
+ * increasing order of index, and are laid out in that order as with
+ * `layout_page'. The pages are ordered by their lowest pagelet index.
+ *
+ * Pagelets are first placed using first-fit-decreasing bin packing. Then the
+ * least-filled pages are emptied into the others where possible, moving or
+ * swapping pagelets between pages. Higher effort levels (from 0) spend more
+ * attempts on this second pass.
+ *
+ * Throws `res::export_error' if any single pagelet is too large to fit in a
+ * page.
+ */
+std::vector<std::vector<size_t>> pack_pagelets(
+    const std::vector<pagelet_info> &pagelets,
+    int alignment,
+    int effort = 4);
+
+/*
+ * nsf::cluster_pagelets
+ *
+ * Assigns the given pagelets to standard pages as with `pack_pagelets', but
+ * keeps pagelets which are used together in the same page or in neighbouring
+ * pages. `keys' lists, for each pagelet, the EIDs of the assets it refers to
+ * along with its own EID. Pagelets which share any key are used together.
+ *
+ * The pagelets which share keys are placed first, in the order found by
+ * stepping from each pagelet to the one it has the most keys in common with.
+ * Each one goes in the last page or the page before it, or in a new page if it
+ * fits in neither. The other pagelets then fill the remaining space, largest
+ * first. This may take more pages than `pack_pagelets'.
+ *
+ * The pagelets in each page are in increasing order of index. The pages are in
+ * the order they should be placed in the archive.
+ *
+ * Throws `res::export_error' if any single pagelet is too large to fit in a
+ * page.
+ */
+std::vector<std::vector<size_t>> cluster_pagelets(
+    const std::vector<pagelet_info> &pagelets,
+    const std::vector<std::vector<uint32_t>> &keys,
+    int alignment);
+
 /*
  * nsf::archive
  *
@@ -131,6 +237,21 @@ class archive : public res::asset {
     friend class res::asset;
 
 private:
+    // (inner struct) compressed_cache_entry
+    // The compressed form of an exported page. `source' is the uncompressed
+    // page data which was compressed. It is held so that its storage cannot be
+    // reused by another page while this entry exists.
+    struct compressed_cache_entry {
+        util::shared_blob source;
+        int effort;
+        util::shared_blob compressed;
+    };
+
+    // (var) m_compressed_cache
+    // The last compressed page exported for each page index. A page is only
+    // compressed again if its exported data has changed since the last export.
+    mutable std::vector<compressed_cache_entry> m_compressed_cache;
+
     // (explicit ctor)
     // FIXME explain
     explicit archive(res::project &proj) :
@@ -145,17 +266,214 @@ public:
     // FIXME explain
     DEFINE_APROP(pages, std::vector<res::anyref>);
 
+    // (prop) compressed_pages
+    // The pages from `pages' which are to be written in compressed form (magic
+    // number 0x1235) when exporting. When importing, this is set to the pages
+    // which were compressed in the imported file.
+    DEFINE_APROP(compressed_pages, std::vector<res::anyref>);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Splits the given NSF file data into pages. Each page is created as a
+    // `misc::raw_data' asset which refers to the page's part of `data' rather
+    // than holding a copy of it, so importing from a memory-mapped file (see
+    // `util::mapped_file') does not read or copy the file up front.
+    //
+    // Compressed pages are decompressed into their own 64K buffer and listed
+    // in `compressed_pages'. Otherwise they are imported the same as any other
+    // page.
+    void import_file(TRANSACT, const util::shared_blob &data);
+
+    // (inner enum) processing
+    // Selects when `import_and_process' processes entries by type:
+    //
+    //   eager: Every entry is processed during the import.
+    //   lazy: Entries are left as `nsf::raw_entry' assets, to be processed
+    //     later by `process_on_demand' when they are first needed.
+    enum class processing {
+        eager,
+        lazy
+    };
+
+    // (func) import_and_process
+    // Imports the given NSF file data as with `import_file', then processes
+    // each page into an `nsf::spage' or `nsf::tpage' asset and each entry
+    // within the standard pages into an entry asset under "entries/<eid>" in
+    // the project root. If `mode' is `processing::eager', each entry is then
+    // processed by type for the given game version.
+    //
+    // The pages and entries are parsed in parallel using up to `jobs' threads
+    // (see `util::parallel_for'). The parsed results are then applied to the
+    // project in order on the calling thread, so the resulting assets and the
+    // changes recorded in the transaction are the same as if every page had
+    // been imported one at a time.
+    void import_and_process(
+        TRANSACT,
+        const util::shared_blob &data,
+        game_ver ver,
+        processing mode = processing::eager,
+        int jobs = 0);
+
+    // (inner enum) compression
+    // Selects which pages `export_file' writes in compressed form:
+    //
+    //   none: No pages are compressed.
+    //   keep: Only the pages listed in `compressed_pages' are compressed.
+    //   all:  Every page is compressed.
+    //
+    // In each case, a page is only written compressed if the compressed form
+    // is smaller than the raw 64K page.
+    enum class compression {
+        none,
+        keep,
+        all
+    };
+
+    // (s-var) min_compress_effort, max_compress_effort,
+    //   default_compress_effort
+    // The range of effort levels for `compress_spage'. Higher levels search
+    // harder for back references, which is slower but gives smaller pages.
+    static constexpr int min_compress_effort = 1;
+    static constexpr int max_compress_effort = 9;
+    static constexpr int default_compress_effort = 6;
+
+    // (inner struct) checksum_mismatch
+    // A page found by `verify_file' whose stored checksum does not match the
+    // checksum of its data.
+    struct checksum_mismatch {
+        size_t page;
+        uint32_t stored;
+        uint32_t actual;
+    };
+
+    // (s-func) verify_file
+    // Checks the checksum of every page in the given NSF file data and returns
+    // the pages whose stored checksum is wrong, in page order. Compressed pages
+    // are checked against their decompressed data. The checksums are
+    // calculated in parallel on up to `jobs' threads (see `util::parallel_for').
+    static std::vector<checksum_mismatch> verify_file(
+        const util::shared_blob &data,
+        int jobs = 0);
+
+    // (inner enum) packing
+    // Selects how `pack_pages' assigns pagelets to pages:
+    //
+    //   compact: The pagelets fit in as few pages as possible, using
+    //     `pack_pagelets'.
+    //   locality: Entries which refer to the same assets (see
+    //     `entry::get_refs') are kept in the same or neighbouring pages, using
+    //     `cluster_pagelets', so fewer pages are read to load them together.
+    enum class packing {
+        compact,
+        locality
+    };
+
+    // (func) pack_pages
+    // Reassigns the pagelets of this archive's standard pages to pages as
+    // selected by `mode'. The effort level is passed on to `pack_pagelets'.
+    // Only pages of the same type share pagelets. The existing pages of each
+    // type are reused in order. New standard pages are added after the last
+    // page of their type if more pages are needed, and pages which are no
+    // longer needed are removed from `pages' and destroyed.
+    //
+    // The pages are not exported, but the pagelets are, to find their sizes.
+    // Export errors from the pagelets are thrown from this function.
+    //
+    // The reused pages keep their chunk IDs, and new pages are numbered after
+    // the largest existing one. Call `renumber_pages' afterwards to number the
+    // pages in order instead.
+    void pack_pages(
+        TRANSACT,
+        packing mode = packing::compact,
+        int effort = 4);
+
+    // (func) fit_pages
+    // Moves pagelets out of any standard page which no longer fits in 64K,
+    // such as after an entry has grown, so that the archive can be exported.
+    // The largest pagelets are taken out of each such page until it fits. Each
+    // one is then added to the end of the first page of the same type which
+    // has room for it, or to a new page after the last page of that type. The
+    // pages which already fit are otherwise left unchanged.
+    //
+    // New pages are numbered as with `pack_pages'. Returns true if any
+    // pagelets were moved. Throws `res::export_error' if a pagelet is too
+    // large to fit in a page by itself.
+    bool fit_pages(TRANSACT);
+
+    // (func) renumber_pages
+    // Sets the chunk ID of each standard page to `2 * i + 1', where `i' is the
+    // index of the page in `pages', as in the files from the original games.
+    // Pages which already have the right chunk ID are not changed.
+    //
+    // The level's NSD file is not part of the archive, so its lookup tables
+    // must be rebuilt separately to match.
+    void renumber_pages(TRANSACT);
 
     // (func) export_file
-    // FIXME explain
-    util::blob export_file() const;
+    // Exports the archive as NSF file data. Pages are compressed as selected
+    // by `mode' (see `compression' above) using `compress_spage' at the given
+    // effort level. Pages which aren't compressed are written as raw 64K
+    // pages.
+    //
+    // The pages, and the entries within them, are exported and compressed in
+    // parallel on up to `jobs' threads (see `util::parallel_for'), and then
+    // written in order. The result is the same for any number of threads. No
+    // assets may be changed by other threads during the export.
+    //
+    // The sink version writes each page to `out' as soon as it and every page
+    // before it have been exported (see `util::parallel_for_ordered'), so the
+    // whole file is never held in memory at once. The other version returns
+    // the entire file as one blob, with the pages copied into place at offsets
+    // worked out from their sizes.
+    void export_file(
+        util::sink &out,
+        compression mode = compression::keep,
+        int effort = default_compress_effort,
+        int jobs = 0) const;
+    util::blob export_file(
+        compression mode = compression::keep,
+        int effort = default_compress_effort,
+        int jobs = 0) const;
 
-    // (func) decompress_spage
-    // FIXME explain
-    static util::blob decompress_spage(const unsigned char *data, size_t &size);
+private:
+    // (func) prepare_export
+    // Checks the page refs and sizes the compressed page cache before the
+    // pages are exported by `export_page', and returns whether each page is to
+    // be compressed for the given mode.
+    std::vector<char> prepare_export(compression mode) const;
+
+    // (func) export_page
+    // Exports the page at the given index as it is to be written by
+    // `export_file', either as the compressed page or the raw 64K page. This
+    // may be called for different pages on different threads at once.
+    util::shared_blob export_page(
+        size_t index,
+        bool compress,
+        int effort) const;
+
+public:
+    // (s-func) decompress_spage
+    // Decompresses the compressed page (magic number 0x1235) at `data' into
+    // the 64K buffer at `out', or into a new 64K blob. No more than
+    // `data_size' bytes are read from `data'. The number of bytes of `data'
+    // taken up by the compressed page is written to `size'.
+    static void decompress_spage(
+        const unsigned char *data,
+        size_t data_size,
+        unsigned char *out,
+        size_t &size);
+    static util::blob decompress_spage(
+        const unsigned char *data,
+        size_t data_size,
+        size_t &size);
+
+    // (s-func) compress_spage
+    // Compresses the given 64K page into the format read by `decompress_spage'.
+    // The effort level must be between `min_compress_effort' and
+    // `max_compress_effort'. The result may be larger than the original page if
+    // the page does not compress well.
+    static util::blob compress_spage(
+        const unsigned char *data,
+        int effort = default_compress_effort);
 };
 
 /*
@@ -167,11 +485,19 @@ class spage : public res::asset {
     friend class res::asset;
 
 private:
+    // (var) m_export_cache
+    // The data last returned by `export_file'. See `res::export_cache'.
+    mutable res::export_cache m_export_cache;
+
     // (explicit ctor)
     // FIXME explain
     explicit spage(res::project &proj) :
         asset(proj) {}
 
+    // (func) export_uncached
+    // Exports the page without using the export cache.
+    util::blob export_uncached() const;
+
 public:
     // (typedef) ref
     // FIXME explain
@@ -190,16 +516,47 @@ public:
     DEFINE_APROP(cid, uint32_t);
 
     // (prop) checksum
-    // FIXME explain
+    // The checksum from the imported page header. Exported pages always have
+    // their checksum calculated from the exported data (see `page_checksum'),
+    // so this is not used when exporting.
     DEFINE_APROP(checksum, uint32_t);
 
+    // (inner struct) staging
+    // The result of parsing page data with `parse_file'. This holds everything
+    // needed to import the page, but is not tied to any project or asset.
+    struct staging {
+        uint16_t type;
+        uint32_t cid;
+        uint32_t checksum;
+        std::vector<util::shared_blob> pagelets;
+    };
+
+    // (s-func) parse_file
+    // Parses the given page data into a `staging' object without creating or
+    // modifying any assets. This may be called from any thread.
+    static staging parse_file(const util::shared_blob &data);
+
+    // (func) import_staged
+    // Creates the pagelet assets and sets the page's properties using page data
+    // previously parsed by `parse_file'.
+    void import_staged(TRANSACT, staging st);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Splits the given page data into pagelets. As with `archive::import_file',
+    // each pagelet refers to its part of `data' instead of copying it. This is
+    // the same as `parse_file' followed by `import_staged'.
+    void import_file(TRANSACT, const util::shared_blob &data);
 
     // (func) export_file
-    // FIXME explain
-    util::blob export_file() const;
+    // Exports the page as 64K of page data, either written to the given sink
+    // or returned as a blob. Pagelets which are still unprocessed are written
+    // from their existing data without being copied first.
+    //
+    // As with `entry::export_file', the result is cached until the page or any
+    // asset it was exported from is changed. Only the entries which changed
+    // are exported again when the page is exported after a change.
+    void export_file(util::sink &out) const;
+    util::shared_blob export_file() const;
 };
 
 /*
@@ -211,11 +568,19 @@ class tpage : public res::asset {
     friend class res::asset;
 
 private:
+    // (var) m_export_cache
+    // The data last returned by `export_file'. See `res::export_cache'.
+    mutable res::export_cache m_export_cache;
+
     // (explicit ctor)
     // FIXME explain
     explicit tpage(res::project &proj) :
         asset(proj) {}
 
+    // (func) export_uncached
+    // Exports the page without using the export cache.
+    util::blob export_uncached() const;
+
 public: 
     // (typedef) ref
     // FIXME explain
@@ -234,12 +599,67 @@ public:
     DEFINE_APROP(entry_type, uint32_t);
 
     // (prop) texture
-    // FIXME explain
+    // The texture holding the page's texels. This is the entire 64K page,
+    // including the page header, as the whole page is loaded into video
+    // memory. Several texture pages may share the same texture (see
+    // `import_staged'), so the header in the texels may be from another page.
+    // The page header is written from the page's own properties on export.
     DEFINE_APROP(texture, gfx::texture::ref);
 
+    // (inner struct) staging
+    // The result of parsing texture page data with `parse_file'. See
+    // `spage::staging' for details. `texel_hash' is the result of `hash_texels'
+    // for `texels'.
+    struct staging {
+        uint16_t type;
+        uint32_t eid;
+        uint32_t entry_type;
+        util::blob texels;
+        size_t texel_hash;
+    };
+
+    // (s-func) hash_texels, same_texels
+    // Hashes or compares the texels of texture pages, excluding the page
+    // header. Texture pages with the same texels apart from their headers can
+    // share a texture.
+    static size_t hash_texels(const util::blob &texels);
+    static bool same_texels(const util::blob &a, const util::blob &b);
+
+    // (typedef) texture_map
+    // The textures created by `import_staged', by the hash of their texels.
+    using texture_map = std::unordered_map<
+        size_t,
+        std::vector<gfx::texture::ref>>;
+
+    // (s-func) parse_file
+    // Parses the given texture page data into a `staging' object without
+    // creating or modifying any assets. This may be called from any thread.
+    static staging parse_file(const util::shared_blob &data);
+
+    // (func) import_staged
+    // Creates the texture asset and sets the page's properties using texture
+    // page data previously parsed by `parse_file'.
+    //
+    // If `textures' is given, the page shares any texture in it which has the
+    // same texels (see `same_texels') instead of creating a new one, saving
+    // 64K per duplicate page. Otherwise, the new texture is added to it. The
+    // texture is named after the EID of the first page which created it.
+    void import_staged(
+        TRANSACT,
+        staging st,
+        texture_map *textures = nullptr);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Same as `parse_file' followed by `import_staged'.
+    void import_file(TRANSACT, const util::shared_blob &data);
+
+    // (func) export_file
+    // Exports the page as 64K of page data, either written to the given sink
+    // or returned as a blob. The header is written from the page's properties
+    // and the checksum is calculated from the exported data (see
+    // `page_checksum'). As with `spage::export_file', the result is cached.
+    void export_file(util::sink &out) const;
+    util::shared_blob export_file() const;
 };
 
 /*
@@ -248,12 +668,48 @@ public:
  * FIXME explain
  */
 class entry : public res::asset {
+private:
+    // (var) m_export_cache
+    // The data last returned by `export_file'. See `res::export_cache'.
+    mutable res::export_cache m_export_cache;
+
 protected:
     // (explicit ctor)
     // FIXME explain
     explicit entry(res::project &proj) :
         ver(game_ver::none), asset(proj) {}
 
+    // (s-func) get_entry_info
+    // Returns the `pagelet_info' of an entry with the given items.
+    static pagelet_info get_entry_info(const std::vector<util::blob> &items);
+
+    // (s-func) get_entry_info
+    // Returns the `pagelet_info' of an entry with `item_count' items of the
+    // given sizes.
+    static pagelet_info get_entry_info(
+        const size_t *item_sizes,
+        size_t item_count);
+
+    // (s-func) write_entry
+    // Writes an entry with the given EID, type and items to `out', including
+    // the entry header. This does not allocate.
+    static void write_entry(
+        util::sink &out,
+        uint32_t eid,
+        uint32_t type,
+        const std::vector<util::blob> &items);
+
+    // (s-func) write_entry_header
+    // Writes the header of an entry with the given EID, type and `item_count'
+    // items of the given sizes to `out'. The items themselves must be written
+    // next, in order. This does not allocate.
+    static void write_entry_header(
+        util::sink &out,
+        uint32_t eid,
+        uint32_t type,
+        const size_t *item_sizes,
+        size_t item_count);
+
 public:
     // (typedef) ref
     // FIXME explain
@@ -268,13 +724,38 @@ public:
     DEFINE_APROP(eid, eid);
 
     // (func) export_file
-    // FIXME explain
-    util::blob export_file() const;
+    // Exports the entry as entry data, including the entry header. The result
+    // is cached, and later calls return the cached data without exporting the
+    // entry again until this entry or any asset it was exported from (such as
+    // a model's mesh or frame) is changed.
+    util::shared_blob export_file() const;
 
     // (pure func) export_entry
     // FIXME explain
     virtual std::vector<util::blob> export_entry(
         uint32_t &out_type) const = 0;
+
+    // (func) get_export_info
+    // If the entry can be written by `export_entry_into' without exporting it
+    // first, sets `out' to the `pagelet_info' of the exported entry and returns
+    // true. Otherwise, returns false. The base version returns false.
+    virtual bool get_export_info(pagelet_info &out) const;
+
+    // (func) export_entry_into
+    // Writes the same data as `export_file' to the given sink. Entry types for
+    // which `get_export_info' returns true write the entry directly, without
+    // any heap allocation and without using the export cache, so an entry can
+    // be written straight into its place in a page buffer. If an export error
+    // is thrown, part of the entry may already have been written. The base
+    // version writes the result of `export_file'.
+    virtual void export_entry_into(util::sink &out) const;
+
+    // (func) get_refs
+    // Returns the EIDs of the entries and texture pages this entry refers to,
+    // such as the texture pages used by a scenery entry. The EIDs are not
+    // checked, and may not belong to any existing asset. The base version
+    // returns no EIDs.
+    virtual std::vector<eid> get_refs() const;
 };
 
 /*
@@ -304,15 +785,46 @@ public:
     // FIXME explain
     DEFINE_APROP(type, uint32_t);
 
+    // (inner struct) staging
+    // The result of parsing entry data with `parse_file'. See `spage::staging'
+    // for details.
+    struct staging {
+        uint32_t eid;
+        uint32_t type;
+        std::vector<util::blob> items;
+    };
+
+    // (s-func) parse_file
+    // Parses the given entry data into a `staging' object, copying out the
+    // data for each item, without creating or modifying any assets. This may
+    // be called from any thread.
+    static staging parse_file(const util::shared_blob &data);
+
+    // (func) import_staged
+    // Sets the entry's properties using entry data previously parsed by
+    // `parse_file'.
+    void import_staged(TRANSACT, staging st);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Same as `parse_file' followed by `import_staged'.
+    void import_file(TRANSACT, const util::shared_blob &data);
 
     // (func) export_entry
     // FIXME explain
     std::vector<util::blob> export_entry(
         uint32_t &out_type) const final override;
 
+    // (func) get_export_info, export_entry_into
+    // See `entry'. Raw entries are always written directly from their items.
+    bool get_export_info(pagelet_info &out) const final override;
+    void export_entry_into(util::sink &out) const final override;
+
+    // (func) get_refs
+    // Returns the EIDs referenced by the entry's items, as they would be
+    // returned by the entry's processed form. This lets the references of a
+    // pending entry be found without processing it.
+    std::vector<eid> get_refs() const final override;
+
     // (func) process_as<T>
     // FIXME explain
     template <typename T>
@@ -337,11 +849,62 @@ public:
         destroy(TS);
     }
 
+    // (typedef) processor
+    // A pointer to one of the `process_as' functions.
+    using processor = void (raw_entry::*)(TRANSACT, game_ver);
+
+    // (s-func) find_processor
+    // Returns the `process_as' function used by `process_by_type' for entries
+    // of the given type in the given game version, or nullptr if entries of
+    // that type are not processed.
+    static processor find_processor(game_ver ver, uint32_t type);
+
     // (func) process_by_type
     // FIXME explain
     bool process_by_type(TRANSACT, game_ver ver);
+
+    // (func) is_pending
+    // Returns true if this entry was imported for a known game version (see
+    // `entry::ver') but has not been processed yet, as happens when importing
+    // with `archive::processing::lazy'.
+    bool is_pending() const;
 };
 
+/*
+ * nsf::process_on_demand
+ *
+ * If the named asset is a pending raw entry (see `raw_entry::is_pending'),
+ * processes it now and returns true. The processed entry replaces the raw entry
+ * under the same name, so existing refs to the entry now refer to the processed
+ * entry. Otherwise, does nothing and returns false.
+ *
+ * Code which needs the processed form of an entry, such as an editor or viewer
+ * for the entry, should call this before looking up the entry by type.
+ */
+bool process_on_demand(TRANSACT, res::atom name);
+
+/*
+ * nsf::find_pending
+ *
+ * Returns the names of every pending raw entry in the given project. This is
+ * for code which needs every entry in its processed form at once, which should
+ * call `process_on_demand' on each of the returned names.
+ */
+std::vector<res::atom> find_pending(res::project &proj);
+
+/*
+ * nsf::process_pending
+ *
+ * Calls `process_on_demand' on each of the given names in the given project.
+ * The changes are merged into the project's latest transaction instead of being
+ * added as a new undo step (see `transact::nexus::amend'), so that viewing an
+ * entry does not change the undo or redo history.
+ *
+ * Returns false if the project's transaction system was busy undoing or redoing
+ * a transaction, in which case nothing is processed.
+ */
+bool process_pending(res::project &proj, const std::vector<res::atom> &names);
+
 /*
  * nsf::wgeo_v1
  *
@@ -384,6 +947,16 @@ public:
     // FIXME explain
     std::vector<util::blob> export_entry(
         uint32_t &out_type) const final override;
+
+    // (func) get_export_info, export_entry_into
+    // See `entry'. The entry is written directly if its world, model, mesh,
+    // animation and frame refs are all valid.
+    bool get_export_info(pagelet_info &out) const final override;
+    void export_entry_into(util::sink &out) const final override;
+
+    // (func) get_refs
+    // Returns the texture pages listed in `tpag_ref*'.
+    std::vector<eid> get_refs() const final override;
 };
 
 /*
@@ -440,8 +1013,370 @@ public:
     // FIXME explain
     std::vector<util::blob> export_entry(
         uint32_t &out_type) const final override;
+
+    // (func) get_export_info, export_entry_into
+    // See `entry'. The entry is written directly if its world, model, mesh,
+    // animation and frame refs are all valid.
+    bool get_export_info(pagelet_info &out) const final override;
+    void export_entry_into(util::sink &out) const final override;
+
+    // (func) get_refs
+    // Returns the texture pages listed in `tpag_ref*'.
+    std::vector<eid> get_refs() const final override;
+};
+
+/*
+ * nsf::unpack_wgeo_v1_vertices
+ * nsf::unpack_wgeo_v1_triangles
+ *
+ * Decodes `count' vertices or triangles from the vertex or triangle item of a
+ * wgeo_v1 entry, which holds an 8-byte record for each. The item must be at
+ * least `count * 8' bytes in size.
+ */
+std::vector<gfx::vertex> unpack_wgeo_v1_vertices(
+    const util::blob &item,
+    size_t count);
+std::vector<gfx::triangle> unpack_wgeo_v1_triangles(
+    const util::blob &item,
+    size_t count);
+
+/*
+ * nsf::unpack_wgeo_v2_vertices
+ * nsf::unpack_wgeo_v2_triangles
+ * nsf::unpack_wgeo_v2_quads
+ * nsf::pack_wgeo_v2_vertices
+ * nsf::pack_wgeo_v2_triangles
+ * nsf::pack_wgeo_v2_quads
+ * nsf::wgeo_v2_split_item_size
+ *
+ * Decodes `count' vertices, triangles or quads from the given item of a wgeo_v2
+ * entry, or encodes them into a new item or onto the end of a sink. The vertex
+ * and triangle items hold a 4-byte record for each element, in reverse order,
+ * followed by a 2-byte record for each in order, padded to a multiple of 4
+ * bytes; `wgeo_v2_split_item_size' returns the size of such an item. The quad
+ * item holds an 8-byte record for each quad. When unpacking, the item must be
+ * at least that large.
+ *
+ * Vertex coordinates are 12-bit signed values, except in Crash 3, where they
+ * are unsigned; `coords_unsigned' selects the latter. When packing, an export
+ * error is thrown if any value does not fit in its field, before anything is
+ * written. Packing into a sink does not allocate.
+ *
+ * Whole groups of records are converted at once using SSE2 where available,
+ * with the same results as converting them one at a time.
+ */
+std::vector<gfx::vertex> unpack_wgeo_v2_vertices(
+    const util::blob &item,
+    size_t count,
+    bool coords_unsigned);
+std::vector<gfx::triangle> unpack_wgeo_v2_triangles(
+    const util::blob &item,
+    size_t count);
+std::vector<gfx::quad> unpack_wgeo_v2_quads(
+    const util::blob &item,
+    size_t count);
+util::blob pack_wgeo_v2_vertices(
+    const std::vector<gfx::vertex> &vertices,
+    bool coords_unsigned);
+util::blob pack_wgeo_v2_triangles(
+    const std::vector<gfx::triangle> &triangles);
+util::blob pack_wgeo_v2_quads(
+    const std::vector<gfx::quad> &quads);
+void pack_wgeo_v2_vertices(
+    util::sink &out,
+    const std::vector<gfx::vertex> &vertices,
+    bool coords_unsigned);
+void pack_wgeo_v2_triangles(
+    util::sink &out,
+    const std::vector<gfx::triangle> &triangles);
+void pack_wgeo_v2_quads(
+    util::sink &out,
+    const std::vector<gfx::quad> &quads);
+size_t wgeo_v2_split_item_size(size_t count);
+
+/*
+ * nsf::entry_graph
+ *
+ * The references between the entries and texture pages of an archive, as given
+ * by `entry::get_refs'. Each entry in one of the archive's standard pages and
+ * each of its texture pages is a node in the graph.
+ */
+struct entry_graph {
+    // (inner struct) node
+    // An entry or texture page. `page' is its index into the archive's pages,
+    // and `refs' are the indices of the nodes it refers to. References to EIDs
+    // which are not in the archive are left out.
+    struct node {
+        res::atom name;
+        eid id;
+        size_t page;
+        std::vector<size_t> refs;
+    };
+
+    // (var) nodes
+    // The nodes, in the order they appear in the archive.
+    std::vector<node> nodes;
+
+    // (s-func) build
+    // Builds the graph for the given archive. Entries which are pending (see
+    // `raw_entry::is_pending') are included without processing them.
+    static entry_graph build(const archive &arc);
+};
+
+/*
+ * nsf::chunk_fetches
+ *
+ * The pages which must be read to load a scenery chunk. `pages' is the number
+ * of distinct pages and `runs' is the number of runs of consecutive pages among
+ * them, which is the number of seeks needed to read them in order.
+ */
+struct chunk_fetches {
+    eid chunk;
+    size_t pages;
+    size_t runs;
+};
+
+/*
+ * nsf::measure_fetches
+ *
+ * Returns the expected page fetches for each scenery chunk in the given graph,
+ * in graph order. A scenery chunk is any node which refers to another node.
+ *
+ * Loading a chunk is assumed to load every chunk which refers to exactly the
+ * same nodes as well, since neighbouring scenery is usually drawn with the same
+ * texture pages. The pages counted are those holding these chunks and the nodes
+ * they refer to.
+ */
+std::vector<chunk_fetches> measure_fetches(const entry_graph &graph);
+
+/*
+ * nsf::archive_digest
+ *
+ * Hashes of the pages, entries and entry items of an archive, for comparing
+ * archives without comparing all of their data (see `diff_archives'). The
+ * hashes are not cryptographic, and are only meaningful within one run of the
+ * program.
+ */
+struct archive_digest {
+    // (inner struct) page
+    // A page of the archive. `id' is the CID of a standard page, or the EID of
+    // a texture page. `hash' covers the page header and the hashes of every
+    // pagelet, so it changes whenever anything within the page changes.
+    struct page {
+        uint16_t type;
+        uint32_t id;
+        size_t hash;
+    };
+
+    // (inner struct) entry
+    // An entry or texture page. `page' is its index into the archive's pages
+    // and `slot' is its index into that page's pagelets. `hash' covers the type
+    // and items of the entry. A texture page has a single item, its texels.
+    struct entry {
+        eid id;
+        uint32_t type;
+        size_t page;
+        size_t slot;
+        size_t hash;
+        std::vector<size_t> item_hashes;
+    };
+
+    // (var) pages, entries
+    // The pages and the entries within them, in archive order.
+    std::vector<page> pages;
+    std::vector<entry> entries;
+
+    // (s-func) build
+    // Hashes the given archive. Entries which are pending (see
+    // `raw_entry::is_pending') are hashed without processing them; other
+    // entries are hashed by the items from `entry::export_entry'.
+    static archive_digest build(const archive &arc);
+};
+
+/*
+ * nsf::entry_change
+ *
+ * A difference between two archives in one entry or texture page, as found by
+ * `diff_archives':
+ *
+ *   added: Only the new archive has the entry.
+ *   removed: Only the old archive has the entry.
+ *   moved: The entry is the same, but in a different page.
+ *   modified: The type or items of the entry differ. The entry may also have
+ *     moved. `items' lists the indices of the items which differ, including
+ *     any items which only one of the entries has.
+ *
+ * `old_page' and `new_page' are the entry's page indices in each archive, or
+ * `no_page' where the entry is not in that archive.
+ */
+struct entry_change {
+    enum class kind {
+        added,
+        removed,
+        moved,
+        modified
+    };
+
+    static constexpr size_t no_page = SIZE_MAX;
+
+    kind what;
+    eid id;
+    size_t old_page;
+    size_t new_page;
+    std::vector<size_t> items;
+};
+
+/*
+ * nsf::diff_archives
+ *
+ * Compares the entries of two archives by EID. The changes for entries in the
+ * old archive are given first, in old archive order, followed by the entries
+ * added in the new archive, in new archive order. Unchanged entries are left
+ * out, as are entries which only moved within their page.
+ *
+ * If an archive has several entries with the same EID, they are paired with
+ * the entries of that EID in the other archive in the order they appear.
+ */
+std::vector<entry_change> diff_archives(
+    const archive_digest &old_arc,
+    const archive_digest &new_arc);
+
+/*
+ * nsf::eid_index
+ *
+ * Keeps an index of the entries and texture pages in a project by EID, and of
+ * where each of them is placed in the project's archives. The index is updated
+ * as assets appear and disappear and as their `eid', `pages' and `pagelets'
+ * properties change, so each lookup takes constant time instead of a search
+ * through every page.
+ *
+ * If several assets have the same EID, lookups find the one which appeared
+ * most recently.
+ *
+ * As with `res::tree_tracker', the index must not outlive the project it is
+ * set to. Set the project to null first if necessary.
+ */
+class eid_index : private util::nocopy {
+public:
+    // (inner struct) location
+    // The position of an entry or texture page in an archive. `page' is the
+    // index into the archive's `pages' and `slot' is the index into that
+    // page's `pagelets'. For a texture page, `slot' is always zero.
+    struct location {
+        archive *arc;
+        size_t page;
+        size_t slot;
+    };
+
+private:
+    // (inner struct) tracked_asset
+    // The indexed state of an entry, texture page, standard page or archive,
+    // kept so that it can be removed from the index again when it changes or
+    // disappears.
+    //
+    // `name' is the asset's name when it was indexed, `eid' is its EID (for
+    // entries and texture pages), and `names' lists the pages (for archives)
+    // or pagelets (for standard pages) it has added to the index.
+    struct tracked_asset {
+        res::atom name;
+        uint32_t eid;
+        std::vector<res::atom> names;
+        util::event<>::watch h_change;
+    };
+
+    // (var) m_proj
+    // The project being indexed, or null if none.
+    res::project *m_proj = nullptr;
+
+    // (var) m_tracked
+    // The state of each indexed asset.
+    std::unordered_map<
+        res::asset *,
+        std::unique_ptr<tracked_asset>> m_tracked;
+
+    // (var) m_by_eid
+    // The entries and texture pages with each EID, in the order they appeared.
+    std::unordered_map<uint32_t, std::vector<res::asset *>> m_by_eid;
+
+    // (var) m_pages
+    // The archive and page index of each page name listed in an archive.
+    std::unordered_map<
+        res::atom,
+        std::pair<archive *, size_t>,
+        res::atom::hash> m_pages;
+
+    // (var) m_pagelets
+    // The page name and slot of each pagelet name listed in a standard page.
+    std::unordered_map<
+        res::atom,
+        std::pair<res::atom, size_t>,
+        res::atom::hash> m_pagelets;
+
+    // (handler) h_asset_appear, h_asset_disappear
+    // Hooks the project's asset appear and disappear events to add and remove
+    // assets from the index.
+    decltype(res::project::on_asset_appear)::watch h_asset_appear;
+    decltype(res::project::on_asset_disappear)::watch h_asset_disappear;
+
+    // (func) add, remove
+    // Adds or removes the given asset from the index, if it is of a type which
+    // is indexed.
+    void add(res::asset &asset);
+    void remove(res::asset &asset);
+
+    // (func) index, unindex
+    // Adds or removes the current EID, pages or pagelets of a tracked asset.
+    void index(res::asset &asset, tracked_asset &t);
+    void unindex(res::asset &asset, tracked_asset &t);
+
+public:
+    // (default ctor)
+    // Constructs an index with no project set.
+    eid_index();
+
+    // (func) get_proj, set_proj
+    // Gets or sets the project being indexed. Setting the project indexes all
+    // of its existing assets.
+    res::project *get_proj() const;
+    void set_proj(res::project *proj);
+
+    // (func) find
+    // Returns the entry or texture page with the given EID, or nullptr if
+    // there is none.
+    //
+    // The second form only finds assets listed in the pages of the given
+    // archive. This tells apart assets with the same EID from different
+    // archives, for example when two levels are imported into one project.
+    res::asset *find(eid value) const;
+    res::asset *find(eid value, const archive *arc) const;
+
+    // (func) find_location
+    // Finds the archive, page and slot of the entry or texture page with the
+    // given EID, or with the given name. Returns false if there is no such
+    // asset or if it is not listed in an archive's pages.
+    bool find_location(eid value, location &out) const;
+    bool find_location(res::atom name, location &out) const;
 };
 
+#if FEATURE_INTERNAL_TEST
+/*
+ * nsf::test_entry
+ * nsf::make_test_archive
+ *
+ * For internal tests. Creates an archive named "archive" in the given project
+ * with one standard page for each list of entries in `page_entries'. Each entry
+ * is a raw entry of type 1 with the given EID and single item. The pages are
+ * numbered with chunk IDs 1, 3, 5 and so on.
+ */
+struct test_entry {
+    uint32_t eid;
+    util::blob item;
+};
+archive::ref make_test_archive(
+    res::project &proj,
+    const std::vector<std::vector<test_entry>> &page_entries);
+#endif
+
 }
 
 namespace reflect {
@@ -452,7 +1387,7 @@ struct asset_type_info<nsf::archive> {
     using base_type = res::asset;
 
     static constexpr const char *name = "nsf::archive";
-    static constexpr int prop_count = 1;
+    static constexpr int prop_count = 2;
 };
 template <>
 struct asset_prop_info<nsf::archive, 0> {
@@ -461,6 +1396,13 @@ struct asset_prop_info<nsf::archive, 0> {
     static constexpr const char *name = "pages";
     static constexpr auto ptr = &nsf::archive::p_pages;
 };
+template <>
+struct asset_prop_info<nsf::archive, 1> {
+    using type = std::vector<res::anyref>;
+
+    static constexpr const char *name = "compressed_pages";
+    static constexpr auto ptr = &nsf::archive::p_compressed_pages;
+};
 
 // reflection info for nsf::spage
 template <>
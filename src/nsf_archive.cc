@@ -19,144 +19,526 @@
 //
 
 #include "common.hh"
+#include <exception>
+#include <algorithm>
 #include "nsf.hh"
 #include "misc.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
 namespace drnsf {
 namespace nsf {
 
 // declared in nsf.hh
-void archive::import_file(TRANSACT, const util::blob &data)
+void archive::import_file(TRANSACT, const util::shared_blob &data)
 {
     assert_alive();
 
     std::vector<misc::raw_data::ref> pages;
+    std::vector<misc::raw_data::ref> compressed_pages;
 
     util::binreader r;
     uint32_t offset = 0;
     while (offset < data.size()) {
 
+        // Ensure there is enough data left for a page header.
+        if (data.size() - offset < 12)
+            throw res::import_error("nsf::archive: page cut off");
+
         // Read the magic number for this page.
-        r.begin(&data[offset], page_size);
+        r.begin(&data[offset], 2);
         auto magic = r.read_u16();
-        r.end_early();
-        
-        // Skip the page if it is compressed.
+        r.end();
+
+        if (magic != 0x1234 && magic != 0x1235)
+            throw res::import_error("nsf::archive: bad page magic number");
+
+        auto &&page = pages.emplace_back();
+
+        // Create the page asset.
+        auto index = pages.size();
+        page = get_name() / "page-$"_fmt(index);
+        page.create(TS, get_proj());
+
         if (magic == 0x1234) {
-            auto &&page = pages.emplace_back();
-           
-            // Create the page asset.
-            auto index = pages.size();
-            page = get_name() / "page-$"_fmt(index);
-            page.create(TS, get_proj());
-
-            // Copy the page data into the asset.
-            page->set_data(TS, {
-                data.data() + offset,
-                data.data() + offset + page_size
-            });
+            // Ensure the page isn't cut off by the end of the file.
+            if (data.size() - offset < page_size)
+                throw res::import_error("nsf::archive: page cut off");
+
+            // Give the asset a view of the page data. This shares the input
+            // data instead of copying it.
+            page->set_data(TS, data.slice(offset, page_size));
 
             offset += page_size;
-        }
-        else if (magic == 0x1235) {
+        } else {
+            // Decompress the page into a new buffer for the asset.
             size_t size;
-            decompress_spage(&data[offset], size);
-            offset += size; 
+            page->set_data(TS, decompress_spage(
+                &data[offset],
+                data.size() - offset,
+                size
+            ));
+            compressed_pages.push_back(page);
+
+            offset += size;
         }
     }
 
     // Finish importing.
     set_pages(TS, {pages.begin(), pages.end()});
+    set_compressed_pages(TS, {
+        compressed_pages.begin(),
+        compressed_pages.end()
+    });
 }
 
 // declared in nsf.hh
-util::blob archive::export_file() const
+std::vector<archive::checksum_mismatch> archive::verify_file(
+    const util::shared_blob &data,
+    int jobs)
 {
-    util::blob data;
+    // Find the pages in the file. The offset of each page is only known after
+    // the page before it, so this is done serially. Compressed pages have to
+    // be decompressed here to find their size.
+    std::vector<util::shared_blob> pages;
 
-    for (auto &&i : util::range_of(get_pages())) {
-        auto ref = get_pages()[i];
+    util::binreader r;
+    size_t offset = 0;
+    while (offset < data.size()) {
+        if (data.size() - offset < 12)
+            throw res::import_error("nsf::archive: page cut off");
 
-        if (!ref)
-            throw res::export_error("nsf::archive: null page ref");
+        r.begin(&data[offset], 2);
+        auto magic = r.read_u16();
+        r.end();
 
-        misc::raw_data::ref raw_ref = ref;
-        if (raw_ref.ok()) {
-            auto raw_data = raw_ref->get_data();
-            data.insert(data.end(), raw_data.begin(), raw_data.end());
-            continue;
+        if (magic == 0x1234) {
+            if (data.size() - offset < page_size)
+                throw res::import_error("nsf::archive: page cut off");
+
+            pages.push_back(data.slice(offset, page_size));
+            offset += page_size;
+        } else if (magic == 0x1235) {
+            size_t size;
+            pages.push_back(decompress_spage(
+                &data[offset],
+                data.size() - offset,
+                size
+            ));
+            offset += size;
+        } else {
+            throw res::import_error("nsf::archive: bad page magic number");
+        }
+    }
+
+    // Calculate the checksums.
+    std::vector<uint32_t> stored(pages.size());
+    std::vector<uint32_t> actual(pages.size());
+    util::parallel_for(pages.size(), [&](size_t i) {
+        auto &&page = pages[i];
+        stored[i] =
+            uint32_t(page[12]) |
+            uint32_t(page[13]) << 8 |
+            uint32_t(page[14]) << 16 |
+            uint32_t(page[15]) << 24;
+        actual[i] = page_checksum(page.data(), page.size());
+    }, jobs);
+
+    std::vector<checksum_mismatch> result;
+    for (auto &&i : util::range_of(pages)) {
+        if (stored[i] != actual[i]) {
+            result.push_back({i, stored[i], actual[i]});
         }
+    }
+    return result;
+}
 
-        spage::ref spage_ref = ref;
-        if (spage_ref.ok()) {
-            auto spage_data = spage_ref->export_file();
-            data.insert(data.end(), spage_data.begin(), spage_data.end());
+// declared in nsf.hh
+void archive::import_and_process(
+    TRANSACT,
+    const util::shared_blob &data,
+    game_ver ver,
+    processing mode,
+    int jobs)
+{
+    assert_alive();
+
+    // Split the file into pages.
+    import_file(TS, data);
+
+    // Gather the data for each page before parsing. The worker threads below
+    // must not access any assets, as the project is not thread-safe.
+    auto pages = get_pages();
+    std::vector<util::shared_blob> page_data(pages.size());
+    for (auto &&i : util::range_of(pages)) {
+        misc::raw_data::ref page = pages[i];
+        page_data[i] = page->get_data();
+    }
+
+    // (inner struct) staged_entry, staged_page
+    // The parsed form of each entry and page. Any exception thrown during
+    // parsing is kept here and rethrown at the same point in the commit loop
+    // below where the equivalent serial import would have thrown it.
+    struct staged_entry {
+        raw_entry::staging st;
+        std::exception_ptr error;
+    };
+    struct staged_page {
+        bool is_tpage;
+        tpage::staging tpage_st;
+        spage::staging spage_st;
+        std::vector<staged_entry> entries;
+        std::exception_ptr error;
+    };
+
+    // Parse every page and entry in parallel.
+    std::vector<staged_page> staged(pages.size());
+    util::parallel_for(staged.size(), [&](size_t i) {
+        auto &&sp = staged[i];
+
+        // Pages with type 1 should be processed as texture pages.
+        sp.is_tpage = (page_data[i][2] == 1);
+        try {
+            if (sp.is_tpage) {
+                sp.tpage_st = tpage::parse_file(page_data[i]);
+                return;
+            }
+            sp.spage_st = spage::parse_file(page_data[i]);
+        } catch (...) {
+            sp.error = std::current_exception();
+            return;
+        }
+
+        sp.entries.resize(sp.spage_st.pagelets.size());
+        for (auto &&j : util::range_of(sp.entries)) {
+            try {
+                sp.entries[j].st = raw_entry::parse_file(
+                    sp.spage_st.pagelets[j]
+                );
+            } catch (...) {
+                sp.entries[j].error = std::current_exception();
+            }
+        }
+    }, jobs);
+
+    // Apply the parsed pages and entries to the project, in order. Texture
+    // pages with the same texels share one texture.
+    tpage::texture_map textures;
+    for (auto &&i : util::range_of(pages)) {
+        auto &&sp = staged[i];
+        misc::raw_data::ref page = pages[i];
+
+        if (sp.is_tpage) {
+            tpage::ref tpage = page;
+            page->rename(TS, page / "_PROCESSING");
+            page /= "_PROCESSING";
+            tpage.create(TS, get_proj());
+            if (sp.error)
+                std::rethrow_exception(sp.error);
+            tpage->import_staged(TS, std::move(sp.tpage_st), &textures);
+            page->destroy(TS);
             continue;
         }
 
+        spage::ref spage = page;
+        page->rename(TS, page / "_PROCESSING");
+        page /= "_PROCESSING";
+        spage.create(TS, get_proj());
+        if (sp.error)
+            std::rethrow_exception(sp.error);
+        spage->import_staged(TS, std::move(sp.spage_st));
+        page->destroy(TS);
+
+        // Process all of the entries inside the page.
+        auto pagelets = spage->get_pagelets();
+        for (auto &&j : util::range_of(pagelets)) {
+            auto &&p = pagelets[j];
+            auto &&se = sp.entries[j];
+            misc::raw_data::ref pagelet = p;
+
+            raw_entry::ref entry = pagelet;
+            pagelet->rename(TS, pagelet / "_PROCESSING");
+            pagelet /= "_PROCESSING";
+            entry.create(TS, get_proj());
+            if (se.error)
+                std::rethrow_exception(se.error);
+            entry->import_staged(TS, std::move(se.st));
+            pagelet->destroy(TS);
+
+            // Rename the entry asset to "entries/<eid>". This brings all of
+            // the entries together as siblings for easy access.
+            auto new_path =
+                get_proj().get_asset_root() /
+                "entries" /
+                entry->get_eid().str();
+            if (!new_path.get())
+                entry->rename(TS, new_path);
+            entry = new_path;
+            p = new_path;
+
+            // The entry is processed below, or left to be processed on
+            // demand.
+            entry->ver = ver;
+        }
+        spage->set_pagelets(TS, pagelets);
+
+        // Process the entries once the page lists them, so that processing
+        // can find which archive each entry is in (see `nsf::eid_index').
+        if (mode == processing::eager) {
+            for (auto &&p : pagelets) {
+                process_on_demand(TS, p);
+            }
+        }
+    }
+}
+
+// declared in nsf.hh
+std::vector<char> archive::prepare_export(compression mode) const
+{
+    auto &&pages = get_pages();
+    auto &&compressed_pages = get_compressed_pages();
+
+    m_compressed_cache.resize(pages.size());
+
+    // Decide which pages are to be compressed before starting any threads.
+    std::vector<char> compress(pages.size());
+    for (auto &&i : util::range_of(pages)) {
+        auto &&ref = pages[i];
+
+        if (!ref)
+            throw res::export_error("nsf::archive: null page ref");
+
+        switch (mode) {
+        case compression::none:
+            compress[i] = false;
+            break;
+        case compression::keep:
+            compress[i] = std::find(
+                compressed_pages.begin(),
+                compressed_pages.end(),
+                ref
+            ) != compressed_pages.end();
+            break;
+        case compression::all:
+            compress[i] = true;
+            break;
+        }
+    }
+    return compress;
+}
+
+// declared in nsf.hh
+util::shared_blob archive::export_page(
+    size_t index,
+    bool compress,
+    int effort) const
+{
+    auto &&ref = get_pages()[index];
+
+    // Get the page data. Unprocessed pages are written directly from their
+    // existing data without copying, and standard and texture pages are only
+    // exported again if they have changed since they were last exported.
+    util::shared_blob page_data;
+
+    misc::raw_data::ref raw_ref = ref;
+    spage::ref spage_ref = ref;
+    tpage::ref tpage_ref = ref;
+    if (raw_ref.ok()) {
+        page_data = raw_ref->get_data();
+    } else if (spage_ref.ok()) {
+        page_data = spage_ref->export_file();
+    } else if (tpage_ref.ok()) {
+        page_data = tpage_ref->export_file();
+    } else {
         throw res::export_error("nsf::archive: page has incompatible type");
     }
 
+    // Compress the page if it is meant to be compressed, but only keep the
+    // result if it actually saves space.
+    if (compress && page_data.size() == page_size) {
+        // Reuse the previous compression of this page if the page data is
+        // unchanged since then.
+        auto &&cached = m_compressed_cache[index];
+        if (cached.source.data() != page_data.data() ||
+            cached.source.size() != page_data.size() ||
+            cached.effort != effort) {
+            cached.source = page_data;
+            cached.effort = effort;
+            cached.compressed = compress_spage(page_data.data(), effort);
+        }
+
+        if (cached.compressed.size() < page_data.size()) {
+            return cached.compressed;
+        }
+    }
+
+    return page_data;
+}
+
+// declared in nsf.hh
+void archive::export_file(
+    util::sink &out,
+    compression mode,
+    int effort,
+    int jobs) const
+{
+    auto compress = prepare_export(mode);
+
+    // Export and compress the pages in parallel, as with the other version
+    // below, but write out each page as soon as it and every page before it
+    // are ready, and then release it.
+    std::vector<util::shared_blob> pages(compress.size());
+    util::parallel_for_ordered(pages.size(), [&](size_t i) {
+        pages[i] = export_page(i, compress[i], effort);
+    }, [&](size_t i) {
+        out.write(pages[i].data(), pages[i].size());
+        pages[i] = {};
+    }, jobs);
+}
+
+// declared in nsf.hh
+util::blob archive::export_file(
+    compression mode,
+    int effort,
+    int jobs) const
+{
+    auto compress = prepare_export(mode);
+
+    // Export and compress the pages in parallel. Each page's data depends only
+    // on that page and the assets it was exported from, and each page has its
+    // own entry in the compressed page cache, so the pages can be exported in
+    // any order.
+    std::vector<util::shared_blob> pages(compress.size());
+    util::parallel_for(pages.size(), [&](size_t i) {
+        pages[i] = export_page(i, compress[i], effort);
+    }, jobs);
+
+    // Work out where each page goes in the file, then copy the pages into
+    // place. Uncompressed pages take 64K each.
+    std::vector<size_t> offsets(pages.size() + 1);
+    for (auto &&i : util::range_of(pages)) {
+        offsets[i + 1] = offsets[i] + pages[i].size();
+    }
+
+    util::blob data(offsets.back());
+    util::parallel_for(pages.size(), [&](size_t i) {
+        std::copy(pages[i].begin(), pages[i].end(), data.begin() + offsets[i]);
+    }, jobs);
     return data;
 }
 
-util::blob archive::decompress_spage(const unsigned char *data, size_t &size) 
+#if FEATURE_INTERNAL_TEST
+// declared in nsf.hh
+archive::ref make_test_archive(
+    res::project &proj,
+    const std::vector<std::vector<test_entry>> &page_entries)
 {
-    util::binreader r(util::read_dir::ltr);
-    util::binwriter w;
-    
-    // Read the page header.
-    r.begin(data, 12);
-    auto magic   = r.read_u16();
-    auto padding = r.read_u16();
-    auto length  = r.read_u32();
-    auto skip    = r.read_u32();
-    r.end();
-
-    // Ensure the magic number is correct.
-    if (magic != 0x1235)
-        throw res::import_error("nsf::archive::decompress_spage: bad magic number");
-
-    // Decompress the page.
-    size = 12;
-    w.begin();
-    while (w.length() < length) {
-        r.begin(&data[size], 2);
-        auto fmt = r.read_ubits(1);
-        uint32_t seek, span;
-        if (fmt) {
-            seek = r.read_ubits(12);
-            span = r.read_ubits(3) + 3;
-            r.end_early();
-            if (span == 10) span = 64;    
-            r.begin(w, -seek);
-            size += 2;
-        }
-        else {
-            seek = 0xFFFFFFFF;
-            span = r.read_ubits(7);
-            r.end_early();
-            r.begin(&data[size + 1], span);
-            size += (1 + span);
+    auto root = proj.get_asset_root();
+    archive::ref arc = root / "archive";
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+
+        std::vector<res::anyref> pages;
+        for (auto &&p : util::range_of(page_entries)) {
+            std::vector<res::anyref> pagelets;
+            for (auto &&te : page_entries[p]) {
+                raw_entry::ref entry = root / "entry-$"_fmt(te.eid);
+                entry.create(TS, proj);
+                entry->set_eid(TS, te.eid);
+                entry->set_type(TS, 1);
+                entry->set_items(TS, { te.item });
+                pagelets.push_back(entry);
+            }
+
+            spage::ref page = root / "page-$"_fmt(p);
+            page.create(TS, proj);
+            page->set_type(TS, 0);
+            page->set_cid(TS, p * 2 + 1);
+            page->set_pagelets(TS, std::move(pagelets));
+            pages.push_back(page);
         }
-        while (seek < span) {
-            w.write_bytes(r.read_bytes(seek));
-            r.end();
-            span -= seek;
-            r.begin(w, -seek);
+        arc->set_pages(TS, std::move(pages));
+    });
+
+    return arc;
+}
+
+namespace {
+
+// (s-func) make_varied_archive
+// Creates an archive with several standard pages of entries, which are of
+// varying size and compressibility, in the given project.
+archive::ref make_varied_archive(res::project &proj)
+{
+    std::vector<std::vector<test_entry>> page_entries(12);
+    for (auto &&p : util::range_of(page_entries)) {
+        for (size_t i = 0; i < 8; i++) {
+            util::blob item(512 * (p + i + 1));
+            for (auto &&k : util::range_of(item)) {
+                item[k] = (k % (p + 2) == 0) ? k * i + p : 0;
+            }
+            page_entries[p].push_back({
+                uint32_t((p * 8 + i) * 2 + 1),
+                std::move(item)
+            });
         }
-        w.write_bytes(r.read_bytes(span));
-        r.end_early();
     }
-    size += skip;
-
-    auto remainder = page_size - length;
-    r.begin(&data[size], remainder);
-    w.write_bytes(r.read_bytes(remainder));
-    r.end();
-    size += remainder; 
-    return w.end();
+    return make_test_archive(proj, page_entries);
+}
+
+// (test) ParallelExportMatchesSerial
+// Ensures the archive exports to the same data on several threads as on one,
+// both with and without compression, and through either export function.
+TEST(nsf_archive, ParallelExportMatchesSerial)
+{
+    for (auto mode : { archive::compression::none, archive::compression::all }) {
+        res::project serial_proj;
+        res::project parallel_proj;
+        auto serial_arc = make_varied_archive(serial_proj);
+        auto parallel_arc = make_varied_archive(parallel_proj);
+
+        auto expected = serial_arc->export_file(mode, 1, 1);
+        auto actual = parallel_arc->export_file(mode, 1, 4);
+        EXPECT_TRUE(actual == expected);
+
+        util::blob sink_data;
+        util::blob_sink sink(sink_data);
+        parallel_arc->export_file(sink, mode, 1, 4);
+        EXPECT_TRUE(sink_data == expected);
+    }
+}
+
+// (test) SinkExportStreamsPages
+// Ensures the sink version of `export_file' writes out the pages before a page
+// which fails to export, rather than only writing once every page is done.
+TEST(nsf_archive, SinkExportStreamsPages)
+{
+    res::project proj;
+    auto arc = make_varied_archive(proj);
+
+    // Replace the sixth page with an asset which is not a page.
+    proj.get_transact().run([&](TRANSACT) {
+        auto pages = arc->get_pages();
+        pages[5] = spage::ref(pages[5])->get_pagelets()[0];
+        arc->set_pages(TS, std::move(pages));
+    });
+
+    for (int jobs : { 1, 4 }) {
+        util::blob sink_data;
+        util::blob_sink sink(sink_data);
+        EXPECT_THROW(
+            arc->export_file(sink, archive::compression::none, 1, jobs),
+            res::export_error
+        );
+        EXPECT_EQ(sink_data.size(), page_size * 5);
+    }
+}
+
 }
+#endif
 
 }
 }
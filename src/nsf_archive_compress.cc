@@ -0,0 +1,595 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <cstring>
+#include <algorithm>
+#include "nsf.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#include <iostream>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// (s-var) s_span_table
+// The lengths of back references in a compressed page, indexed by the 3-bit
+// span field of the back reference.
+static const uint8_t s_span_table[8] = { 3, 4, 5, 6, 7, 8, 9, 64 };
+
+// declared in nsf.hh
+void archive::decompress_spage(
+    const unsigned char *data,
+    size_t data_size,
+    unsigned char *out,
+    size_t &size)
+{
+    // Ensure there is enough data for the page header.
+    if (data_size < 12)
+        throw res::import_error("nsf::archive::decompress_spage: cut off");
+
+    // Read the page header.
+    util::binreader r;
+    r.begin(data, 12);
+    auto magic   = r.read_u16();
+    r.discard(2); // padding
+    auto length  = r.read_u32();
+    auto skip    = r.read_u32();
+    r.end();
+
+    // Ensure the magic number is correct.
+    if (magic != 0x1235)
+        throw res::import_error("nsf::archive::decompress_spage: bad magic number");
+
+    // Ensure the decompressed data fits within a page.
+    if (length > page_size)
+        throw res::import_error("nsf::archive::decompress_spage: bad length");
+
+    // Decompress the page. The compressed data is a series of tokens, each
+    // of which is either a run of literal bytes or a reference back to a span
+    // of previously decompressed bytes:
+    //
+    //   0LLLLLLL <literal bytes>
+    //     A run of L (0-127) literal bytes follows the token.
+    //
+    //   1SSSSSSS SSSSSNNN
+    //     Copy a span of previous output starting S (12-bit) bytes back. The
+    //     span length is given by N (see `s_span_table'). The span may overlap
+    //     the bytes being written, in which case the last S bytes repeat.
+    const unsigned char *in = data + 12;
+    const unsigned char *in_end = data + data_size;
+    size_t out_len = 0;
+    while (out_len < length) {
+        if (in == in_end)
+            throw res::import_error("nsf::archive::decompress_spage: cut off");
+
+        unsigned int token = *in++;
+        size_t span;
+        if (token & 0x80) {
+            if (in == in_end)
+                throw res::import_error("nsf::archive::decompress_spage: cut off");
+
+            token = token << 8 | *in++;
+            size_t seek = (token >> 3) & 0xFFF;
+            span = s_span_table[token & 7];
+
+            if (seek == 0 || seek > out_len)
+                throw res::import_error("nsf::archive::decompress_spage: bad back reference");
+            if (span > length - out_len)
+                throw res::import_error("nsf::archive::decompress_spage: overrun");
+
+            unsigned char *dst = out + out_len;
+            const unsigned char *src = dst - seek;
+            if (seek >= span) {
+                std::memcpy(dst, src, span);
+            } else if (seek == 1) {
+                std::memset(dst, *src, span);
+            } else {
+                // Overlapping copy; this must go byte by byte so that the
+                // bytes written by this copy are repeated.
+                for (size_t i = 0; i < span; i++) {
+                    dst[i] = src[i];
+                }
+            }
+        } else {
+            span = token;
+
+            if (span > size_t(in_end - in))
+                throw res::import_error("nsf::archive::decompress_spage: cut off");
+            if (span > length - out_len)
+                throw res::import_error("nsf::archive::decompress_spage: overrun");
+
+            std::memcpy(out + out_len, in, span);
+            in += span;
+        }
+        out_len += span;
+    }
+    size = in - data;
+
+    // Copy the uncompressed remainder of the page, which comes after `skip'
+    // bytes of padding.
+    auto remainder = page_size - length;
+    if (skip > data_size - size || remainder > data_size - size - skip)
+        throw res::import_error("nsf::archive::decompress_spage: cut off");
+    size += skip;
+    std::memcpy(out + length, data + size, remainder);
+    size += remainder;
+}
+
+// declared in nsf.hh
+util::blob archive::decompress_spage(
+    const unsigned char *data,
+    size_t data_size,
+    size_t &size)
+{
+    util::blob result(page_size);
+    decompress_spage(data, data_size, result.data(), size);
+    return result;
+}
+
+// (s-var) s_chain_limits
+// The maximum number of earlier positions `archive::compress_spage' will try
+// when looking for a back reference, indexed by effort level.
+static const int s_chain_limits[archive::max_compress_effort + 1] = {
+    0, 1, 2, 4, 8, 16, 32, 64, 256, 4096
+};
+
+// (s-var) s_lazy_effort
+// The effort level at and above which `archive::compress_spage' checks if a
+// better match starts at the next byte before taking the match it has found.
+static const int s_lazy_effort = 4;
+
+// declared in nsf.hh
+util::blob archive::compress_spage(const unsigned char *data, int effort)
+{
+    if (effort < min_compress_effort || effort > max_compress_effort)
+        throw std::logic_error("nsf::archive::compress_spage: bad effort");
+
+    const int chain_limit = s_chain_limits[effort];
+    const bool lazy = (effort >= s_lazy_effort);
+
+    util::binwriter w;
+    w.begin();
+    w.reserve(page_size + page_size / 127 + 16);
+
+    // Write the page header. The entire page is compressed, so there is no
+    // uncompressed remainder.
+    w.write_u16(0x1235);
+    w.write_u16(0);
+    w.write_u32(page_size);
+    w.write_u32(0);
+
+    util::blob out = w.end();
+
+    // Positions are kept in hash chains keyed by the three bytes starting at
+    // each position. `head' holds the most recent position for each hash, and
+    // `prev' links each position to the previous one with the same hash, or
+    // -1 if there is none.
+    std::vector<int32_t> head(4096, -1);
+    std::vector<int32_t> prev(page_size, -1);
+    auto hash = [&](size_t pos) {
+        unsigned int value = data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16;
+        return (value * 2654435761u) >> 20;
+    };
+    auto insert = [&](size_t pos) {
+        if (page_size - pos < 3)
+            return;
+        auto h = hash(pos);
+        prev[pos] = head[h];
+        head[h] = pos;
+    };
+
+    // Finds the best back reference for the data at `pos'. Back references
+    // may be at most 4095 bytes back and may overlap the bytes being written,
+    // but may only have a length of 3 through 9 or 64. The length is returned
+    // and the distance is written to `best_seek'.
+    auto find = [&](size_t pos, size_t &best_seek) -> size_t {
+        if (page_size - pos < 3)
+            return 0;
+        size_t max_len = std::min<size_t>(64, page_size - pos);
+        size_t best_len = 0;
+        int chain = chain_limit;
+        for (int32_t candidate = head[hash(pos)];
+            candidate >= 0 && pos - candidate <= 4095 && chain > 0;
+            candidate = prev[candidate], chain--) {
+            size_t len = 0;
+            while (len < max_len && data[candidate + len] == data[pos + len]) {
+                len++;
+            }
+            if (len < 3) {
+                continue;
+            } else if (len > 9 && len < 64) {
+                len = 9;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_seek = pos - candidate;
+                if (len == 64)
+                    break;
+            }
+        }
+        return best_len;
+    };
+
+    // Pending literal bytes, written out in runs of up to 127 bytes.
+    size_t literal_start = 0;
+    size_t literal_len = 0;
+    auto flush_literals = [&]{
+        if (!literal_len)
+            return;
+        out.push_back(literal_len);
+        out.insert(
+            out.end(),
+            data + literal_start,
+            data + literal_start + literal_len
+        );
+        literal_len = 0;
+    };
+
+    size_t pos = 0;
+    while (pos < page_size) {
+        size_t match_seek = 0;
+        size_t match_len = find(pos, match_seek);
+        insert(pos);
+
+        // Put off taking this match if a longer one starts at the next byte.
+        if (lazy && match_len && match_len < 64) {
+            size_t next_seek;
+            if (find(pos + 1, next_seek) > match_len) {
+                match_len = 0;
+            }
+        }
+
+        if (!match_len) {
+            if (literal_len == 0) {
+                literal_start = pos;
+            }
+            literal_len++;
+            pos++;
+            if (literal_len == 127) {
+                flush_literals();
+            }
+            continue;
+        }
+
+        flush_literals();
+        int span_code = (match_len == 64) ? 7 : match_len - 3;
+        out.push_back(0x80 | match_seek >> 5);
+        out.push_back((match_seek & 0x1F) << 3 | span_code);
+
+        // Record the positions covered by the match so later data can refer
+        // back into it.
+        for (size_t i = 1; i < match_len; i++) {
+            insert(pos + i);
+        }
+        pos += match_len;
+    }
+    flush_literals();
+
+    return out;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) reference_decompress
+// The original token-at-a-time decompressor, kept here to check that
+// `archive::decompress_spage' produces the exact same output.
+util::blob reference_decompress(const unsigned char *data, size_t &size)
+{
+    util::binreader r(util::read_dir::ltr);
+    util::binwriter w;
+
+    r.begin(data, 12);
+    auto magic   = r.read_u16();
+    r.discard(2); // padding
+    auto length  = r.read_u32();
+    auto skip    = r.read_u32();
+    r.end();
+
+    if (magic != 0x1235)
+        throw res::import_error("reference_decompress: bad magic number");
+
+    size = 12;
+    w.begin();
+    while (uint32_t(w.length()) < length) {
+        r.begin(&data[size], 2);
+        auto fmt = r.read_ubits(1);
+        uint32_t seek, span;
+        if (fmt) {
+            seek = r.read_ubits(12);
+            span = r.read_ubits(3) + 3;
+            r.end_early();
+            if (span == 10) span = 64;
+            r.begin(w, -seek);
+            size += 2;
+        }
+        else {
+            seek = 0xFFFFFFFF;
+            span = r.read_ubits(7);
+            r.end_early();
+            r.begin(&data[size + 1], span);
+            size += (1 + span);
+        }
+        while (seek < span) {
+            w.write_bytes(r.read_bytes(seek));
+            r.end();
+            span -= seek;
+            r.begin(w, -seek);
+        }
+        w.write_bytes(r.read_bytes(span));
+        r.end_early();
+    }
+    size += skip;
+
+    auto remainder = page_size - length;
+    r.begin(&data[size], remainder);
+    w.write_bytes(r.read_bytes(remainder));
+    r.end();
+    size += remainder;
+    return w.end();
+}
+
+// (s-func) make_test_page
+// Creates a page which looks somewhat like a real page: a mix of repeated
+// structures, small varying values, random bytes, and zero padding.
+util::blob make_test_page(unsigned int seed)
+{
+    util::blob page(page_size);
+    uint32_t state = seed * 2654435761u + 1;
+    auto rand = [&]{
+        state = state * 1103515245 + 12345;
+        return state >> 16;
+    };
+    size_t pos = 0;
+    size_t used = page_size - rand() % 16384;
+    while (pos < used) {
+        size_t len = std::min<size_t>(rand() % 200 + 1, used - pos);
+        switch (rand() % 3) {
+        case 0:
+            for (size_t i = 0; i < len; i++) {
+                page[pos + i] = rand();
+            }
+            break;
+        case 1:
+            for (size_t i = 0; i < len; i++) {
+                page[pos + i] = (i % 6 == 0) ? rand() % 4 : 0;
+            }
+            break;
+        case 2:
+            if (pos >= 512) {
+                size_t from = pos - 1 - rand() % 512;
+                for (size_t i = 0; i < len; i++) {
+                    page[pos + i] = page[from + i];
+                }
+            }
+            break;
+        }
+        pos += len;
+    }
+    return page;
+}
+
+TEST(nsf_archive, DecompressMatchesReference)
+{
+    for (unsigned int seed = 0; seed < 16; seed++) {
+        auto page = make_test_page(seed);
+        auto compressed = archive::compress_spage(page.data());
+
+        size_t size;
+        auto result = archive::decompress_spage(
+            compressed.data(),
+            compressed.size(),
+            size
+        );
+        EXPECT_EQ(size, compressed.size());
+        EXPECT_EQ(result, page);
+
+        size_t reference_size;
+        auto reference = reference_decompress(
+            compressed.data(),
+            reference_size
+        );
+        EXPECT_EQ(reference_size, size);
+        EXPECT_EQ(reference, result);
+    }
+}
+
+TEST(nsf_archive, CompressEffortLevels)
+{
+    for (unsigned int seed = 0; seed < 4; seed++) {
+        auto page = make_test_page(seed);
+
+        size_t last_size = 0;
+        for (int effort = archive::min_compress_effort;
+            effort <= archive::max_compress_effort;
+            effort++) {
+            auto compressed = archive::compress_spage(page.data(), effort);
+
+            size_t size;
+            auto result = archive::decompress_spage(
+                compressed.data(),
+                compressed.size(),
+                size
+            );
+            EXPECT_EQ(size, compressed.size());
+            EXPECT_EQ(result, page);
+
+            // Higher effort levels should never do much worse than lower
+            // ones. Lazy matching can occasionally lose a few bytes.
+            if (effort > archive::min_compress_effort) {
+                EXPECT_LE(compressed.size(), last_size + 64);
+            }
+            last_size = compressed.size();
+        }
+    }
+
+    util::blob page(page_size);
+    EXPECT_THROW(archive::compress_spage(page.data(), 0), std::logic_error);
+    EXPECT_THROW(archive::compress_spage(page.data(), 10), std::logic_error);
+}
+
+TEST(nsf_archive, DecompressOverlapAndRemainder)
+{
+    // Build a page by hand using overlapping back references of several
+    // distances, a skip, and an uncompressed remainder.
+    util::blob data = {
+        0x35, 0x12, 0x00, 0x00, // magic, padding
+        0x00, 0x00, 0x00, 0x00, // length (filled in below)
+        0x03, 0x00, 0x00, 0x00, // skip
+        0x03, 0xAA, 0xBB, 0xCC, // literals
+        0x00,                   // empty literal run
+        0x80, 0x0F,             // seek 1, span 64
+        0x80, 0x17,             // seek 2, span 64
+        0x80, 0x1C,             // seek 3, span 7
+        0x80, 0x29,             // seek 5, span 4
+    };
+    uint32_t length = 3 + 64 + 64 + 7 + 4;
+    data[4] = length;
+    data[5] = length >> 8;
+    data.insert(data.end(), 3, 0xEE);
+    for (size_t i = 0; i < page_size - length; i++) {
+        data.push_back(i * 7);
+    }
+
+    size_t size;
+    auto result = archive::decompress_spage(data.data(), data.size(), size);
+    size_t reference_size;
+    auto reference = reference_decompress(data.data(), reference_size);
+    EXPECT_EQ(size, data.size());
+    EXPECT_EQ(reference_size, data.size());
+    EXPECT_EQ(result, reference);
+}
+
+TEST(nsf_archive, DecompressErrors)
+{
+    util::blob data = {
+        0x35, 0x12, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x01, 0xAA,
+        0x80, 0x17, // seek 2, but only one byte has been written
+    };
+    size_t size;
+    EXPECT_THROW(
+        archive::decompress_spage(data.data(), data.size(), size),
+        res::import_error
+    );
+    data[15] = 0x0F;
+    EXPECT_THROW( // cut off
+        archive::decompress_spage(data.data(), data.size(), size),
+        res::import_error
+    );
+    data[0] = 0x34;
+    EXPECT_THROW(
+        archive::decompress_spage(data.data(), data.size(), size),
+        res::import_error
+    );
+}
+
+// (test) DISABLED_DecompressBenchmark
+// Measures the throughput of `archive::decompress_spage' on a single thread,
+// compared to the original decompressor. To run this, use:
+//
+//   drnsf :internal-test --gtest_also_run_disabled_tests
+//     --gtest_filter=*Benchmark*
+TEST(nsf_archive, DISABLED_DecompressBenchmark)
+{
+    std::vector<util::blob> pages;
+    for (unsigned int seed = 0; seed < 16; seed++) {
+        auto page = make_test_page(seed);
+        pages.push_back(archive::compress_spage(page.data()));
+    }
+
+    const int rounds = 64;
+    util::blob out(page_size);
+    size_t size;
+
+    util::stopwatch sw;
+    for (int i = 0; i < rounds; i++) {
+        for (auto &&page : pages) {
+            archive::decompress_spage(
+                page.data(),
+                page.size(),
+                out.data(),
+                size
+            );
+        }
+    }
+    long new_time = sw.lap();
+
+    for (int i = 0; i < rounds; i++) {
+        for (auto &&page : pages) {
+            reference_decompress(page.data(), size);
+        }
+    }
+    long old_time = sw.lap();
+
+    double megabytes = double(rounds) * pages.size() * page_size / 1048576;
+    std::cout
+        << "decompress_spage: "
+        << megabytes * 1000 / std::max(new_time, 1L)
+        << " MB/s (original: "
+        << megabytes * 1000 / std::max(old_time, 1L)
+        << " MB/s)"
+        << std::endl;
+}
+
+// (test) DISABLED_CompressBenchmark
+// Measures the speed of `archive::compress_spage' on a single thread and the
+// resulting size at each effort level. See `DISABLED_DecompressBenchmark' for
+// how to run this.
+TEST(nsf_archive, DISABLED_CompressBenchmark)
+{
+    std::vector<util::blob> pages;
+    for (unsigned int seed = 0; seed < 16; seed++) {
+        pages.push_back(make_test_page(seed));
+    }
+
+    double megabytes = double(pages.size()) * page_size / 1048576;
+    for (int effort = archive::min_compress_effort;
+        effort <= archive::max_compress_effort;
+        effort++) {
+        size_t total_size = 0;
+        util::stopwatch sw;
+        for (auto &&page : pages) {
+            total_size += archive::compress_spage(page.data(), effort).size();
+        }
+        long time = sw.lap();
+
+        std::cout
+            << "compress_spage effort "
+            << effort
+            << ": "
+            << megabytes * 1000 / std::max(time, 1L)
+            << " MB/s, "
+            << 100.0 * total_size / (pages.size() * page_size)
+            << "% of original size"
+            << std::endl;
+    }
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,291 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include "nsf.hh"
+#include "misc.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// (s-func) hash_bytes
+// Hashes the given data. The standard library's string hash is used, as it is
+// fast and needs no copy of the data.
+static size_t hash_bytes(const unsigned char *data, size_t size)
+{
+    return std::hash<std::string_view>()(std::string_view(
+        reinterpret_cast<const char *>(data),
+        size
+    ));
+}
+
+// (s-func) combine
+// Mixes `value' into the running hash `seed', in the manner of boost's
+// `hash_combine'.
+static size_t combine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9E3779B9 + (seed << 6) + (seed >> 2));
+}
+
+// (s-func) hash_entry
+// Fills in the item hashes and overall hash of the given digest entry.
+static void hash_entry(
+    archive_digest::entry &entry,
+    const std::vector<util::blob> &items)
+{
+    entry.hash = combine(entry.type, items.size());
+    entry.item_hashes.reserve(items.size());
+    for (auto &&item : items) {
+        auto item_hash = hash_bytes(item.data(), item.size());
+        entry.item_hashes.push_back(item_hash);
+        entry.hash = combine(entry.hash, item_hash);
+    }
+}
+
+// declared in nsf.hh
+archive_digest archive_digest::build(const archive &arc)
+{
+    archive_digest digest;
+
+    auto &&pages = arc.get_pages();
+    for (auto &&page_index : util::range_of(pages)) {
+        spage::ref spage = pages[page_index];
+        tpage::ref tpage = pages[page_index];
+
+        if (tpage.ok()) {
+            auto &&texture = tpage->get_texture();
+            if (!texture.ok())
+                throw res::export_error("nsf::archive_digest: no texture");
+
+            auto &&texels = texture->get_texels();
+            auto &&entry = digest.entries.emplace_back();
+            entry.id = tpage->get_eid();
+            entry.type = tpage->get_entry_type();
+            entry.page = page_index;
+            entry.slot = 0;
+            entry.item_hashes = { tpage::hash_texels(texels) };
+            entry.hash = combine(entry.type, entry.item_hashes[0]);
+
+            auto &&page = digest.pages.emplace_back();
+            page.type = tpage->get_type();
+            page.id = tpage->get_eid();
+            page.hash = combine(combine(page.type, page.id), entry.hash);
+            continue;
+        }
+
+        if (!spage.ok())
+            throw res::export_error("nsf::archive_digest: unknown page type");
+
+        auto &&page = digest.pages.emplace_back();
+        page.type = spage->get_type();
+        page.id = spage->get_cid();
+        page.hash = combine(page.type, page.id);
+
+        auto &&pagelets = spage->get_pagelets();
+        for (auto &&slot : util::range_of(pagelets)) {
+            auto &&pagelet = pagelets[slot];
+            raw_entry::ref raw_ref = pagelet;
+            nsf::entry::ref entry_ref = pagelet;
+            misc::raw_data::ref data_ref = pagelet;
+
+            // Pagelets which are not entries have no EID, so they only count
+            // towards the page hash.
+            if (data_ref.ok()) {
+                auto &&data = data_ref->get_data();
+                auto data_hash = hash_bytes(data.data(), data.size());
+                page.hash = combine(page.hash, data_hash);
+                continue;
+            }
+            if (!entry_ref.ok()) {
+                throw res::export_error(
+                    "nsf::archive_digest: pagelet has incompatible type"
+                );
+            }
+
+            auto &&entry = digest.entries.emplace_back();
+            entry.id = entry_ref->get_eid();
+            entry.page = page_index;
+            entry.slot = slot;
+            if (raw_ref.ok()) {
+                entry.type = raw_ref->get_type();
+                hash_entry(entry, raw_ref->get_items());
+            } else {
+                hash_entry(entry, entry_ref->export_entry(entry.type));
+            }
+            page.hash = combine(combine(page.hash, entry.id), entry.hash);
+        }
+    }
+
+    return digest;
+}
+
+// declared in nsf.hh
+std::vector<entry_change> diff_archives(
+    const archive_digest &old_arc,
+    const archive_digest &new_arc)
+{
+    using kind = entry_change::kind;
+
+    // Index the new entries by EID, keeping every entry for each EID in order
+    // so that duplicates are paired up in order.
+    std::unordered_map<uint32_t, std::vector<size_t>> new_by_eid;
+    for (auto &&i : util::range_of(new_arc.entries)) {
+        new_by_eid[new_arc.entries[i].id].push_back(i);
+    }
+    std::unordered_map<uint32_t, size_t> used_by_eid;
+    std::vector<bool> paired(new_arc.entries.size());
+
+    std::vector<entry_change> changes;
+    for (auto &&a : old_arc.entries) {
+        auto it = new_by_eid.find(a.id);
+        auto &&used = used_by_eid[a.id];
+        if (it == new_by_eid.end() || used == it->second.size()) {
+            changes.push_back({
+                kind::removed,
+                a.id,
+                a.page,
+                entry_change::no_page,
+                {}
+            });
+            continue;
+        }
+
+        auto index = it->second[used++];
+        auto &&b = new_arc.entries[index];
+        paired[index] = true;
+
+        if (a.hash == b.hash && a.type == b.type &&
+            a.item_hashes == b.item_hashes) {
+            if (a.page != b.page) {
+                changes.push_back({ kind::moved, a.id, a.page, b.page, {} });
+            }
+            continue;
+        }
+
+        entry_change change{ kind::modified, a.id, a.page, b.page, {} };
+        auto item_count = std::max(a.item_hashes.size(), b.item_hashes.size());
+        for (size_t i = 0; i < item_count; i++) {
+            if (i >= a.item_hashes.size() ||
+                i >= b.item_hashes.size() ||
+                a.item_hashes[i] != b.item_hashes[i]) {
+                change.items.push_back(i);
+            }
+        }
+        changes.push_back(std::move(change));
+    }
+
+    for (auto &&i : util::range_of(new_arc.entries)) {
+        if (paired[i])
+            continue;
+
+        auto &&b = new_arc.entries[i];
+        changes.push_back({
+            kind::added,
+            b.id,
+            entry_change::no_page,
+            b.page,
+            {}
+        });
+    }
+
+    return changes;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) make_diff_archive
+// Creates an archive in the given project with one standard page for each of
+// the given lists of entries. Each entry is given as its EID and the value of
+// the bytes in its only item.
+archive::ref make_diff_archive(
+    res::project &proj,
+    const std::vector<std::vector<std::pair<uint32_t, int>>> &page_entries)
+{
+    std::vector<std::vector<test_entry>> entries(page_entries.size());
+    for (auto &&p : util::range_of(page_entries)) {
+        for (auto &&[id, value] : page_entries[p]) {
+            entries[p].push_back({ id, util::blob(64, value) });
+        }
+    }
+    return make_test_archive(proj, entries);
+}
+
+// (test) FindsEachKindOfChange
+// Ensures added, removed, moved and modified entries are each found, and that
+// unchanged entries and identical pages are left alone.
+TEST(nsf_diff, FindsEachKindOfChange)
+{
+    using kind = entry_change::kind;
+
+    res::project old_proj;
+    res::project new_proj;
+    auto old_arc = make_diff_archive(old_proj, {
+        { { 1, 0x11 }, { 3, 0x33 } },
+        { { 5, 0x55 }, { 7, 0x77 } },
+        { { 9, 0x99 } }
+    });
+    auto new_arc = make_diff_archive(new_proj, {
+        { { 1, 0x11 }, { 3, 0x33 } },
+        { { 5, 0x56 }, { 11, 0xBB } },
+        { { 9, 0x99 }, { 7, 0x77 } }
+    });
+
+    auto old_digest = archive_digest::build(*old_arc);
+    auto new_digest = archive_digest::build(*new_arc);
+    EXPECT_EQ(old_digest.pages[0].hash, new_digest.pages[0].hash);
+    EXPECT_NE(old_digest.pages[1].hash, new_digest.pages[1].hash);
+
+    auto changes = diff_archives(old_digest, new_digest);
+    ASSERT_EQ(changes.size(), 3u);
+
+    EXPECT_TRUE(changes[0].what == kind::modified);
+    EXPECT_EQ(changes[0].id, 5u);
+    EXPECT_EQ(changes[0].items, std::vector<size_t>{ 0 });
+
+    EXPECT_TRUE(changes[1].what == kind::moved);
+    EXPECT_EQ(changes[1].id, 7u);
+    EXPECT_EQ(changes[1].old_page, 1u);
+    EXPECT_EQ(changes[1].new_page, 2u);
+
+    EXPECT_TRUE(changes[2].what == kind::added);
+    EXPECT_EQ(changes[2].id, 11u);
+    EXPECT_EQ(changes[2].old_page, entry_change::no_page);
+
+    EXPECT_TRUE(diff_archives(old_digest, old_digest).empty());
+
+    auto reverse = diff_archives(new_digest, old_digest);
+    ASSERT_EQ(reverse.size(), 3u);
+    EXPECT_TRUE(reverse[1].what == kind::removed);
+    EXPECT_EQ(reverse[1].id, 11u);
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,368 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include "nsf.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#include "misc.hh"
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+void eid_index::add(res::asset &asset)
+{
+    util::event<> *change_event;
+    if (auto e = dynamic_cast<entry *>(&asset)) {
+        change_event = &e->p_eid.on_change;
+    } else if (auto tp = dynamic_cast<tpage *>(&asset)) {
+        change_event = &tp->p_eid.on_change;
+    } else if (auto sp = dynamic_cast<spage *>(&asset)) {
+        change_event = &sp->p_pagelets.on_change;
+    } else if (auto arc = dynamic_cast<archive *>(&asset)) {
+        change_event = &arc->p_pages.on_change;
+    } else {
+        return;
+    }
+
+    remove(asset);
+
+    auto t = std::make_unique<tracked_asset>();
+    t->name = asset.get_name();
+    index(asset, *t);
+
+    // Reindex the asset whenever the property it is indexed by changes.
+    t->h_change <<= [this, &asset, state = t.get()] {
+        unindex(asset, *state);
+        index(asset, *state);
+    };
+    t->h_change.bind(*change_event);
+
+    m_tracked[&asset] = std::move(t);
+}
+
+// declared in nsf.hh
+void eid_index::remove(res::asset &asset)
+{
+    auto it = m_tracked.find(&asset);
+    if (it == m_tracked.end())
+        return;
+
+    unindex(asset, *it->second);
+    m_tracked.erase(it);
+}
+
+// declared in nsf.hh
+void eid_index::index(res::asset &asset, tracked_asset &t)
+{
+    if (auto e = dynamic_cast<entry *>(&asset)) {
+        t.eid = e->get_eid();
+        m_by_eid[t.eid].push_back(&asset);
+    } else if (auto tp = dynamic_cast<tpage *>(&asset)) {
+        t.eid = tp->get_eid();
+        m_by_eid[t.eid].push_back(&asset);
+    } else if (auto sp = dynamic_cast<spage *>(&asset)) {
+        auto &&pagelets = sp->get_pagelets();
+        for (auto &&i : util::range_of(pagelets)) {
+            if (!pagelets[i])
+                continue;
+            m_pagelets[pagelets[i]] = { t.name, i };
+            t.names.push_back(pagelets[i]);
+        }
+    } else if (auto arc = dynamic_cast<archive *>(&asset)) {
+        auto &&pages = arc->get_pages();
+        for (auto &&i : util::range_of(pages)) {
+            if (!pages[i])
+                continue;
+            m_pages[pages[i]] = { arc, i };
+            t.names.push_back(pages[i]);
+        }
+    }
+}
+
+// declared in nsf.hh
+void eid_index::unindex(res::asset &asset, tracked_asset &t)
+{
+    if (dynamic_cast<entry *>(&asset) || dynamic_cast<tpage *>(&asset)) {
+        auto it = m_by_eid.find(t.eid);
+        if (it == m_by_eid.end())
+            return;
+
+        auto &&assets = it->second;
+        assets.erase(
+            std::remove(assets.begin(), assets.end(), &asset),
+            assets.end()
+        );
+        if (assets.empty()) {
+            m_by_eid.erase(it);
+        }
+    } else if (dynamic_cast<spage *>(&asset)) {
+        // Only remove pagelets which have not since been claimed by another
+        // page.
+        for (auto &&name : t.names) {
+            auto it = m_pagelets.find(name);
+            if (it != m_pagelets.end() && it->second.first == t.name) {
+                m_pagelets.erase(it);
+            }
+        }
+        t.names.clear();
+    } else if (auto arc = dynamic_cast<archive *>(&asset)) {
+        for (auto &&name : t.names) {
+            auto it = m_pages.find(name);
+            if (it != m_pages.end() && it->second.first == arc) {
+                m_pages.erase(it);
+            }
+        }
+        t.names.clear();
+    }
+}
+
+// declared in nsf.hh
+eid_index::eid_index()
+{
+    h_asset_appear <<= [this](res::asset &asset) {
+        add(asset);
+    };
+    h_asset_disappear <<= [this](res::asset &asset) {
+        remove(asset);
+    };
+}
+
+// declared in nsf.hh
+res::project *eid_index::get_proj() const
+{
+    return m_proj;
+}
+
+// declared in nsf.hh
+void eid_index::set_proj(res::project *proj)
+{
+    if (m_proj == proj)
+        return;
+
+    if (m_proj) {
+        h_asset_appear.unbind();
+        h_asset_disappear.unbind();
+        m_tracked.clear();
+        m_by_eid.clear();
+        m_pages.clear();
+        m_pagelets.clear();
+    }
+
+    m_proj = proj;
+
+    if (m_proj) {
+        h_asset_appear.bind(m_proj->on_asset_appear);
+        h_asset_disappear.bind(m_proj->on_asset_disappear);
+        for (auto &&asset : m_proj->get_asset_list()) {
+            add(*asset);
+        }
+    }
+}
+
+// declared in nsf.hh
+res::asset *eid_index::find(eid value) const
+{
+    auto it = m_by_eid.find(value);
+    if (it == m_by_eid.end())
+        return nullptr;
+
+    return it->second.back();
+}
+
+// declared in nsf.hh
+res::asset *eid_index::find(eid value, const archive *arc) const
+{
+    auto it = m_by_eid.find(value);
+    if (it == m_by_eid.end())
+        return nullptr;
+
+    // Search from the most recent asset, as with the other `find'.
+    auto &&assets = it->second;
+    for (auto i = assets.rbegin(); i != assets.rend(); ++i) {
+        location loc;
+        if (find_location((*i)->get_name(), loc) && loc.arc == arc)
+            return *i;
+    }
+    return nullptr;
+}
+
+// declared in nsf.hh
+bool eid_index::find_location(res::atom name, location &out) const
+{
+    // For an entry, find the page it is in first. Texture pages are listed
+    // in the archive directly.
+    res::atom page_name = name;
+    out.slot = 0;
+    auto pagelet_it = m_pagelets.find(name);
+    if (pagelet_it != m_pagelets.end()) {
+        page_name = pagelet_it->second.first;
+        out.slot = pagelet_it->second.second;
+    }
+
+    auto it = m_pages.find(page_name);
+    if (it == m_pages.end())
+        return false;
+
+    out.arc = it->second.first;
+    out.page = it->second.second;
+    return true;
+}
+
+// declared in nsf.hh
+bool eid_index::find_location(eid value, location &out) const
+{
+    auto asset = find(value);
+    if (!asset)
+        return false;
+
+    return find_location(asset->get_name(), out);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (test) TracksChanges
+// Ensures the index follows entries and pages as they are created, moved
+// between pages, changed, destroyed, and restored by undo.
+TEST(nsf_eid_index, TracksChanges)
+{
+    res::project proj;
+    eid_index index;
+    index.set_proj(&proj);
+
+    auto root = proj.get_asset_root();
+    archive::ref arc = root / "nsfile";
+    spage::ref page_a = root / "page-a";
+    spage::ref page_b = root / "page-b";
+    raw_entry::ref entry_1 = root / "entries" / "one";
+    raw_entry::ref entry_2 = root / "entries" / "two";
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+        page_a.create(TS, proj);
+        page_b.create(TS, proj);
+        entry_1.create(TS, proj);
+        entry_1->set_eid(TS, 0x11);
+        entry_2.create(TS, proj);
+        entry_2->set_eid(TS, 0x21);
+        page_a->set_pagelets(TS, { entry_1 });
+        page_b->set_pagelets(TS, { nullptr, entry_2 });
+        arc->set_pages(TS, { page_a, page_b });
+    });
+
+    eid_index::location loc;
+    EXPECT_EQ(index.find(0x11), entry_1.get());
+    EXPECT_EQ(index.find(0x21), entry_2.get());
+    ASSERT_TRUE(index.find_location(0x21, loc));
+    EXPECT_EQ(loc.arc, arc.get());
+    EXPECT_EQ(loc.page, 1u);
+    EXPECT_EQ(loc.slot, 1u);
+
+    // Move entry two to the first page and change entry one's EID.
+    proj.get_transact().run([&](TRANSACT) {
+        page_b->set_pagelets(TS, {});
+        page_a->set_pagelets(TS, { entry_1, entry_2 });
+        entry_1->set_eid(TS, 0x31);
+    });
+
+    EXPECT_EQ(index.find(0x11), nullptr);
+    EXPECT_EQ(index.find(0x31), entry_1.get());
+    ASSERT_TRUE(index.find_location(0x21, loc));
+    EXPECT_EQ(loc.page, 0u);
+    EXPECT_EQ(loc.slot, 1u);
+
+    // Destroy entry two, then undo it.
+    proj.get_transact().run([&](TRANSACT) {
+        entry_2->destroy(TS);
+    });
+    EXPECT_EQ(index.find(0x21), nullptr);
+    EXPECT_FALSE(index.find_location(0x21, loc));
+
+    proj.get_transact().undo();
+    EXPECT_EQ(index.find(0x21), entry_2.get());
+    EXPECT_TRUE(index.find_location(0x21, loc));
+
+    proj.get_transact().undo();
+    EXPECT_EQ(index.find(0x11), entry_1.get());
+    EXPECT_EQ(index.find(0x31), nullptr);
+    ASSERT_TRUE(index.find_location(0x21, loc));
+    EXPECT_EQ(loc.page, 1u);
+
+    // A new index on an existing project picks up the existing assets.
+    eid_index index2;
+    index2.set_proj(&proj);
+    EXPECT_EQ(index2.find(0x11), entry_1.get());
+    ASSERT_TRUE(index2.find_location(0x11, loc));
+    EXPECT_EQ(loc.page, 0u);
+    EXPECT_EQ(loc.slot, 0u);
+}
+
+// (test) FindsByArchive
+// Ensures assets with the same EID in different archives can be told apart by
+// archive.
+TEST(nsf_eid_index, FindsByArchive)
+{
+    res::project proj;
+    eid_index index;
+    index.set_proj(&proj);
+
+    auto root = proj.get_asset_root();
+    archive::ref arc_a = root / "a" / "nsfile";
+    archive::ref arc_b = root / "b" / "nsfile";
+    spage::ref page_a = root / "a" / "page";
+    spage::ref page_b = root / "b" / "page";
+    raw_entry::ref entry_a = root / "a" / "entry";
+    raw_entry::ref entry_b = root / "b" / "entry";
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc_a.create(TS, proj);
+        arc_b.create(TS, proj);
+        page_a.create(TS, proj);
+        page_b.create(TS, proj);
+        entry_a.create(TS, proj);
+        entry_a->set_eid(TS, 0x11);
+        entry_b.create(TS, proj);
+        entry_b->set_eid(TS, 0x11);
+        page_a->set_pagelets(TS, { entry_a });
+        page_b->set_pagelets(TS, { entry_b });
+        arc_a->set_pages(TS, { page_a });
+        arc_b->set_pages(TS, { page_b });
+    });
+
+    EXPECT_EQ(index.find(0x11), entry_b.get());
+    EXPECT_EQ(index.find(0x11, arc_a.get()), entry_a.get());
+    EXPECT_EQ(index.find(0x11, arc_b.get()), entry_b.get());
+    EXPECT_EQ(index.find(0x21, arc_a.get()), nullptr);
+
+    eid_index::location loc;
+    ASSERT_TRUE(index.find_location(entry_a, loc));
+    EXPECT_EQ(loc.arc, arc_a.get());
+}
+
+}
+#endif
+
+}
+}
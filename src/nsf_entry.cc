@@ -25,38 +25,134 @@ namespace drnsf {
 namespace nsf {
 
 // declared in nsf.hh
-util::blob entry::export_file() const
+pagelet_info entry::get_entry_info(const std::vector<util::blob> &items)
 {
-    assert_alive();
-
-    util::binwriter w;
-    w.begin();
+    pagelet_info info;
+    info.is_entry = true;
+    info.first_item_offset = 20 + items.size() * 4;
+    info.size = info.first_item_offset;
+    for (auto &&item : items) {
+        info.size += item.size();
+    }
+    return info;
+}
 
-    uint32_t type;
-    auto items = export_entry(type);
+// declared in nsf.hh
+pagelet_info entry::get_entry_info(const size_t *item_sizes, size_t item_count)
+{
+    pagelet_info info;
+    info.is_entry = true;
+    info.first_item_offset = 20 + item_count * 4;
+    info.size = info.first_item_offset;
+    for (size_t i = 0; i < item_count; i++) {
+        info.size += item_sizes[i];
+    }
+    return info;
+}
 
+// declared in nsf.hh
+void entry::write_entry(
+    util::sink &out,
+    uint32_t eid,
+    uint32_t type,
+    const std::vector<util::blob> &items)
+{
     // Write the entry header.
-    w.write_u32(0x100FFFF);
-    w.write_u32(get_eid());
-    w.write_u32(type);
-    w.write_u32(items.size());
+    out.write_u32(0x100FFFF);
+    out.write_u32(eid);
+    out.write_u32(type);
+    out.write_u32(items.size());
 
     // Calculate and write the item offsets.
     uint32_t item_offset = 20 + items.size() * 4;
     for (auto &&item : items) {
-        w.write_u32(item_offset);
+        out.write_u32(item_offset);
         item_offset += item.size();
     }
-    w.write_u32(item_offset);
-
-    auto data = w.end();
+    out.write_u32(item_offset);
 
     // Write the items themselves.
     for (auto &&item : items) {
-        data.insert(data.end(), item.begin(), item.end());
+        out.write(item.data(), item.size());
+    }
+}
+
+// declared in nsf.hh
+void entry::write_entry_header(
+    util::sink &out,
+    uint32_t eid,
+    uint32_t type,
+    const size_t *item_sizes,
+    size_t item_count)
+{
+    out.write_u32(0x100FFFF);
+    out.write_u32(eid);
+    out.write_u32(type);
+    out.write_u32(item_count);
+
+    uint32_t item_offset = 20 + item_count * 4;
+    for (size_t i = 0; i < item_count; i++) {
+        out.write_u32(item_offset);
+        item_offset += item_sizes[i];
+    }
+    out.write_u32(item_offset);
+}
+
+// declared in nsf.hh
+util::shared_blob entry::export_file() const
+{
+    assert_alive();
+
+    util::shared_blob result;
+    if (m_export_cache.lookup(result))
+        return result;
+
+    res::dep_recorder recorder;
+
+    // Write the entry directly into a buffer of the right size if possible.
+    // Otherwise, export the items first and then write them out.
+    pagelet_info info;
+    if (get_export_info(info)) {
+        util::blob data(info.size);
+        util::buffer_sink out(data.data(), data.size());
+        export_entry_into(out);
+        result = std::move(data);
+    } else {
+        uint32_t type;
+        auto items = export_entry(type);
+
+        util::blob data;
+        data.reserve(get_entry_info(items).size);
+        util::blob_sink out(data);
+        write_entry(out, get_eid(), type, items);
+        result = std::move(data);
     }
 
-    return data;
+    m_export_cache.store(result, recorder.get_deps());
+    return result;
+}
+
+// declared in nsf.hh
+bool entry::get_export_info(pagelet_info &out) const
+{
+    assert_alive();
+
+    return false;
+}
+
+// declared in nsf.hh
+void entry::export_entry_into(util::sink &out) const
+{
+    auto data = export_file();
+    out.write(data.data(), data.size());
+}
+
+// declared in nsf.hh
+std::vector<eid> entry::get_refs() const
+{
+    assert_alive();
+
+    return {};
 }
 
 }
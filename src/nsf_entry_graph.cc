@@ -0,0 +1,203 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include "nsf.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+entry_graph entry_graph::build(const archive &arc)
+{
+    entry_graph graph;
+    std::vector<std::vector<eid>> ref_eids;
+
+    // Gather the nodes and the EIDs they refer to.
+    auto &&pages = arc.get_pages();
+    for (auto &&page : util::range_of(pages)) {
+        spage::ref spage = pages[page];
+        tpage::ref tpage = pages[page];
+        if (spage.ok()) {
+            for (auto &&pagelet : spage->get_pagelets()) {
+                entry::ref entry = pagelet;
+                if (!entry.ok())
+                    continue;
+                graph.nodes.push_back({ entry, entry->get_eid(), page, {} });
+                ref_eids.push_back(entry->get_refs());
+            }
+        } else if (tpage.ok()) {
+            graph.nodes.push_back({ tpage, tpage->get_eid(), page, {} });
+            ref_eids.emplace_back();
+        }
+    }
+
+    // Resolve the references to nodes. If several nodes have the same EID,
+    // references go to the first of them.
+    std::unordered_map<uint32_t, size_t> by_eid;
+    for (auto &&i : util::range_of(graph.nodes)) {
+        by_eid.emplace(graph.nodes[i].id, i);
+    }
+    for (auto &&i : util::range_of(graph.nodes)) {
+        auto &&refs = graph.nodes[i].refs;
+        for (auto &&ref_eid : ref_eids[i]) {
+            auto it = by_eid.find(ref_eid);
+            if (it == by_eid.end())
+                continue;
+            if (std::find(refs.begin(), refs.end(), it->second) == refs.end()) {
+                refs.push_back(it->second);
+            }
+        }
+    }
+
+    return graph;
+}
+
+// declared in nsf.hh
+std::vector<chunk_fetches> measure_fetches(const entry_graph &graph)
+{
+    // Group the chunks by the set of nodes they refer to.
+    std::map<std::vector<size_t>, std::vector<size_t>> groups;
+    std::vector<std::vector<size_t>> ref_sets(graph.nodes.size());
+    for (auto &&i : util::range_of(graph.nodes)) {
+        auto &&set = ref_sets[i];
+        set = graph.nodes[i].refs;
+        if (set.empty())
+            continue;
+        std::sort(set.begin(), set.end());
+        groups[set].push_back(i);
+    }
+
+    std::vector<chunk_fetches> result;
+    for (auto &&i : util::range_of(graph.nodes)) {
+        auto &&set = ref_sets[i];
+        if (set.empty())
+            continue;
+
+        // Gather the pages of every chunk in this chunk's group, and of the
+        // nodes they refer to.
+        std::vector<size_t> pages;
+        for (auto &&chunk : groups[set]) {
+            pages.push_back(graph.nodes[chunk].page);
+        }
+        for (auto &&ref : set) {
+            pages.push_back(graph.nodes[ref].page);
+        }
+
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+        size_t runs = 0;
+        for (auto &&k : util::range_of(pages)) {
+            if (k == 0 || pages[k] != pages[k - 1] + 1) {
+                runs++;
+            }
+        }
+
+        result.push_back({ graph.nodes[i].id, pages.size(), runs });
+    }
+    return result;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (test) LocalityPackingGroupsChunks
+// Ensures that packing with `archive::packing::locality' places scenery
+// entries which share a texture page in the same page, reducing the page
+// fetches measured for each chunk. The entries are left unprocessed, so their
+// references come from `raw_entry::get_refs'.
+TEST(nsf_entry_graph, LocalityPackingGroupsChunks)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+
+    archive::ref arc = root / "archive";
+    std::vector<res::anyref> pages;
+    std::vector<res::anyref> spage_pagelets[2];
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+
+        // Two texture pages, and four 30000-byte scenery entries. Entries 0
+        // and 2 use the first texture page and entries 1 and 3 use the
+        // second, but each standard page starts with one of each.
+        for (uint32_t t = 0; t < 2; t++) {
+            tpage::ref tp = root / "tpage$"_fmt(t);
+            tp.create(TS, proj);
+            tp->set_eid(TS, 0x101 + t * 2);
+            pages.push_back(tp);
+        }
+        for (uint32_t i = 0; i < 4; i++) {
+            util::blob info(30000);
+            info[40] = 1;
+            info[44] = 0x01 + (i % 2) * 2;
+            info[45] = 0x01;
+
+            raw_entry::ref e = root / "entry$"_fmt(i);
+            e.create(TS, proj);
+            e->ver = game_ver::crash2;
+            e->set_eid(TS, 0x201 + i * 2);
+            e->set_type(TS, 3);
+            e->set_items(TS, { info });
+            spage_pagelets[i / 2].push_back(e);
+        }
+        for (uint32_t p = 0; p < 2; p++) {
+            spage::ref sp = root / "spage$"_fmt(p);
+            sp.create(TS, proj);
+            sp->set_type(TS, 0);
+            sp->set_pagelets(TS, spage_pagelets[p]);
+            pages.push_back(sp);
+        }
+        arc->set_pages(TS, pages);
+    });
+
+    // Each chunk needs its texture page and both standard pages.
+    auto before = measure_fetches(entry_graph::build(*arc));
+    ASSERT_EQ(before.size(), 4u);
+    for (auto &&fetches : before) {
+        EXPECT_EQ(fetches.pages, 3u);
+    }
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc->pack_pages(TS, archive::packing::locality);
+    });
+
+    // Each chunk now needs its texture page and one standard page.
+    auto after = measure_fetches(entry_graph::build(*arc));
+    ASSERT_EQ(after.size(), 4u);
+    for (auto &&fetches : after) {
+        EXPECT_EQ(fetches.pages, 2u);
+    }
+    EXPECT_EQ(arc->get_pages().size(), 4u);
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,160 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include "nsf.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#include <iostream>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+uint32_t page_checksum(const unsigned char *data, size_t size)
+{
+    // Every byte is added to the checksum, which is then rotated left by three
+    // bits. Each step depends on the result of the one before it, so this
+    // cannot be split across SIMD lanes or independent accumulators. Instead,
+    // the branch for the skipped checksum bytes is taken out of the main loop
+    // and the main loop is unrolled, leaving only the add and rotate.
+    uint32_t c = 0x12345678;
+
+    const auto step = [&c](uint32_t value) {
+        c += value;
+        c = (c << 3) | (c >> 29);
+    };
+
+    size_t i = 0;
+
+    // Bytes 0-11 are the start of the page header.
+    for (; i < size && i < 12; i++) {
+        step(data[i]);
+    }
+
+    // Bytes 12-15 are the checksum itself. These are not added, but the
+    // checksum is still rotated for each of them.
+    for (; i < size && i < 16; i++) {
+        step(0);
+    }
+
+    for (; size - i >= 8; i += 8) {
+        step(data[i + 0]);
+        step(data[i + 1]);
+        step(data[i + 2]);
+        step(data[i + 3]);
+        step(data[i + 4]);
+        step(data[i + 5]);
+        step(data[i + 6]);
+        step(data[i + 7]);
+    }
+
+    for (; i < size; i++) {
+        step(data[i]);
+    }
+
+    return c;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) reference_checksum
+// A direct implementation of the page checksum, one byte at a time.
+uint32_t reference_checksum(const unsigned char *data, size_t size)
+{
+    uint32_t c = 0x12345678;
+    for (size_t i = 0; i < size; i++) {
+        if (i < 12 || i >= 16) {
+            c += data[i];
+        }
+        c = (c << 3) | (c >> 29);
+    }
+    return c;
+}
+
+// (test) MatchesReference
+// Ensures the unrolled checksum matches the reference version, including for
+// short data and sizes which are not a multiple of the unrolling.
+TEST(nsf_page_checksum, MatchesReference)
+{
+    util::blob page(page_size);
+    uint32_t x = 1;
+    for (auto &&b : page) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+
+    for (size_t size : { 0, 1, 12, 13, 16, 17, 100, 65535, 65536 }) {
+        EXPECT_EQ(
+            page_checksum(page.data(), size),
+            reference_checksum(page.data(), size)
+        ) << "size " << size;
+    }
+
+    // Changing the checksum bytes must not change the checksum.
+    auto before = page_checksum(page.data());
+    page[12] ^= 0xFF;
+    page[15] ^= 0x01;
+    EXPECT_EQ(page_checksum(page.data()), before);
+
+    // Changing any other byte must.
+    page[page_size - 1] ^= 0x01;
+    EXPECT_NE(page_checksum(page.data()), before);
+}
+
+// (test) DISABLED_Benchmark
+// Measures the throughput of `page_checksum' on a single thread. To run this,
+// use:
+//
+//   drnsf :internal-test --gtest_also_run_disabled_tests
+//     --gtest_filter=*Benchmark*
+TEST(nsf_page_checksum, DISABLED_Benchmark)
+{
+    util::blob page(page_size, 0x5A);
+
+    const int rounds = 4096;
+    uint32_t result = 0;
+
+    util::stopwatch sw;
+    for (int i = 0; i < rounds; i++) {
+        page[20] = i;
+        result ^= page_checksum(page.data());
+    }
+    long time = sw.lap();
+
+    double megabytes = double(rounds) * page_size / 1048576;
+    std::cout
+        << "page_checksum: "
+        << megabytes * 1000 / std::max(time, 1L)
+        << " MB/s (result "
+        << result
+        << ")"
+        << std::endl;
+}
+
+}
+#endif
+
+}
+}
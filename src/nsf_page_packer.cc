@@ -0,0 +1,921 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include "nsf.hh"
+#include "misc.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// (s-func) fits_with
+// Returns true if the pagelets in `page' fit in a page of the given alignment
+// with pagelet `add' added and pagelet `remove' removed. Either may be SIZE_MAX
+// to add or remove nothing. The pagelets in `page' must be in increasing order
+// of index.
+static bool fits_with(
+    const std::vector<pagelet_info> &pagelets,
+    const std::vector<size_t> &page,
+    int alignment,
+    size_t add,
+    size_t remove = SIZE_MAX)
+{
+    std::vector<pagelet_info> infos;
+    infos.reserve(page.size() + 1);
+    for (auto &&i : page) {
+        if (add < i) {
+            infos.push_back(pagelets[add]);
+            add = SIZE_MAX;
+        }
+        if (i != remove) {
+            infos.push_back(pagelets[i]);
+        }
+    }
+    if (add != SIZE_MAX) {
+        infos.push_back(pagelets[add]);
+    }
+    return layout_page(infos, alignment) <= page_size;
+}
+
+// (s-func) used_size
+// Returns the laid out size of the pagelets in `page'.
+static size_t used_size(
+    const std::vector<pagelet_info> &pagelets,
+    const std::vector<size_t> &page,
+    int alignment)
+{
+    std::vector<pagelet_info> infos;
+    infos.reserve(page.size());
+    for (auto &&i : page) {
+        infos.push_back(pagelets[i]);
+    }
+    return layout_page(infos, alignment);
+}
+
+// (s-func) insert_sorted
+// Inserts the pagelet index `i' into `page', keeping it in increasing order.
+static void insert_sorted(std::vector<size_t> &page, size_t i)
+{
+    page.insert(std::lower_bound(page.begin(), page.end(), i), i);
+}
+
+// (s-func) empty_page
+// Attempts to move every pagelet in `pages[victim]' into the other pages,
+// either directly or by swapping it with a smaller pagelet which then needs
+// to be placed instead. On success, the page is removed from `pages' and the
+// function returns true. Otherwise, `pages' is left unchanged.
+static bool empty_page(
+    const std::vector<pagelet_info> &pagelets,
+    std::vector<std::vector<size_t>> &pages,
+    size_t victim,
+    int alignment)
+{
+    auto work = pages;
+    std::vector<size_t> pending = std::move(work[victim]);
+    work.erase(work.begin() + victim);
+
+    const auto by_size_desc = [&](size_t a, size_t b) {
+        return pagelets[a].size > pagelets[b].size;
+    };
+
+    // Each swap replaces a pending pagelet with a smaller one, so the process
+    // always ends, but it is limited anyway to keep the worst case cheap.
+    size_t swaps_left = 16 * pagelets.size();
+
+    std::sort(pending.begin(), pending.end(), by_size_desc);
+    while (!pending.empty()) {
+        size_t x = pending.front();
+        pending.erase(pending.begin());
+
+        // Move the pagelet into the page it fills the most (best fit).
+        size_t best = SIZE_MAX;
+        size_t best_size = 0;
+        for (auto &&p : util::range_of(work)) {
+            if (!fits_with(pagelets, work[p], alignment, x))
+                continue;
+            auto size = used_size(pagelets, work[p], alignment);
+            if (best == SIZE_MAX || size > best_size) {
+                best = p;
+                best_size = size;
+            }
+        }
+        if (best != SIZE_MAX) {
+            insert_sorted(work[best], x);
+            continue;
+        }
+
+        // Otherwise, swap it for the largest smaller pagelet it can replace.
+        if (swaps_left == 0)
+            return false;
+        swaps_left--;
+
+        size_t swap_page = SIZE_MAX;
+        size_t swap_item = SIZE_MAX;
+        for (auto &&p : util::range_of(work)) {
+            for (auto &&y : work[p]) {
+                if (pagelets[y].size >= pagelets[x].size)
+                    continue;
+                if (swap_item != SIZE_MAX &&
+                    pagelets[y].size <= pagelets[swap_item].size)
+                    continue;
+                if (!fits_with(pagelets, work[p], alignment, x, y))
+                    continue;
+                swap_page = p;
+                swap_item = y;
+            }
+        }
+        if (swap_item == SIZE_MAX)
+            return false;
+
+        auto &&page = work[swap_page];
+        page.erase(std::find(page.begin(), page.end(), swap_item));
+        insert_sorted(page, x);
+        pending.insert(
+            std::upper_bound(
+                pending.begin(),
+                pending.end(),
+                swap_item,
+                by_size_desc
+            ),
+            swap_item
+        );
+    }
+
+    pages = std::move(work);
+    return true;
+}
+
+// (s-func) get_ref_info
+// Returns the `pagelet_info' of the given pagelet of a standard page, exporting
+// it first if it is an entry.
+static pagelet_info get_ref_info(const res::anyref &ref)
+{
+    if (!ref)
+        throw res::export_error("nsf::spage: null pagelet ref");
+
+    misc::raw_data::ref raw_ref = ref;
+    entry::ref entry_ref = ref;
+    if (raw_ref.ok()) {
+        return get_pagelet_info(raw_ref->get_data());
+    } else if (entry_ref.ok()) {
+        return get_pagelet_info(entry_ref->export_file());
+    } else {
+        throw res::export_error("nsf::spage: pagelet has incompatible type");
+    }
+}
+
+// (s-func) get_max_cid
+// Returns the largest chunk ID of the standard pages among the given pages, or
+// zero if there are none. New pages are numbered on from this.
+static uint32_t get_max_cid(const std::vector<res::anyref> &pages)
+{
+    uint32_t max_cid = 0;
+    for (auto &&page : pages) {
+        spage::ref spage = page;
+        if (spage.ok()) {
+            max_cid = std::max(max_cid, spage->get_cid());
+        }
+    }
+    return max_cid;
+}
+
+// declared in nsf.hh
+std::vector<std::vector<size_t>> pack_pagelets(
+    const std::vector<pagelet_info> &pagelets,
+    int alignment,
+    int effort)
+{
+    std::vector<std::vector<size_t>> pages;
+
+    // First-fit-decreasing: place each pagelet, largest first, into the first
+    // page it fits in, adding a new page if it fits in none of them.
+    std::vector<size_t> order(pagelets.size());
+    for (auto &&i : util::range_of(order)) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return pagelets[a].size > pagelets[b].size;
+    });
+
+    for (auto &&i : order) {
+        bool placed = false;
+        for (auto &&page : pages) {
+            if (fits_with(pagelets, page, alignment, i)) {
+                insert_sorted(page, i);
+                placed = true;
+                break;
+            }
+        }
+        if (placed)
+            continue;
+
+        if (layout_page({ pagelets[i] }, alignment) > page_size)
+            throw res::export_error("nsf::pack_pagelets: pagelet too large");
+
+        pages.push_back({ i });
+    }
+
+    // Local search: try to empty the least-filled pages into the others. On
+    // each round, up to `effort' pages are tried, least-filled first, and the
+    // search ends after a round in which no page could be emptied.
+    bool improved = true;
+    while (improved && effort > 0 && pages.size() > 1) {
+        improved = false;
+
+        std::vector<std::pair<size_t, size_t>> fill;
+        for (auto &&p : util::range_of(pages)) {
+            fill.emplace_back(used_size(pagelets, pages[p], alignment), p);
+        }
+        std::sort(fill.begin(), fill.end());
+
+        int tries = std::min<int>(effort, fill.size());
+        for (int t = 0; t < tries; t++) {
+            if (empty_page(pagelets, pages, fill[t].second, alignment)) {
+                improved = true;
+                break;
+            }
+        }
+    }
+
+    std::sort(pages.begin(), pages.end());
+    return pages;
+}
+
+// declared in nsf.hh
+std::vector<std::vector<size_t>> cluster_pagelets(
+    const std::vector<pagelet_info> &pagelets,
+    const std::vector<std::vector<uint32_t>> &keys,
+    int alignment)
+{
+    for (auto &&info : pagelets) {
+        if (layout_page({ info }, alignment) > page_size)
+            throw res::export_error("nsf::cluster_pagelets: pagelet too large");
+    }
+
+    // Remove any repeated keys, then find the pagelets which use each key.
+    auto key_sets = keys;
+    std::unordered_map<uint32_t, std::vector<size_t>> users;
+    for (auto &&i : util::range_of(pagelets)) {
+        auto &&set = key_sets[i];
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        for (auto &&key : set) {
+            users[key].push_back(i);
+        }
+    }
+
+    // Order the pagelets which share keys by walking from each one in turn.
+    // Each step goes to the unvisited pagelet with the most keys in common
+    // with the current one, preferring the one with the fewest keys (the
+    // closest match) and then the lowest index. The walk ends when no
+    // unvisited pagelet shares a key with the current one.
+    std::vector<size_t> order;
+    std::vector<bool> visited(pagelets.size());
+    std::unordered_map<size_t, size_t> shared;
+
+    const auto is_better = [&](size_t a, size_t b) {
+        if (shared[a] != shared[b])
+            return shared[a] > shared[b];
+        if (key_sets[a].size() != key_sets[b].size())
+            return key_sets[a].size() < key_sets[b].size();
+        return a < b;
+    };
+
+    for (auto &&i : util::range_of(pagelets)) {
+        if (visited[i])
+            continue;
+
+        bool has_shared_key = false;
+        for (auto &&key : key_sets[i]) {
+            if (users[key].size() > 1) {
+                has_shared_key = true;
+                break;
+            }
+        }
+        if (!has_shared_key)
+            continue;
+
+        size_t current = i;
+        while (current != SIZE_MAX) {
+            visited[current] = true;
+            order.push_back(current);
+
+            shared.clear();
+            for (auto &&key : key_sets[current]) {
+                for (auto &&j : users[key]) {
+                    if (!visited[j]) {
+                        shared[j]++;
+                    }
+                }
+            }
+
+            size_t next = SIZE_MAX;
+            for (auto &&[j, count] : shared) {
+                if (next == SIZE_MAX || is_better(j, next)) {
+                    next = j;
+                }
+            }
+            current = next;
+        }
+    }
+
+    // Place the ordered pagelets into the last page or the one before it.
+    std::vector<std::vector<size_t>> pages;
+    for (auto &&i : order) {
+        size_t n = pages.size();
+        if (n >= 1 && fits_with(pagelets, pages[n - 1], alignment, i)) {
+            insert_sorted(pages[n - 1], i);
+        } else if (n >= 2 && fits_with(pagelets, pages[n - 2], alignment, i)) {
+            insert_sorted(pages[n - 2], i);
+        } else {
+            pages.push_back({ i });
+        }
+    }
+
+    // Fill the remaining space with the other pagelets, largest first, each in
+    // the page it fills the most (best fit).
+    std::vector<size_t> rest;
+    for (auto &&i : util::range_of(pagelets)) {
+        if (!visited[i]) {
+            rest.push_back(i);
+        }
+    }
+    std::stable_sort(rest.begin(), rest.end(), [&](size_t a, size_t b) {
+        return pagelets[a].size > pagelets[b].size;
+    });
+
+    for (auto &&i : rest) {
+        size_t best = SIZE_MAX;
+        size_t best_size = 0;
+        for (auto &&p : util::range_of(pages)) {
+            if (!fits_with(pagelets, pages[p], alignment, i))
+                continue;
+            auto size = used_size(pagelets, pages[p], alignment);
+            if (best == SIZE_MAX || size > best_size) {
+                best = p;
+                best_size = size;
+            }
+        }
+        if (best != SIZE_MAX) {
+            insert_sorted(pages[best], i);
+        } else {
+            pages.push_back({ i });
+        }
+    }
+
+    return pages;
+}
+
+// declared in nsf.hh
+void archive::pack_pages(TRANSACT, packing mode, int effort)
+{
+    assert_alive();
+
+    auto pages = get_pages();
+    auto compressed_pages = get_compressed_pages();
+
+    // (inner struct) page_group
+    // The standard pages of one page type, by index into `pages'.
+    struct page_group {
+        std::vector<size_t> pages;
+        std::vector<res::anyref> new_pages;
+    };
+
+    std::map<uint16_t, page_group> groups;
+    for (auto &&i : util::range_of(pages)) {
+        spage::ref spage = pages[i];
+        if (!spage.ok())
+            continue;
+        groups[spage->get_type()].pages.push_back(i);
+    }
+
+    std::vector<bool> remove(pages.size());
+    size_t next_name = pages.size() + 1;
+    uint32_t max_cid = get_max_cid(pages);
+
+    for (auto &&[type, group] : groups) {
+        // Gather the pagelets from every page of this type, in page order.
+        std::vector<res::anyref> pagelets;
+        std::vector<pagelet_info> infos;
+        std::vector<std::vector<uint32_t>> keys;
+        for (auto &&i : group.pages) {
+            spage::ref spage = pages[i];
+            for (auto &&ref : spage->get_pagelets()) {
+                pagelets.push_back(ref);
+                infos.push_back(get_ref_info(ref));
+
+                entry::ref entry_ref = ref;
+                keys.emplace_back();
+                if (mode == packing::locality && entry_ref.ok()) {
+                    keys.back().push_back(entry_ref->get_eid());
+                    for (auto &&ref_eid : entry_ref->get_refs()) {
+                        keys.back().push_back(ref_eid);
+                    }
+                }
+            }
+        }
+
+        if (pagelets.empty())
+            continue;
+
+        auto alignment = get_page_alignment(type);
+        std::vector<std::vector<size_t>> packed;
+        switch (mode) {
+        case packing::compact:
+            packed = pack_pagelets(infos, alignment, effort);
+            break;
+        case packing::locality:
+            packed = cluster_pagelets(infos, keys, alignment);
+            break;
+        }
+
+        for (auto &&k : util::range_of(packed)) {
+            std::vector<res::anyref> page_pagelets;
+            for (auto &&i : packed[k]) {
+                page_pagelets.push_back(pagelets[i]);
+            }
+
+            spage::ref spage;
+            if (k < group.pages.size()) {
+                spage = pages[group.pages[k]];
+            } else {
+                // Create a new page. Its chunk ID follows on from the largest
+                // existing one.
+                do {
+                    spage = get_name() / "page-$"_fmt(next_name++);
+                } while (spage.get());
+                spage.create(TS, get_proj());
+                spage->set_type(TS, type);
+                max_cid += 2;
+                spage->set_cid(TS, max_cid);
+                group.new_pages.push_back(spage);
+            }
+
+            if (spage->get_pagelets() != page_pagelets) {
+                spage->set_pagelets(TS, std::move(page_pagelets));
+            }
+        }
+
+        for (size_t k = packed.size(); k < group.pages.size(); k++) {
+            remove[group.pages[k]] = true;
+        }
+    }
+
+    // Rebuild the page list, placing any new pages after the last page of the
+    // same type.
+    std::vector<res::anyref> new_pages;
+    std::vector<res::anyref> removed_pages;
+    for (auto &&i : util::range_of(pages)) {
+        if (remove[i]) {
+            removed_pages.push_back(pages[i]);
+        } else {
+            new_pages.push_back(pages[i]);
+        }
+
+        spage::ref spage = pages[i];
+        if (!spage.ok())
+            continue;
+        auto &&group = groups[spage->get_type()];
+        if (group.pages.back() == i) {
+            new_pages.insert(
+                new_pages.end(),
+                group.new_pages.begin(),
+                group.new_pages.end()
+            );
+        }
+    }
+
+    if (removed_pages.empty() && new_pages.size() == pages.size())
+        return;
+
+    for (auto &&page : removed_pages) {
+        compressed_pages.erase(
+            std::remove(
+                compressed_pages.begin(),
+                compressed_pages.end(),
+                page
+            ),
+            compressed_pages.end()
+        );
+    }
+
+    set_pages(TS, std::move(new_pages));
+    set_compressed_pages(TS, std::move(compressed_pages));
+
+    for (auto &&page : removed_pages) {
+        page->destroy(TS);
+    }
+}
+
+// declared in nsf.hh
+bool archive::fit_pages(TRANSACT)
+{
+    assert_alive();
+
+    auto pages = get_pages();
+
+    // (inner struct) page_state
+    // The pagelets of one standard page as they are being moved around.
+    struct page_state {
+        spage::ref page;
+        std::vector<res::anyref> pagelets;
+        std::vector<pagelet_info> infos;
+        bool changed;
+    };
+
+    // (inner struct) page_group
+    // The standard pages of one page type, in page order, and the index into
+    // `pages' of the last of them.
+    struct page_group {
+        std::vector<page_state> pages;
+        size_t last;
+        std::vector<res::anyref> new_pages;
+    };
+
+    std::map<uint16_t, page_group> groups;
+    for (auto &&i : util::range_of(pages)) {
+        spage::ref spage = pages[i];
+        if (!spage.ok())
+            continue;
+
+        page_state st;
+        st.page = spage;
+        st.pagelets = spage->get_pagelets();
+        for (auto &&ref : st.pagelets) {
+            st.infos.push_back(get_ref_info(ref));
+        }
+        st.changed = false;
+
+        auto &&group = groups[spage->get_type()];
+        group.pages.push_back(std::move(st));
+        group.last = i;
+    }
+
+    bool changed = false;
+    size_t next_name = pages.size() + 1;
+    uint32_t max_cid = get_max_cid(pages);
+
+    for (auto &&[type, group] : groups) {
+        auto alignment = get_page_alignment(type);
+
+        // Take the largest pagelets out of each page which does not fit.
+        std::vector<std::pair<res::anyref, pagelet_info>> moved;
+        for (auto &&st : group.pages) {
+            while (layout_page(st.infos, alignment) > page_size) {
+                auto largest = std::max_element(
+                    st.infos.begin(),
+                    st.infos.end(),
+                    [](const pagelet_info &a, const pagelet_info &b) {
+                        return a.size < b.size;
+                    }
+                ) - st.infos.begin();
+                moved.emplace_back(st.pagelets[largest], st.infos[largest]);
+                st.pagelets.erase(st.pagelets.begin() + largest);
+                st.infos.erase(st.infos.begin() + largest);
+                st.changed = true;
+            }
+        }
+
+        if (moved.empty())
+            continue;
+        changed = true;
+
+        // Place the pagelets which were taken out, largest first, at the end
+        // of the first page they fit in.
+        std::stable_sort(moved.begin(), moved.end(), [](auto &&a, auto &&b) {
+            return a.second.size > b.second.size;
+        });
+        for (auto &&[ref, info] : moved) {
+            if (layout_page({ info }, alignment) > page_size) {
+                throw res::export_error(
+                    "nsf::archive: pagelet too large to fit in any page"
+                );
+            }
+
+            size_t dest = SIZE_MAX;
+            for (auto &&k : util::range_of(group.pages)) {
+                auto &&infos = group.pages[k].infos;
+                infos.push_back(info);
+                bool fits = layout_page(infos, alignment) <= page_size;
+                infos.pop_back();
+                if (fits) {
+                    dest = k;
+                    break;
+                }
+            }
+
+            if (dest == SIZE_MAX) {
+                // Create a new page. Its chunk ID follows on from the largest
+                // existing one.
+                spage::ref spage;
+                do {
+                    spage = get_name() / "page-$"_fmt(next_name++);
+                } while (spage.get());
+                spage.create(TS, get_proj());
+                spage->set_type(TS, type);
+                max_cid += 2;
+                spage->set_cid(TS, max_cid);
+                group.new_pages.push_back(spage);
+
+                dest = group.pages.size();
+                group.pages.push_back({ spage, {}, {}, false });
+            }
+
+            auto &&st = group.pages[dest];
+            st.pagelets.push_back(ref);
+            st.infos.push_back(info);
+            st.changed = true;
+        }
+
+        for (auto &&st : group.pages) {
+            if (st.changed) {
+                st.page->set_pagelets(TS, std::move(st.pagelets));
+            }
+        }
+    }
+
+    if (!changed)
+        return false;
+
+    // Place any new pages after the last page of the same type.
+    std::vector<res::anyref> new_pages;
+    for (auto &&i : util::range_of(pages)) {
+        new_pages.push_back(pages[i]);
+
+        spage::ref spage = pages[i];
+        if (!spage.ok())
+            continue;
+        auto &&group = groups[spage->get_type()];
+        if (group.last == i) {
+            new_pages.insert(
+                new_pages.end(),
+                group.new_pages.begin(),
+                group.new_pages.end()
+            );
+        }
+    }
+
+    if (new_pages.size() != pages.size()) {
+        set_pages(TS, std::move(new_pages));
+    }
+    return true;
+}
+
+// declared in nsf.hh
+void archive::renumber_pages(TRANSACT)
+{
+    assert_alive();
+
+    auto &&pages = get_pages();
+    for (auto &&i : util::range_of(pages)) {
+        spage::ref spage = pages[i];
+        if (!spage.ok())
+            continue;
+
+        uint32_t cid = i * 2 + 1;
+        if (spage->get_cid() != cid) {
+            spage->set_cid(TS, cid);
+        }
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) make_entry_info
+// Returns the info for an entry of the given size with `item_count' items.
+pagelet_info make_entry_info(size_t size, uint32_t item_count = 1)
+{
+    return { size, true, 20 + (item_count + 1) * 4 };
+}
+
+// (test) PackerMinimisesPages
+// Ensures the packer places pagelets into fewer pages than their original
+// order would need, that every page fits, and that every pagelet is placed
+// exactly once.
+TEST(nsf_page_packer, PackerMinimisesPages)
+{
+    // Each page can hold one 40000-byte and one 25000-byte pagelet. Filling
+    // pages with the pagelets in this order would take nine pages.
+    std::vector<pagelet_info> pagelets;
+    for (int i = 0; i < 6; i++) {
+        pagelets.push_back(make_entry_info(40000));
+    }
+    for (int i = 0; i < 6; i++) {
+        pagelets.push_back(make_entry_info(25000));
+    }
+
+    for (int alignment : { 4, 16 }) {
+        auto pages = pack_pagelets(pagelets, alignment);
+        EXPECT_EQ(pages.size(), 6u);
+
+        std::vector<int> seen(pagelets.size());
+        for (auto &&page : pages) {
+            std::vector<pagelet_info> infos;
+            for (auto &&i : page) {
+                seen[i]++;
+                infos.push_back(pagelets[i]);
+            }
+            EXPECT_TRUE(std::is_sorted(page.begin(), page.end()));
+            EXPECT_LE(layout_page(infos, alignment), page_size);
+        }
+        for (auto &&count : seen) {
+            EXPECT_EQ(count, 1);
+        }
+    }
+
+    // A pagelet which can't fit in any page is an error.
+    EXPECT_THROW(
+        pack_pagelets({ make_entry_info(page_size) }, 4),
+        res::export_error
+    );
+}
+
+// (test) LocalSearchEmptiesPages
+// Ensures the local search pass saves pages which first-fit-decreasing alone
+// does not. Here, first-fit-decreasing puts the two largest pagelets together
+// and needs a third page for the smallest one, but the pagelets fit in two
+// pages.
+TEST(nsf_page_packer, LocalSearchEmptiesPages)
+{
+    std::vector<pagelet_info> pagelets;
+    for (size_t size : { 21884, 16836, 15296, 19816, 20080, 29904 }) {
+        pagelets.push_back({ size, false, 0 });
+    }
+
+    EXPECT_EQ(pack_pagelets(pagelets, 4, 0).size(), 3u);
+    EXPECT_EQ(pack_pagelets(pagelets, 4).size(), 2u);
+}
+
+// (s-func) make_sized_archive
+// Creates an archive in the given project with one standard page for each list
+// of item sizes, holding one single-item entry of each size. The entries are
+// numbered in order from EID 1.
+archive::ref make_sized_archive(
+    res::project &proj,
+    const std::vector<std::vector<size_t>> &page_sizes)
+{
+    std::vector<std::vector<test_entry>> page_entries(page_sizes.size());
+    uint32_t next_eid = 1;
+    for (auto &&p : util::range_of(page_sizes)) {
+        for (auto &&size : page_sizes[p]) {
+            util::blob item(size);
+            for (auto &&k : util::range_of(item)) {
+                item[k] = k * next_eid;
+            }
+            page_entries[p].push_back({ next_eid, std::move(item) });
+            next_eid += 2;
+        }
+    }
+    return make_test_archive(proj, page_entries);
+}
+
+// (s-func) expect_round_trip
+// Exports the given archive, imports the result into a new project and checks
+// that it has the same pages, chunk IDs and entries.
+void expect_round_trip(const archive::ref &arc)
+{
+    auto data = arc->export_file(archive::compression::none, 1, 1);
+
+    res::project proj;
+    archive::ref copy = proj.get_asset_root() / "archive";
+    proj.get_transact().run([&](TRANSACT) {
+        copy.create(TS, proj);
+        copy->import_and_process(
+            TS,
+            data,
+            game_ver::crash2,
+            archive::processing::lazy
+        );
+    });
+
+    auto &&pages = arc->get_pages();
+    auto &&copy_pages = copy->get_pages();
+    ASSERT_EQ(copy_pages.size(), pages.size());
+    for (auto &&i : util::range_of(pages)) {
+        spage::ref page = pages[i];
+        spage::ref copy_page = copy_pages[i];
+        ASSERT_TRUE(copy_page.ok());
+        EXPECT_EQ(copy_page->get_cid(), page->get_cid());
+
+        auto &&pagelets = page->get_pagelets();
+        auto &&copy_pagelets = copy_page->get_pagelets();
+        ASSERT_EQ(copy_pagelets.size(), pagelets.size());
+        for (auto &&j : util::range_of(pagelets)) {
+            raw_entry::ref entry = pagelets[j];
+            raw_entry::ref copy_entry = copy_pagelets[j];
+            ASSERT_TRUE(copy_entry.ok());
+            EXPECT_EQ(copy_entry->get_eid(), entry->get_eid());
+            EXPECT_TRUE(copy_entry->get_items() == entry->get_items());
+        }
+    }
+}
+
+// (test) FitPagesMovesOverflow
+// Ensures an archive with pages which have grown past 64K fails to export,
+// then exports and imports again with every entry intact once `fit_pages' has
+// moved entries out of those pages.
+TEST(nsf_page_packer, FitPagesMovesOverflow)
+{
+    res::project proj;
+    auto arc = make_sized_archive(proj, {
+        { 30000, 30000, 20000 },
+        { 10000 },
+        { 40000, 40000 },
+        { 50000 }
+    });
+    EXPECT_THROW(arc->export_file(), res::export_error);
+
+    bool changed = false;
+    proj.get_transact().run([&](TRANSACT) {
+        changed = arc->fit_pages(TS);
+    });
+    EXPECT_TRUE(changed);
+
+    // The 40000-byte entry from the third page fits in the second page. The
+    // 30000-byte entry from the first page then fits nowhere, so it gets a new
+    // page after the last one, numbered after the largest chunk ID.
+    auto &&pages = arc->get_pages();
+    ASSERT_EQ(pages.size(), 5u);
+    spage::ref new_page = pages[4];
+    EXPECT_EQ(new_page->get_cid(), 9u);
+    expect_round_trip(arc);
+
+    // Nothing moves once every page fits.
+    proj.get_transact().run([&](TRANSACT) {
+        changed = arc->fit_pages(TS);
+    });
+    EXPECT_FALSE(changed);
+
+    // An entry too large for any page is an error.
+    res::project big_proj;
+    auto big = make_sized_archive(big_proj, { { page_size } });
+    big_proj.get_transact().run([&](TRANSACT) {
+        EXPECT_THROW(big->fit_pages(TS), res::export_error);
+    });
+}
+
+// (test) PackPagesRenumbersPages
+// Ensures an archive which overflows can be packed into fewer pages which
+// survive a round trip, that packing keeps the chunk IDs of the pages it
+// reuses, and that `renumber_pages' then numbers the pages in order.
+TEST(nsf_page_packer, PackPagesRenumbersPages)
+{
+    res::project proj;
+    auto arc = make_sized_archive(proj, {
+        { 40000, 40000 },
+        { 20000 },
+        { 20000 },
+        { 20000 }
+    });
+
+    proj.get_transact().run([&](TRANSACT) {
+        spage::ref first = arc->get_pages()[0];
+        first->set_cid(TS, 11);
+        arc->pack_pages(TS);
+    });
+
+    auto &&pages = arc->get_pages();
+    ASSERT_EQ(pages.size(), 3u);
+    spage::ref first = pages[0];
+    EXPECT_EQ(first->get_cid(), 11u);
+    expect_round_trip(arc);
+
+    proj.get_transact().run([&](TRANSACT) {
+        arc->renumber_pages(TS);
+    });
+    for (auto &&i : util::range_of(pages)) {
+        spage::ref page = pages[i];
+        EXPECT_EQ(page->get_cid(), i * 2 + 1);
+    }
+}
+
+}
+#endif
+
+}
+}
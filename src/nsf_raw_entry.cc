@@ -19,23 +19,28 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void raw_entry::import_file(TRANSACT, const util::blob &data)
+// declared in nsf.hh
+raw_entry::staging raw_entry::parse_file(const util::shared_blob &data)
 {
-    assert_alive();
+    staging st;
 
     util::binreader r;
     r.begin(data);
 
     // Read the entry header.
     auto magic      = r.read_u32();
-    auto eid        = r.read_u32();
-    auto type       = r.read_u32();
+    st.eid          = r.read_u32();
+    st.type         = r.read_u32();
     auto item_count = r.read_u32();
 
     // Ensure magic number is correct.
@@ -50,8 +55,8 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
     r.end_early();
 
     // Copy the data for each item.
-    std::vector<util::blob> items(item_count);
-    for (auto &&i : util::range_of(items)) {
+    st.items.resize(item_count);
+    for (auto &&i : util::range_of(st.items)) {
         auto &&item_start_offset = item_offsets[i];
         auto &&item_end_offset = item_offsets[i + 1];
 
@@ -70,16 +75,31 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
             throw res::import_error("nsf::raw_entry: negative item size");
 
         // Extract the item's data.
-        items[i] = {
+        st.items[i] = {
             data.data() + item_start_offset,
             data.data() + item_end_offset
         };
     }
 
-    // Finish importing.
-    set_eid(TS, eid);
-    set_type(TS, type);
-    set_items(TS, std::move(items));
+    return st;
+}
+
+// declared in nsf.hh
+void raw_entry::import_staged(TRANSACT, staging st)
+{
+    assert_alive();
+
+    set_eid(TS, st.eid);
+    set_type(TS, st.type);
+    set_items(TS, std::move(st.items));
+}
+
+// declared in res.hh
+void raw_entry::import_file(TRANSACT, const util::shared_blob &data)
+{
+    assert_alive();
+
+    import_staged(TS, parse_file(data));
 }
 
 // declared in nsf.hh
@@ -91,37 +111,202 @@ std::vector<util::blob> raw_entry::export_entry(uint32_t &out_type) const
     return get_items();
 }
 
-// declared in res.hh
-bool raw_entry::process_by_type(TRANSACT, game_ver ver)
+// declared in nsf.hh
+bool raw_entry::get_export_info(pagelet_info &out) const
+{
+    assert_alive();
+
+    out = get_entry_info(get_items());
+    return true;
+}
+
+// declared in nsf.hh
+void raw_entry::export_entry_into(util::sink &out) const
+{
+    assert_alive();
+
+    write_entry(out, get_eid(), get_type(), get_items());
+}
+
+// declared in nsf.hh
+std::vector<eid> raw_entry::get_refs() const
 {
     assert_alive();
 
+    // Only scenery entries have references so far. Find the position of the
+    // tpag ref count in the info item (0) for this game version.
+    if (get_type() != 3)
+        return {};
+
+    size_t count_offset;
     switch (ver) {
     case game_ver::crash1:
-        switch (get_type()) {
+        count_offset = 24;
+        break;
+    case game_ver::crash2:
+    case game_ver::crash3:
+        count_offset = 40;
+        break;
+    default:
+        return {};
+    }
+
+    auto &&items = get_items();
+    if (items.empty() || items[0].size() < count_offset + 4 + 8 * 4)
+        return {};
+
+    util::binreader r;
+    r.begin(items[0].data() + count_offset, 4 + 8 * 4);
+    auto tpag_ref_count = r.read_u32();
+    if (tpag_ref_count > 8)
+        return {};
+
+    std::vector<eid> result;
+    for (uint32_t i = 0; i < tpag_ref_count; i++) {
+        result.push_back(r.read_u32());
+    }
+    r.end_early();
+    return result;
+}
+
+// declared in nsf.hh
+raw_entry::processor raw_entry::find_processor(game_ver ver, uint32_t type)
+{
+    switch (ver) {
+    case game_ver::crash1:
+        switch (type) {
         case 3:
-            process_as<wgeo_v1>(TS, ver);
-            return true;
+            return &raw_entry::process_as<wgeo_v1>;
         }
         break;
     case game_ver::crash2:
-        switch (get_type()) {
+        switch (type) {
         case 3:
-            process_as<wgeo_v2>(TS, ver);
-            return true;
+            return &raw_entry::process_as<wgeo_v2>;
         }
         break;
     case game_ver::crash3:
-        switch (get_type()) {
+        switch (type) {
         case 3:
-            process_as<wgeo_v2>(TS, ver);
-            return true;
+            return &raw_entry::process_as<wgeo_v2>;
         }
         break;
+    default:
+        break;
     }
 
-    return false;
+    return nullptr;
+}
+
+// declared in res.hh
+bool raw_entry::process_by_type(TRANSACT, game_ver ver)
+{
+    assert_alive();
+
+    auto fn = find_processor(ver, get_type());
+    if (!fn)
+        return false;
+
+    (this->*fn)(TS, ver);
+    return true;
+}
+
+// declared in nsf.hh
+bool raw_entry::is_pending() const
+{
+    assert_alive();
+
+    return ver != game_ver::none && find_processor(ver, get_type());
+}
+
+// declared in nsf.hh
+bool process_on_demand(TRANSACT, res::atom name)
+{
+    raw_entry::ref entry = name;
+    if (!entry.ok() || !entry->is_pending())
+        return false;
+
+    return entry->process_by_type(TS, entry->ver);
+}
+
+// declared in nsf.hh
+std::vector<res::atom> find_pending(res::project &proj)
+{
+    std::vector<res::atom> names;
+    for (auto &&asset : proj.get_asset_list()) {
+        auto entry = dynamic_cast<raw_entry *>(asset.get());
+        if (entry && entry->is_pending()) {
+            names.push_back(entry->get_name());
+        }
+    }
+    return names;
+}
+
+// declared in nsf.hh
+bool process_pending(res::project &proj, const std::vector<res::atom> &names)
+{
+    return proj.get_transact().amend([&](TRANSACT) {
+        for (auto &&name : names) {
+            process_on_demand(TS, name);
+        }
+    });
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (test) DirectExportDoesNotAllocate
+// Ensures raw entries can be written into a page buffer without allocating,
+// and that the result matches `export_file'.
+TEST(nsf_raw_entry, DirectExportDoesNotAllocate)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+
+    std::vector<raw_entry::ref> entries;
+    proj.get_transact().run([&](TRANSACT) {
+        for (int i = 0; i < 8; i++) {
+            raw_entry::ref entry = root / "entry-$"_fmt(i);
+            entry.create(TS, proj);
+            entry->set_eid(TS, i * 2 + 1);
+            entry->set_type(TS, 1);
+            entry->set_items(TS, {
+                util::blob(100 * i, 0x55),
+                util::blob(3, 0xAA)
+            });
+            entries.push_back(entry);
+        }
+    });
+
+    std::vector<pagelet_info> infos(entries.size());
+    size_t total_size = 0;
+    for (auto &&i : util::range_of(entries)) {
+        ASSERT_TRUE(entries[i]->get_export_info(infos[i]));
+        total_size += infos[i].size;
+    }
+
+    util::blob data(total_size);
+    {
+        util::alloc_counter counter;
+        util::buffer_sink out(data.data(), data.size());
+        for (auto &&entry : entries) {
+            entry->export_entry_into(out);
+        }
+        EXPECT_EQ(out.size(), total_size);
+        EXPECT_EQ(counter.get_count(), 0u);
+    }
+
+    auto p = data.begin();
+    for (auto &&i : util::range_of(entries)) {
+        auto expected = entries[i]->export_file();
+        EXPECT_EQ(expected.size(), infos[i].size);
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(), p));
+        p += infos[i].size;
+    }
+}
+
 }
+#endif
 
 }
 }
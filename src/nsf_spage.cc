@@ -19,30 +19,32 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 #include "misc.hh"
 
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void spage::import_file(TRANSACT, const util::blob &data)
+// declared in nsf.hh
+spage::staging spage::parse_file(const util::shared_blob &data)
 {
-    assert_alive();
-
-    util::binreader r;
-    r.begin(data);
-
     // Ensure the page data is the correct size (64K).
     if (data.size() != page_size)
         throw res::import_error("nsf::spage: not 64K");
 
+    staging st;
+
+    util::binreader r;
+    r.begin(data);
+
     // Read the page header.
-    auto magic         = r.read_u16();
-    auto type          = r.read_u16();
-    auto cid           = r.read_u32();
-    auto pagelet_count = r.read_u32();
-    auto checksum      = r.read_u32();
+    auto header = r.read_record(16);
+    auto magic         = header.read_u16();
+    st.type            = header.read_u16();
+    st.cid             = header.read_u32();
+    auto pagelet_count = header.read_u32();
+    st.checksum        = header.read_u32();
 
     // Ensure the magic number is correct.
     if (magic != 0x1234)
@@ -50,17 +52,16 @@ void spage::import_file(TRANSACT, const util::blob &data)
 
     // Read the pagelet offsets. Pagelets should be entries, but we treat
     // them as blobs instead so they can be totally unprocessed, etc.
-    std::vector<uint32_t> pagelet_offsets(pagelet_count + 1);
+    auto offsets = r.read_record((size_t(pagelet_count) + 1) * 4);
+    std::vector<uint32_t> pagelet_offsets(size_t(pagelet_count) + 1);
     for (auto &&pagelet_offset : pagelet_offsets) {
-        pagelet_offset = r.read_u32();
+        pagelet_offset = offsets.read_u32();
     }
     r.end_early();
 
-    // Copy the data for each pagelet as a new raw_data asset. The caller
-    // can later process these into entries if desired.
-    std::vector<misc::raw_data::ref> pagelets(pagelet_count);
-    for (auto &&i : util::range_of(pagelets)) {
-        auto &&pagelet = pagelets[i];
+    // Find the data for each pagelet.
+    st.pagelets.resize(pagelet_count);
+    for (auto &&i : util::range_of(st.pagelets)) {
         auto &&pagelet_start_offset = pagelet_offsets[i];
         auto &&pagelet_end_offset = pagelet_offsets[i + 1];
 
@@ -78,47 +79,141 @@ void spage::import_file(TRANSACT, const util::blob &data)
         if (pagelet_end_offset < pagelet_start_offset)
             throw res::import_error("nsf::spage: negative pagelet size");
 
+        // Take a view of the pagelet data. This shares the page data instead
+        // of copying it.
+        st.pagelets[i] = data.slice(
+            pagelet_start_offset,
+            pagelet_end_offset - pagelet_start_offset
+        );
+    }
+
+    return st;
+}
+
+// declared in nsf.hh
+void spage::import_staged(TRANSACT, staging st)
+{
+    assert_alive();
+
+    // Create a new raw_data asset for each pagelet. The caller can later
+    // process these into entries if desired.
+    std::vector<misc::raw_data::ref> pagelets(st.pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        auto &&pagelet = pagelets[i];
+
         // Create the pagelet asset.
         pagelet = get_name() / "pagelet-$"_fmt(i);
         pagelet.create(TS, get_proj());
-
-        // Copy the pagelet data into the asset.
-        pagelet->set_data(TS,
-            {&data[pagelet_start_offset], &data[pagelet_end_offset]}
-        );
+        pagelet->set_data(TS, std::move(st.pagelets[i]));
     }
 
     // Finish importing.
-    set_type(TS, type);
-    set_cid(TS, cid);
-    set_checksum(TS, checksum);
+    set_type(TS, st.type);
+    set_cid(TS, st.cid);
+    set_checksum(TS, st.checksum);
     set_pagelets(TS, {pagelets.begin(), pagelets.end()});
 }
 
-// declared in nsf.hh
-util::blob spage::export_file() const
+// declared in res.hh
+void spage::import_file(TRANSACT, const util::shared_blob &data)
 {
     assert_alive();
 
-    util::binwriter w;
-    w.begin();
+    import_staged(TS, parse_file(data));
+}
+
+// declared in nsf.hh
+pagelet_info get_pagelet_info(const util::shared_blob &pagelet)
+{
+    pagelet_info info;
+    info.size = pagelet.size();
+    info.is_entry = false;
+    info.first_item_offset = 0;
+
+    // There is no guarantee that a pagelet is actually backed by an
+    // `nsf::entry' asset. For example, it may be an unprocessed
+    // `misc::raw_data' asset. Such entries still need padding, so here we will
+    // parse a little bit of the entry header and perform some basic tests to
+    // ensure this pagelet actually is an entry.
+    if (pagelet.size() >= 20) {
+        // Read the entry header.
+        util::binreader r;
+        r.begin(pagelet);
+        auto header = r.read_record(20);
+        auto magic = header.read_u32();
+        header.discard(12);
+        auto first_offset = header.read_u32();
+        r.end_early();
+
+        // Ensure this appears to be a viable entry.
+        if (magic == 0x100FFFF && first_offset < pagelet.size()) {
+            info.is_entry = true;
+            info.first_item_offset = first_offset;
+        }
+    }
+
+    return info;
+}
+
+// declared in nsf.hh
+int get_page_alignment(uint16_t type)
+{
+    return (type == 0) ? 4 : 16;
+}
+
+// declared in nsf.hh
+size_t layout_page(
+    const std::vector<pagelet_info> &pagelets,
+    int alignment,
+    std::vector<uint32_t> *padding)
+{
+    if (padding) {
+        padding->assign(pagelets.size(), 0);
+    }
+
+    // The pagelets start after the page header and the offset of each pagelet
+    // (plus the end offset of the last pagelet).
+    size_t offset = 20 + pagelets.size() * 4;
+    for (auto &&i : util::range_of(pagelets)) {
+        auto &&pagelet = pagelets[i];
+
+        // When calculating the offset of an entry within a page, we must pad
+        // out the area before the entry such that the first item of the entry
+        // is aligned. For most pages with 4-byte alignment, this should should
+        // already be the case as every header and entry size is a multiple of
+        // 4. However, audio pages require 16-byte alignment.
+        if (pagelet.is_entry) {
+            int misalignment =
+                (offset + pagelet.first_item_offset) % alignment;
+            if (misalignment) {
+                offset += alignment - misalignment;
+                if (padding) {
+                    (*padding)[i] = alignment - misalignment;
+                }
+            }
+        }
+
+        offset += pagelet.size;
+    }
+    return offset;
+}
+
+// declared in nsf.hh
+util::blob spage::export_uncached() const
+{
+    assert_alive();
 
     auto &&pagelets = get_pagelets();
 
-    // Write the page header.
-    w.write_u16(0x1234);
-    w.write_u16(get_type());
-    w.write_u32(get_cid());
-    w.write_u32(pagelets.size());
-    w.write_u32(get_checksum());
-
-    // Decide on a page entry alignment. All known non-zero type pages (except
-    // type 1 TPAG texture pages) contain audio data and need to have 16-byte
-    // aligned entries. Normal type zero pages only require 4-byte alignment.
-    int alignment = (get_type() == 0) ? 4 : 16;
-
-    // Export the pagelets if they are processed entries.
-    std::vector<util::blob> pagelets_raw(pagelets.size());
+    int alignment = get_page_alignment(get_type());
+
+    // Gather the pagelets. Unprocessed pagelets are shared rather than copied,
+    // and entries which can write themselves directly into the page (see
+    // `entry::export_entry_into') are left to be written below. Any other
+    // entries are exported here.
+    std::vector<util::shared_blob> pagelets_raw(pagelets.size());
+    std::vector<entry::ref> pagelets_direct(pagelets.size());
+    std::vector<pagelet_info> pagelets_info(pagelets.size());
     for (auto &&i : util::range_of(get_pagelets())) {
         auto ref = get_pagelets()[i];
 
@@ -126,88 +221,109 @@ util::blob spage::export_file() const
             throw res::export_error("nsf::spage: null pagelet ref");
 
         misc::raw_data::ref raw_ref = ref;
+        entry::ref entry_ref = ref;
         if (raw_ref.ok()) {
             pagelets_raw[i] = raw_ref->get_data();
-            continue;
-        }
-
-        entry::ref entry_ref = ref;
-        if (entry_ref.ok()) {
+        } else if (entry_ref.ok()) {
+            if (entry_ref->get_export_info(pagelets_info[i])) {
+                pagelets_direct[i] = entry_ref;
+                continue;
+            }
             pagelets_raw[i] = entry_ref->export_file();
-            continue;
+        } else {
+            throw res::export_error(
+                "nsf::spage: pagelet has incompatible type"
+            );
         }
+        pagelets_info[i] = get_pagelet_info(pagelets_raw[i]);
+    }
+
+    // Lay out the pagelets, padding each entry so that its first item is
+    // aligned.
+    std::vector<uint32_t> pagelet_padding;
+    size_t page_end = layout_page(pagelets_info, alignment, &pagelet_padding);
 
-        throw res::export_error("nsf::spage: pagelet has incompatible type");
+    // Ensure a 64K page size. The page is named in the error so that the user
+    // knows which page to fit (see `archive::fit_pages').
+    if (page_end > page_size) {
+        throw res::export_error(
+            "nsf::spage: $: over 64K page size"_fmt(get_name().full_path())
+        );
     }
 
-    // Calculate and write the pagelet offsets.
-    std::vector<int> pagelet_padding(pagelets.size());
-    uint32_t pagelet_offset = 20 + pagelets.size() * 4;
-    for (auto &&i : util::range_of(pagelets_raw)) {
-        auto &&pagelet = pagelets_raw[i];
+    // The page is written into a zero-filled buffer of the final size, so the
+    // padding between and after pagelets needs no further writes.
+    util::blob data(page_size);
+    util::buffer_sink out(data.data(), data.size());
 
-        // When calculating the offset of an entry within a page, we must pad
-        // out the area before the entry such that the first item of the entry
-        // is aligned. For most pages with 4-byte alignment, this should should
-        // already be the case as every header and entry size is a multiple of
-        // 4. However, audio pages require 16-byte alignment.
-        //
-        // There is no guarantee that this particular pagelet is actually backed
-        // by an `nsf::entry' asset. For example, it may be an unprocessed
-        // `misc::raw_data' asset. We still need to pad such entries, so here we
-        // will parse a little bit of the entry header and perform some basic
-        // tests to ensure this pagelet actually is an entry.
-        if (pagelet.size() >= 20) {
-            // Read the entry header.
-            util::binreader er;
-            er.begin(pagelet);
-            auto magic = er.read_u32();
-            er.discard(12);
-            auto first_offset = er.read_u32();
-            er.end_early();
-
-            // Ensure this appears to be a viable entry.
-            if (magic != 0x100FFFF)
-                goto pagelet_not_an_entry;
-            if (first_offset >= pagelet.size())
-                goto pagelet_not_an_entry;
-
-            // Calculate the padding.
-            int misalignment = (pagelet_offset + first_offset) % alignment;
-            if (misalignment) {
-                pagelet_padding[i] = alignment - misalignment;
-            }
-        }
+    // Write the page header.
+    out.write_u32(0x1234 | (uint32_t(get_type()) << 16));
+    out.write_u32(get_cid());
+    out.write_u32(pagelets.size());
+    out.write_u32(0); // checksum, calculated below
 
+    // Write the pagelet offsets.
+    std::vector<uint32_t> pagelet_offsets(pagelets.size());
+    uint32_t pagelet_offset = 20 + pagelets.size() * 4;
+    for (auto &&i : util::range_of(pagelets_info)) {
         pagelet_offset += pagelet_padding[i];
-
-    pagelet_not_an_entry:
-        w.write_u32(pagelet_offset);
-        pagelet_offset += pagelet.size();
+        pagelet_offsets[i] = pagelet_offset;
+        out.write_u32(pagelet_offset);
+        pagelet_offset += pagelets_info[i].size;
     }
-    w.write_u32(pagelet_offset);
-
-    auto data = w.end();
+    out.write_u32(pagelet_offset);
 
     // Write the pagelets themselves.
-    for (auto &&i : util::range_of(pagelets_raw)) {
-        auto &&pagelet = pagelets_raw[i];
-        data.insert(data.end(), pagelet_padding[i], 0);
-        data.insert(data.end(), pagelet.begin(), pagelet.end());
+    for (auto &&i : util::range_of(pagelets_info)) {
+        auto dest = data.data() + pagelet_offsets[i];
+        auto size = pagelets_info[i].size;
+        if (pagelets_direct[i]) {
+            util::buffer_sink pagelet_out(dest, size);
+            pagelets_direct[i]->export_entry_into(pagelet_out);
+            if (pagelet_out.size() != size) {
+                throw res::export_error(
+                    "nsf::spage: entry size does not match its export info"
+                );
+            }
+        } else {
+            std::copy(
+                pagelets_raw[i].begin(),
+                pagelets_raw[i].end(),
+                dest
+            );
+        }
     }
 
-    // Ensure a 64K page size.
-    if (data.size() > page_size)
-        throw res::export_error("nsf::spage: over 64K page size");
+    // Calculate the checksum and write it into the header.
+    uint32_t checksum = page_checksum(data.data(), data.size());
+    data[12] = checksum;
+    data[13] = checksum >> 8;
+    data[14] = checksum >> 16;
+    data[15] = checksum >> 24;
 
-    if (data.size() < page_size) {
-        data.resize(page_size);
-    }
+    return data;
+}
+
+// declared in nsf.hh
+void spage::export_file(util::sink &out) const
+{
+    auto data = export_file();
+    out.write(data.data(), data.size());
+}
+
+// declared in nsf.hh
+util::shared_blob spage::export_file() const
+{
+    assert_alive();
 
-    // Calculate checksum, if necessary.
-    // TODO
+    util::shared_blob result;
+    if (m_export_cache.lookup(result))
+        return result;
 
-    return data;
+    res::dep_recorder recorder;
+    result = export_uncached();
+    m_export_cache.store(result, recorder.get_deps());
+    return result;
 }
 
 }
@@ -19,71 +19,283 @@
 //
 
 #include "common.hh"
+#include <algorithm>
+#include <string_view>
 #include "nsf.hh"
 #include "misc.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void tpage::import_file(TRANSACT, const util::blob &data)
+// (s-var) header_size
+// The size of the texture page header, which is not included when hashing or
+// comparing texels.
+static constexpr size_t header_size = 16;
+
+// declared in nsf.hh
+size_t tpage::hash_texels(const util::blob &texels)
 {
-    assert_alive();
+    if (texels.size() < header_size)
+        return 0;
 
-    util::binreader r;
-    r.begin(data);
+    return std::hash<std::string_view>()(std::string_view(
+        reinterpret_cast<const char *>(texels.data()) + header_size,
+        texels.size() - header_size
+    ));
+}
 
+// declared in nsf.hh
+bool tpage::same_texels(const util::blob &a, const util::blob &b)
+{
+    if (a.size() < header_size || a.size() != b.size())
+        return false;
+
+    return std::equal(a.begin() + header_size, a.end(), b.begin() + header_size);
+}
+
+// declared in nsf.hh
+tpage::staging tpage::parse_file(const util::shared_blob &data)
+{
     // Ensure the page data is the correct size (64K).
     if (data.size() != page_size)
         throw res::import_error("nsf::tpage: not 64K");
 
+    staging st;
+
+    util::binreader r;
+    r.begin(data);
+
     // Read the texture page header.
-    auto magic      = r.read_u16();
-    auto type       = r.read_u16();
-    auto eid        = r.read_u32();
-    auto entry_type = r.read_u32();
+    auto magic    = r.read_u16();
+    st.type       = r.read_u16();
+    st.eid        = r.read_u32();
+    st.entry_type = r.read_u32();
     r.end_early();
 
     // Ensure the magic number is correct.
     if (magic != 0x1234)
         throw res::import_error("nsf::tpage: bad magic number");
 
-    // Create the texture asset.
-    res::atom atom = get_proj().get_asset_root()
-        / "textures"
-        / "$"_fmt(nsf::eid(eid));
+    st.texels = data.to_blob();
+    st.texel_hash = hash_texels(st.texels);
 
-    gfx::texture::ref texture = atom;
-    texture.create(TS, get_proj());
-    texture->set_texels(TS, data);
+    return st;
+}
+
+// declared in nsf.hh
+void tpage::import_staged(TRANSACT, staging st, texture_map *textures)
+{
+    assert_alive();
+
+    // Share an existing texture with the same texels, if there is one.
+    gfx::texture::ref texture;
+    if (textures) {
+        for (auto &&candidate : (*textures)[st.texel_hash]) {
+            if (candidate.ok() &&
+                same_texels(candidate->get_texels(), st.texels)) {
+                texture = candidate;
+                break;
+            }
+        }
+    }
+
+    // Otherwise, create the texture asset.
+    if (!texture) {
+        res::atom atom = get_proj().get_asset_root()
+            / "textures"
+            / "$"_fmt(nsf::eid(st.eid));
+
+        texture = atom;
+        texture.create(TS, get_proj());
+        texture->set_texels(TS, std::move(st.texels));
+
+        if (textures) {
+            (*textures)[st.texel_hash].push_back(texture);
+        }
+    }
 
     // Finish importing.
-    set_type(TS, type);
-    set_eid(TS, eid);
-    set_entry_type(TS, entry_type);
+    set_type(TS, st.type);
+    set_eid(TS, st.eid);
+    set_entry_type(TS, st.entry_type);
     set_texture(TS, texture);
 }
 
-/*
+// declared in res.hh
+void tpage::import_file(TRANSACT, const util::shared_blob &data)
+{
+    assert_alive();
+
+    import_staged(TS, parse_file(data));
+}
+
 // declared in nsf.hh
-util::blob tpage::export_file() const
+util::blob tpage::export_uncached() const
 {
     assert_alive();
 
-    util::binwriter w;
-    w.begin();
+    auto &&texture = get_texture();
+    if (!texture.ok())
+        throw res::export_error("nsf::tpage: no texture");
+
+    util::blob data = texture->get_texels();
+    if (data.size() != page_size)
+        throw res::export_error("nsf::tpage: texels not 64K");
 
-    // Write the page header.
+    // Write the page header over the header in the texels.
+    util::binwriter w;
+    w.begin(data.data(), 12);
     w.write_u16(0x1234);
     w.write_u16(get_type());
     w.write_u32(get_eid());
     w.write_u32(get_entry_type());
-        
-    // TODO: write texels here
+    w.end_external();
+
+    // Calculate the checksum and write it into the header.
+    uint32_t checksum = page_checksum(data.data(), data.size());
+    data[12] = checksum;
+    data[13] = checksum >> 8;
+    data[14] = checksum >> 16;
+    data[15] = checksum >> 24;
 
     return data;
 }
-*/
+
+// declared in nsf.hh
+void tpage::export_file(util::sink &out) const
+{
+    auto data = export_file();
+    out.write(data.data(), data.size());
+}
+
+// declared in nsf.hh
+util::shared_blob tpage::export_file() const
+{
+    assert_alive();
+
+    util::shared_blob result;
+    if (m_export_cache.lookup(result))
+        return result;
+
+    res::dep_recorder recorder;
+    result = export_uncached();
+    m_export_cache.store(result, recorder.get_deps());
+    return result;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) make_tpage_data
+// Returns the data for a texture page with the given EID and texels, with a
+// correct checksum.
+util::shared_blob make_tpage_data(uint32_t eid, unsigned char texel_seed)
+{
+    util::blob data(page_size);
+    for (auto &&i : util::range_of(data)) {
+        data[i] = (i * 31 + texel_seed) >> 3;
+    }
+
+    util::binwriter w;
+    w.begin();
+    w.write_u16(0x1234);
+    w.write_u16(1);
+    w.write_u32(eid);
+    w.write_u32(5);
+    auto header = w.end();
+    std::copy(header.begin(), header.end(), data.begin());
+
+    uint32_t checksum = page_checksum(data.data(), data.size());
+    data[12] = checksum;
+    data[13] = checksum >> 8;
+    data[14] = checksum >> 16;
+    data[15] = checksum >> 24;
+    return data;
+}
+
+// (test) DuplicatesShareTexture
+// Ensures texture pages with the same texels share one texture when imported
+// with a texture map, that different texels get their own texture, and that
+// every page exports back to its original data.
+TEST(nsf_tpage, DuplicatesShareTexture)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+
+    std::vector<util::shared_blob> datas = {
+        make_tpage_data(0x101, 0),
+        make_tpage_data(0x103, 0),
+        make_tpage_data(0x105, 1)
+    };
+    std::vector<tpage::ref> tpages(datas.size());
+
+    proj.get_transact().run([&](TRANSACT) {
+        tpage::texture_map textures;
+        for (auto &&i : util::range_of(tpages)) {
+            tpages[i] = root / "tpage$"_fmt(i);
+            tpages[i].create(TS, proj);
+            tpages[i]->import_staged(
+                TS,
+                tpage::parse_file(datas[i]),
+                &textures
+            );
+        }
+    });
+
+    EXPECT_TRUE(tpages[0]->get_texture() == tpages[1]->get_texture());
+    EXPECT_FALSE(tpages[0]->get_texture() == tpages[2]->get_texture());
+    for (auto &&i : util::range_of(tpages)) {
+        EXPECT_TRUE(tpages[i]->export_file() == datas[i]);
+    }
+}
+
+// (test) ImportedPagesFoundByEID
+// Ensures texture pages imported as part of an archive can be found through an
+// `eid_index', so that a page which shares the texture of an earlier page still
+// gives its texture from its own EID, and that the archive exports back to its
+// original data.
+TEST(nsf_tpage, ImportedPagesFoundByEID)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+
+    std::vector<uint32_t> eids = { 0x101, 0x103 };
+    util::blob data;
+    for (auto &&eid : eids) {
+        auto page = make_tpage_data(eid, 0);
+        data.insert(data.end(), page.begin(), page.end());
+    }
+
+    archive::ref arc = root / "archive";
+    proj.get_transact().run([&](TRANSACT) {
+        arc.create(TS, proj);
+        arc->import_and_process(
+            TS,
+            data,
+            game_ver::crash2,
+            archive::processing::lazy
+        );
+    });
+
+    eid_index index;
+    index.set_proj(&proj);
+    auto &&pages = arc->get_pages();
+    ASSERT_EQ(pages.size(), eids.size());
+    for (auto &&i : util::range_of(eids)) {
+        auto tp = dynamic_cast<tpage *>(index.find(eids[i], arc.get()));
+        ASSERT_NE(tp, nullptr);
+        EXPECT_TRUE(pages[i] == tp->get_name());
+        EXPECT_TRUE(tp->get_texture().ok());
+    }
+    EXPECT_TRUE(arc->export_file() == data);
+}
+
+}
+#endif
 
 }
 }
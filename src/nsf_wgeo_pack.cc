@@ -0,0 +1,949 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64)
+#define DRNSF_WGEO_SSE2 1
+#include <emmintrin.h>
+#else
+#define DRNSF_WGEO_SSE2 0
+#endif
+#include "nsf.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#include <iostream>
+#endif
+
+namespace drnsf {
+namespace nsf {
+
+// (s-func) load_u16, load_u32, load_u64
+// Reads a little-endian value from the given bytes.
+static uint16_t load_u16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t load_u32(const unsigned char *p)
+{
+    return load_u16(p) | (uint32_t(load_u16(p + 2)) << 16);
+}
+
+static uint64_t load_u64(const unsigned char *p)
+{
+    return load_u32(p) | (uint64_t(load_u32(p + 4)) << 32);
+}
+
+// (s-func) store_u16, store_u32
+// Writes a little-endian value to the given bytes.
+static void store_u16(unsigned char *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void store_u32(unsigned char *p, uint32_t value)
+{
+    store_u16(p, value);
+    store_u16(p + 2, value >> 16);
+}
+
+// (s-func) sign_extend
+// Returns the lowest `bits' bits of `value' as a signed value.
+static int sign_extend(uint64_t value, int bits)
+{
+    return int64_t(value << (64 - bits)) >> (64 - bits);
+}
+
+// (typedef) v1_triangle_record
+// The 8-byte record of a triangle in a wgeo_v1 entry.
+using v1_triangle_record = util::bit_record<
+    util::ubits<5>,  // unk0
+    util::ubits<3>,  // tpag index
+    util::ubits<12>, // tinf index
+    util::ubits<12>, // vertex 0
+    util::ubits<8>,  // unk1
+    util::ubits<12>, // vertex 1
+    util::ubits<12>  // vertex 2
+>;
+
+// (typedef) v2_triangle_word, v2_triangle_half
+// The 4-byte and 2-byte records of a triangle in a wgeo_v2 entry.
+using v2_triangle_word = util::bit_record<
+    util::ubits<8>,  // unk0
+    util::ubits<12>, // vertex 0
+    util::ubits<12>  // vertex 1
+>;
+using v2_triangle_half = util::bit_record<
+    util::ubits<4>,  // unk1
+    util::ubits<12>  // vertex 2
+>;
+
+// (typedef) v2_quad_record
+// The 8-byte record of a quad in a wgeo_v2 entry.
+using v2_quad_record = util::bit_record<
+    util::ubits<8>,  // unk0
+    util::ubits<12>, // vertex 0
+    util::ubits<12>, // vertex 1
+    util::ubits<8>,  // unk1
+    util::ubits<12>, // vertex 2
+    util::ubits<12>  // vertex 3
+>;
+
+// (s-func) get_v2_triangle_word, get_v2_triangle_half
+// Returns the fields of the records of the given triangle.
+static v2_triangle_word::values get_v2_triangle_word(const gfx::triangle &t)
+{
+    return {{ t.unk0, t.v[0].vertex_index, t.v[1].vertex_index }};
+}
+
+static v2_triangle_half::values get_v2_triangle_half(const gfx::triangle &t)
+{
+    return {{ t.unk1, t.v[2].vertex_index }};
+}
+
+// (s-func) get_v2_quad_record
+// Returns the fields of the record of the given quad.
+static v2_quad_record::values get_v2_quad_record(const gfx::quad &q)
+{
+    return {{
+        q.unk0,
+        q.v[0].vertex_index,
+        q.v[1].vertex_index,
+        q.unk1,
+        q.v[2].vertex_index,
+        q.v[3].vertex_index
+    }};
+}
+
+// The SIMD code for triangles shifts the fields out by hand, so make sure it
+// agrees with the records.
+static_assert(
+    v2_triangle_word::offset(1) == 8 && v2_triangle_word::offset(2) == 20 &&
+    v2_triangle_half::offset(1) == 4,
+    "wgeo_v2 triangle layout mismatch"
+);
+
+// declared in nsf.hh
+std::vector<gfx::vertex> unpack_wgeo_v1_vertices(
+    const util::blob &item,
+    size_t count)
+{
+    std::vector<gfx::vertex> vertices(count);
+    for (size_t i = 0; i < count; i++) {
+        auto &vertex = vertices[i];
+        auto record = load_u64(&item[i * 8]);
+
+        int y1 = record >> 24 & 0xFF;
+        int y2 = record >> 33 & 0x3;
+        int y3 = sign_extend(record >> 48, 3);
+
+        vertex.x = sign_extend(record >> 35, 13);
+        vertex.y = y1 | (y2 << 8) | int(unsigned(y3) << 10);
+        vertex.z = sign_extend(record >> 51, 13);
+
+        vertex.fx = (record >> 32 & 1) | 4;
+
+        vertex.color.r = record >> 16;
+        vertex.color.g = record >> 8;
+        vertex.color.b = record;
+    }
+    return vertices;
+}
+
+// declared in nsf.hh
+std::vector<gfx::triangle> unpack_wgeo_v1_triangles(
+    const util::blob &item,
+    size_t count)
+{
+    std::vector<gfx::triangle> triangles(count);
+    for (size_t i = 0; i < count; i++) {
+        auto &triangle = triangles[i];
+        auto fields = v1_triangle_record::decode(&item[i * 8]);
+
+        triangle.v[0].vertex_index = fields[3];
+        triangle.v[1].vertex_index = fields[5];
+        triangle.v[2].vertex_index = fields[6];
+
+        triangle.v[0].color_index = -1;
+        triangle.v[1].color_index = -1;
+        triangle.v[2].color_index = -1;
+
+        triangle.tpag_index = fields[1];
+        triangle.tinf_index = fields[2];
+
+        triangle.unk0 = fields[0];
+        triangle.unk1 = fields[4];
+    }
+    return triangles;
+}
+
+// declared in nsf.hh
+std::vector<gfx::vertex> unpack_wgeo_v2_vertices(
+    const util::blob &item,
+    size_t count,
+    bool coords_unsigned)
+{
+    // Each vertex has a 4-byte record, from the end of the first half of the
+    // item backwards:
+    //
+    //   bits 0-3:   color index, bits 4-7
+    //   bits 4-15:  x
+    //   bits 16-17: color index, bits 8-9
+    //   bits 18-19: fx
+    //   bits 20-31: z
+    //
+    // and a 2-byte record, from the start of the second half forwards:
+    //
+    //   bits 0-3:   color index, bits 0-3
+    //   bits 4-15:  y
+    std::vector<gfx::vertex> vertices(count);
+    auto words = item.data();
+    auto halves = item.data() + count * 4;
+
+    size_t i = 0;
+#if DRNSF_WGEO_SSE2
+    const __m128i mask_2 = _mm_set1_epi32(0x3);
+    const __m128i mask_4 = _mm_set1_epi32(0xF);
+    for (; i + 4 <= count; i += 4) {
+        // Load the records of four vertices, reversing the order of the
+        // 4-byte records and widening the 2-byte records.
+        __m128i w = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(words + (count - 4 - i) * 4)
+        );
+        w = _mm_shuffle_epi32(w, _MM_SHUFFLE(0, 1, 2, 3));
+        __m128i h = _mm_loadl_epi64(
+            reinterpret_cast<const __m128i *>(halves + i * 2)
+        );
+        h = _mm_unpacklo_epi16(h, _mm_setzero_si128());
+
+        __m128i x, y, z;
+        if (coords_unsigned) {
+            x = _mm_srli_epi32(_mm_slli_epi32(w, 16), 20);
+            y = _mm_srli_epi32(h, 4);
+            z = _mm_srli_epi32(w, 20);
+        } else {
+            x = _mm_srai_epi32(_mm_slli_epi32(w, 16), 20);
+            y = _mm_srai_epi32(_mm_slli_epi32(h, 16), 20);
+            z = _mm_srai_epi32(w, 20);
+        }
+        __m128i fx = _mm_and_si128(_mm_srli_epi32(w, 18), mask_2);
+        __m128i color = _mm_or_si128(
+            _mm_and_si128(h, mask_4),
+            _mm_or_si128(
+                _mm_slli_epi32(_mm_and_si128(w, mask_4), 4),
+                _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(w, 16), mask_2), 8)
+            )
+        );
+
+        int32_t lanes[5][4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[0]), x);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[1]), y);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[2]), z);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[3]), fx);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[4]), color);
+        for (int lane = 0; lane < 4; lane++) {
+            auto &vertex = vertices[i + lane];
+            vertex.x = lanes[0][lane];
+            vertex.y = lanes[1][lane];
+            vertex.z = lanes[2][lane];
+            vertex.fx = lanes[3][lane];
+            vertex.color_index = lanes[4][lane];
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        auto &vertex = vertices[i];
+        uint32_t w = load_u32(words + (count - 1 - i) * 4);
+        uint32_t h = load_u16(halves + i * 2);
+
+        if (coords_unsigned) {
+            vertex.x = w >> 4 & 0xFFF;
+            vertex.y = h >> 4;
+            vertex.z = w >> 20;
+        } else {
+            vertex.x = sign_extend(w >> 4, 12);
+            vertex.y = sign_extend(h >> 4, 12);
+            vertex.z = sign_extend(w >> 20, 12);
+        }
+        vertex.fx = w >> 18 & 0x3;
+        vertex.color_index = (h & 0xF) | (w & 0xF) << 4 | (w >> 16 & 0x3) << 8;
+    }
+    return vertices;
+}
+
+// declared in nsf.hh
+std::vector<gfx::triangle> unpack_wgeo_v2_triangles(
+    const util::blob &item,
+    size_t count)
+{
+    // Each triangle has a 4-byte record (`v2_triangle_word'), from the end of
+    // the first half of the item backwards, and a 2-byte record
+    // (`v2_triangle_half'), from the start of the second half forwards.
+    std::vector<gfx::triangle> triangles(count);
+    auto words = item.data();
+    auto halves = item.data() + count * 4;
+
+    size_t i = 0;
+#if DRNSF_WGEO_SSE2
+    const __m128i mask_4 = _mm_set1_epi32(0xF);
+    const __m128i mask_8 = _mm_set1_epi32(0xFF);
+    const __m128i mask_12 = _mm_set1_epi32(0xFFF);
+    for (; i + 4 <= count; i += 4) {
+        __m128i w = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(words + (count - 4 - i) * 4)
+        );
+        w = _mm_shuffle_epi32(w, _MM_SHUFFLE(0, 1, 2, 3));
+        __m128i h = _mm_loadl_epi64(
+            reinterpret_cast<const __m128i *>(halves + i * 2)
+        );
+        h = _mm_unpacklo_epi16(h, _mm_setzero_si128());
+
+        int32_t lanes[5][4];
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(lanes[0]),
+            _mm_and_si128(_mm_srli_epi32(w, 8), mask_12)
+        );
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(lanes[1]),
+            _mm_srli_epi32(w, 20)
+        );
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(lanes[2]),
+            _mm_srli_epi32(h, 4)
+        );
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(lanes[3]),
+            _mm_and_si128(w, mask_8)
+        );
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(lanes[4]),
+            _mm_and_si128(h, mask_4)
+        );
+        for (int lane = 0; lane < 4; lane++) {
+            auto &triangle = triangles[i + lane];
+            for (int corner = 0; corner < 3; corner++) {
+                triangle.v[corner].vertex_index = lanes[corner][lane];
+                triangle.v[corner].color_index = -1;
+            }
+            triangle.unk0 = lanes[3][lane];
+            triangle.unk1 = lanes[4][lane];
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        auto &triangle = triangles[i];
+        auto w = v2_triangle_word::decode(words + (count - 1 - i) * 4);
+        auto h = v2_triangle_half::decode(halves + i * 2);
+
+        triangle.v[0].vertex_index = w[1];
+        triangle.v[1].vertex_index = w[2];
+        triangle.v[2].vertex_index = h[1];
+
+        triangle.v[0].color_index = -1;
+        triangle.v[1].color_index = -1;
+        triangle.v[2].color_index = -1;
+
+        triangle.unk0 = w[0];
+        triangle.unk1 = h[0];
+    }
+    return triangles;
+}
+
+// declared in nsf.hh
+std::vector<gfx::quad> unpack_wgeo_v2_quads(
+    const util::blob &item,
+    size_t count)
+{
+    std::vector<gfx::quad> quads(count);
+    for (size_t i = 0; i < count; i++) {
+        auto &quad = quads[i];
+        auto fields = v2_quad_record::decode(&item[i * 8]);
+
+        quad.v[0].vertex_index = fields[1];
+        quad.v[1].vertex_index = fields[2];
+        quad.v[2].vertex_index = fields[4];
+        quad.v[3].vertex_index = fields[5];
+
+        for (auto &&corner : quad.v) {
+            corner.color_index = -1;
+        }
+
+        quad.unk0 = fields[0];
+        quad.unk1 = fields[3];
+    }
+    return quads;
+}
+
+// (s-var) pack_chunk_count
+// The number of records encoded at a time into a buffer on the stack when
+// packing into a sink. This is a whole number of SIMD groups.
+static constexpr size_t pack_chunk_count = 64;
+
+// (s-func) check_v2_vertices, check_v2_triangles, check_v2_quads
+// Throws an export error if any of the given vertices, triangles or quads do
+// not fit in a wgeo_v2 record.
+static void check_v2_vertices(
+    const std::vector<gfx::vertex> &vertices,
+    bool coords_unsigned)
+{
+    const int COORD_MIN = coords_unsigned ? 0 : -(1 << 11);
+    const int COORD_MAX = (1 << 11) - 1;
+
+    for (auto &&vertex : vertices) {
+        if (vertex.x < COORD_MIN || vertex.x >= COORD_MAX ||
+            vertex.z < COORD_MIN || vertex.z >= COORD_MAX) {
+            throw res::export_error("nsf::wgeo_v2: vertex x/z out of range");
+        }
+        if (vertex.y < COORD_MIN || vertex.y >= COORD_MAX) {
+            throw res::export_error("nsf::wgeo_v2: vertex y out of range");
+        }
+
+        if (vertex.color_index == -1) {
+            throw res::export_error("nsf::wgeo_v2: vertex colors required");
+        }
+        if (vertex.color_index < 0 || vertex.color_index >= (1L << 10)) {
+            throw res::export_error("nsf::wgeo_v2: vertex color out of range");
+        }
+
+        if (vertex.fx < 0 || vertex.fx >= 4) {
+            throw res::export_error("nsf::wgeo_v2: vertex fx out of range");
+        }
+    }
+}
+
+static void check_v2_triangles(const std::vector<gfx::triangle> &triangles)
+{
+    for (auto &&triangle : triangles) {
+        if (!v2_triangle_word::fits(get_v2_triangle_word(triangle)) ||
+            !v2_triangle_half::fits(get_v2_triangle_half(triangle))) {
+            throw res::export_error(
+                "nsf::wgeo_v2: triangle value out of range"
+            );
+        }
+        for (auto &&corner : triangle.v) {
+            if (corner.color_index != -1) {
+                throw res::export_error(
+                    "nsf::wgeo_v2: corner colors not supported"
+                );
+            }
+        }
+    }
+}
+
+static void check_v2_quads(const std::vector<gfx::quad> &quads)
+{
+    for (auto &&quad : quads) {
+        if (!v2_quad_record::fits(get_v2_quad_record(quad))) {
+            throw res::export_error("nsf::wgeo_v2: quad value out of range");
+        }
+        for (auto &&corner : quad.v) {
+            if (corner.color_index != -1) {
+                throw res::export_error(
+                    "nsf::wgeo_v2: corner colors not supported"
+                );
+            }
+        }
+    }
+}
+
+// (s-func) encode_v2_vertices, encode_v2_triangles
+// Encodes the `count' vertices or triangles at `elems', which must already
+// have been checked. The 4-byte records are written to `words' in reverse
+// order, and the 2-byte records are written to `halves' in order. Either may
+// be null, in which case those records are not written.
+static void encode_v2_vertices(
+    unsigned char *words,
+    unsigned char *halves,
+    const gfx::vertex *elems,
+    size_t count)
+{
+    // See `unpack_wgeo_v2_vertices' for the layout of the records.
+    size_t i = 0;
+#if DRNSF_WGEO_SSE2
+    const __m128i mask_4 = _mm_set1_epi32(0xF);
+    const __m128i mask_12 = _mm_set1_epi32(0xFFF);
+    for (; i + 4 <= count; i += 4) {
+        auto v = &elems[i];
+        __m128i x = _mm_setr_epi32(v[0].x, v[1].x, v[2].x, v[3].x);
+        __m128i y = _mm_setr_epi32(v[0].y, v[1].y, v[2].y, v[3].y);
+        __m128i z = _mm_setr_epi32(v[0].z, v[1].z, v[2].z, v[3].z);
+        __m128i fx = _mm_setr_epi32(v[0].fx, v[1].fx, v[2].fx, v[3].fx);
+        __m128i color = _mm_setr_epi32(
+            v[0].color_index,
+            v[1].color_index,
+            v[2].color_index,
+            v[3].color_index
+        );
+
+        if (words) {
+            __m128i w = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_and_si128(_mm_srli_epi32(color, 4), mask_4),
+                    _mm_slli_epi32(_mm_and_si128(x, mask_12), 4)
+                ),
+                _mm_or_si128(
+                    _mm_slli_epi32(_mm_srli_epi32(color, 8), 16),
+                    _mm_or_si128(
+                        _mm_slli_epi32(fx, 18),
+                        _mm_slli_epi32(z, 20)
+                    )
+                )
+            );
+            w = _mm_shuffle_epi32(w, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(words + (count - 4 - i) * 4),
+                w
+            );
+        }
+
+        // Narrow the 2-byte records to 16 bits. The values are sign extended
+        // from bit 15 first so that the saturating pack leaves them as they
+        // are.
+        if (halves) {
+            __m128i h = _mm_or_si128(
+                _mm_and_si128(color, mask_4),
+                _mm_slli_epi32(y, 4)
+            );
+            h = _mm_srai_epi32(_mm_slli_epi32(h, 16), 16);
+            h = _mm_packs_epi32(h, h);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(halves + i * 2), h);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        auto &vertex = elems[i];
+        uint32_t color = vertex.color_index;
+
+        if (words) {
+            uint32_t w = (color >> 4 & 0xF)
+                | (uint32_t(vertex.x) & 0xFFF) << 4
+                | (color >> 8) << 16
+                | uint32_t(vertex.fx) << 18
+                | uint32_t(vertex.z) << 20;
+            store_u32(words + (count - 1 - i) * 4, w);
+        }
+        if (halves) {
+            uint32_t h = (color & 0xF) | uint32_t(vertex.y) << 4;
+            store_u16(halves + i * 2, h);
+        }
+    }
+}
+
+static void encode_v2_triangles(
+    unsigned char *words,
+    unsigned char *halves,
+    const gfx::triangle *elems,
+    size_t count)
+{
+    size_t i = 0;
+#if DRNSF_WGEO_SSE2
+    for (; i + 4 <= count; i += 4) {
+        auto t = &elems[i];
+        if (words) {
+            __m128i v0 = _mm_setr_epi32(
+                t[0].v[0].vertex_index,
+                t[1].v[0].vertex_index,
+                t[2].v[0].vertex_index,
+                t[3].v[0].vertex_index
+            );
+            __m128i v1 = _mm_setr_epi32(
+                t[0].v[1].vertex_index,
+                t[1].v[1].vertex_index,
+                t[2].v[1].vertex_index,
+                t[3].v[1].vertex_index
+            );
+            __m128i unk0 = _mm_setr_epi32(
+                t[0].unk0,
+                t[1].unk0,
+                t[2].unk0,
+                t[3].unk0
+            );
+
+            __m128i w = _mm_or_si128(
+                unk0,
+                _mm_or_si128(_mm_slli_epi32(v0, 8), _mm_slli_epi32(v1, 20))
+            );
+            w = _mm_shuffle_epi32(w, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(words + (count - 4 - i) * 4),
+                w
+            );
+        }
+
+        if (halves) {
+            __m128i v2 = _mm_setr_epi32(
+                t[0].v[2].vertex_index,
+                t[1].v[2].vertex_index,
+                t[2].v[2].vertex_index,
+                t[3].v[2].vertex_index
+            );
+            __m128i unk1 = _mm_setr_epi32(
+                t[0].unk1,
+                t[1].unk1,
+                t[2].unk1,
+                t[3].unk1
+            );
+
+            __m128i h = _mm_or_si128(unk1, _mm_slli_epi32(v2, 4));
+            h = _mm_srai_epi32(_mm_slli_epi32(h, 16), 16);
+            h = _mm_packs_epi32(h, h);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(halves + i * 2), h);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        if (words) {
+            v2_triangle_word::encode(
+                words + (count - 1 - i) * 4,
+                get_v2_triangle_word(elems[i])
+            );
+        }
+        if (halves) {
+            v2_triangle_half::encode(
+                halves + i * 2,
+                get_v2_triangle_half(elems[i])
+            );
+        }
+    }
+}
+
+// (s-func) write_split_item
+// Writes a wgeo_v2 vertex or triangle item holding the given elements to `out',
+// encoding `pack_chunk_count' records at a time with `encode' (see
+// `encode_v2_vertices').
+template <typename T>
+static void write_split_item(
+    util::sink &out,
+    const std::vector<T> &elems,
+    void (*encode)(unsigned char *, unsigned char *, const T *, size_t))
+{
+    unsigned char buffer[pack_chunk_count * 4];
+    size_t count = elems.size();
+
+    // The 4-byte records are in reverse order, so encode the chunks from the
+    // last one to the first.
+    for (size_t end = count; end > 0;) {
+        size_t chunk_count = std::min(end, pack_chunk_count);
+        end -= chunk_count;
+        encode(buffer, nullptr, &elems[end], chunk_count);
+        out.write(buffer, chunk_count * 4);
+    }
+
+    for (size_t start = 0; start < count; start += pack_chunk_count) {
+        size_t chunk_count = std::min(count - start, pack_chunk_count);
+        encode(nullptr, buffer, &elems[start], chunk_count);
+        out.write(buffer, chunk_count * 2);
+    }
+
+    out.write_zeros(wgeo_v2_split_item_size(count) - count * 6);
+}
+
+// declared in nsf.hh
+size_t wgeo_v2_split_item_size(size_t count)
+{
+    return (count * 6 + 3) & ~size_t(3);
+}
+
+// declared in nsf.hh
+util::blob pack_wgeo_v2_vertices(
+    const std::vector<gfx::vertex> &vertices,
+    bool coords_unsigned)
+{
+    check_v2_vertices(vertices, coords_unsigned);
+
+    size_t count = vertices.size();
+    util::blob item(wgeo_v2_split_item_size(count));
+    encode_v2_vertices(
+        item.data(),
+        item.data() + count * 4,
+        vertices.data(),
+        count
+    );
+    return item;
+}
+
+// declared in nsf.hh
+void pack_wgeo_v2_vertices(
+    util::sink &out,
+    const std::vector<gfx::vertex> &vertices,
+    bool coords_unsigned)
+{
+    check_v2_vertices(vertices, coords_unsigned);
+    write_split_item(out, vertices, encode_v2_vertices);
+}
+
+// declared in nsf.hh
+util::blob pack_wgeo_v2_triangles(const std::vector<gfx::triangle> &triangles)
+{
+    check_v2_triangles(triangles);
+
+    size_t count = triangles.size();
+    util::blob item(wgeo_v2_split_item_size(count));
+    encode_v2_triangles(
+        item.data(),
+        item.data() + count * 4,
+        triangles.data(),
+        count
+    );
+    return item;
+}
+
+// declared in nsf.hh
+void pack_wgeo_v2_triangles(
+    util::sink &out,
+    const std::vector<gfx::triangle> &triangles)
+{
+    check_v2_triangles(triangles);
+    write_split_item(out, triangles, encode_v2_triangles);
+}
+
+// declared in nsf.hh
+util::blob pack_wgeo_v2_quads(const std::vector<gfx::quad> &quads)
+{
+    check_v2_quads(quads);
+
+    util::blob item(quads.size() * 8);
+    for (size_t i = 0; i < quads.size(); i++) {
+        v2_quad_record::encode(&item[i * 8], get_v2_quad_record(quads[i]));
+    }
+    return item;
+}
+
+// declared in nsf.hh
+void pack_wgeo_v2_quads(util::sink &out, const std::vector<gfx::quad> &quads)
+{
+    check_v2_quads(quads);
+
+    unsigned char buffer[pack_chunk_count * 8];
+    for (size_t start = 0; start < quads.size(); start += pack_chunk_count) {
+        size_t chunk_count = std::min(quads.size() - start, pack_chunk_count);
+        for (size_t i = 0; i < chunk_count; i++) {
+            v2_quad_record::encode(
+                &buffer[i * 8],
+                get_v2_quad_record(quads[start + i])
+            );
+        }
+        out.write(buffer, chunk_count * 8);
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) random_item
+// Returns an item of the given size filled with pseudo-random bytes.
+util::blob random_item(size_t size, uint32_t seed)
+{
+    util::blob item(size);
+    for (auto &&b : item) {
+        seed = seed * 1103515245 + 12345;
+        b = seed >> 24;
+    }
+    return item;
+}
+
+// (test) V2MatchesBinreader
+// Ensures the wgeo_v2 kernels give the same results as reading and writing each
+// record with a binreader or binwriter, for counts which do and do not fill
+// whole SIMD groups.
+TEST(nsf_wgeo_pack, V2MatchesBinreader)
+{
+    for (size_t count = 0; count < 11; count++) {
+        for (bool is_unsigned : { false, true }) {
+            auto item = random_item(wgeo_v2_split_item_size(count), count + 1);
+            std::fill(item.begin() + count * 6, item.end(), 0);
+
+            auto vertices = unpack_wgeo_v2_vertices(item, count, is_unsigned);
+            auto triangles = unpack_wgeo_v2_triangles(item, count);
+            auto read_coord = [&](util::binreader &r) {
+                return is_unsigned ? r.read_ubits(12) : r.read_sbits(12);
+            };
+            for (size_t i = 0; i < count; i++) {
+                util::binreader r;
+                r.begin(&item[(count - 1 - i) * 4], 4);
+                auto color_mid = r.read_ubits(4);
+                auto x = read_coord(r);
+                auto color_high = r.read_ubits(2);
+                auto fx = r.read_ubits(2);
+                auto z = read_coord(r);
+                r.end();
+                r.begin(&item[count * 4 + i * 2], 2);
+                auto color_low = r.read_ubits(4);
+                auto y = read_coord(r);
+                r.end();
+
+                EXPECT_EQ(vertices[i].x, x);
+                EXPECT_EQ(vertices[i].y, y);
+                EXPECT_EQ(vertices[i].z, z);
+                EXPECT_EQ(vertices[i].fx, fx);
+                EXPECT_EQ(
+                    vertices[i].color_index,
+                    color_low | color_mid << 4 | color_high << 8
+                );
+
+                r.begin(&item[(count - 1 - i) * 4], 4);
+                EXPECT_EQ(int64_t(triangles[i].unk0), r.read_ubits(8));
+                EXPECT_EQ(triangles[i].v[0].vertex_index, r.read_ubits(12));
+                EXPECT_EQ(triangles[i].v[1].vertex_index, r.read_ubits(12));
+                r.end();
+                r.begin(&item[count * 4 + i * 2], 2);
+                EXPECT_EQ(int64_t(triangles[i].unk1), r.read_ubits(4));
+                EXPECT_EQ(triangles[i].v[2].vertex_index, r.read_ubits(12));
+                r.end();
+            }
+            EXPECT_EQ(pack_wgeo_v2_triangles(triangles), item);
+
+            // Bring the coordinates into the range allowed when packing, and
+            // compare against writing the records with a binwriter.
+            for (auto &&vertex : vertices) {
+                for (auto &&coord : vertex.v) {
+                    if (is_unsigned) {
+                        coord &= 0x7FF;
+                    }
+                    if (coord == 2047) {
+                        coord = 0;
+                    }
+                }
+            }
+            util::binwriter w;
+            w.begin();
+            for (auto &&vertex : util::reverse_of(vertices)) {
+                w.write_ubits(4, (vertex.color_index >> 4) & 0xF);
+                w.write_sbits(12, vertex.x);
+                w.write_ubits(2, (vertex.color_index >> 8) & 0x3);
+                w.write_ubits(2, vertex.fx);
+                w.write_sbits(12, vertex.z);
+            }
+            for (auto &&vertex : vertices) {
+                w.write_ubits(4, vertex.color_index & 0xF);
+                w.write_sbits(12, vertex.y);
+            }
+            w.pad(4);
+            EXPECT_EQ(pack_wgeo_v2_vertices(vertices, is_unsigned), w.end());
+        }
+
+        auto quad_item = random_item(count * 8, count + 100);
+        auto quads = unpack_wgeo_v2_quads(quad_item, count);
+        EXPECT_EQ(pack_wgeo_v2_quads(quads), quad_item);
+    }
+}
+
+// (test) DISABLED_QuadBenchmark
+// Compares converting quad items with `unpack_wgeo_v2_quads' and
+// `pack_wgeo_v2_quads' against reading and writing each field with a binreader
+// or binwriter, and against shifting each field out of the record by hand. To
+// run this, use:
+//
+//   drnsf :internal-test --gtest_also_run_disabled_tests
+//     --gtest_filter=*QuadBenchmark*
+TEST(nsf_wgeo_pack, DISABLED_QuadBenchmark)
+{
+    const size_t count = 65536;
+    const int rounds = 32;
+    auto item = random_item(count * 8, 1);
+    int64_t result = 0;
+
+    auto report = [&](const char *name, long time) {
+        std::cout
+            << name
+            << ": "
+            << double(count) * rounds / std::max(time, 1L) / 1000
+            << " records/us"
+            << std::endl;
+    };
+
+    util::stopwatch sw;
+    for (int round = 0; round < rounds; round++) {
+        std::vector<gfx::quad> quads(count);
+        util::binreader r;
+        r.begin(item);
+        for (auto &&quad : quads) {
+            quad.unk0 = r.read_ubits(8);
+            quad.v[0].vertex_index = r.read_ubits(12);
+            quad.v[1].vertex_index = r.read_ubits(12);
+            quad.unk1 = r.read_ubits(8);
+            quad.v[2].vertex_index = r.read_ubits(12);
+            quad.v[3].vertex_index = r.read_ubits(12);
+            for (auto &&corner : quad.v) {
+                corner.color_index = -1;
+            }
+        }
+        r.end();
+        result += quads[round].v[3].vertex_index;
+    }
+    report("decode (binreader)", sw.lap());
+
+    for (int round = 0; round < rounds; round++) {
+        std::vector<gfx::quad> quads(count);
+        for (size_t i = 0; i < count; i++) {
+            auto &quad = quads[i];
+            auto record = load_u64(&item[i * 8]);
+            quad.v[0].vertex_index = record >> 8 & 0xFFF;
+            quad.v[1].vertex_index = record >> 20 & 0xFFF;
+            quad.v[2].vertex_index = record >> 40 & 0xFFF;
+            quad.v[3].vertex_index = record >> 52;
+            for (auto &&corner : quad.v) {
+                corner.color_index = -1;
+            }
+            quad.unk0 = record & 0xFF;
+            quad.unk1 = record >> 32 & 0xFF;
+        }
+        result += quads[round].v[3].vertex_index;
+    }
+    report("decode (by hand)", sw.lap());
+
+    std::vector<gfx::quad> quads;
+    for (int round = 0; round < rounds; round++) {
+        quads = unpack_wgeo_v2_quads(item, count);
+        result += quads[round].v[3].vertex_index;
+    }
+    report("decode (unpack_wgeo_v2_quads)", sw.lap());
+
+    for (int round = 0; round < rounds; round++) {
+        util::binwriter w;
+        w.begin();
+        for (auto &&quad : quads) {
+            w.write_ubits(8, quad.unk0);
+            w.write_ubits(12, quad.v[0].vertex_index);
+            w.write_ubits(12, quad.v[1].vertex_index);
+            w.write_ubits(8, quad.unk1);
+            w.write_ubits(12, quad.v[2].vertex_index);
+            w.write_ubits(12, quad.v[3].vertex_index);
+        }
+        result += w.end()[round];
+    }
+    report("encode (binwriter)", sw.lap());
+
+    for (int round = 0; round < rounds; round++) {
+        result += pack_wgeo_v2_quads(quads)[round];
+    }
+    report("encode (pack_wgeo_v2_quads)", sw.lap());
+
+    std::cout << "(result " << result << ")" << std::endl;
+}
+
+}
+#endif
+
+}
+}
@@ -19,11 +19,37 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 
 namespace drnsf {
 namespace nsf {
 
+// (typedef) texinfo_color_record
+// The first 4-byte record of a texinfo, which gives its color, and which is
+// followed by a `texinfo_tex_record' if the texinfo is textured (type 1).
+using texinfo_color_record = util::bit_record<
+    util::ubits<8>, // blue
+    util::ubits<8>, // green
+    util::ubits<8>, // red
+    util::ubits<4>, // clut x
+    util::ubits<1>, // unused
+    util::ubits<2>, // semi-transparency
+    util::ubits<1>  // type
+>;
+
+// (typedef) texinfo_tex_record
+// The second 4-byte record of a textured texinfo.
+using texinfo_tex_record = util::bit_record<
+    util::ubits<5>, // y offset
+    util::ubits<1>, // unused
+    util::ubits<7>, // clut y
+    util::ubits<5>, // x offset
+    util::ubits<2>, // segment
+    util::ubits<2>, // color mode
+    util::ubits<10> // region index
+>;
+
 // declared in res.hh
 void wgeo_v1::import_entry(TRANSACT, const std::vector<util::blob> &items)
 {
@@ -41,62 +67,55 @@ void wgeo_v1::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the info item (0).
     r.begin(item_info);
-    auto world_x        = r.read_s32();
-    auto world_z        = r.read_s32();
-    auto world_y        = r.read_s32();
-    auto triangle_count = r.read_u32();
-    auto vertex_count   = r.read_u32();
-    auto texinfo_count  = r.read_u32();
-    auto tpag_ref_count = r.read_u32();
-    auto is_backdrop    = r.read_u32();
+    auto info = r.read_record(0x40);
+    auto world_x        = info.read_s32();
+    auto world_z        = info.read_s32();
+    auto world_y        = info.read_s32();
+    auto triangle_count = info.read_u32();
+    auto vertex_count   = info.read_u32();
+    auto texinfo_count  = info.read_u32();
+    auto tpag_ref_count = info.read_u32();
+    auto is_backdrop    = info.read_u32();
 
     uint32_t tpag_refs[8];
     for (int i = 0; i < 8; i++) {
-        tpag_refs[i] = r.read_u32();
+        tpag_refs[i] = info.read_u32();
     }
     r.end_early();
 
+    // Ensure the texinfo count is correct.
+    if (texinfo_count > (item_info.size() - 0x40) / 4)
+        throw res::import_error("nsf::wgeo_v1: bad texinfo count");
+
+    // Parse the texinfos.
     std::vector<gfx::texinfo> texinfos(texinfo_count);
     for (auto &&i : util::range_of(texinfos)) {
         auto &texinfo = texinfos[i];
         
-        r.begin(&item_info[0x40 + (i * 4)], 4);
-        auto cb         = r.read_ubits(8);
-        auto cg         = r.read_ubits(8);
-        auto cr         = r.read_ubits(8);
-        auto clut_x     = r.read_ubits(4);
-        r.discard_bits(1);
-        auto semi_trans = r.read_ubits(2);
-        auto type       = r.read_ubits(1);
-        r.end();
+        auto color = texinfo_color_record::decode(&item_info[0x40 + i * 4]);
+        auto type = color[6];
 
         if (type == 1) {
             if (i == texinfo_count-1) {
                 break;
             }
-            r.begin(&item_info[0x40 + ((i+1) * 4)], 4);
-            auto y_offs       = r.read_ubits(5);
-            r.discard_bits(1);
-            auto clut_y       = r.read_ubits(7);
-            auto x_offs       = r.read_ubits(5);
-            auto segment      = r.read_ubits(2);
-            auto color_mode   = r.read_ubits(2);
-            auto region_index = r.read_ubits(10);
-            r.end();
-
-            texinfo.color_mode   = color_mode;
-            texinfo.segment      = segment;
-            texinfo.x_offs       = x_offs;
-            texinfo.y_offs       = y_offs;
-            texinfo.region_index = region_index;
-            texinfo.clut_x       = clut_x;
-            texinfo.clut_y       = clut_y;
-            texinfo.semi_trans   = semi_trans;
+            auto tex = texinfo_tex_record::decode(
+                &item_info[0x40 + (i + 1) * 4]
+            );
+
+            texinfo.color_mode   = tex[5];
+            texinfo.segment      = tex[4];
+            texinfo.x_offs       = tex[3];
+            texinfo.y_offs       = tex[0];
+            texinfo.region_index = tex[6];
+            texinfo.clut_x       = color[3];
+            texinfo.clut_y       = tex[2];
+            texinfo.semi_trans   = color[5];
         }
         texinfo.type    = type;
-        texinfo.color.r = cr;
-        texinfo.color.g = cg;
-        texinfo.color.b = cb;
+        texinfo.color.r = color[2];
+        texinfo.color.g = color[1];
+        texinfo.color.b = color[0];
     }
 
     // Ensure the triangle count is correct.
@@ -104,75 +123,23 @@ void wgeo_v1::import_entry(TRANSACT, const std::vector<util::blob> &items)
         throw res::import_error("nsf::wgeo_v1: bad triangle item size");
 
     // Parse the triangles.
-    std::vector<gfx::triangle> triangles(triangle_count);
-    for (auto &&i : util::range_of(triangles)) {
-        auto &triangle = triangles[i];
-
-        // TODO - explain triangle format here
-
-        r.begin(&item_triangles[i * 8], 8);
-        auto triangle_unk0 = r.read_ubits(5);
-        auto tpag_index    = r.read_ubits(3);
-        auto tinf_index    = r.read_ubits(12);
-        auto vertex0       = r.read_ubits(12);
-        auto triangle_unk1 = r.read_ubits(8);
-        auto vertex1       = r.read_ubits(12);
-        auto vertex2       = r.read_ubits(12);
-        r.end();
-
-        triangle.v[0].vertex_index = vertex0;
-        triangle.v[1].vertex_index = vertex1;
-        triangle.v[2].vertex_index = vertex2;
-
-        triangle.v[0].color_index = -1;
-        triangle.v[1].color_index = -1;
-        triangle.v[2].color_index = -1;
-
-        triangle.tpag_index = tpag_index;
-        triangle.tinf_index = tinf_index;
-
-        triangle.unk0 = triangle_unk0;
-        triangle.unk1 = triangle_unk1;
-    }
+    auto triangles = unpack_wgeo_v1_triangles(item_triangles, triangle_count);
 
     // Ensure the vertex count is correct.
     if (vertex_count != item_vertices.size() / 8)
         throw res::import_error("nsf::wgeo_v1: bad vertex item size");
     
     // Parse the vertices.
-    std::vector<gfx::vertex> vertices(vertex_count);
-    for (auto &&i : util::range_of(vertices)) {
-        auto &vertex = vertices[i];
-
-        // TODO - explain vertex format here
-        r.begin(&item_vertices[i * 8], 8);
-        auto cb = r.read_ubits(8);
-        auto cg = r.read_ubits(8);
-        auto cr = r.read_ubits(8);
-        auto y1 = r.read_ubits(8);
-        auto fx = r.read_ubits(1);
-        auto y2 = r.read_ubits(2);
-        auto x  = r.read_sbits(13);
-        auto y3 = r.read_sbits(3);
-        auto z  = r.read_sbits(13);
-        r.end();
-
-        vertex.x = x;
-        vertex.y = y1 | (y2 << 8) | (y3 << 10);
-        vertex.z = z;
-
-        vertex.fx = fx | 4;
-
-        vertex.color.r = cr;
-        vertex.color.g = cg;
-        vertex.color.b = cb;
-    }
+    auto vertices = unpack_wgeo_v1_vertices(item_vertices, vertex_count);
 
     // Ensure the tpag ref count is viable.
     if (tpag_ref_count > 8)
         throw res::import_error("nsf::wgeo_v1: bad tpag ref count");
 
-    // Parse the tpag references.
+    // Parse the tpag references. The EID index is only set up if a texture
+    // page needs to be looked up, see below.
+    eid_index index;
+    const archive *arc = nullptr;
     std::vector<gfx::texture::ref> textures(tpag_ref_count);
     for (auto &&i : util::range_of(textures)) {
         auto &texture = textures[i];
@@ -182,6 +149,29 @@ void wgeo_v1::import_entry(TRANSACT, const std::vector<util::blob> &items)
             / "$"_fmt(eid(tpag_refs[i]));
 
         texture = t_name;
+
+        // A texture page which shares the texture of an identical page
+        // imported before it has no texture of its own under its EID (see
+        // `tpage::import_staged'), so use the texture page's texture instead.
+        // If this entry is in an archive, only that archive's texture pages
+        // are used, as other archives may have pages with the same EIDs.
+        if (!texture.ok()) {
+            if (!index.get_proj()) {
+                index.set_proj(&get_proj());
+                eid_index::location loc;
+                if (index.find_location(get_name(), loc)) {
+                    arc = loc.arc;
+                }
+            }
+
+            auto tp = dynamic_cast<tpage *>(
+                arc ? index.find(tpag_refs[i], arc) : index.find(tpag_refs[i])
+            );
+            if (tp) {
+                texture = tp->get_texture();
+            }
+        }
+
         if (!texture)
             throw res::import_error("nsf::wgeo_v1: invalid tpag ref");
     }    
@@ -238,77 +228,88 @@ void wgeo_v1::import_entry(TRANSACT, const std::vector<util::blob> &items)
     set_world(TS, world);
 }
 
-// declared in nsf.hh
-std::vector<util::blob> wgeo_v1::export_entry(uint32_t &out_type) const
+// (s-var) record_chunk_count
+// The number of vertex or triangle records encoded at a time into a buffer on
+// the stack.
+static constexpr size_t record_chunk_count = 64;
+
+// (s-struct) export_parts
+// The assets a wgeo_v1 entry is exported from.
+struct export_parts {
+    gfx::world::ref world;
+    gfx::mesh::ref mesh;
+    gfx::frame::ref frame;
+};
+
+// (s-func) find_export_parts
+// Finds the assets the given entry is exported from. Returns null if they were
+// found, or the message of the export error to throw otherwise.
+static const char *find_export_parts(const wgeo_v1 &entry, export_parts &out)
 {
-    assert_alive();
-
-    util::binwriter w;
-
-    out_type = 3;
-    std::vector<util::blob> items(3);
-
-    auto &item_info      = items[0];
-    auto &item_triangles = items[1];
-    auto &item_vertices  = items[2];
-
-    auto &&world = get_world();
+    auto &&world = entry.get_world();
     if (!world.ok())
-        throw res::export_error("nsf::wgeo_v1: bad world ref");
+        return "nsf::wgeo_v1: bad world ref";
 
     auto &&model = world->get_model();
     if (!model.ok())
-        throw res::export_error("nsf::wgeo_v1: bad model ref");
+        return "nsf::wgeo_v1: bad model ref";
 
     auto &&mesh = model->get_mesh();
     if (!mesh.ok())
-        throw res::export_error("nsf::wgeo_v1: bad mesh ref");
+        return "nsf::wgeo_v1: bad mesh ref";
 
     auto &&anim = model->get_anim();
     if (!anim.ok())
-        throw res::export_error("nsf::wgeo_v1: bad anim ref");
+        return "nsf::wgeo_v1: bad anim ref";
 
     auto &&frames = anim->get_frames();
     if (frames.size() != 1)
-        throw res::export_error("nsf::wgeo_v1: invalid frame count");
+        return "nsf::wgeo_v1: invalid frame count";
 
     auto &&frame = frames[0];
     if (!frame.ok())
-        throw res::export_error("nsf::wgeo_v1: bad frame ref");
+        return "nsf::wgeo_v1: bad frame ref";
+
+    out.world = world;
+    out.mesh = mesh;
+    out.frame = frame;
+    return nullptr;
+}
+
+// (s-func) get_item_sizes
+// Sets `out' to the sizes of the info, triangle and vertex items of an entry
+// exported from the given assets.
+static void get_item_sizes(const export_parts &parts, size_t (&out)[3])
+{
+    out[0] = 16 * 4;
+    out[1] = parts.mesh->get_triangles().size() * 8;
+    out[2] = parts.frame->get_vertices().size() * 8;
+}
+
+// (s-func) write_items
+// Writes the items of the given entry, exported from the given assets, to
+// `out'. An export error is thrown if the assets do not fit this format. This
+// does not allocate.
+static void write_items(
+    util::sink &out,
+    const wgeo_v1 &entry,
+    const export_parts &parts)
+{
+    auto &&triangles = parts.mesh->get_triangles();
+    auto &&vertices = parts.frame->get_vertices();
 
     // Check the scale to ensure it matches this format.
-    if (frame->get_x_scale() != 8.0f ||
-        frame->get_y_scale() != 8.0f ||
-        frame->get_z_scale() != 8.0f) {
+    if (parts.frame->get_x_scale() != 8.0f ||
+        parts.frame->get_y_scale() != 8.0f ||
+        parts.frame->get_z_scale() != 8.0f) {
         // TODO - consider proximity tests instead of exact equality tests
         throw res::export_error("nsf::wgeo_v1: scale is invalid");
     }
 
-    // Export the info item (0).
-    w.begin();
-    w.write_s32(world->get_x());
-    w.write_s32(world->get_z());
-    w.write_s32(world->get_y());
-    w.write_u32(mesh->get_triangles().size());
-    w.write_u32(frame->get_vertices().size());
-    w.write_u32(0); // for now
-    w.write_u32(get_tpag_ref_count());
-    w.write_u32(0); // for now
-    w.write_u32(get_tpag_ref0());
-    w.write_u32(get_tpag_ref1());
-    w.write_u32(get_tpag_ref2());
-    w.write_u32(get_tpag_ref3());
-    w.write_u32(get_tpag_ref4());
-    w.write_u32(get_tpag_ref5());
-    w.write_u32(get_tpag_ref6());
-    w.write_u32(get_tpag_ref7());
-    item_info = w.end();
-
-    // Export the vertices.
+    // Check the vertices, which are written without checks below.
     const int COORD_MIN = -(1 << 12);
     const int COORD_MAX = (1 << 12) - 1;
-    w.begin();
-    for (auto &&vertex : frame->get_vertices()) {
+    for (auto &&vertex : vertices) {
         int x = vertex.x;
         int y = vertex.y;
         int z = vertex.z;
@@ -318,39 +319,147 @@ std::vector<util::blob> wgeo_v1::export_entry(uint32_t &out_type) const
             z < COORD_MIN || z >= COORD_MAX) {
             throw res::export_error("nsf::wgeo_v1: vertex x/y/z out of range");
         }
+    }
 
-        unsigned int y1 = y & 0xFF;
-        unsigned int y2 = (y >> 8) & 0x3;
-        signed int y3 = (y >> 10) & 0x7;
-
-        w.write_ubits( 1, vertex.fx);
-        w.write_ubits( 2, y2);
-        w.write_ubits(13, z);
-        w.write_sbits( 3, y3);
-        w.write_sbits(13, x);
-        w.write_ubits( 8, vertex.color.b);
-        w.write_ubits( 8, vertex.color.g);
-        w.write_ubits( 8, vertex.color.r);
-        w.write_ubits( 8, y1);
+    // Write the info item (0).
+    out.write_u32(parts.world->get_x());
+    out.write_u32(parts.world->get_z());
+    out.write_u32(parts.world->get_y());
+    out.write_u32(triangles.size());
+    out.write_u32(vertices.size());
+    out.write_u32(0); // for now
+    out.write_u32(entry.get_tpag_ref_count());
+    out.write_u32(0); // for now
+    out.write_u32(entry.get_tpag_ref0());
+    out.write_u32(entry.get_tpag_ref1());
+    out.write_u32(entry.get_tpag_ref2());
+    out.write_u32(entry.get_tpag_ref3());
+    out.write_u32(entry.get_tpag_ref4());
+    out.write_u32(entry.get_tpag_ref5());
+    out.write_u32(entry.get_tpag_ref6());
+    out.write_u32(entry.get_tpag_ref7());
+
+    // Write the triangles (1) and vertices (2) a chunk at a time. Each record
+    // is 8 bytes, so the items need no padding.
+    unsigned char buffer[record_chunk_count * 8];
+    util::binwriter w;
+    for (size_t start = 0, end; start < triangles.size(); start = end) {
+        end = std::min(start + record_chunk_count, triangles.size());
+        w.begin(buffer, sizeof(buffer));
+        for (size_t i = start; i < end; i++) {
+            auto &triangle = triangles[i];
+            w.write_ubits(8, triangle.unk0);
+            w.write_ubits(12, triangle.v[0].vertex_index);
+            w.write_ubits(12, triangle.v[1].vertex_index);
+            w.write_ubits(8, triangle.unk1);
+            w.write_ubits(12, 0); // for now
+            w.write_ubits(12, triangle.v[2].vertex_index);
+        }
+        out.write(buffer, w.end_external());
     }
-    w.pad(4);
-    item_vertices = w.end();
-
-    // Export the triangles.
-    w.begin();
-    for (auto &&triangle : mesh->get_triangles()) {
-        w.write_ubits(8, triangle.unk0);
-        w.write_ubits(12, triangle.v[0].vertex_index);
-        w.write_ubits(12, triangle.v[1].vertex_index);
-        w.write_ubits(8, triangle.unk1);
-        w.write_ubits(12, 0); // for now
-        w.write_ubits(12, triangle.v[2].vertex_index);
+    for (size_t start = 0, end; start < vertices.size(); start = end) {
+        end = std::min(start + record_chunk_count, vertices.size());
+        w.begin(buffer, sizeof(buffer));
+        for (size_t i = start; i < end; i++) {
+            auto &vertex = vertices[i];
+            int y = vertex.y;
+            unsigned int y1 = y & 0xFF;
+            unsigned int y2 = (y >> 8) & 0x3;
+            signed int y3 = (y >> 10) & 0x7;
+
+            w.write_ubits( 1, vertex.fx);
+            w.write_ubits( 2, y2);
+            w.write_ubits(13, vertex.z);
+            w.write_sbits( 3, y3);
+            w.write_sbits(13, vertex.x);
+            w.write_ubits( 8, vertex.color.b);
+            w.write_ubits( 8, vertex.color.g);
+            w.write_ubits( 8, vertex.color.r);
+            w.write_ubits( 8, y1);
+        }
+        out.write(buffer, w.end_external());
     }
-    w.pad(4);
-    item_triangles = w.end();
+}
+
+// declared in nsf.hh
+std::vector<util::blob> wgeo_v1::export_entry(uint32_t &out_type) const
+{
+    assert_alive();
+
+    export_parts parts;
+    if (auto error = find_export_parts(*this, parts))
+        throw res::export_error(error);
+
+    size_t item_sizes[3];
+    get_item_sizes(parts, item_sizes);
 
+    // Write the items one after another, and then split them up.
+    util::blob data;
+    auto info = get_entry_info(item_sizes, 3);
+    data.reserve(info.size - info.first_item_offset);
+    util::blob_sink out(data);
+    write_items(out, *this, parts);
+
+    out_type = 3;
+    std::vector<util::blob> items(3);
+    auto p = data.begin();
+    for (auto &&i : util::range_of(items)) {
+        items[i].assign(p, p + item_sizes[i]);
+        p += item_sizes[i];
+    }
     return items;
 }
 
+// declared in nsf.hh
+bool wgeo_v1::get_export_info(pagelet_info &out) const
+{
+    assert_alive();
+
+    // Leave invalid refs to `export_entry', which reports them.
+    export_parts parts;
+    if (find_export_parts(*this, parts))
+        return false;
+
+    size_t item_sizes[3];
+    get_item_sizes(parts, item_sizes);
+    out = get_entry_info(item_sizes, 3);
+    return true;
+}
+
+// declared in nsf.hh
+void wgeo_v1::export_entry_into(util::sink &out) const
+{
+    assert_alive();
+
+    export_parts parts;
+    if (auto error = find_export_parts(*this, parts))
+        throw res::export_error(error);
+
+    size_t item_sizes[3];
+    get_item_sizes(parts, item_sizes);
+    write_entry_header(out, get_eid(), 3, item_sizes, 3);
+    write_items(out, *this, parts);
+}
+
+// declared in nsf.hh
+std::vector<eid> wgeo_v1::get_refs() const
+{
+    assert_alive();
+
+    const uint32_t tpag_refs[8] = {
+        get_tpag_ref0(),
+        get_tpag_ref1(),
+        get_tpag_ref2(),
+        get_tpag_ref3(),
+        get_tpag_ref4(),
+        get_tpag_ref5(),
+        get_tpag_ref6(),
+        get_tpag_ref7()
+    };
+
+    auto count = std::min<uint32_t>(get_tpag_ref_count(), 8);
+    return std::vector<eid>(tpag_refs, tpag_refs + count);
+}
+
 }
 }
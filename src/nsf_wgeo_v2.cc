@@ -19,8 +19,13 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
 namespace drnsf {
 namespace nsf {
 
@@ -45,25 +50,26 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the info item (0).
     r.begin(item_info);
-    auto world_x        = r.read_s32();
-    auto world_z        = r.read_s32();
-    auto world_y        = r.read_s32();
-    auto info_unk0      = r.read_u32();
-    auto vertex_count   = r.read_u32();
-    auto triangle_count = r.read_u32();
-    auto quad_count     = r.read_u32();
-    auto item4_count    = r.read_u32();
-    auto color_count    = r.read_u32();
-    auto item6_count    = r.read_u32();
-    auto tpag_ref_count = r.read_u32();
-    auto tpag_ref0      = r.read_u32();
-    auto tpag_ref1      = r.read_u32();
-    auto tpag_ref2      = r.read_u32();
-    auto tpag_ref3      = r.read_u32();
-    auto tpag_ref4      = r.read_u32();
-    auto tpag_ref5      = r.read_u32();
-    auto tpag_ref6      = r.read_u32();
-    auto tpag_ref7      = r.read_u32();
+    auto info = r.read_record(0x4C);
+    auto world_x        = info.read_s32();
+    auto world_z        = info.read_s32();
+    auto world_y        = info.read_s32();
+    auto info_unk0      = info.read_u32();
+    auto vertex_count   = info.read_u32();
+    auto triangle_count = info.read_u32();
+    auto quad_count     = info.read_u32();
+    auto item4_count    = info.read_u32();
+    auto color_count    = info.read_u32();
+    auto item6_count    = info.read_u32();
+    auto tpag_ref_count = info.read_u32();
+    auto tpag_ref0      = info.read_u32();
+    auto tpag_ref1      = info.read_u32();
+    auto tpag_ref2      = info.read_u32();
+    auto tpag_ref3      = info.read_u32();
+    auto tpag_ref4      = info.read_u32();
+    auto tpag_ref5      = info.read_u32();
+    auto tpag_ref6      = info.read_u32();
+    auto tpag_ref7      = info.read_u32();
     r.end();
 
     // Ensure the vertex count is correct.
@@ -71,99 +77,25 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
         throw res::import_error("nsf::wgeo_v2: bad vertex item size");
 
     // Parse the vertices.
-    std::vector<gfx::vertex> vertices(vertex_count);
-    for (auto &&i : util::range_of(vertices)) {
-        auto &vertex = vertices[i];
-
-        // TODO - explain vertex format here
-
-        r.begin(&item_vertices[(vertex_count - 1 - i) * 4], 4);
-        auto color_mid  = r.read_ubits(4);
-        auto x          = ver == nsf::game_ver::crash3 ? r.read_ubits(12) : r.read_sbits(12);
-        auto color_high = r.read_ubits(2);
-        auto fx         = r.read_ubits(2);
-        auto z          = ver == nsf::game_ver::crash3 ? r.read_ubits(12) : r.read_sbits(12);
-        r.end();
-
-        r.begin(&item_vertices[vertex_count * 4 + i * 2], 2);
-        auto color_low = r.read_ubits(4);
-        auto y         = ver == nsf::game_ver::crash3 ? r.read_ubits(12) : r.read_sbits(12);
-        r.end();
-
-        vertex.x = x;
-        vertex.y = y;
-        vertex.z = z;
-
-        vertex.fx = fx;
-
-        vertex.color_index = color_low | color_mid << 4 | color_high << 8;
-    }
+    auto vertices = unpack_wgeo_v2_vertices(
+        item_vertices,
+        vertex_count,
+        ver == nsf::game_ver::crash3
+    );
 
     // Ensure the triangle count is correct.
     if (triangle_count != item_triangles.size() / 6)
         throw res::import_error("nsf::wgeo_v2: bad triangle item size");
 
     // Parse the triangles.
-    std::vector<gfx::triangle> triangles(triangle_count);
-    for (auto &&i : util::range_of(triangles)) {
-        auto &triangle = triangles[i];
-
-        // TODO - explain triangle format here
-
-        r.begin(&item_triangles[(triangle_count - 1 - i) * 4], 4);
-        auto triangle_unk0 = r.read_ubits(8);
-        auto vertex0       = r.read_ubits(12);
-        auto vertex1       = r.read_ubits(12);
-        r.end();
-
-        r.begin(&item_triangles[triangle_count * 4 + i * 2], 2);
-        auto triangle_unk1 = r.read_ubits(4);
-        auto vertex2       = r.read_ubits(12);
-        r.end();
-
-        triangle.v[0].vertex_index = vertex0;
-        triangle.v[1].vertex_index = vertex1;
-        triangle.v[2].vertex_index = vertex2;
-
-        triangle.v[0].color_index = -1;
-        triangle.v[1].color_index = -1;
-        triangle.v[2].color_index = -1;
-
-        triangle.unk0 = triangle_unk0;
-        triangle.unk1 = triangle_unk1;
-    }
+    auto triangles = unpack_wgeo_v2_triangles(item_triangles, triangle_count);
 
     // Ensure the quad count is correct.
     if (quad_count != item_quads.size() / 8)
         throw res::import_error("nsf::wgeo_v2: bad quad item size");
 
     // Parse the quads.
-    std::vector<gfx::quad> quads(quad_count);
-    r.begin(item_quads);
-    for (auto &&quad : quads) {
-        // TODO - explain quad format here
-
-        auto quad_unk0 = r.read_ubits(8);
-        auto vertex0   = r.read_ubits(12);
-        auto vertex1   = r.read_ubits(12);
-        auto quad_unk1 = r.read_ubits(8);
-        auto vertex2   = r.read_ubits(12);
-        auto vertex3   = r.read_ubits(12);
-
-        quad.v[0].vertex_index = vertex0;
-        quad.v[1].vertex_index = vertex1;
-        quad.v[2].vertex_index = vertex2;
-        quad.v[3].vertex_index = vertex3;
-
-        quad.v[0].color_index = -1;
-        quad.v[1].color_index = -1;
-        quad.v[2].color_index = -1;
-        quad.v[3].color_index = -1;
-
-        quad.unk0 = quad_unk0;
-        quad.unk1 = quad_unk1;
-    }
-    r.end();
+    auto quads = unpack_wgeo_v2_quads(item_quads, quad_count);
 
     // Ensure the item4 count is correct.
     if (item4_count != item_4.size() / 12)
@@ -179,13 +111,14 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Parse the colors.
     std::vector<gfx::rgb888> colors(color_count);
     r.begin(item_colors);
+    auto color_data = r.read_record(color_count * 4);
     for (auto &&color : colors) {
         // TODO - explain color format here
 
-        color.r = r.read_u8();
-        color.g = r.read_u8();
-        color.b = r.read_u8();
-        auto ex = r.read_u8();
+        color.r = color_data.read_u8();
+        color.g = color_data.read_u8();
+        color.b = color_data.read_u8();
+        auto ex = color_data.read_u8();
 
         if (ex != 0)
             throw res::import_error("nsf::wgeo_v2: bad extra color byte");
@@ -261,47 +194,77 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     set_world(TS, world);
 }
 
-// declared in nsf.hh
-std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
+// (s-struct) export_parts
+// The assets a wgeo_v2 entry is exported from.
+struct export_parts {
+    gfx::world::ref world;
+    gfx::mesh::ref mesh;
+    gfx::frame::ref frame;
+};
+
+// (s-func) find_export_parts
+// Finds the assets the given entry is exported from. Returns null if they were
+// found, or the message of the export error to throw otherwise.
+static const char *find_export_parts(const wgeo_v2 &entry, export_parts &out)
 {
-    assert_alive();
-
-    util::binwriter w;
-
-    out_type = 3;
-    std::vector<util::blob> items(7);
-
-    auto &item_info      = items[0];
-    auto &item_vertices  = items[1];
-    auto &item_triangles = items[2];
-    auto &item_quads     = items[3];
-    auto &item_4         = items[4];
-    auto &item_colors    = items[5];
-    auto &item_6         = items[6];
-
-    auto &&world = get_world();
+    auto &&world = entry.get_world();
     if (!world.ok())
-        throw res::export_error("nsf::wgeo_v2: bad world ref");
+        return "nsf::wgeo_v2: bad world ref";
 
     auto &&model = world->get_model();
     if (!model.ok())
-        throw res::export_error("nsf::wgeo_v2: bad model ref");
+        return "nsf::wgeo_v2: bad model ref";
 
     auto &&mesh = model->get_mesh();
     if (!mesh.ok())
-        throw res::export_error("nsf::wgeo_v2: bad mesh ref");
+        return "nsf::wgeo_v2: bad mesh ref";
 
     auto &&anim = model->get_anim();
     if (!anim.ok())
-        throw res::export_error("nsf::wgeo_v2: bad anim ref");
+        return "nsf::wgeo_v2: bad anim ref";
 
     auto &&frames = anim->get_frames();
     if (frames.size() != 1)
-        throw res::export_error("nsf::wgeo_v2: invalid frame count");
+        return "nsf::wgeo_v2: invalid frame count";
 
     auto &&frame = frames[0];
     if (!frame.ok())
-        throw res::export_error("nsf::wgeo_v2: bad frame ref");
+        return "nsf::wgeo_v2: bad frame ref";
+
+    out.world = world;
+    out.mesh = mesh;
+    out.frame = frame;
+    return nullptr;
+}
+
+// (s-func) get_item_sizes
+// Sets `out' to the sizes of the seven items of the given entry, exported from
+// the given assets.
+static void get_item_sizes(
+    const wgeo_v2 &entry,
+    const export_parts &parts,
+    size_t (&out)[7])
+{
+    out[0] = 19 * 4;
+    out[1] = wgeo_v2_split_item_size(parts.frame->get_vertices().size());
+    out[2] = wgeo_v2_split_item_size(parts.mesh->get_triangles().size());
+    out[3] = parts.mesh->get_quads().size() * 8;
+    out[4] = entry.get_item4().size();
+    out[5] = parts.mesh->get_colors().size() * 4;
+    out[6] = entry.get_item6().size();
+}
+
+// (s-func) write_items
+// Writes the items of the given entry, exported from the given assets, to
+// `out'. An export error is thrown if the assets do not fit this format. This
+// does not allocate.
+static void write_items(
+    util::sink &out,
+    const wgeo_v2 &entry,
+    const export_parts &parts)
+{
+    auto &&mesh = parts.mesh;
+    auto &&frame = parts.frame;
 
     // Check the scale to ensure it matches this format.
     if (frame->get_x_scale() != 16.0f ||
@@ -311,135 +274,244 @@ std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
         throw res::export_error("nsf::wgeo_v2: scale is invalid");
     }
 
-    // Export the info item (0).
-    w.begin();
-    w.write_s32(world->get_x());
-    w.write_s32(world->get_z());
-    w.write_s32(world->get_y());
-    w.write_u32(get_info_unk0());
-    w.write_u32(frame->get_vertices().size());
-    w.write_u32(mesh->get_triangles().size());
-    w.write_u32(mesh->get_quads().size());
-    w.write_u32(get_item4().size() / 12);
-    w.write_u32(mesh->get_colors().size());
-    w.write_u32(get_item6().size() / 4);
-    w.write_u32(get_tpag_ref_count());
-    w.write_u32(get_tpag_ref0());
-    w.write_u32(get_tpag_ref1());
-    w.write_u32(get_tpag_ref2());
-    w.write_u32(get_tpag_ref3());
-    w.write_u32(get_tpag_ref4());
-    w.write_u32(get_tpag_ref5());
-    w.write_u32(get_tpag_ref6());
-    w.write_u32(get_tpag_ref7());
-    item_info = w.end();
-
-    // Export the vertices.
-    const int COORD_MIN = -(1 << 11);
-    const int COORD_MAX = (1 << 11) - 1;
-    w.begin();
-    for (auto &&vertex : util::reverse_of(frame->get_vertices())) {
-        int x = vertex.x;
-        int z = vertex.z;
+    // Write the info item (0).
+    out.write_u32(parts.world->get_x());
+    out.write_u32(parts.world->get_z());
+    out.write_u32(parts.world->get_y());
+    out.write_u32(entry.get_info_unk0());
+    out.write_u32(frame->get_vertices().size());
+    out.write_u32(mesh->get_triangles().size());
+    out.write_u32(mesh->get_quads().size());
+    out.write_u32(entry.get_item4().size() / 12);
+    out.write_u32(mesh->get_colors().size());
+    out.write_u32(entry.get_item6().size() / 4);
+    out.write_u32(entry.get_tpag_ref_count());
+    out.write_u32(entry.get_tpag_ref0());
+    out.write_u32(entry.get_tpag_ref1());
+    out.write_u32(entry.get_tpag_ref2());
+    out.write_u32(entry.get_tpag_ref3());
+    out.write_u32(entry.get_tpag_ref4());
+    out.write_u32(entry.get_tpag_ref5());
+    out.write_u32(entry.get_tpag_ref6());
+    out.write_u32(entry.get_tpag_ref7());
+
+    // Write the vertices, triangles and quads.
+    pack_wgeo_v2_vertices(
+        out,
+        frame->get_vertices(),
+        entry.ver == nsf::game_ver::crash3
+    );
+    pack_wgeo_v2_triangles(out, mesh->get_triangles());
+    pack_wgeo_v2_quads(out, mesh->get_quads());
+
+    // Write item4.
+    auto &&item4 = entry.get_item4();
+    out.write(item4.data(), item4.size());
+
+    // Write the colors.
+    for (auto &&color : mesh->get_colors()) {
+        unsigned char bytes[4] = { color.r, color.g, color.b, 0 };
+        out.write(bytes, 4);
+    }
 
-        if (x < COORD_MIN || x >= COORD_MAX ||
-            z < COORD_MIN || z >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex x/z out of range");
-        }
+    // Write item6.
+    auto &&item6 = entry.get_item6();
+    out.write(item6.data(), item6.size());
+}
 
-        if (vertex.color_index == -1) {
-            throw res::export_error("nsf::wgeo_v2: vertex colors required");
-        }
-        if (vertex.color_index < 0 || vertex.color_index >= (1L << 10)) {
-            throw res::export_error("nsf::wgeo_v2: vertex color out of range");
-        }
+// declared in nsf.hh
+std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
+{
+    assert_alive();
+
+    export_parts parts;
+    if (auto error = find_export_parts(*this, parts))
+        throw res::export_error(error);
+
+    size_t item_sizes[7];
+    get_item_sizes(*this, parts, item_sizes);
 
-        unsigned int color_high = (vertex.color_index >> 8) & 0x3;
-        unsigned int color_mid  = (vertex.color_index >> 4) & 0xF;
+    // Write the items one after another, and then split them up.
+    util::blob data;
+    auto info = get_entry_info(item_sizes, 7);
+    data.reserve(info.size - info.first_item_offset);
+    util::blob_sink out(data);
+    write_items(out, *this, parts);
 
-        w.write_ubits( 4, color_mid);
-        ver == nsf::game_ver::crash3 ? w.write_ubits(12, x) : w.write_sbits(12, x);
-        w.write_ubits( 2, color_high);
-        w.write_ubits( 2, vertex.fx);
-        ver == nsf::game_ver::crash3 ? w.write_ubits(12, z) : w.write_sbits(12, z);
+    out_type = 3;
+    std::vector<util::blob> items(7);
+    auto p = data.begin();
+    for (auto &&i : util::range_of(items)) {
+        items[i].assign(p, p + item_sizes[i]);
+        p += item_sizes[i];
     }
-    for (auto &&vertex : frame->get_vertices()) {
-        int y = vertex.y;
+    return items;
+}
 
-        if (y < COORD_MIN || y >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex y out of range");
-        }
+// declared in nsf.hh
+bool wgeo_v2::get_export_info(pagelet_info &out) const
+{
+    assert_alive();
 
-        // The vertex color index has already been range checked in the loop
-        // above.
+    // Leave invalid refs to `export_entry', which reports them.
+    export_parts parts;
+    if (find_export_parts(*this, parts))
+        return false;
 
-        unsigned int color_low = vertex.color_index & 0xF;
+    size_t item_sizes[7];
+    get_item_sizes(*this, parts, item_sizes);
+    out = get_entry_info(item_sizes, 7);
+    return true;
+}
 
-        w.write_ubits( 4, color_low);
-        ver == nsf::game_ver::crash3 ? w.write_ubits(12, y) : w.write_sbits(12, y);
-    }
-    w.pad(4);
-    item_vertices = w.end();
+// declared in nsf.hh
+void wgeo_v2::export_entry_into(util::sink &out) const
+{
+    assert_alive();
 
-    // Export the triangles.
-    w.begin();
-    for (auto &&triangle : util::reverse_of(mesh->get_triangles())) {
-        w.write_ubits(8, triangle.unk0);
-        w.write_ubits(12, triangle.v[0].vertex_index);
-        w.write_ubits(12, triangle.v[1].vertex_index);
-    }
-    for (auto &&triangle : mesh->get_triangles()) {
-        w.write_ubits(4, triangle.unk1);
-        w.write_ubits(12, triangle.v[2].vertex_index);
-
-        if (triangle.v[0].color_index != -1 ||
-            triangle.v[1].color_index != -1 ||
-            triangle.v[2].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
+    export_parts parts;
+    if (auto error = find_export_parts(*this, parts))
+        throw res::export_error(error);
+
+    size_t item_sizes[7];
+    get_item_sizes(*this, parts, item_sizes);
+    write_entry_header(out, get_eid(), 3, item_sizes, 7);
+    write_items(out, *this, parts);
+}
+
+// declared in nsf.hh
+std::vector<eid> wgeo_v2::get_refs() const
+{
+    assert_alive();
+
+    const uint32_t tpag_refs[8] = {
+        get_tpag_ref0(),
+        get_tpag_ref1(),
+        get_tpag_ref2(),
+        get_tpag_ref3(),
+        get_tpag_ref4(),
+        get_tpag_ref5(),
+        get_tpag_ref6(),
+        get_tpag_ref7()
+    };
+
+    auto count = std::min<uint32_t>(get_tpag_ref_count(), 8);
+    return std::vector<eid>(tpag_refs, tpag_refs + count);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (test) DirectExportDoesNotAllocate
+// Ensures a processed wgeo_v2 entry can be written into a page buffer without
+// allocating, and that the result matches the entry it was imported from. The
+// element counts span several chunks and need padding.
+TEST(nsf_wgeo_v2, DirectExportDoesNotAllocate)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+
+    const size_t count = 151;
+    std::vector<gfx::vertex> vertices(count);
+    std::vector<gfx::triangle> triangles(count);
+    std::vector<gfx::quad> quads(count);
+    for (size_t i = 0; i < count; i++) {
+        int n = i;
+        vertices[i].x = n * 13 - 1000;
+        vertices[i].y = 900 - n * 7;
+        vertices[i].z = n * 5;
+        vertices[i].fx = n % 4;
+        vertices[i].color_index = n * 6;
+        triangles[i].unk0 = n;
+        triangles[i].unk1 = n % 16;
+        for (int j = 0; j < 3; j++) {
+            triangles[i].v[j] = { int((i + j) % count), -1 };
+        }
+        quads[i].unk0 = 255 - n;
+        quads[i].unk1 = n;
+        for (int j = 0; j < 4; j++) {
+            quads[i].v[j] = { int((i + j * 2) % count), -1 };
         }
     }
-    w.pad(4);
-    item_triangles = w.end();
 
-    // Export the quads.
+    util::binwriter w;
     w.begin();
-    for (auto &&quad : mesh->get_quads()) {
-        w.write_ubits(8, quad.unk0);
-        w.write_ubits(12, quad.v[0].vertex_index);
-        w.write_ubits(12, quad.v[1].vertex_index);
-        w.write_ubits(8, quad.unk1);
-        w.write_ubits(12, quad.v[2].vertex_index);
-        w.write_ubits(12, quad.v[3].vertex_index);
-
-        if (quad.v[0].color_index != -1 || quad.v[1].color_index != -1 ||
-            quad.v[2].color_index != -1 || quad.v[3].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
-        }
+    w.write_s32(100);
+    w.write_s32(-200);
+    w.write_s32(300);
+    w.write_u32(7);
+    w.write_u32(count);
+    w.write_u32(count);
+    w.write_u32(count);
+    w.write_u32(2);
+    w.write_u32(3);
+    w.write_u32(1);
+    w.write_u32(1);
+    w.write_u32(0x6EA4F7);
+    for (int i = 0; i < 7; i++) {
+        w.write_u32(0);
+    }
+    std::vector<util::blob> items = {
+        w.end(),
+        pack_wgeo_v2_vertices(vertices, false),
+        pack_wgeo_v2_triangles(triangles),
+        pack_wgeo_v2_quads(quads),
+        util::blob(24, 0x44),
+        { 1, 2, 3, 0, 4, 5, 6, 0, 7, 8, 9, 0 },
+        util::blob(4, 0x66)
+    };
+
+    auto name = root / "entry";
+    proj.get_transact().run([&](TRANSACT) {
+        raw_entry::ref raw = name;
+        raw.create(TS, proj);
+        raw->set_eid(TS, 0x1F);
+        raw->set_type(TS, 3);
+        raw->set_items(TS, items);
+        raw->ver = game_ver::crash2;
+        ASSERT_TRUE(raw->process_by_type(TS, game_ver::crash2));
+    });
+
+    wgeo_v2::ref entry = name;
+    ASSERT_TRUE(entry.ok());
+
+    pagelet_info info;
+    ASSERT_TRUE(entry->get_export_info(info));
+
+    util::blob data(info.size);
+    {
+        util::alloc_counter counter;
+        util::buffer_sink out(data.data(), data.size());
+        entry->export_entry_into(out);
+        EXPECT_EQ(out.size(), info.size);
+        EXPECT_EQ(counter.get_count(), 0u);
     }
-    item_quads = w.end();
-
-    // Export item4.
-    item_4 = get_item4();
 
-    // Export the colors.
-    w.begin();
-    for (auto &&color : mesh->get_colors()) {
-        w.write_u8(color.r);
-        w.write_u8(color.g);
-        w.write_u8(color.b);
-        w.write_u8(0);
+    util::binreader r;
+    r.begin(data);
+    EXPECT_EQ(r.read_u32(), 0x100FFFFu);
+    EXPECT_EQ(r.read_u32(), 0x1Fu);
+    EXPECT_EQ(r.read_u32(), 3u);
+    EXPECT_EQ(r.read_u32(), items.size());
+    uint32_t item_offset = info.first_item_offset;
+    for (auto &&item : items) {
+        EXPECT_EQ(r.read_u32(), item_offset);
+        EXPECT_TRUE(std::equal(
+            item.begin(),
+            item.end(),
+            data.begin() + item_offset
+        ));
+        item_offset += item.size();
     }
-    item_colors = w.end();
+    EXPECT_EQ(r.read_u32(), info.size);
+    r.end_early();
 
-    // Export item6.
-    item_6 = get_item6();
+    uint32_t type;
+    EXPECT_EQ(entry->export_entry(type), items);
+}
 
-    return items;
 }
+#endif
 
 }
 }
@@ -27,6 +27,7 @@
  */
 
 #include <map>
+#include <mutex>
 #include <vector>
 #include "transact.hh"
 
@@ -197,6 +198,17 @@ public:
     // Gets the project pointer the root node was created with (see make_root).
     project *get_proj() const;
 
+    // (inner struct) hash
+    // A hash function object for atoms, for using atoms as keys in unordered
+    // containers, e.g. `std::unordered_map<atom, T, atom::hash>'. Like the
+    // lesser operator, this only depends on the identity of the atom.
+    struct hash {
+        size_t operator()(const atom &a) const noexcept
+        {
+            return std::hash<nucleus *>()(a.m_nuc);
+        }
+    };
+
     // (func) is_descendant_of
     // Returns true if the atom is a descendant of the specified atom. For
     // example, "foo/bar" is a descendant of "foo", but not of "snappy". "a/b/c"
@@ -303,15 +315,24 @@ private:
     // FIXME explain
     std::list<std::unique_ptr<asset>>::iterator m_iter;
 
+    // (var) m_revision
+    // See `get_revision' below.
+    uint64_t m_revision;
+
     // (func) create_imple
     // FIXME explain
     void create_impl(TRANSACT, atom name);
 
+    // (s-func) next_revision
+    // Returns a new revision number, greater than any returned before.
+    static uint64_t next_revision() noexcept;
+
 protected:
     // (explicit ctor)
     // FIXME explain
     explicit asset(project &proj) :
-        m_proj(proj) {}
+        m_proj(proj),
+        m_revision(next_revision()) {}
 
     // (func) on_prop_change
     // This function is called after the value of a property on the asset is
@@ -360,6 +381,128 @@ public:
     // (func) get_proj
     // FIXME explain
     project &get_proj() const;
+
+    // (func) get_revision
+    // Returns the asset's revision number. This is a number which is unique
+    // among all assets and changes whenever any of the asset's properties are
+    // changed, including by undo or redo. If the revision number of an asset
+    // is the same as it was before, then none of its properties have changed.
+    uint64_t get_revision() const
+    {
+        return m_revision;
+    }
+};
+
+/*
+ * res::dependency
+ *
+ * Records that some data (such as an exported entry) was produced from the
+ * asset named `name' as of revision `revision'. See `res::dep_recorder'.
+ */
+struct dependency {
+    atom name;
+    uint64_t revision;
+};
+
+/*
+ * res::dep_recorder
+ *
+ * While a recorder exists, it records every asset whose properties are read on
+ * the thread which created it. This is used to find out which assets some
+ * piece of exported data depends on, so that the data can be cached until one
+ * of those assets changes (see `res::export_cache').
+ *
+ * Recorders may be nested, in which case only the innermost recorder is active.
+ * When a nested recorder is destroyed, the assets it recorded are added to the
+ * recorder which was active before it.
+ */
+class dep_recorder : private util::nocopy {
+private:
+    // (var) m_outer
+    // The recorder which was active on this thread when this one was created,
+    // or null if there was none.
+    dep_recorder *m_outer;
+
+    // (var) m_assets
+    // The assets recorded so far. This may contain duplicates.
+    std::vector<const asset *> m_assets;
+
+public:
+    // (default ctor)
+    // Constructs the recorder and makes it the active recorder for the current
+    // thread.
+    dep_recorder() noexcept;
+
+    // (dtor)
+    // Adds the recorded assets to the outer recorder, if any, and makes that
+    // recorder active again.
+    ~dep_recorder() noexcept;
+
+    // (s-func) note
+    // Records the given asset in the current thread's active recorder, if
+    // there is one.
+    static void note(const asset &asset);
+
+    // (s-func) note_all
+    // Records the assets named by the given dependencies in the current
+    // thread's active recorder, if there is one.
+    static void note_all(const std::vector<dependency> &deps);
+
+    // (func) get_deps
+    // Returns the dependencies recorded so far, without duplicates.
+    std::vector<dependency> get_deps() const;
+};
+
+/*
+ * res::export_cache
+ *
+ * Holds a piece of exported data along with the dependencies it was produced
+ * from (see `res::dep_recorder'). The cached data remains usable until any of
+ * those assets changes, is destroyed, or is renamed.
+ *
+ * Example usage:
+ *
+ *   util::shared_blob data;
+ *   if (m_cache.lookup(data))
+ *       return data;
+ *
+ *   res::dep_recorder recorder;
+ *   data = ...; // export the data
+ *   m_cache.store(data, recorder.get_deps());
+ *   return data;
+ */
+class export_cache : private util::nocopy {
+private:
+    // (var) m_mutex
+    // Guards the cache, so that an asset which is exported from several
+    // threads at once (such as during `nsf::archive::export_file') can use the
+    // cache safely.
+    mutable std::mutex m_mutex;
+
+    // (var) m_valid
+    // True if the cache holds any data.
+    bool m_valid = false;
+
+    // (var) m_data, m_deps
+    // The cached data and the dependencies it was produced from.
+    util::shared_blob m_data;
+    std::vector<dependency> m_deps;
+
+public:
+    // (func) lookup
+    // If the cache holds data and none of its dependencies have changed, the
+    // data is written to `data', the dependencies are recorded in the current
+    // thread's active `res::dep_recorder' if any, and true is returned.
+    // Otherwise, returns false.
+    bool lookup(util::shared_blob &data) const;
+
+    // (func) store
+    // Replaces the contents of the cache.
+    void store(util::shared_blob data, std::vector<dependency> deps);
+
+    // (func) clear
+    // Empties the cache.
+    void clear();
 };
 
 /*
@@ -395,6 +538,7 @@ private:
         void execute() noexcept override
         {
             if (m_after) {
+                m_prop.m_owner.m_revision = asset::next_revision();
                 m_prop.m_owner.on_prop_change(&m_prop);
                 m_prop.on_change();
             }
@@ -422,6 +566,7 @@ public:
     const T &get() const
     {
         m_owner.assert_alive();
+        dep_recorder::note(m_owner);
         return m_value;
     }
 
@@ -20,6 +20,8 @@
 
 #include "common.hh"
 #include <cstring>
+#include <atomic>
+#include <mutex>
 #include "res.hh"
 
 namespace drnsf {
@@ -38,8 +40,14 @@ struct nucleus_name_comparator {
 // FIXME explain
 struct atom::nucleus {
     // (var) m_refcount
-    // FIXME explain
-    int m_refcount;
+    // The number of atoms and child nuclei referring to this nucleus. The
+    // nucleus is deleted when this reaches zero.
+    //
+    // This is atomic so that atoms may be copied and destroyed on several
+    // threads at once, such as while exporting pages in parallel. Changes
+    // which may bring the count to or from zero are made while holding
+    // `s_tree_mutex'.
+    std::atomic<int> m_refcount;
 
     // (var) m_name
     // FIXME explain
@@ -63,6 +71,13 @@ struct atom::nucleus {
     std::map<const char *, nucleus *, nucleus_name_comparator> m_children;
 };
 
+// (s-var) s_tree_mutex
+// Held while creating and deleting nuclei, so that atoms may be looked up with
+// `operator /', copied and destroyed on several threads at once. Listing the
+// children of an atom is not guarded, and must not happen at the same time as
+// any of those.
+static std::mutex s_tree_mutex;
+
 // declared in res.hh
 atom::atom(nucleus *nuc) noexcept :
     m_nuc(nuc)
@@ -134,6 +149,20 @@ atom::atom(atom &&src) noexcept :
 atom::~atom() noexcept
 {
     nucleus *nuc = m_nuc;
+    if (!nuc)
+        return;
+
+    // Release the reference without locking if it isn't the last one.
+    int count = nuc->m_refcount;
+    while (count > 1) {
+        if (nuc->m_refcount.compare_exchange_weak(count, count - 1))
+            return;
+    }
+
+    // Otherwise, the nucleus may need deleting. Another thread may look up the
+    // nucleus with `operator /' and take a new reference before the lock is
+    // acquired, so the count is checked again with the lock held.
+    std::lock_guard<std::mutex> lock(s_tree_mutex);
     while (nuc && --nuc->m_refcount == 0) {
         nucleus *parent = nuc->m_parent;
         if (parent) {
@@ -206,6 +235,8 @@ atom atom::operator /(const char *s) const
         throw std::logic_error("res::atom::(slash op): string is empty");
     }
 
+    std::lock_guard<std::mutex> lock(s_tree_mutex);
+
     auto iter = m_nuc->m_children.find(s);
     if (iter != m_nuc->m_children.end()) {
         return atom(iter->second);
@@ -0,0 +1,140 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <atomic>
+#include <algorithm>
+#include "res.hh"
+
+namespace drnsf {
+namespace res {
+
+// (s-var) s_last_revision
+// The most recent revision number given out by `asset::next_revision'.
+static std::atomic<uint64_t> s_last_revision = 0;
+
+// (s-var) s_active_recorder
+// The innermost `dep_recorder' on the current thread, or null if none.
+static thread_local dep_recorder *s_active_recorder = nullptr;
+
+// declared in res.hh
+uint64_t asset::next_revision() noexcept
+{
+    return ++s_last_revision;
+}
+
+// declared in res.hh
+dep_recorder::dep_recorder() noexcept :
+    m_outer(s_active_recorder)
+{
+    s_active_recorder = this;
+}
+
+// declared in res.hh
+dep_recorder::~dep_recorder() noexcept
+{
+    s_active_recorder = m_outer;
+    if (m_outer) {
+        m_outer->m_assets.insert(
+            m_outer->m_assets.end(),
+            m_assets.begin(),
+            m_assets.end()
+        );
+    }
+}
+
+// declared in res.hh
+void dep_recorder::note(const asset &asset)
+{
+    if (s_active_recorder) {
+        s_active_recorder->m_assets.push_back(&asset);
+    }
+}
+
+// declared in res.hh
+void dep_recorder::note_all(const std::vector<dependency> &deps)
+{
+    if (!s_active_recorder)
+        return;
+
+    for (auto &&dep : deps) {
+        auto asset = dep.name.get();
+        if (asset) {
+            s_active_recorder->m_assets.push_back(asset);
+        }
+    }
+}
+
+// declared in res.hh
+std::vector<dependency> dep_recorder::get_deps() const
+{
+    auto assets = m_assets;
+    std::sort(assets.begin(), assets.end());
+    assets.erase(std::unique(assets.begin(), assets.end()), assets.end());
+
+    std::vector<dependency> deps;
+    deps.reserve(assets.size());
+    for (auto &&asset : assets) {
+        deps.push_back({ asset->get_name(), asset->get_revision() });
+    }
+    return deps;
+}
+
+// declared in res.hh
+bool export_cache::lookup(util::shared_blob &data) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_valid)
+        return false;
+
+    for (auto &&dep : m_deps) {
+        auto asset = dep.name.get();
+        if (!asset || asset->get_revision() != dep.revision)
+            return false;
+    }
+
+    dep_recorder::note_all(m_deps);
+    data = m_data;
+    return true;
+}
+
+// declared in res.hh
+void export_cache::store(util::shared_blob data, std::vector<dependency> deps)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_data = std::move(data);
+    m_deps = std::move(deps);
+    m_valid = true;
+}
+
+// declared in res.hh
+void export_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_data = {};
+    m_deps.clear();
+    m_valid = false;
+}
+
+}
+}
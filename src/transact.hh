@@ -349,6 +349,18 @@ private:
     // FIXME explain
     std::unique_ptr<transaction> m_redo;
 
+    // (var) m_base
+    // Holds the operations of amendments made while there was no transaction
+    // to undo (see `amend'). This transaction is never undone, but must be
+    // kept alive because its operations may own objects (such as erased
+    // assets) which other transactions still refer to.
+    std::unique_ptr<transaction> m_base;
+
+    // (var) m_teller
+    // Points to the teller of the transaction currently being built by `run',
+    // or null if no transaction is being built.
+    teller *m_teller;
+
 public:
     // (default ctor)
     // FIXME explain
@@ -390,6 +402,22 @@ public:
     // FIXME explain
     void run(std::function<void(TRANSACT)> fn);
 
+    // (func) amend
+    // Runs the given function and merges its operations into the transaction
+    // which produced the current state, instead of introducing a new undo
+    // step. Undoing that transaction also undoes the amendment. The redo
+    // stack is left as-is.
+    //
+    // This is meant for changes which do not alter the meaning of the project,
+    // such as processing a raw entry into its typed equivalent when it is
+    // first viewed.
+    //
+    // If a transaction is currently being built by `run', the function runs
+    // as part of that transaction instead. If the nexus is busy for any other
+    // reason (undo or redo in progress), the function is not run and false is
+    // returned.
+    bool amend(std::function<void(TRANSACT)> fn);
+
     // (event) on_status_change
     // FIXME explain
     util::event<> on_status_change;
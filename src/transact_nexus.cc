@@ -21,12 +21,17 @@
 #include "common.hh"
 #include "transact.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
 namespace drnsf {
 namespace transact {
 
 // declared in transact.hh
 nexus::nexus() :
-    m_status(status::ready)
+    m_status(status::ready),
+    m_teller(nullptr)
 {
 }
 
@@ -175,12 +180,24 @@ void nexus::run(std::function<void(TRANSACT)> fn)
     // all of the changes automatically.
     transact::teller ts;
 
-    // Run the functor given to the nexus.
+    // Run the functor given to the nexus. The teller is made available to
+    // `amend' for the duration of the call, so that amendments made by event
+    // handlers become part of this transaction.
+    m_teller = &ts;
+    DRNSF_ON_EXIT { m_teller = nullptr; };
     fn(ts);
 
     // Commit the transaction.
     auto t = ts.commit();
 
+    // A transaction which made no changes is not added to the history, so
+    // the redo stack is kept as well.
+    if (t->m_ops.empty()) {
+        m_status = status::ready;
+        on_status_change();
+        return;
+    }
+
     // Set this new transaction's next pointer to the current next-to-undo
     // transaction, and set the next-to-undo to the new transaction.
     //
@@ -200,5 +217,141 @@ void nexus::run(std::function<void(TRANSACT)> fn)
     on_status_change();
 }
 
+// declared in transact.hh
+bool nexus::amend(std::function<void(TRANSACT)> fn)
+{
+    // If a transaction is being built, the amendment simply becomes part of
+    // that transaction.
+    if (m_teller) {
+        fn(*m_teller);
+        return true;
+    }
+
+    if (m_status != status::ready) {
+        return false;
+    }
+
+    m_status = status::busy;
+    on_status_change();
+
+    // Restore the ready status even if the functor throws. The teller below
+    // rolls back any partial changes in that case.
+    DRNSF_ON_EXIT {
+        m_status = status::ready;
+        on_status_change();
+    };
+
+    transact::teller ts;
+    m_teller = &ts;
+    DRNSF_ON_EXIT { m_teller = nullptr; };
+    fn(ts);
+    auto t = ts.commit();
+
+    // Merge the new operations into the transaction which produced the current
+    // state. Operations are stored latest-first, so the new operations go at
+    // the front of the list, ensuring they are undone before the rest of that
+    // transaction.
+    //
+    // If there is no such transaction, the operations are kept in the base
+    // transaction, which is never undone.
+    auto &target = m_undo ? m_undo : m_base;
+    if (!target) {
+        target = std::move(t);
+    } else {
+        target->m_ops.splice(target->m_ops.begin(), t->m_ops);
+    }
+
+    return true;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (test) AmendKeepsHistory
+// Ensures amendments do not add an undo step or clear the redo stack, and that
+// undoing the amended transaction also undoes the amendment.
+TEST(transact_nexus, AmendKeepsHistory)
+{
+    nexus nx;
+    int a = 0;
+    int b = 0;
+
+    nx.run([&](TRANSACT) {
+        TS.describe("A");
+        TS.set(a, 1);
+    });
+    nx.run([&](TRANSACT) {
+        TS.describe("B");
+        TS.set(a, 2);
+    });
+    nx.undo();
+    ASSERT_TRUE(nx.has_redo());
+
+    EXPECT_TRUE(nx.amend([&](TRANSACT) {
+        TS.set(b, 1);
+    }));
+    EXPECT_EQ(b, 1);
+    EXPECT_STREQ(nx.get_undo().describe(), "A");
+    EXPECT_TRUE(nx.has_redo());
+
+    nx.undo();
+    EXPECT_EQ(a, 0);
+    EXPECT_EQ(b, 0);
+    EXPECT_FALSE(nx.has_undo());
+
+    nx.redo();
+    nx.redo();
+    EXPECT_EQ(a, 2);
+    EXPECT_EQ(b, 1);
+}
+
+// (test) RunWithoutChanges
+// Ensures a transaction which makes no changes does not add an undo step or
+// clear the redo stack.
+TEST(transact_nexus, RunWithoutChanges)
+{
+    nexus nx;
+    int a = 0;
+
+    nx.run([&](TRANSACT) {
+        TS.describe("A");
+        TS.set(a, 1);
+    });
+    nx.undo();
+
+    nx.run([&](TRANSACT) {
+        TS.describe("Nothing");
+    });
+    EXPECT_FALSE(nx.has_undo());
+    EXPECT_TRUE(nx.has_redo());
+}
+
+// (test) AmendDuringRun
+// Ensures an amendment made while a transaction is being built becomes part of
+// that transaction.
+TEST(transact_nexus, AmendDuringRun)
+{
+    nexus nx;
+    int a = 0;
+    int b = 0;
+
+    nx.run([&](TRANSACT) {
+        TS.describe("A");
+        TS.set(a, 1);
+        EXPECT_TRUE(nx.amend([&](TRANSACT) {
+            TS.set(b, 1);
+        }));
+    });
+    EXPECT_EQ(b, 1);
+
+    nx.undo();
+    EXPECT_EQ(a, 0);
+    EXPECT_EQ(b, 0);
+    EXPECT_FALSE(nx.has_undo());
+}
+
+}
+#endif
+
 }
 }
@@ -32,6 +32,7 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <array>
 #include <cstring>
 
 namespace drnsf {
@@ -45,6 +46,130 @@ namespace util {
  */
 using blob = std::vector<uint8_t>;
 
+/*
+ * util::shared_blob
+ *
+ * This type represents an immutable, reference-counted view of a series of
+ * bytes. Copying a shared_blob does not copy the underlying bytes; instead the
+ * copy refers to the same memory and shares ownership of it. The memory is
+ * released once the last shared_blob referring to it is destroyed.
+ *
+ * A shared_blob may be constructed from a `util::blob', in which case the blob
+ * is moved into a new shared buffer, or from an arbitrary owner object and a
+ * pointer into memory kept alive by that owner (for example, a file mapping;
+ * see `util::mapped_file' below).
+ *
+ * Because the data cannot be modified through a shared_blob, "modifying" one
+ * means building a new `util::blob' with the desired contents and assigning it
+ * over the old value. This makes shared_blob suitable for copy-on-write use,
+ * such as assets which reference parts of a larger file until they are edited.
+ */
+class shared_blob {
+private:
+    // (var) m_owner
+    // The object keeping the referenced memory alive, or null if the blob is
+    // empty.
+    std::shared_ptr<const void> m_owner;
+
+    // (var) m_data
+    // A pointer to the first byte of the blob. This may be null if the size is
+    // zero.
+    const unsigned char *m_data = nullptr;
+
+    // (var) m_size
+    // The number of bytes in the blob.
+    size_t m_size = 0;
+
+public:
+    // (default ctor)
+    // Constructs an empty blob.
+    shared_blob() = default;
+
+    // (conversion ctor)
+    // Constructs a shared_blob which takes ownership of the given blob's data.
+    // No copy is made if the blob is passed as an rvalue.
+    shared_blob(blob data);
+
+    // (ctor)
+    // Constructs a shared_blob referring to `size' bytes at `data', which must
+    // remain valid for as long as `owner' (or any copy of it) is alive.
+    shared_blob(
+        std::shared_ptr<const void> owner,
+        const unsigned char *data,
+        size_t size) :
+        m_owner(std::move(owner)),
+        m_data(data),
+        m_size(size) {}
+
+    // (func) data, size, empty
+    // Basic accessors similar to those of `std::vector'.
+    const unsigned char *data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    // (func) begin, end
+    // Returns pointers to the beginning and end of the data, for use with
+    // iterator-based algorithms and for-range loops.
+    const unsigned char *begin() const
+    {
+        return m_data;
+    }
+    const unsigned char *end() const
+    {
+        return m_data + m_size;
+    }
+
+    // (subscript operator)
+    // Returns the byte at the given offset. The offset is not range checked.
+    const unsigned char &operator [](size_t offset) const
+    {
+        return m_data[offset];
+    }
+
+    // (func) slice
+    // Returns a shared_blob referring to `size' bytes starting at `offset'
+    // within this blob. The returned blob shares ownership of the memory, so
+    // no bytes are copied. An exception is thrown if the range exceeds the
+    // bounds of this blob.
+    shared_blob slice(size_t offset, size_t size) const;
+
+    // (func) to_blob
+    // Returns a copy of the data as a standalone `util::blob'.
+    blob to_blob() const
+    {
+        return blob(begin(), end());
+    }
+
+    // (conversion operator)
+    // Copies the data into a standalone `util::blob'. See `to_blob'.
+    operator blob() const
+    {
+        return to_blob();
+    }
+
+    // (equal operator, not-equal operator)
+    // Compares the contents (not the identity) of two shared blobs.
+    bool operator ==(const shared_blob &rhs) const
+    {
+        return m_size == rhs.m_size && (m_size == 0 ||
+            m_data == rhs.m_data ||
+            std::memcmp(m_data, rhs.m_data, m_size) == 0);
+    }
+    bool operator !=(const shared_blob &rhs) const
+    {
+        return !(*this == rhs);
+    }
+};
+
 /*
  * util::nocopy
  *
@@ -535,6 +660,119 @@ enum class read_dir {
     ltr
 };
 
+/*
+ * util::record_view
+ *
+ * A view of a fixed-size record of bytes which has already been checked to lie
+ * within the data of a reader, returned by `binreader::read_record'. Because
+ * the whole record is range-checked once when the view is created, the reads
+ * on the view itself are not checked, so a loop over many small records can
+ * read each field with a plain load.
+ *
+ * In debug builds (!NDEBUG), the view also keeps the size of the record and
+ * each read is range-checked like those of `binreader', throwing an exception
+ * if it would read past the end of the record.
+ *
+ * The view refers to the reader's data, which must outlive it. Values are read
+ * in little-endian byte order, as with `binreader'.
+ */
+class record_view {
+    friend class binreader;
+
+private:
+    // (var) m_data
+    // A pointer to the next byte of the record which has not yet been read.
+    const unsigned char *m_data;
+
+#if !NDEBUG
+    // (var) m_size
+    // The number of bytes remaining in the record.
+    size_t m_size;
+#endif
+
+    // (explicit ctor)
+    // Constructs a view of the `size' bytes at `data'.
+    explicit record_view(const unsigned char *data, size_t size) :
+        m_data(data)
+#if !NDEBUG
+        , m_size(size)
+#endif
+    {
+        (void)size;
+    }
+
+    // (func) take
+    // Returns a pointer to the next `len' bytes of the record and skips over
+    // them. In debug builds, an exception is thrown if there are not enough
+    // bytes left in the record.
+    const unsigned char *take(size_t len)
+    {
+#if !NDEBUG
+        if (m_size < len)
+            throw std::logic_error("util::record_view: out of data");
+        m_size -= len;
+#endif
+        auto p = m_data;
+        m_data += len;
+        return p;
+    }
+
+public:
+    // (func) read_u8
+    // Reads an unsigned 8-bit value from the record.
+    uint8_t read_u8()
+    {
+        return *take(1);
+    }
+
+    // (func) read_u16
+    // Reads an unsigned 16-bit value from the record.
+    uint16_t read_u16()
+    {
+        auto p = take(2);
+        return p[0] | (p[1] << 8);
+    }
+
+    // (func) read_u32
+    // Reads an unsigned 32-bit value from the record.
+    uint32_t read_u32()
+    {
+        auto p = take(4);
+        return p[0]
+            | (p[1] << 8)
+            | (p[2] << 16)
+            | (uint32_t(p[3]) << 24);
+    }
+
+    // (func) read_s8
+    // Reads a signed 8-bit value from the record.
+    int8_t read_s8()
+    {
+        return read_u8();
+    }
+
+    // (func) read_s16
+    // Reads a signed 16-bit value from the record.
+    int16_t read_s16()
+    {
+        return read_u16();
+    }
+
+    // (func) read_s32
+    // Reads a signed 32-bit value from the record.
+    int32_t read_s32()
+    {
+        return read_u32();
+    }
+
+    // (func) discard
+    // Skips over the given number of bytes of the record.
+    void discard(size_t bytes)
+    {
+        take(bytes);
+    }
+};
+
 /*
  * util::binreader
  *
@@ -569,11 +807,12 @@ class binreader : private nocopy {
 
 private:
     // (var) m_data
-    // FIXME explain
+    // A pointer to the next byte of data which has not yet been read or loaded
+    // into the bit buffer, or null if the reader has not been started.
     const unsigned char *m_data;
 
     // (var) m_size
-    // FIXME explain
+    // The number of bytes remaining at `m_data'.
     size_t m_size;
 
     // (var) m_data_base
@@ -581,17 +820,32 @@ private:
     const unsigned char* m_data_base;
 
     // (var) m_bitbuf
-    // FIXME explain
-    unsigned char m_bitbuf;
+    // The bit buffer. Bits are loaded into this from the data many bytes at a
+    // time, and the next bit to be read is the lowest bit (rtl) or the highest
+    // bit (ltr) of the buffer. Bits past the first `m_bitbuf_len' may contain
+    // the data of bytes which have not been loaded yet, or may be zero.
+    uint64_t m_bitbuf;
 
     // (var) m_bitbuf_len
-    // FIXME explain
+    // The number of bits in the bit buffer which have been loaded from the
+    // data but not yet read.
     int m_bitbuf_len;
 
     // (var) m_read_dir
     // Direction in which to read bits
     read_dir m_read_dir;
 
+    // (func) refill
+    // Loads as many whole bytes of the data into the bit buffer as will fit,
+    // and throws an exception if there are still fewer than `bits' bits in
+    // the buffer. `bits' must be no more than 56.
+    void refill(int bits);
+
+    // (func) unload
+    // Returns any whole bytes in the bit buffer to the data, leaving only the
+    // bits of a partially read byte, if any, in the buffer.
+    void unload();
+
 public:
     // (default ctor)
     // FIXME explain
@@ -605,6 +859,12 @@ public:
     // FIXME explain
     void begin(const util::blob &data);
 
+    // (func) begin
+    // Binds the reader to the data referenced by the given shared blob. The
+    // blob (or another reference to its data) must be kept alive until the
+    // reader is ended.
+    void begin(const util::shared_blob &data);
+
     // (func) begin
     // Bind the reader at offset bytes from the start or end of the block bound by 
     // the given writer. 
@@ -654,6 +914,14 @@ public:
     // Reads a given number of bytes and returns a vector of them.
     blob read_bytes(int bytes);
 
+    // (func) read_record
+    // Returns a view of the next `bytes' bytes of data and skips over them,
+    // so that the fields of a fixed-size record, or of a run of records, can
+    // be read from the view without range-checking each one (see
+    // `util::record_view'). An exception is thrown if there is not enough
+    // data, or if part of a byte of bit data has been read.
+    record_view read_record(size_t bytes);
+
     // (func) discard
     // FIXME explain
     void discard(int bytes);
@@ -668,7 +936,19 @@ public:
  *
  * This class provides a mechanism for writing binary data.
  *
- * FIXME explain
+ * A writer can write into one of three places, depending on how it is begun:
+ *
+ * 1. A blob owned by the writer (`begin()'), which is returned by `end'.
+ * 2. A fixed buffer owned by the caller (`begin(data, capacity)'). Writing
+ *    past the end of the buffer throws an exception.
+ * 3. The end of a blob owned by the caller (`begin(chunk)'), which grows as
+ *    needed. This lets several pieces of data be written one after another
+ *    into one shared buffer.
+ *
+ * Writing in the latter two modes is finished with `end_external' instead of
+ * `end'. In the first and third modes, `reserve' may be used to make room for
+ * data ahead of time when its size is known, so that the output is not
+ * reallocated as it grows.
  */
 class binwriter : private nocopy {
     friend class binreader;
@@ -679,9 +959,33 @@ private:
     bool m_active;
 
     // (var) m_data
-    // FIXME explain
+    // The blob owned by the writer, which is written to when the writer is
+    // begun with `begin()'.
     util::blob m_data;
 
+    // (var) m_chunk
+    // The blob being written to, which is either `m_data' or a blob owned by
+    // the caller, or null if writing into a fixed buffer. The blob may be
+    // larger than the data written so far while the writer is active.
+    util::blob *m_chunk;
+
+    // (var) m_chunk_start
+    // The offset into `m_chunk' at which the writer began writing.
+    size_t m_chunk_start;
+
+    // (var) m_out
+    // A pointer to the start of the data being written.
+    unsigned char *m_out;
+
+    // (var) m_size
+    // The number of bytes written so far.
+    size_t m_size;
+
+    // (var) m_capacity
+    // The number of bytes which may be written at `m_out' before the output
+    // must grow.
+    size_t m_capacity;
+
     // (var) m_bitbuf
     // FIXME explain
     unsigned char m_bitbuf;
@@ -690,19 +994,59 @@ private:
     // FIXME explain
     int m_bitbuf_len;
 
+    // (func) grow
+    // Makes room in the output for at least `len' more bytes, allowing for
+    // further growth if `exact' is false. An exception is thrown if writing
+    // into a fixed buffer which is too small.
+    void grow(size_t len, bool exact);
+
+    // (func) put
+    // Returns a pointer to space in the output for `len' more bytes, and
+    // counts them as written.
+    unsigned char *put(size_t len)
+    {
+        if (m_capacity - m_size < len) {
+            grow(len, false);
+        }
+        auto p = m_out + m_size;
+        m_size += len;
+        return p;
+    }
+
 public:
     // (default ctor)
     // FIXME explain
     binwriter();
 
     // (func) begin
-    // FIXME explain
+    // Begins writing into a new blob owned by the writer.
     void begin();
 
+    // (func) begin
+    // Begins writing into the given buffer of `capacity' bytes. The buffer
+    // must be kept alive until the writer is ended.
+    void begin(void *data, size_t capacity);
+
+    // (func) begin
+    // Begins writing onto the end of the given blob. The blob must be kept
+    // alive, and must not be otherwise used, until the writer is ended.
+    void begin(util::blob &chunk);
+
     // (func) end
-    // FIXME explain
+    // Finishes writing into the writer's own blob, and returns the blob.
     util::blob end();
 
+    // (func) end_external
+    // Finishes writing into a buffer or blob given to `begin', and returns the
+    // number of bytes written.
+    size_t end_external();
+
+    // (func) reserve
+    // Makes room in the output for at least `len' more bytes, so that writing
+    // them does not reallocate the output. When writing into a fixed buffer,
+    // an exception is thrown if there is not enough room left.
+    void reserve(size_t len);
+
     // (func) write_u8
     // fixme explain
     void write_u8(uint8_t value);
@@ -736,8 +1080,9 @@ public:
     void write_sbits(int bits, int64_t value);
 
     // (func) write_bytes
-    // Writes the given blob to the output buffer.
-    void write_bytes(util::blob data);
+    // Writes the given data to the output buffer.
+    void write_bytes(const void *data, size_t len);
+    void write_bytes(const util::blob &data);
 
     // (func) pad
     // Writes zero-value bytes to the output buffer until the size of the buffer
@@ -747,7 +1092,191 @@ public:
 
     // (func) length
     // fixme explain
-    int length() { return m_data.size(); }
+    int length() { return m_size; }
+};
+
+/*
+ * util::ubits
+ * util::sbits
+ *
+ * Field types for `util::bit_record'. `ubits<N>' is an unsigned N-bit field and
+ * `sbits<N>' is a signed one, as read by `binreader::read_ubits' and
+ * `binreader::read_sbits'.
+ */
+template <int Bits>
+struct ubits {
+    static_assert(Bits >= 1 && Bits <= 63, "bad bit count");
+    static constexpr int width = Bits;
+    static constexpr bool is_signed = false;
+};
+template <int Bits>
+struct sbits {
+    static_assert(Bits >= 1 && Bits <= 63, "bad bit count");
+    static constexpr int width = Bits;
+    static constexpr bool is_signed = true;
+};
+
+/*
+ * util::bit_record
+ *
+ * Describes a fixed-size record made up of bit fields, such as:
+ *
+ *   using quad_record = util::bit_record<
+ *       util::ubits<8>,  // unk0
+ *       util::ubits<12>, // vertex 0
+ *       util::sbits<12>  // x
+ *   >;
+ *
+ * The fields are laid out from the lowest bit of the record upwards, and the
+ * record is stored little-endian, the same as reading or writing the fields in
+ * order with a `binreader' or `binwriter' in `read_dir::rtl' order. The widths
+ * must add up to a whole number of bytes, no more than 64 bits.
+ *
+ * The offset of each field and the size of the record are computed at compile
+ * time, so `decode' and `encode' compile down to a load or store and a shift
+ * and mask for each field. Declaring a record once and using it for both
+ * reading and writing keeps the two from drifting apart.
+ */
+template <typename... Fields>
+struct bit_record {
+    // (s-var) field_count, bit_count, size
+    // The number of fields, and the size of the record in bits and bytes.
+    static constexpr size_t field_count = sizeof...(Fields);
+    static constexpr int bit_count = (Fields::width + ... + 0);
+    static constexpr size_t size = bit_count / 8;
+
+    static_assert(bit_count % 8 == 0, "record is not a whole number of bytes");
+    static_assert(bit_count <= 64, "record is larger than 64 bits");
+
+    // (typedef) values
+    // The values of each of the fields, in order.
+    using values = std::array<int64_t, field_count>;
+
+    // (s-func) width, offset, is_signed
+    // Returns the width of the given field, the bit offset of its lowest bit
+    // within the record, or whether it is signed.
+    static constexpr int width(size_t field)
+    {
+        constexpr int widths[] = { Fields::width... };
+        return widths[field];
+    }
+    static constexpr int offset(size_t field)
+    {
+        int result = 0;
+        for (size_t i = 0; i < field; i++) {
+            result += width(i);
+        }
+        return result;
+    }
+    static constexpr bool is_signed(size_t field)
+    {
+        constexpr bool signs[] = { Fields::is_signed... };
+        return signs[field];
+    }
+
+    // (s-func) load, store
+    // Reads or writes the raw bits of a record.
+    static uint64_t load(const unsigned char *data)
+    {
+        return load_impl(data, std::make_index_sequence<size>());
+    }
+    static void store(unsigned char *data, uint64_t bits)
+    {
+        store_impl(data, bits, std::make_index_sequence<size>());
+    }
+
+    // (s-func) get
+    // Returns the value of the given field from the raw bits of a record.
+    template <size_t Field>
+    static int64_t get(uint64_t bits)
+    {
+        constexpr int w = width(Field);
+        constexpr int o = offset(Field);
+        if constexpr (is_signed(Field)) {
+            return int64_t(bits << (64 - o - w)) >> (64 - w);
+        } else {
+            return (bits >> o) & ((uint64_t(1) << w) - 1);
+        }
+    }
+
+    // (s-func) put
+    // Returns the raw bits of the given field with the given value. Values are
+    // truncated to the width of the field.
+    template <size_t Field>
+    static uint64_t put(int64_t value)
+    {
+        constexpr int w = width(Field);
+        constexpr int o = offset(Field);
+        return (uint64_t(value) & ((uint64_t(1) << w) - 1)) << o;
+    }
+
+    // (s-func) fits
+    // Returns true if each value fits in its field. Any value fits in a signed
+    // field, as it is truncated the same as by `binwriter::write_sbits'.
+    static bool fits(const values &v)
+    {
+        return fits_impl(v, std::make_index_sequence<field_count>());
+    }
+
+    // (s-func) decode
+    // Reads the fields of the record at `data'.
+    static values decode(const unsigned char *data)
+    {
+        return decode_impl(load(data), std::make_index_sequence<field_count>());
+    }
+
+    // (s-func) encode
+    // Writes the record with the given field values to `data'. The values are
+    // truncated to the width of their fields (see `fits').
+    static void encode(unsigned char *data, const values &v)
+    {
+        store(data, encode_impl(v, std::make_index_sequence<field_count>()));
+    }
+
+private:
+    // (s-func) load_impl, store_impl
+    // Implement `load' and `store' for each byte in turn. These are written
+    // out in full rather than as loops, so that compilers can recognize them
+    // as a single load or store.
+    template <size_t... I>
+    static uint64_t load_impl(
+        const unsigned char *data,
+        std::index_sequence<I...>)
+    {
+        return ((uint64_t(data[I]) << (I * 8)) | ... | 0);
+    }
+
+    template <size_t... I>
+    static void store_impl(
+        unsigned char *data,
+        uint64_t bits,
+        std::index_sequence<I...>)
+    {
+        ((data[I] = bits >> (I * 8)), ...);
+    }
+
+    // (s-func) fits_impl, decode_impl, encode_impl
+    // Implement `fits', `decode' and `encode' for each field in turn.
+    template <size_t... I>
+    static bool fits_impl(const values &v, std::index_sequence<I...>)
+    {
+        // Negative values become too large when made unsigned, so one
+        // comparison checks both ends of the range.
+        return ((is_signed(I) ||
+            uint64_t(v[I]) < (uint64_t(1) << width(I))) && ...);
+    }
+
+    template <size_t... I>
+    static values decode_impl(uint64_t bits, std::index_sequence<I...>)
+    {
+        return {{ get<I>(bits)... }};
+    }
+
+    template <size_t... I>
+    static uint64_t encode_impl(const values &v, std::index_sequence<I...>)
+    {
+        return (put<I>(v[I]) | ... | 0);
+    }
 };
 
 /*
@@ -857,6 +1386,28 @@ public:
     // If the file is not currently open, an exception is thrown.
     void write(const void *buffer, size_t len);
 
+    // (func) read_at
+    // Reads data from the given offset in the currently open file. This is
+    // based on `pread' (or `ReadFile' with an offset on Windows), so several
+    // threads may read from different parts of the file through separate
+    // objects without seeking each other's handles.
+    //
+    // Any data buffered by `write' is flushed first, and the current
+    // read/write position is restored afterwards, so `read_at' and `write_at'
+    // may be mixed with `read', `write' and `seek' on the same object.
+    //
+    // The return value and exceptions are the same as for `read'.
+    bool read_at(uint64_t offset, void *buffer, size_t len);
+
+    // (func) write_at
+    // Writes data at the given offset in the currently open file, in the same
+    // manner as `read_at'. Data which `read' had already buffered is dropped,
+    // so later reads see the new data. If an error occurs, an exception is
+    // thrown.
+    //
+    // If the file is not currently open, an exception is thrown.
+    void write_at(uint64_t offset, const void *buffer, size_t len);
+
     // (func) seek
     // Based on `std::fseek'. Moves the current read/write position in the open
     // file.
@@ -885,6 +1436,273 @@ public:
     long tell() const;
 };
 
+/*
+ * util::mapped_file
+ *
+ * This class provides read-only memory-mapped access to a file. While the file
+ * is open, its entire contents are available through `data' and `size' without
+ * being read into memory up front; the operating system pages the data in as
+ * it is accessed.
+ *
+ * When initially constructed, the object is in a closed state. To use the
+ * object, call `open' with a filename. The mapping is released when the object
+ * is destroyed or when `close' is called.
+ *
+ * To hand out views of the mapped data which keep the mapping alive, hold the
+ * object in a `std::shared_ptr' and use it as the owner of a `shared_blob':
+ *
+ *   auto map = std::make_shared<util::mapped_file>();
+ *   map->open("S000000E.NSF");
+ *   util::shared_blob data(map, map->data(), map->size());
+ */
+class mapped_file : private util::nocopy {
+private:
+    // (var) m_data
+    // A pointer to the mapped memory, or null if no file is open or if the
+    // open file is empty.
+    const unsigned char *m_data = nullptr;
+
+    // (var) m_size
+    // The size of the mapped file in bytes.
+    size_t m_size = 0;
+
+    // (var) m_open
+    // True if a file is currently open, false otherwise.
+    bool m_open = false;
+
+#ifdef _WIN32
+    // (var) m_file_handle, m_map_handle
+    // The Windows API handles for the open file and its file mapping object.
+    void *m_file_handle = nullptr;
+    void *m_map_handle = nullptr;
+#endif
+
+public:
+    // (default ctor)
+    // Constructs the object in a "closed" state.
+    mapped_file() = default;
+
+    // (dtor)
+    // Unmaps and closes the file if it is open.
+    ~mapped_file();
+
+    // (func) open
+    // Opens and maps the given file for reading. If an error occurs, an
+    // exception is thrown and the object is not modified.
+    //
+    // If a file is already open, an exception is thrown.
+    void open(const std::string &path);
+
+    // (func) close
+    // Unmaps and closes the currently open file. If no file is currently open,
+    // an exception is thrown.
+    void close();
+
+    // (func) data, size
+    // Returns a pointer to the mapped contents of the file, or the size of the
+    // file in bytes. The data pointer may be null for an empty file.
+    const unsigned char *data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+};
+
+/*
+ * util::sink
+ *
+ * An abstract destination for data which is written out in order from start to
+ * end. Exporters which write to a sink can stream their output to a file (see
+ * `util::file_sink') or a fixed buffer (see `util::buffer_sink') instead of
+ * building the entire output in memory first.
+ */
+class sink : public util::polymorphic, private util::nocopy {
+public:
+    // (pure func) write
+    // Writes the given data after any data previously written to the sink. If
+    // the data cannot be written, an exception is thrown.
+    virtual void write(const void *data, size_t len) = 0;
+
+    // (func) write_zeros
+    // Writes the given number of zero bytes to the sink.
+    void write_zeros(size_t len);
+
+    // (func) write_u32
+    // Writes the given value to the sink as four bytes, least significant
+    // first.
+    void write_u32(uint32_t value);
+};
+
+/*
+ * util::file_sink
+ *
+ * A sink which writes to an open `util::file'. The file must stay open for as
+ * long as the sink is in use.
+ */
+class file_sink : public sink {
+private:
+    // (var) m_file
+    // The file being written to.
+    util::file &m_file;
+
+public:
+    // (explicit ctor)
+    // Constructs a sink which writes to the given file.
+    explicit file_sink(util::file &file) :
+        m_file(file) {}
+
+    // (func) write
+    // See `util::sink::write'.
+    void write(const void *data, size_t len) override;
+};
+
+/*
+ * util::buffer_sink
+ *
+ * A sink which writes into a preallocated buffer of a fixed size. Attempting to
+ * write past the end of the buffer throws an exception and writes nothing.
+ */
+class buffer_sink : public sink {
+private:
+    // (var) m_data, m_capacity
+    // The buffer being written to, and its size in bytes.
+    unsigned char *m_data;
+    size_t m_capacity;
+
+    // (var) m_size
+    // The number of bytes written so far.
+    size_t m_size = 0;
+
+public:
+    // (ctor)
+    // Constructs a sink which writes into the given buffer.
+    buffer_sink(void *data, size_t capacity) :
+        m_data(static_cast<unsigned char *>(data)),
+        m_capacity(capacity) {}
+
+    // (func) write
+    // See `util::sink::write'.
+    void write(const void *data, size_t len) override;
+
+    // (func) size
+    // Returns the number of bytes written so far.
+    size_t size() const
+    {
+        return m_size;
+    }
+};
+
+/*
+ * util::blob_sink
+ *
+ * A sink which appends to a `util::blob'.
+ */
+class blob_sink : public sink {
+private:
+    // (var) m_blob
+    // The blob being appended to.
+    util::blob &m_blob;
+
+public:
+    // (explicit ctor)
+    // Constructs a sink which appends to the given blob.
+    explicit blob_sink(util::blob &blob) :
+        m_blob(blob) {}
+
+    // (func) write
+    // See `util::sink::write'.
+    void write(const void *data, size_t len) override;
+};
+
+/*
+ * util::parallel_for
+ *
+ * Calls `fn(i)' for each `i' from zero up to (but not including) `count', using
+ * up to `jobs' threads (including the calling thread). If `jobs' is zero or
+ * negative, the number of threads is based on the number of hardware threads
+ * available. The calls may be made in any order and may run concurrently, so
+ * `fn' must be safe to call from multiple threads at once.
+ *
+ * This function returns once every call has finished. If any call throws an
+ * exception, indices which have not yet started are skipped and the exception
+ * thrown for the lowest index is rethrown on the calling thread.
+ */
+void parallel_for(
+    size_t count,
+    const std::function<void(size_t)> &fn,
+    int jobs = 0);
+
+/*
+ * util::parallel_for_ordered
+ *
+ * Calls `fn(i)' for each `i' as with `parallel_for', using up to `jobs' other
+ * threads, and calls `done(i)' on the calling thread for each `i' in order, as
+ * soon as `fn(i)' and every call before it have finished. This allows results
+ * to be written or printed in order while later indices are still being worked
+ * on, without waiting for all of them.
+ *
+ * If any call to `fn' throws an exception, `done' is still called for each of
+ * the indices before it, and then the exception is rethrown on the calling
+ * thread as with `parallel_for'. If `done' throws an exception, no more calls
+ * to `fn' are started and the exception is rethrown once the other threads
+ * have finished.
+ */
+void parallel_for_ordered(
+    size_t count,
+    const std::function<void(size_t)> &fn,
+    const std::function<void(size_t)> &done,
+    int jobs = 0);
+
+#if FEATURE_INTERNAL_TEST
+/*
+ * util::alloc_counter
+ *
+ * Counts the heap allocations made with `operator new' on the current thread
+ * while the counter exists, for tests which check that some code does not
+ * allocate. The global `operator new' and `operator delete' are replaced to
+ * support this in builds with FEATURE_INTERNAL_TEST enabled. Aligned
+ * allocations are not counted.
+ *
+ * Counters may be nested, in which case only the innermost counter counts.
+ */
+class alloc_counter : private util::nocopy {
+private:
+    // (var) m_outer
+    // The counter which was active on this thread when this one was created,
+    // or null if there was none.
+    alloc_counter *m_outer;
+
+    // (var) m_count
+    // The number of allocations counted so far.
+    size_t m_count = 0;
+
+public:
+    // (default ctor)
+    // Constructs the counter and makes it the active counter for the current
+    // thread.
+    alloc_counter() noexcept;
+
+    // (dtor)
+    // Makes the outer counter active again.
+    ~alloc_counter() noexcept;
+
+    // (func) get_count
+    // Returns the number of allocations counted so far.
+    size_t get_count() const
+    {
+        return m_count;
+    }
+
+    // (s-func) note
+    // Counts an allocation in the current thread's active counter, if there is
+    // one. This is called by the replacement `operator new'.
+    static void note() noexcept;
+};
+#endif
+
 /*
  * util::get_time
  *
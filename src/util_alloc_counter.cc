@@ -0,0 +1,79 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "util.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+
+namespace drnsf {
+namespace util {
+
+// (s-var) s_active_counter
+// The innermost `alloc_counter' on the current thread, or null if none.
+static thread_local alloc_counter *s_active_counter = nullptr;
+
+// declared in util.hh
+alloc_counter::alloc_counter() noexcept :
+    m_outer(s_active_counter)
+{
+    s_active_counter = this;
+}
+
+// declared in util.hh
+alloc_counter::~alloc_counter() noexcept
+{
+    s_active_counter = m_outer;
+}
+
+// declared in util.hh
+void alloc_counter::note() noexcept
+{
+    if (s_active_counter) {
+        s_active_counter->m_count++;
+    }
+}
+
+namespace {
+
+// (test) CountsAllocations
+// Ensures allocations are counted by the innermost counter only, and only
+// while it exists.
+TEST(util_alloc_counter, CountsAllocations)
+{
+    alloc_counter outer;
+    {
+        alloc_counter inner;
+        auto p = std::make_unique<int>(1);
+        EXPECT_EQ(inner.get_count(), 1u);
+    }
+    EXPECT_EQ(outer.get_count(), 0u);
+
+    std::vector<int> v(16);
+    EXPECT_EQ(outer.get_count(), 1u);
+}
+
+}
+
+}
+}
+
+#endif
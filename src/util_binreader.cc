@@ -19,9 +19,14 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include <sstream>
 #include "util.hh"
 
+#if FEATURE_INTERNAL_TEST
+#include <iostream>
+#endif
+
 namespace drnsf {
 namespace util {
 
@@ -67,20 +72,38 @@ void binreader::begin(const util::blob &data)
     }
 }
 
+// declared in util.hh
+void binreader::begin(const util::shared_blob &data)
+{
+    if (m_data)
+        throw std::logic_error("util::binreader::begin: already started");
+
+    if (data.size() == 0) {
+        static unsigned char garbage[1];
+        m_data = garbage;
+        m_size = 0;
+    } else {
+        m_data = data.data();
+        m_size = data.size();
+
+        m_data_base = m_data;
+    }
+}
+
 void binreader::begin(const util::binwriter &writer, int offset)
 {
     if (m_data)
         throw std::logic_error("util::binreader::begin: already started");
-    if (!writer.m_data.size())
+    if (!writer.m_size)
         throw std::logic_error("util::binreader::begin: no writer data");
 
     if (offset < 0)
-        offset += writer.m_data.size();
-    if (offset < 0 || offset > writer.m_data.size())
+        offset += writer.m_size;
+    if (offset < 0 || size_t(offset) > writer.m_size)
         throw std::logic_error("util::binreader::begin: bad offset arg");
 
-    m_data = &writer.m_data[offset];
-    m_size = writer.m_data.size() - offset;
+    m_data = writer.m_out + offset;
+    m_size = writer.m_size - offset;
 
     m_data_base = m_data;
 }
@@ -91,6 +114,8 @@ void binreader::end()
     if (!m_data)
         throw std::logic_error("util::binreader::end: not started");
 
+    unload();
+
     if (m_size > 0)
         throw std::logic_error("util::binreader::end: data remaining");
 
@@ -101,6 +126,64 @@ void binreader::end()
     m_size = 0;
 }
 
+// declared in util.hh
+void binreader::refill(int bits)
+{
+    if (m_size >= 8) {
+        // Load the next eight bytes at once. Only the bytes which fit whole
+        // are counted as loaded; the bits of the rest are either shifted out
+        // or are loaded again, in the same place, by the next refill.
+        uint64_t word = 0;
+        if (m_read_dir == read_dir::rtl) {
+            for (int i = 0; i < 8; i++) {
+                word |= uint64_t(m_data[i]) << (i * 8);
+            }
+            m_bitbuf |= word << m_bitbuf_len;
+        } else {
+            for (int i = 0; i < 8; i++) {
+                word |= uint64_t(m_data[i]) << (56 - i * 8);
+            }
+            m_bitbuf |= word >> m_bitbuf_len;
+        }
+        int bytes = (63 - m_bitbuf_len) >> 3;
+        m_data += bytes;
+        m_size -= bytes;
+        m_bitbuf_len += bytes * 8;
+    } else {
+        while (m_bitbuf_len <= 56 && m_size > 0) {
+            uint64_t byte = *m_data;
+            if (m_read_dir == read_dir::rtl) {
+                m_bitbuf |= byte << m_bitbuf_len;
+            } else {
+                m_bitbuf |= byte << (56 - m_bitbuf_len);
+            }
+            m_data++;
+            m_size--;
+            m_bitbuf_len += 8;
+        }
+    }
+
+    if (m_bitbuf_len < bits)
+        throw std::logic_error("util::binreader::read_ubits: out of data");
+}
+
+// declared in util.hh
+void binreader::unload()
+{
+    int bytes = m_bitbuf_len / 8;
+    m_data -= bytes;
+    m_size += bytes;
+    m_bitbuf_len -= bytes * 8;
+
+    if (m_bitbuf_len == 0) {
+        m_bitbuf = 0;
+    } else if (m_read_dir == read_dir::rtl) {
+        m_bitbuf &= (uint64_t(1) << m_bitbuf_len) - 1;
+    } else {
+        m_bitbuf &= ~(~uint64_t(0) >> m_bitbuf_len);
+    }
+}
+
 // declared in util.hh
 void binreader::end_early()
 {
@@ -116,6 +199,9 @@ void binreader::end_early()
 // declared in util.hh
 uint8_t binreader::read_u8()
 {
+    if (m_bitbuf_len > 0)
+        unload();
+
     if (m_size == 0)
         throw std::logic_error("util::binreader::read_u8: out of data");
 
@@ -131,18 +217,39 @@ uint8_t binreader::read_u8()
 // declared in util.hh
 uint16_t binreader::read_u16()
 {
-    uint16_t value;
-    value  = read_u8();
-    value |= read_u8() << 8;
+    if (m_bitbuf_len > 0)
+        unload();
+
+    if (m_size < 2)
+        throw std::logic_error("util::binreader::read_u16: out of data");
+
+    if (m_bitbuf_len > 0)
+        throw std::logic_error("util::binreader::read_u16: bit data remaining");
+
+    uint16_t value = m_data[0] | (m_data[1] << 8);
+    m_data += 2;
+    m_size -= 2;
     return value;
 }
 
 // declared in util.hh
 uint32_t binreader::read_u32()
 {
-    uint32_t value;
-    value  = read_u16();
-    value |= read_u16() << 16;
+    if (m_bitbuf_len > 0)
+        unload();
+
+    if (m_size < 4)
+        throw std::logic_error("util::binreader::read_u32: out of data");
+
+    if (m_bitbuf_len > 0)
+        throw std::logic_error("util::binreader::read_u32: bit data remaining");
+
+    uint32_t value = m_data[0]
+        | (m_data[1] << 8)
+        | (m_data[2] << 16)
+        | (uint32_t(m_data[3]) << 24);
+    m_data += 4;
+    m_size -= 4;
     return value;
 }
 
@@ -155,41 +262,30 @@ int64_t binreader::read_ubits(int bits)
     if (bits == 0)
         return 0;
 
-    if (m_bitbuf_len == 0) {
-        m_bitbuf = read_u8();
-        m_bitbuf_len = 8;
+    // A refill may leave as few as 57 bits in the buffer, so longer values
+    // are read in two parts.
+    if (bits > 56) {
+        if (m_read_dir == read_dir::rtl) {
+            int64_t value = read_ubits(32);
+            return value | (read_ubits(bits - 32) << 32);
+        } else {
+            int64_t value = read_ubits(bits - 32) << 32;
+            return value | read_ubits(32);
+        }
     }
 
-    std::int_fast64_t value;
+    if (m_bitbuf_len < bits)
+        refill(bits);
+
+    uint64_t value;
     if (m_read_dir == read_dir::rtl) {
-        if (bits <= m_bitbuf_len) {
-            value = m_bitbuf & ((1 << bits) - 1);
-            m_bitbuf >>= bits;
-            m_bitbuf_len -= bits;
-        }
-        else {
-            value = m_bitbuf;
-            int bits_consumed = m_bitbuf_len;
-            m_bitbuf_len = 0;
-            value |= read_ubits(bits - bits_consumed) << bits_consumed;
-        }
-    }
-    else if (m_read_dir == read_dir::ltr) {
-        if (bits <= m_bitbuf_len) {
-            value = (m_bitbuf & (256 - (1 << (8 - bits)))) >> (8 - bits);
-            m_bitbuf <<= bits;
-            m_bitbuf_len -= bits;
-        }
-        else {
-            int bits_consumed = m_bitbuf_len;
-            if (bits < 8)
-                value = m_bitbuf >> (8 - bits);
-            else
-                value = m_bitbuf << (bits - 8);
-            m_bitbuf_len = 0;
-            value |= read_ubits(bits - bits_consumed);
-        }
+        value = m_bitbuf & ((uint64_t(1) << bits) - 1);
+        m_bitbuf >>= bits;
+    } else {
+        value = m_bitbuf >> (64 - bits);
+        m_bitbuf <<= bits;
     }
+    m_bitbuf_len -= bits;
     return value;
 }
 
@@ -231,6 +327,8 @@ blob binreader::read_bytes(int bytes)
     if (!m_data)
         throw std::logic_error("util::binreader::read_bytes: not started");
 
+    unload();
+
     if (m_size < static_cast<unsigned int>(bytes))
         throw std::logic_error("util::binreader::read_bytes: not enough data");
 
@@ -240,6 +338,29 @@ blob binreader::read_bytes(int bytes)
     return result;
 }
 
+// declared in util.hh
+record_view binreader::read_record(size_t bytes)
+{
+    if (!m_data)
+        throw std::logic_error("util::binreader::read_record: not started");
+
+    unload();
+
+    if (m_bitbuf_len > 0) {
+        throw std::logic_error(
+            "util::binreader::read_record: bit data remaining"
+        );
+    }
+
+    if (m_size < bytes)
+        throw std::logic_error("util::binreader::read_record: out of data");
+
+    record_view view(m_data, bytes);
+    m_data += bytes;
+    m_size -= bytes;
+    return view;
+}
+
 // declared in util.hh
 void binreader::discard(int bytes)
 {
@@ -249,6 +370,8 @@ void binreader::discard(int bytes)
     if (!m_data)
         throw std::logic_error("util::binreader::discard: not started");
 
+    unload();
+
     if (m_size < static_cast<unsigned int>(bytes))
         throw std::logic_error("util::binreader::discard: not enough data");
 
@@ -332,6 +455,51 @@ TEST(util_binreader, UBitsRead)
     r.end();
 }
 
+// (test) BitsMatchReference
+// Ensures that bit fields of every width read the same values as reading one
+// bit at a time, in both directions, and that byte reads work after whole
+// bytes of bits have been read.
+TEST(util_binreader, BitsMatchReference)
+{
+    blob data(64);
+    uint32_t x = 1;
+    for (auto &&b : data) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+
+    for (auto dir : { read_dir::rtl, read_dir::ltr }) {
+        for (int width = 1; width <= 63; width++) {
+            binreader r(dir);
+            r.begin(data);
+            int pos = 0;
+            while (pos + width <= 480) {
+                int64_t expected = 0;
+                for (int i = 0; i < width; i++) {
+                    int bit_pos = pos + i;
+                    int bit = dir == read_dir::rtl
+                        ? (data[bit_pos / 8] >> (bit_pos % 8)) & 1
+                        : (data[bit_pos / 8] >> (7 - bit_pos % 8)) & 1;
+                    if (dir == read_dir::rtl) {
+                        expected |= int64_t(bit) << i;
+                    } else {
+                        expected = (expected << 1) | bit;
+                    }
+                }
+                ASSERT_EQ(r.read_ubits(width), expected)
+                    << "width " << width << " pos " << pos;
+                pos += width;
+            }
+            r.discard_bits((8 - pos % 8) % 8);
+            pos = (pos + 7) / 8;
+            EXPECT_EQ(r.read_u8(), data[pos]);
+            EXPECT_EQ(r.read_u16(), data[pos + 1] | (data[pos + 2] << 8));
+            r.discard(64 - pos - 3);
+            r.end();
+        }
+    }
+}
+
 TEST(util_binreader, S8Read)
 {
     blob data = { 0, 1, 0x7F, 0x80, 0xFF };
@@ -455,6 +623,176 @@ TEST(util_binreader, OverrunError)
     EXPECT_THROW(r_8.read_u8(), std::logic_error);
 }
 
+// (test) RecordRead
+// Ensures that values read through a record view match those read directly
+// from a binreader, and that the reader continues after the record.
+TEST(util_binreader, RecordRead)
+{
+    blob data = {
+        0xFF,
+        0x00, 0x80,
+        0x01, 0x00, 0x00, 0x80,
+        0xAA, 0x55,
+        0x7F
+    };
+    binreader r;
+    r.begin(data);
+    auto rec = r.read_record(9);
+    EXPECT_EQ(r.read_u8(), 0x7F);
+    r.end();
+    EXPECT_EQ(rec.read_s8(), -1);
+    EXPECT_EQ(rec.read_u16(), 0x8000);
+    EXPECT_EQ(rec.read_s32(), -0x7FFFFFFFLL);
+    rec.discard(1);
+    EXPECT_EQ(rec.read_u8(), 0x55);
+#if !NDEBUG
+    EXPECT_THROW(rec.read_u8(), std::logic_error);
+#endif
+
+    r.begin(data);
+    r.read_ubits(4);
+    EXPECT_THROW(r.read_record(1), std::logic_error);
+    r.end_early();
+
+    r.begin(data);
+    EXPECT_THROW(r.read_record(11), std::logic_error);
+    r.end_early();
+}
+
+// (test) BitRecordMatches
+// Ensures `util::bit_record' reads and writes the same bits as a binreader and
+// binwriter reading or writing each field in turn.
+TEST(util_binreader, BitRecordMatches)
+{
+    using record = bit_record<ubits<3>, sbits<13>, ubits<1>, sbits<7>>;
+    static_assert(record::size == 3, "bad record size");
+    static_assert(record::offset(3) == 17, "bad field offset");
+
+    blob data = { 0b10110101, 0b11100110, 0b01011101 };
+    auto fields = record::decode(data.data());
+    binreader r;
+    r.begin(data);
+    EXPECT_EQ(fields[0], r.read_ubits(3));
+    EXPECT_EQ(fields[1], r.read_sbits(13));
+    EXPECT_EQ(fields[2], r.read_ubits(1));
+    EXPECT_EQ(fields[3], r.read_sbits(7));
+    r.end();
+    EXPECT_LT(fields[1], 0);
+
+    EXPECT_TRUE(record::fits(fields));
+    blob out(3);
+    record::encode(out.data(), fields);
+    EXPECT_EQ(out, data);
+
+    fields[0] = 8;
+    EXPECT_FALSE(record::fits(fields));
+}
+
+// (s-func) make_benchmark_data
+// Returns 1 MiB of pseudo-random bytes for the benchmarks below.
+blob make_benchmark_data()
+{
+    blob data(1048576);
+    uint32_t x = 1;
+    for (auto &&b : data) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    return data;
+}
+
+// (test) DISABLED_BitsBenchmark
+// Measures the throughput of `read_ubits' in both directions, reading fields
+// of mixed widths like those in the wgeo entries. To run this, use:
+//
+//   drnsf :internal-test --gtest_also_run_disabled_tests
+//     --gtest_filter=*BitsBenchmark*
+TEST(util_binreader, DISABLED_BitsBenchmark)
+{
+    auto data = make_benchmark_data();
+
+    const int widths[] = { 1, 3, 5, 8, 11, 13, 16, 24, 32, 7 };
+    for (auto dir : { read_dir::rtl, read_dir::ltr }) {
+        const int rounds = 16;
+        int64_t result = 0;
+        int64_t bits_read = 0;
+
+        util::stopwatch sw;
+        for (int i = 0; i < rounds; i++) {
+            binreader r(dir);
+            r.begin(data);
+            int64_t bits_left = int64_t(data.size()) * 8;
+            for (int j = 0; bits_left >= 32; j = (j + 1) % 10) {
+                result += r.read_ubits(widths[j]);
+                bits_left -= widths[j];
+            }
+            bits_read += int64_t(data.size()) * 8 - bits_left;
+            r.end_early();
+        }
+        long time = sw.lap();
+
+        std::cout
+            << (dir == read_dir::rtl ? "rtl" : "ltr")
+            << ": "
+            << double(bits_read) / (std::max(time, 1L) * 1000000.0)
+            << " bits/ns (result "
+            << result
+            << ")"
+            << std::endl;
+    }
+}
+
+// (test) DISABLED_RecordBenchmark
+// Measures the throughput of reading four-byte records like the wgeo colors,
+// one byte at a time, through a binreader and through a record view. To run
+// this, use:
+//
+//   drnsf :internal-test --gtest_also_run_disabled_tests
+//     --gtest_filter=*RecordBenchmark*
+TEST(util_binreader, DISABLED_RecordBenchmark)
+{
+    auto data = make_benchmark_data();
+
+    const size_t count = data.size() / 4;
+    const int rounds = 64;
+    for (bool use_view : { false, true }) {
+        int64_t result = 0;
+
+        util::stopwatch sw;
+        for (int i = 0; i < rounds; i++) {
+            binreader r;
+            r.begin(data);
+            if (use_view) {
+                auto rec = r.read_record(count * 4);
+                for (size_t j = 0; j < count; j++) {
+                    result += rec.read_u8();
+                    result += rec.read_u8();
+                    result += rec.read_u8();
+                    result += rec.read_u8();
+                }
+            } else {
+                for (size_t j = 0; j < count; j++) {
+                    result += r.read_u8();
+                    result += r.read_u8();
+                    result += r.read_u8();
+                    result += r.read_u8();
+                }
+            }
+            r.end();
+        }
+        long time = sw.lap();
+
+        std::cout
+            << (use_view ? "record_view" : "binreader")
+            << ": "
+            << double(count) * rounds / (std::max(time, 1L) * 1000.0)
+            << " records/us (result "
+            << result
+            << ")"
+            << std::endl;
+    }
+}
+
 }
 #endif
 
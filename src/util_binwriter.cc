@@ -19,6 +19,8 @@
 //
 
 #include "common.hh"
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include "util.hh"
 
@@ -28,11 +30,34 @@ namespace util {
 // declared in util.hh
 binwriter::binwriter() :
     m_active(false),
+    m_chunk(nullptr),
+    m_chunk_start(0),
+    m_out(nullptr),
+    m_size(0),
+    m_capacity(0),
     m_bitbuf(0),
     m_bitbuf_len(0)
 {
 }
 
+// declared in util.hh
+void binwriter::grow(size_t len, bool exact)
+{
+    if (!m_chunk)
+        throw std::logic_error("util::binwriter: buffer out of space");
+
+    // The chunk is resized rather than reserved so that the data can be
+    // written through `m_out'. It is cut back down to the data written when
+    // the writer is ended.
+    size_t capacity = m_size + len;
+    if (!exact) {
+        capacity = std::max(capacity, m_capacity * 2);
+    }
+    m_chunk->resize(m_chunk_start + capacity);
+    m_out = m_chunk->data() + m_chunk_start;
+    m_capacity = capacity;
+}
+
 // declared in util.hh
 void binwriter::begin()
 {
@@ -41,6 +66,41 @@ void binwriter::begin()
 
     m_active = true;
     m_data = {};
+    m_chunk = &m_data;
+    m_chunk_start = 0;
+    m_out = nullptr;
+    m_size = 0;
+    m_capacity = 0;
+}
+
+// declared in util.hh
+void binwriter::begin(void *data, size_t capacity)
+{
+    if (m_active)
+        throw std::logic_error("util::binwriter::begin: already started");
+    if (!data)
+        throw std::logic_error("util::binwriter::begin: null data arg");
+
+    m_active = true;
+    m_chunk = nullptr;
+    m_chunk_start = 0;
+    m_out = static_cast<unsigned char *>(data);
+    m_size = 0;
+    m_capacity = capacity;
+}
+
+// declared in util.hh
+void binwriter::begin(util::blob &chunk)
+{
+    if (m_active)
+        throw std::logic_error("util::binwriter::begin: already started");
+
+    m_active = true;
+    m_chunk = &chunk;
+    m_chunk_start = chunk.size();
+    m_out = chunk.data() + m_chunk_start;
+    m_size = 0;
+    m_capacity = 0;
 }
 
 // declared in util.hh
@@ -52,31 +112,86 @@ util::blob binwriter::end()
     if (m_bitbuf_len > 0)
         throw std::logic_error("util::binwriter::end: bit data missing");
 
+    if (m_chunk != &m_data)
+        throw std::logic_error("util::binwriter::end: external output");
+
     m_active = false;
+    m_data.resize(m_size);
+    m_chunk = nullptr;
+    m_out = nullptr;
     return std::move(m_data);
 }
 
+// declared in util.hh
+size_t binwriter::end_external()
+{
+    if (!m_active)
+        throw std::logic_error("util::binwriter::end_external: not started");
+
+    if (m_bitbuf_len > 0)
+        throw std::logic_error(
+            "util::binwriter::end_external: bit data missing"
+        );
+
+    if (m_chunk == &m_data)
+        throw std::logic_error("util::binwriter::end_external: no output");
+
+    if (m_chunk) {
+        m_chunk->resize(m_chunk_start + m_size);
+    }
+
+    m_active = false;
+    m_chunk = nullptr;
+    m_out = nullptr;
+    return m_size;
+}
+
+// declared in util.hh
+void binwriter::reserve(size_t len)
+{
+    if (!m_active)
+        throw std::logic_error("util::binwriter::reserve: not started");
+
+    if (m_capacity - m_size < len) {
+        grow(len, true);
+    }
+}
+
 // declared in util.hh
 void binwriter::write_u8(uint8_t value)
 {
     if (m_bitbuf_len > 0)
         throw std::logic_error("util::binwriter::write_u8: bit data remaining");
 
-    m_data.push_back(value);
+    *put(1) = value;
 }
 
 // declared in util.hh
 void binwriter::write_u16(uint16_t value)
 {
-    write_u8(value);
-    write_u8(value >> 8);
+    if (m_bitbuf_len > 0)
+        throw std::logic_error(
+            "util::binwriter::write_u16: bit data remaining"
+        );
+
+    auto p = put(2);
+    p[0] = value;
+    p[1] = value >> 8;
 }
 
 // declared in util.hh
 void binwriter::write_u32(uint32_t value)
 {
-    write_u16(value);
-    write_u16(value >> 16);
+    if (m_bitbuf_len > 0)
+        throw std::logic_error(
+            "util::binwriter::write_u32: bit data remaining"
+        );
+
+    auto p = put(4);
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
 }
 
 // declared in util.hh
@@ -103,7 +218,7 @@ void binwriter::write_ubits(int bits, int64_t value)
     m_bitbuf_len += bits;
 
     while (m_bitbuf_len >= 8) {
-        m_data.push_back(long_bitbuf);
+        *put(1) = long_bitbuf;
         long_bitbuf >>= 8;
         m_bitbuf_len -= 8;
     }
@@ -146,9 +261,23 @@ void binwriter::write_sbits(int bits, int64_t value)
 }
 
 // declared in util.hh
-void binwriter::write_bytes(util::blob data)
+void binwriter::write_bytes(const void *data, size_t len)
+{
+    if (m_bitbuf_len > 0)
+        throw std::logic_error(
+            "util::binwriter::write_bytes: bit data remaining"
+        );
+
+    if (len == 0)
+        return;
+
+    std::memcpy(put(len), data, len);
+}
+
+// declared in util.hh
+void binwriter::write_bytes(const util::blob &data)
 {
-    m_data.insert(m_data.end(), data.begin(), data.end());
+    write_bytes(data.data(), data.size());
 }
 
 // declared in util.hh
@@ -158,11 +287,13 @@ void binwriter::pad(int alignment)
         throw std::logic_error("util::binwriter::pad: invalid alignment");
     }
 
-    int padding = alignment - (m_data.size() % alignment);
-    if (padding != alignment) {
-        while (padding--) {
-            write_u8(0);
-        }
+    if (m_bitbuf_len > 0) {
+        throw std::logic_error("util::binwriter::pad: bit data remaining");
+    }
+
+    size_t padding = alignment - (m_size % alignment);
+    if (padding != size_t(alignment)) {
+        std::memset(put(padding), 0, padding);
     }
 }
 
@@ -331,24 +462,24 @@ TEST(util_binwriter, Padding)
     binwriter w;
     w.begin();
     w.pad(4);
-    EXPECT_EQ(w.end().size(), 0);
+    EXPECT_EQ(w.end().size(), 0u);
 
     w.begin();
     w.write_u8(0);
     w.pad(4);
-    EXPECT_EQ(w.end().size(), 4);
+    EXPECT_EQ(w.end().size(), 4u);
 
     w.begin();
     w.write_u8(0);
     w.pad(1);
-    EXPECT_EQ(w.end().size(), 1);
+    EXPECT_EQ(w.end().size(), 1u);
 
     w.begin();
     w.write_u32(0);
     w.write_u32(0);
     w.write_u32(0);
     w.pad(8);
-    EXPECT_EQ(w.end().size(), 16);
+    EXPECT_EQ(w.end().size(), 16u);
 
     w.begin();
     w.write_u32(0);
@@ -356,7 +487,46 @@ TEST(util_binwriter, Padding)
     w.write_u32(0);
     w.write_u32(0);
     w.pad(8);
-    EXPECT_EQ(w.end().size(), 16);
+    EXPECT_EQ(w.end().size(), 16u);
+}
+
+// (test) ExternalOutput
+// Ensures writing into a fixed buffer stops at its end, and that writing onto
+// the end of a blob keeps the data already in it, including when the blob has
+// to grow or has had room reserved.
+TEST(util_binwriter, ExternalOutput)
+{
+    unsigned char buffer[6] = {};
+    binwriter w;
+    w.begin(buffer, sizeof(buffer));
+    w.write_u32(0x04030201);
+    w.write_u8(5);
+    EXPECT_THROW(w.write_u16(0), std::logic_error);
+    EXPECT_THROW(w.end(), std::logic_error);
+    EXPECT_EQ(w.end_external(), 5u);
+    EXPECT_EQ(buffer[0], 1);
+    EXPECT_EQ(buffer[4], 5);
+
+    blob chunk = { 0xAA };
+    w.begin(chunk);
+    for (int i = 0; i < 100; i++) {
+        w.write_u16(i);
+    }
+    EXPECT_EQ(w.end_external(), 200u);
+    ASSERT_EQ(chunk.size(), 201u);
+    EXPECT_EQ(chunk[0], 0xAA);
+    EXPECT_EQ(chunk[199], 99);
+
+    w.begin(chunk);
+    w.reserve(64);
+    auto data = chunk.data();
+    w.write_bytes(buffer, 5);
+    w.pad(8);
+    EXPECT_EQ(chunk.data(), data);
+    EXPECT_EQ(w.end_external(), 8u);
+    ASSERT_EQ(chunk.size(), 209u);
+    EXPECT_EQ(chunk[205], 5);
+    EXPECT_EQ(chunk[208], 0);
 }
 
 }
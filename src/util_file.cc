@@ -19,11 +19,55 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "util.hh"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#include "fs.hh"
+#endif
+
 namespace drnsf {
 namespace util {
 
+// (s-func) save_position
+// Flushes any buffered writes to the given file, so that they reach the file
+// before it is read or written at an offset, and returns the current position.
+static int64_t save_position(FILE *f)
+{
+    fflush(f);
+#ifdef _WIN32
+    int64_t pos = _ftelli64(f);
+#else
+    int64_t pos = ftello(f);
+#endif
+    if (pos == -1) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    return pos;
+}
+
+// (s-func) restore_position
+// Seeks the given file back to a position returned by `save_position'. This
+// also drops any data read ahead into the file's buffer, which a write at an
+// offset may have made stale, and on Windows puts back the file pointer which
+// `ReadFile' and `WriteFile' move even when given an offset.
+static void restore_position(FILE *f, int64_t pos)
+{
+#ifdef _WIN32
+    _fseeki64(f, pos, SEEK_SET);
+#else
+    fseeko(f, pos, SEEK_SET);
+#endif
+}
+
 // declared in util.hh
 file::~file()
 {
@@ -90,6 +134,102 @@ void file::write(const void *buffer, size_t len)
     }
 }
 
+// declared in util.hh
+bool file::read_at(uint64_t offset, void *buffer, size_t len)
+{
+    if (!m_handle) {
+        throw std::logic_error("file::read_at: no file open");
+    }
+
+    auto pos = save_position(m_handle);
+    DRNSF_ON_EXIT { restore_position(m_handle, pos); };
+
+    auto out = static_cast<unsigned char *>(buffer);
+    size_t total = 0;
+#ifdef _WIN32
+    auto handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(m_handle)));
+#endif
+    while (total < len) {
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = DWORD(offset + total);
+        ov.OffsetHigh = DWORD((offset + total) >> 32);
+        DWORD count;
+        auto chunk = DWORD((std::min<size_t>)(len - total, 0x40000000));
+        if (!ReadFile(handle, out + total, chunk, &count, &ov)) {
+            if (GetLastError() != ERROR_HANDLE_EOF) {
+                throw std::system_error(
+                    GetLastError(),
+                    std::system_category()
+                );
+            }
+            count = 0;
+        }
+#else
+        auto count = pread(
+            fileno(m_handle),
+            out + total,
+            len - total,
+            offset + total
+        );
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category());
+        }
+#endif
+        if (count == 0) {
+            if (total == 0)
+                return false;
+            throw std::runtime_error("file::read_at: EOF");
+        }
+        total += count;
+    }
+    return true;
+}
+
+// declared in util.hh
+void file::write_at(uint64_t offset, const void *buffer, size_t len)
+{
+    if (!m_handle) {
+        throw std::logic_error("file::write_at: no file open");
+    }
+
+    auto pos = save_position(m_handle);
+    DRNSF_ON_EXIT { restore_position(m_handle, pos); };
+
+    auto in = static_cast<const unsigned char *>(buffer);
+    size_t total = 0;
+#ifdef _WIN32
+    auto handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(m_handle)));
+#endif
+    while (total < len) {
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = DWORD(offset + total);
+        ov.OffsetHigh = DWORD((offset + total) >> 32);
+        DWORD count;
+        auto chunk = DWORD((std::min<size_t>)(len - total, 0x40000000));
+        if (!WriteFile(handle, in + total, chunk, &count, &ov)) {
+            throw std::system_error(GetLastError(), std::system_category());
+        }
+#else
+        auto count = pwrite(
+            fileno(m_handle),
+            in + total,
+            len - total,
+            offset + total
+        );
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category());
+        }
+#endif
+        total += count;
+    }
+}
+
 // declared in util.hh
 void file::seek(long offset, int whence)
 {
@@ -114,5 +254,75 @@ long file::tell() const
     return result;
 }
 
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) read_string
+// Reads `len' bytes at the current position of the given file as a string.
+std::string read_string(file &f, size_t len)
+{
+    std::string result(len, '\0');
+    f.read(&result[0], len);
+    return result;
+}
+
+// (test) OffsetAccessKeepsPosition
+// Ensures `read_at' and `write_at' leave the current position alone, see data
+// still buffered by `write', and are seen by later calls to `read' even when
+// `read' has already buffered the old data.
+TEST(util_file, OffsetAccessKeepsPosition)
+{
+    auto path = (fs::temp_directory_path() / "drnsf-test-file.bin").string();
+    DRNSF_ON_EXIT {
+        std::error_code ec;
+        fs::remove(path, ec);
+    };
+
+    file f;
+    f.open(path, "wb+");
+    f.write("0123456789", 10);
+
+    // The write is still buffered, and must be flushed before reading.
+    char buffer[4];
+    EXPECT_TRUE(f.read_at(6, buffer, 4));
+    EXPECT_EQ(std::string(buffer, 4), "6789");
+    EXPECT_EQ(f.tell(), 10);
+
+    // Buffer the whole file with `read', then change it behind the buffer.
+    f.seek(0, SEEK_SET);
+    EXPECT_EQ(read_string(f, 2), "01");
+    f.write_at(3, "ab", 2);
+    EXPECT_EQ(f.tell(), 2);
+    EXPECT_EQ(read_string(f, 4), "2ab5");
+
+    f.seek(1, SEEK_CUR);
+    EXPECT_TRUE(f.read_at(0, buffer, 4));
+    EXPECT_EQ(std::string(buffer, 4), "012a");
+    EXPECT_EQ(read_string(f, 3), "789");
+}
+
+// (test) ReadAtEOF
+// Ensures `read_at' returns false when reading from the end of the file, and
+// throws when only part of the data could be read.
+TEST(util_file, ReadAtEOF)
+{
+    auto path = (fs::temp_directory_path() / "drnsf-test-eof.bin").string();
+    DRNSF_ON_EXIT {
+        std::error_code ec;
+        fs::remove(path, ec);
+    };
+
+    file f;
+    f.open(path, "wb+");
+    f.write("0123", 4);
+
+    char buffer[4];
+    EXPECT_FALSE(f.read_at(4, buffer, 4));
+    EXPECT_THROW(f.read_at(2, buffer, 4), std::runtime_error);
+}
+
+}
+#endif
+
 }
 }
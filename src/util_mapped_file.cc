@@ -0,0 +1,181 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "util.hh"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+mapped_file::~mapped_file()
+{
+    if (m_open) {
+        close();
+    }
+}
+
+#ifdef _WIN32
+// declared in util.hh
+void mapped_file::open(const std::string &path)
+{
+    if (m_open) {
+        throw std::logic_error("mapped_file::open: file already open");
+    }
+
+    // Deletion is shared so that the file can still be replaced while it is
+    // mapped, as when saving over the file a project was opened from.
+    auto wpath = u8str_to_wstr(path);
+    HANDLE file_handle = CreateFileW(
+        wpath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+    );
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("mapped_file::open: CreateFile failed");
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        CloseHandle(file_handle);
+        throw std::runtime_error("mapped_file::open: GetFileSizeEx failed");
+    }
+
+    // Windows does not allow mapping an empty file. Treat this case as an
+    // open file with no data.
+    HANDLE map_handle = nullptr;
+    const void *data = nullptr;
+    if (file_size.QuadPart > 0) {
+        map_handle = CreateFileMappingW(
+            file_handle,
+            nullptr,
+            PAGE_READONLY,
+            0,
+            0,
+            nullptr
+        );
+        if (!map_handle) {
+            CloseHandle(file_handle);
+            throw std::runtime_error(
+                "mapped_file::open: CreateFileMapping failed"
+            );
+        }
+
+        data = MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            CloseHandle(map_handle);
+            CloseHandle(file_handle);
+            throw std::runtime_error("mapped_file::open: MapViewOfFile failed");
+        }
+    }
+
+    m_file_handle = file_handle;
+    m_map_handle = map_handle;
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = file_size.QuadPart;
+    m_open = true;
+}
+
+// declared in util.hh
+void mapped_file::close()
+{
+    if (!m_open) {
+        throw std::logic_error("mapped_file::close: no file open");
+    }
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_map_handle) {
+        CloseHandle(m_map_handle);
+    }
+    CloseHandle(m_file_handle);
+    m_file_handle = nullptr;
+    m_map_handle = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+    m_open = false;
+}
+#else
+// declared in util.hh
+void mapped_file::open(const std::string &path)
+{
+    if (m_open) {
+        throw std::logic_error("mapped_file::open: file already open");
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    // The mapping remains valid after the descriptor is closed, so there is
+    // no need to keep it around past this function.
+    DRNSF_ON_EXIT { ::close(fd); };
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    // mmap does not allow zero-length mappings. Treat this case as an open
+    // file with no data.
+    void *data = nullptr;
+    if (st.st_size > 0) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = st.st_size;
+    m_open = true;
+}
+
+// declared in util.hh
+void mapped_file::close()
+{
+    if (!m_open) {
+        throw std::logic_error("mapped_file::close: no file open");
+    }
+    if (m_data) {
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_open = false;
+}
+#endif
+
+}
+}
@@ -0,0 +1,286 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "util.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace util {
+
+// (s-func) get_job_count
+// Returns the number of threads to use for `count' calls with the given `jobs'
+// argument to `parallel_for'.
+static int get_job_count(size_t count, int jobs)
+{
+    if (jobs <= 0) {
+        jobs = std::thread::hardware_concurrency();
+        if (jobs <= 0) {
+            jobs = 1;
+        }
+    }
+    if (size_t(jobs) > count) {
+        jobs = count;
+    }
+    return jobs;
+}
+
+// (s-func) run_threads
+// Starts `thread_count' threads which each call `run', calls `main' on the
+// calling thread, and then waits for the threads to finish. If a thread can't
+// be started or `main' throws an exception, `stop' is set so that the threads
+// which are running can finish early, and the exception is rethrown once they
+// have. The threads are always joined before this function returns.
+static void run_threads(
+    int thread_count,
+    const std::function<void()> &run,
+    const std::function<void()> &main,
+    std::atomic<bool> &stop)
+{
+    std::vector<std::thread> threads;
+    try {
+        threads.reserve(thread_count);
+        for (int j = 0; j < thread_count; j++) {
+            threads.emplace_back(run);
+        }
+        main();
+    } catch (...) {
+        stop = true;
+        for (auto &&thread : threads) {
+            thread.join();
+        }
+        throw;
+    }
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+}
+
+// declared in util.hh
+void parallel_for(
+    size_t count,
+    const std::function<void(size_t)> &fn,
+    int jobs)
+{
+    jobs = get_job_count(count, jobs);
+
+    // Run everything on the calling thread if there is no point in starting
+    // any other threads.
+    if (jobs <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next_index = 0;
+    std::atomic<bool> failed = false;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    size_t error_index = SIZE_MAX;
+
+    auto run = [&]{
+        while (!failed) {
+            size_t i = next_index++;
+            if (i >= count)
+                break;
+
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (i < error_index) {
+                    error = std::current_exception();
+                    error_index = i;
+                }
+                failed = true;
+            }
+        }
+    };
+
+    run_threads(jobs - 1, run, run, failed);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// declared in util.hh
+void parallel_for_ordered(
+    size_t count,
+    const std::function<void(size_t)> &fn,
+    const std::function<void(size_t)> &done,
+    int jobs)
+{
+    jobs = get_job_count(count, jobs);
+
+    if (jobs <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+            done(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next_index = 0;
+    std::atomic<bool> failed = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<bool> finished(count);
+    std::exception_ptr error;
+    size_t error_index = SIZE_MAX;
+
+    auto run = [&]{
+        while (!failed) {
+            size_t i = next_index++;
+            if (i >= count)
+                break;
+
+            try {
+                fn(i);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                finished[i] = true;
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (i < error_index) {
+                    error = std::current_exception();
+                    error_index = i;
+                }
+                failed = true;
+            }
+            cv.notify_one();
+        }
+    };
+
+    // Every index below a failed one has already been started, so the calling
+    // thread only has to wait for each index in turn to finish or fail.
+    auto main = [&]{
+        for (size_t i = 0; i < count; i++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{
+                    return finished[i] || error_index <= i;
+                });
+                if (!finished[i])
+                    return;
+            }
+            done(i);
+        }
+    };
+
+    run_threads(jobs, run, main, failed);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_parallel_for, CallsEachIndexOnce)
+{
+    std::vector<std::atomic<int>> calls(1000);
+    parallel_for(calls.size(), [&](size_t i) {
+        calls[i]++;
+    }, 4);
+    for (auto &&call_count : calls) {
+        EXPECT_EQ(call_count, 1);
+    }
+}
+
+TEST(util_parallel_for, RethrowsLowestIndex)
+{
+    for (int jobs : { 1, 4 }) {
+        try {
+            parallel_for(100, [&](size_t i) {
+                if (i == 10 || i == 11)
+                    throw std::runtime_error(std::to_string(i));
+            }, jobs);
+            ADD_FAILURE();
+        } catch (std::runtime_error &ex) {
+            EXPECT_STREQ(ex.what(), "10");
+        }
+    }
+}
+
+TEST(util_parallel_for, OrderedDoneInOrder)
+{
+    for (int jobs : { 1, 4 }) {
+        std::vector<std::atomic<int>> calls(1000);
+        std::vector<size_t> order;
+        parallel_for_ordered(calls.size(), [&](size_t i) {
+            calls[i]++;
+        }, [&](size_t i) {
+            EXPECT_EQ(calls[i], 1);
+            order.push_back(i);
+        }, jobs);
+
+        ASSERT_EQ(order.size(), calls.size());
+        for (auto &&i : util::range_of(order)) {
+            EXPECT_EQ(order[i], i);
+        }
+    }
+}
+
+TEST(util_parallel_for, OrderedDoneBeforeError)
+{
+    for (int jobs : { 1, 4 }) {
+        size_t done_count = 0;
+        try {
+            parallel_for_ordered(100, [&](size_t i) {
+                if (i == 10 || i == 11)
+                    throw std::runtime_error(std::to_string(i));
+            }, [&](size_t i) {
+                EXPECT_EQ(i, done_count);
+                done_count++;
+            }, jobs);
+            ADD_FAILURE();
+        } catch (std::runtime_error &ex) {
+            EXPECT_STREQ(ex.what(), "10");
+        }
+        EXPECT_EQ(done_count, 10u);
+
+        try {
+            parallel_for_ordered(100, [&](size_t i) {}, [&](size_t i) {
+                if (i == 5)
+                    throw std::runtime_error("done");
+            }, jobs);
+            ADD_FAILURE();
+        } catch (std::runtime_error &ex) {
+            EXPECT_STREQ(ex.what(), "done");
+        }
+    }
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,115 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+shared_blob::shared_blob(blob data)
+{
+    if (data.empty())
+        return;
+
+    auto owner = std::make_shared<blob>(std::move(data));
+    m_data = owner->data();
+    m_size = owner->size();
+    m_owner = std::move(owner);
+}
+
+// declared in util.hh
+shared_blob shared_blob::slice(size_t offset, size_t size) const
+{
+    if (offset > m_size || size > m_size - offset)
+        throw std::logic_error("util::shared_blob::slice: out of bounds");
+
+    if (size == 0)
+        return {};
+
+    return shared_blob(m_owner, m_data + offset, size);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_shared_blob, FromBlob)
+{
+    blob data = { 1, 2, 3, 4 };
+    auto ptr = data.data();
+    shared_blob s = std::move(data);
+    EXPECT_EQ(s.size(), 4u);
+    EXPECT_EQ(s.data(), ptr);
+    EXPECT_EQ(s[0], 1);
+    EXPECT_EQ(s[3], 4);
+    EXPECT_EQ(s.to_blob(), blob({ 1, 2, 3, 4 }));
+}
+
+TEST(util_shared_blob, Empty)
+{
+    shared_blob s;
+    EXPECT_TRUE(s.empty());
+    EXPECT_EQ(s.size(), 0u);
+    EXPECT_EQ(s, shared_blob(blob()));
+    EXPECT_EQ(s.to_blob(), blob());
+}
+
+TEST(util_shared_blob, SliceSharesData)
+{
+    shared_blob s = blob{ 0, 1, 2, 3, 4, 5, 6, 7 };
+    auto slice = s.slice(2, 4);
+    EXPECT_EQ(slice.size(), 4u);
+    EXPECT_EQ(slice.data(), s.data() + 2);
+    EXPECT_EQ(slice.to_blob(), blob({ 2, 3, 4, 5 }));
+
+    // The slice must keep the data alive after the original is gone.
+    s = {};
+    EXPECT_EQ(slice.to_blob(), blob({ 2, 3, 4, 5 }));
+
+    auto inner = slice.slice(1, 2);
+    EXPECT_EQ(inner.to_blob(), blob({ 3, 4 }));
+}
+
+TEST(util_shared_blob, SliceBounds)
+{
+    shared_blob s = blob{ 0, 1, 2, 3 };
+    EXPECT_NO_THROW(s.slice(0, 4));
+    EXPECT_NO_THROW(s.slice(4, 0));
+    EXPECT_THROW(s.slice(0, 5), std::logic_error);
+    EXPECT_THROW(s.slice(5, 0), std::logic_error);
+    EXPECT_THROW(s.slice(2, SIZE_MAX), std::logic_error);
+}
+
+TEST(util_shared_blob, Equality)
+{
+    shared_blob a = blob{ 1, 2, 3 };
+    shared_blob b = blob{ 1, 2, 3 };
+    shared_blob c = blob{ 1, 2, 4 };
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+    EXPECT_NE(a, a.slice(0, 2));
+}
+
+}
+#endif
+
+}
+}
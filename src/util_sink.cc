@@ -0,0 +1,117 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2020  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include "util.hh"
+
+#if FEATURE_INTERNAL_TEST
+#include <gtest/gtest.h>
+#endif
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+void sink::write_zeros(size_t len)
+{
+    static const unsigned char zeros[256] = {};
+    while (len > 0) {
+        size_t chunk_len = std::min(len, sizeof(zeros));
+        write(zeros, chunk_len);
+        len -= chunk_len;
+    }
+}
+
+// declared in util.hh
+void sink::write_u32(uint32_t value)
+{
+    unsigned char bytes[4] = {
+        static_cast<unsigned char>(value),
+        static_cast<unsigned char>(value >> 8),
+        static_cast<unsigned char>(value >> 16),
+        static_cast<unsigned char>(value >> 24)
+    };
+    write(bytes, 4);
+}
+
+// declared in util.hh
+void file_sink::write(const void *data, size_t len)
+{
+    m_file.write(data, len);
+}
+
+// declared in util.hh
+void buffer_sink::write(const void *data, size_t len)
+{
+    if (len > m_capacity - m_size)
+        throw std::logic_error("util::buffer_sink::write: buffer full");
+
+    if (len == 0)
+        return;
+
+    std::memcpy(m_data + m_size, data, len);
+    m_size += len;
+}
+
+// declared in util.hh
+void blob_sink::write(const void *data, size_t len)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    m_blob.insert(m_blob.end(), bytes, bytes + len);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_sink, BufferSink)
+{
+    unsigned char buffer[8] = {};
+    buffer_sink s(buffer, 6);
+    s.write("abc", 3);
+    s.write_zeros(2);
+    EXPECT_EQ(s.size(), 5u);
+    EXPECT_THROW(s.write("de", 2), std::logic_error);
+    EXPECT_EQ(s.size(), 5u);
+    s.write("d", 1);
+    EXPECT_EQ(std::memcmp(buffer, "abc\0\0d\0\0", 8), 0);
+}
+
+TEST(util_sink, BlobSink)
+{
+    blob b = { 1 };
+    blob_sink s(b);
+    s.write("\2\3", 2);
+    s.write_zeros(300);
+    EXPECT_EQ(b.size(), 303u);
+    EXPECT_EQ(b[0], 1);
+    EXPECT_EQ(b[2], 3);
+    EXPECT_EQ(b[302], 0);
+    s.write_u32(0x12345678);
+    EXPECT_EQ(b.size(), 307u);
+    EXPECT_EQ(b[303], 0x78);
+    EXPECT_EQ(b[306], 0x12);
+}
+
+}
+#endif
+
+}
+}